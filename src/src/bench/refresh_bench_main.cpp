@@ -0,0 +1,302 @@
+// Benchmark for the directory refresher's mod walks on a skewed mod list.
+//
+// Synthesizes a mod list of many small mods and one huge one (a texture pack
+// with hundreds of thousands of files, last in the list like it usually is)
+// and adds every mod to a DirectoryEntry tree from a TaskPool, the way
+// DirectoryRefresher does, once with a task per mod and once with big mods
+// split into a task per directory.  With a task per mod, the wall time can't
+// drop below the time one thread takes to walk the huge mod.
+//
+// Usage:
+//   mo2-refresh-bench [--mods N] [--mod-files N] [--big-files N]
+//                     [--threads 1,2,4,8] [--rounds N] [--keep DIR]
+//
+// --keep builds the mods in DIR and leaves them there, so later runs skip
+// creating them.
+
+#include "envfs.h"
+#include "shared/directoryentry.h"
+#include "shared/namepool.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using MOShared::DirectoryEntry;
+using MOShared::DirectoryStats;
+
+namespace
+{
+
+// the huge mod's files are spread over Fanout^3 directories
+constexpr std::size_t Fanout = 8;
+
+struct Options
+{
+  std::size_t mods     = 1000;
+  std::size_t modFiles = 40;
+  std::size_t bigFiles = 300000;
+  std::vector<unsigned> threads;
+  unsigned rounds = 3;
+  std::string keep;
+};
+
+struct Mod
+{
+  std::wstring name;
+  std::wstring path;
+};
+
+struct RunResult
+{
+  double seconds        = 0;
+  std::size_t files     = 0;
+  std::size_t observed  = 0;  // files reported to the observers
+};
+
+// counts what the refresher's layer scan observer would record
+class CountingObserver : public DirectoryEntry::WalkObserver
+{
+public:
+  explicit CountingObserver(std::atomic<std::size_t>& files) : m_files(files) {}
+
+  void onDirectoryStart(env::EntryName, const env::DirectoryStamp&) override {}
+  void onDirectoryEnd() override {}
+
+  void onFile(env::EntryName, FILETIME, uint64_t) override
+  {
+    m_files.fetch_add(1, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<std::size_t>& m_files;
+};
+
+bool touch(const fs::path& p)
+{
+  const int fd = open(p.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool createMod(const fs::path& root, std::size_t files, bool huge)
+{
+  std::error_code ec;
+  fs::create_directories(root, ec);
+  if (!touch(root / "meta.ini")) {
+    return false;
+  }
+
+  for (std::size_t i = 0; i < files; ++i) {
+    fs::path dir;
+    if (huge) {
+      const std::size_t d = i % (Fanout * Fanout * Fanout);
+      dir = root / "textures" / ("set" + std::to_string(d / (Fanout * Fanout))) /
+            ("part" + std::to_string(d / Fanout % Fanout)) /
+            ("lod" + std::to_string(d % Fanout));
+    } else {
+      dir = root / (i % 2 == 0 ? "meshes" : "textures") / root.filename() /
+            ("part" + std::to_string(i % 4));
+    }
+
+    fs::create_directories(dir, ec);
+    if (!touch(dir / ("file" + std::to_string(i) + (huge ? ".dds" : ".nif")))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::vector<Mod> createMods(const Options& opts, const fs::path& dir)
+{
+  std::vector<Mod> mods;
+
+  for (std::size_t i = 0; i <= opts.mods; ++i) {
+    const bool huge       = (i == opts.mods);
+    const std::string name = huge ? "huge texture pack" : "mod" + std::to_string(i);
+    const fs::path root    = dir / name;
+
+    if (!fs::exists(root) && !createMod(root, huge ? opts.bigFiles : opts.modFiles, huge)) {
+      std::cerr << "cannot create " << root << "\n";
+      return {};
+    }
+
+    mods.push_back({fs::path(name).wstring(), root.wstring()});
+  }
+
+  return mods;
+}
+
+RunResult run(const std::vector<Mod>& mods, unsigned threads, bool split)
+{
+  env::TaskPool pool(threads, "refresh bench");
+  DirectoryEntry root(L"data", nullptr, 0);
+
+  std::vector<DirectoryStats> stats(mods.size());
+  std::atomic<std::size_t> observed{0};
+
+  const auto begin = std::chrono::steady_clock::now();
+  {
+    env::TaskGroup group(pool);
+
+    for (std::size_t i = 0; i < mods.size(); ++i) {
+      group.run([&, i] {
+        auto observer = std::make_shared<CountingObserver>(observed);
+        const int prio = static_cast<int>(i) + 1;
+
+        if (split) {
+          root.addFromOrigin(group, mods[i].name, mods[i].path, prio, stats[i],
+                             observer.get(), [observer] {});
+        } else {
+          thread_local env::DirectoryWalker walker;
+          root.addFromOrigin(walker, mods[i].name, mods[i].path, prio, stats[i],
+                             observer.get());
+        }
+      });
+    }
+
+    group.wait();
+  }
+
+  RunResult r;
+  r.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  r.files    = root.getFileRegister()->highestCount();
+  r.observed = observed.load();
+  return r;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool hasValue   = i + 1 < argc;
+
+    if (arg == "--mods" && hasValue) {
+      opts.mods = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--mod-files" && hasValue) {
+      opts.modFiles = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--big-files" && hasValue) {
+      opts.bigFiles = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--rounds" && hasValue) {
+      opts.rounds = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+    } else if (arg == "--keep" && hasValue) {
+      opts.keep = argv[++i];
+    } else if (arg == "--threads" && hasValue) {
+      std::stringstream ss(argv[++i]);
+      std::string n;
+      while (std::getline(ss, n, ',')) {
+        opts.threads.push_back(static_cast<unsigned>(std::max(1, std::atoi(n.c_str()))));
+      }
+    } else {
+      return false;
+    }
+  }
+
+  if (opts.threads.empty()) {
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned n = 1; n < hw; n *= 2) {
+      opts.threads.push_back(n);
+    }
+    opts.threads.push_back(hw);
+  }
+
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    std::cerr << "usage: mo2-refresh-bench [--mods N] [--mod-files N] [--big-files N] "
+                 "[--threads 1,2,4] [--rounds N] [--keep DIR]\n";
+    return 2;
+  }
+
+  fs::path dir = opts.keep;
+  if (dir.empty()) {
+    std::string workTemplate =
+        (fs::temp_directory_path() / "mo2-refresh-bench-XXXXXX").string();
+    if (mkdtemp(workTemplate.data()) == nullptr) {
+      std::cerr << "cannot create a work directory\n";
+      return 1;
+    }
+    dir = workTemplate;
+  }
+
+  const auto createStart = std::chrono::steady_clock::now();
+  const auto mods        = createMods(opts, dir);
+  if (mods.empty()) {
+    return 1;
+  }
+  const double createSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - createStart)
+          .count();
+
+  std::printf("mods: %zu with %zu files and one with %zu, ready in %.3fs\n", opts.mods,
+              opts.modFiles, opts.bigFiles, createSeconds);
+  std::printf("%8s %8s %12s %9s %10s\n", "threads", "mode", "seconds", "speedup",
+              "files");
+
+  // every file on disk, meta.ini included, is seen by an observer once
+  const std::size_t expected = opts.mods * (opts.modFiles + 1) + opts.bigFiles + 1;
+
+  double baseline = 0;  // one thread, a task per mod
+  for (const unsigned threads : opts.threads) {
+    for (const bool split : {false, true}) {
+      // best of N rounds, each into a fresh tree
+      RunResult best;
+      for (unsigned round = 0; round < opts.rounds; ++round) {
+        const RunResult r = run(mods, threads, split);
+        if (round == 0 || r.seconds < best.seconds) {
+          best = r;
+        }
+      }
+
+      if (baseline == 0) {
+        baseline = best.seconds;
+      }
+
+      std::printf("%8u %8s %12.3f %8.2fx %10zu%s\n", threads, split ? "split" : "per-mod",
+                  best.seconds, baseline / best.seconds, best.files,
+                  best.observed == expected ? "" : "  (observer mismatch)");
+    }
+  }
+
+  // names are interned once for the whole process, so this is what every
+  // round shared
+  const auto& pool = MOShared::NamePool::instance();
+  std::printf("name pool: %zu names, %.1f MiB\n", pool.size(),
+              pool.bytes() / (1024.0 * 1024.0));
+
+  // one tree at a time is alive, so this is about the size of the biggest
+  rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  std::printf("peak rss: %.1f MiB\n", usage.ru_maxrss / 1024.0);
+
+  if (opts.keep.empty()) {
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+  }
+
+  return 0;
+}
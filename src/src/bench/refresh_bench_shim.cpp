@@ -0,0 +1,64 @@
+// Stand-ins for the helpers of shared/util.cpp and main.cpp that the
+// directory structure and env code call, so mo2-refresh-bench can link them
+// without the rest of the organizer.  They match the Linux versions.
+
+#include "shared/util.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cwctype>
+
+void setExceptionHandlers() {}
+
+namespace MOShared
+{
+
+std::string ToString(const std::wstring& source, bool)
+{
+  return QString::fromStdWString(source).toStdString();
+}
+
+std::wstring ToWString(const std::string& source, bool)
+{
+  return QString::fromStdString(source).toStdWString();
+}
+
+std::wstring& ToLowerInPlace(std::wstring& text)
+{
+  std::transform(text.begin(), text.end(), text.begin(), [](wchar_t c) {
+    return std::towlower(c);
+  });
+  return text;
+}
+
+std::wstring ToLowerCopy(const std::wstring& text)
+{
+  std::wstring result(text);
+  return ToLowerInPlace(result);
+}
+
+std::wstring ToLowerCopy(std::wstring_view text)
+{
+  std::wstring result(text.begin(), text.end());
+  return ToLowerInPlace(result);
+}
+
+bool CaseInsensitiveEqual(const std::wstring& lhs, const std::wstring& rhs)
+{
+  return lhs.length() == rhs.length() &&
+         std::equal(lhs.begin(), lhs.end(), rhs.begin(), [](wchar_t a, wchar_t b) {
+           return std::towlower(a) == std::towlower(b);
+         });
+}
+
+void SetThisThreadName(const QString& s)
+{
+  std::string name = s.toStdString();
+  if (name.size() > 15) {
+    name.resize(15);
+  }
+  pthread_setname_np(pthread_self(), name.c_str());
+}
+
+}  // namespace MOShared
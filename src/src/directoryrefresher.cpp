@@ -39,100 +39,11 @@ along with Mod Organizer.  If not, see <http://www.gnu.org/licenses/>.
 #include <QString>
 
 #include <fstream>
+#include <numeric>
 
 using namespace MOBase;
 using namespace MOShared;
 
-DirectoryStats::DirectoryStats()
-{
-  std::memset(this, 0, sizeof(DirectoryStats));
-}
-
-DirectoryStats& DirectoryStats::operator+=(const DirectoryStats& o)
-{
-  dirTimes += o.dirTimes;
-  fileTimes += o.fileTimes;
-  sortTimes += o.sortTimes;
-
-  subdirLookupTimes += o.subdirLookupTimes;
-  addDirectoryTimes += o.addDirectoryTimes;
-
-  filesLookupTimes += o.filesLookupTimes;
-  addFileTimes += o.addFileTimes;
-  addOriginToFileTimes += o.addOriginToFileTimes;
-  addFileToOriginTimes += o.addFileToOriginTimes;
-  addFileToRegisterTimes += o.addFileToRegisterTimes;
-
-  originExists += o.originExists;
-  originCreate += o.originCreate;
-  originsNeededEnabled += o.originsNeededEnabled;
-
-  subdirExists += o.subdirExists;
-  subdirCreate += o.subdirCreate;
-
-  fileExists += o.fileExists;
-  fileCreate += o.fileCreate;
-  filesInsertedInRegister += o.filesInsertedInRegister;
-  filesAssignedInRegister += o.filesAssignedInRegister;
-
-  return *this;
-}
-
-std::string DirectoryStats::csvHeader()
-{
-  QStringList sl = {"dirTimes",
-                    "fileTimes",
-                    "sortTimes",
-                    "subdirLookupTimes",
-                    "addDirectoryTimes",
-                    "filesLookupTimes",
-                    "addFileTimes",
-                    "addOriginToFileTimes",
-                    "addFileToOriginTimes",
-                    "addFileToRegisterTimes",
-                    "originExists",
-                    "originCreate",
-                    "originsNeededEnabled",
-                    "subdirExists",
-                    "subdirCreate",
-                    "fileExists",
-                    "fileCreate",
-                    "filesInsertedInRegister",
-                    "filesAssignedInRegister"};
-
-  return sl.join(",").toStdString();
-}
-
-std::string DirectoryStats::toCsv() const
-{
-  QStringList oss;
-
-  auto s = [](auto ns) {
-    return ns.count() / 1000.0 / 1000.0 / 1000.0;
-  };
-
-  oss << QString::number(s(dirTimes)) << QString::number(s(fileTimes))
-      << QString::number(s(sortTimes))
-
-      << QString::number(s(subdirLookupTimes)) << QString::number(s(addDirectoryTimes))
-
-      << QString::number(s(filesLookupTimes)) << QString::number(s(addFileTimes))
-      << QString::number(s(addOriginToFileTimes))
-      << QString::number(s(addFileToOriginTimes))
-      << QString::number(s(addFileToRegisterTimes))
-
-      << QString::number(originExists) << QString::number(originCreate)
-      << QString::number(originsNeededEnabled)
-
-      << QString::number(subdirExists) << QString::number(subdirCreate)
-
-      << QString::number(fileExists) << QString::number(fileCreate)
-      << QString::number(filesInsertedInRegister)
-      << QString::number(filesAssignedInRegister);
-
-  return oss.join(",").toStdString();
-}
-
 void dumpStats(std::vector<DirectoryStats>& stats)
 {
   static int run = 0;
@@ -162,7 +73,8 @@ void dumpStats(std::vector<DirectoryStats>& stats)
 }
 
 DirectoryRefresher::DirectoryRefresher(OrganizerCore* core, std::size_t threadCount)
-    : m_Core(*core), m_threadCount(threadCount), m_lastFileCount(0)
+    : m_Core(*core), m_threadCount(threadCount), m_lastFileCount(0),
+      m_pool(threadCount, "refresher")
 {}
 
 DirectoryEntry* DirectoryRefresher::stealDirectoryStructure()
@@ -171,6 +83,19 @@ DirectoryEntry* DirectoryRefresher::stealDirectoryStructure()
   return m_Root.release();
 }
 
+VfsLayerSet::ScanTable DirectoryRefresher::stealLayerScans()
+{
+  std::scoped_lock lock(m_LayerScansLock);
+  return std::exchange(m_LayerScans, {});
+}
+
+void DirectoryRefresher::addLayerScan(const std::string& root,
+                                      std::shared_ptr<const VfsLayerSet::Scan> scan)
+{
+  std::scoped_lock lock(m_LayerScansLock);
+  m_LayerScans.add(root, std::move(scan));
+}
+
 void DirectoryRefresher::setMods(
     const std::vector<std::tuple<QString, QString, int>>& mods,
     const std::set<QString>& managedArchives)
@@ -321,59 +246,48 @@ void DirectoryRefresher::addModToStructure(DirectoryEntry* directoryStructure,
   }
 }
 
-struct ModThread
+// records a mod's walk for the FUSE VFS while it is added to the structure
+class LayerScanObserver : public DirectoryEntry::WalkObserver
 {
-  GameFeatures* gameFeatures;
-  DirectoryRefreshProgress* progress = nullptr;
-  DirectoryEntry* ds                 = nullptr;
-  std::wstring modName;
-  std::wstring path;
-  int prio = -1;
-  std::vector<std::wstring> archives;
-  std::set<std::wstring> enabledArchives;
-  std::vector<std::wstring>* loadOrder = nullptr;
-  DirectoryStats* stats                = nullptr;
-  env::DirectoryWalker walker;
+public:
+  explicit LayerScanObserver(const std::wstring& root)
+      : m_recorder(QString::fromStdWString(root).toStdString())
+  {}
 
-  std::condition_variable cv;
-  std::mutex mutex;
-  bool ready = false;
-
-  void wakeup()
+  // names come as the walk read them, in UTF-8
+  void onDirectoryStart(env::EntryName name, const env::DirectoryStamp& stamp) override
   {
-    {
-      std::scoped_lock lock(mutex);
-      ready = true;
-    }
-
-    cv.notify_one();
+    m_recorder.enterDirectory(name, {stamp.mtime, stamp.ctime, stamp.ino});
   }
 
-  void run()
+  void onDirectoryEnd() override { m_recorder.leaveDirectory(); }
+
+  void onFile(env::EntryName name, FILETIME fileTime, uint64_t size) override
   {
-    std::unique_lock lock(mutex);
-    cv.wait(lock, [&] {
-      return ready;
-    });
+    m_recorder.addFile(name, size, toSystemClock(fileTime));
+  }
 
-    SetThisThreadName(QString::fromStdWString(modName + L" refresher"));
-    ds->addFromOrigin(walker, modName, path, prio, *stats);
+  VfsScanRecorder& recorder() { return m_recorder; }
 
-    if (Settings::instance().archiveParsing()) {
-      ds->addFromAllBSAs(modName, path, prio, archives, enabledArchives, *loadOrder,
-                         *stats);
-    }
+private:
+  VfsScanRecorder m_recorder;
 
-    if (progress) {
-      progress->addDone();
-    }
-
-    SetThisThreadName(QString::fromStdWString(L"idle refresher"));
-    ready = false;
+  static std::chrono::system_clock::time_point toSystemClock(FILETIME ft)
+  {
+    // 100ns intervals since 1601 to the Unix epoch; signed, files from before
+    // 1970 are earlier than it
+    constexpr int64_t EpochDiff = 116444736000000000LL;
+    const int64_t t             = static_cast<int64_t>(
+        (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime);
+    const auto since = std::chrono::nanoseconds((t - EpochDiff) * 100);
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(since));
   }
 };
 
-env::ThreadPool<ModThread> g_threads;
+// mods that had fewer entries than this in the last refresh are walked by a
+// single task, splitting them up costs more than it saves
+constexpr std::size_t SplitModSize = 2000;
 
 void DirectoryRefresher::updateProgress(const DirectoryRefreshProgress* p)
 {
@@ -392,7 +306,6 @@ void DirectoryRefresher::addMultipleModsFilesToStructure(
   }
 
   log::debug("refresher: using {} threads", m_threadCount);
-  g_threads.setMax(m_threadCount);
 
   std::vector<std::wstring> loadOrder;
   if (Settings::instance().archiveParsing()) {
@@ -406,7 +319,35 @@ void DirectoryRefresher::addMultipleModsFilesToStructure(
     }
   }
 
-  for (std::size_t i = 0; i < entries.size(); ++i) {
+  std::set<std::wstring> enabledArchives;
+  for (auto&& a : m_EnabledArchives) {
+    enabledArchives.insert(a.toStdWString());
+  }
+
+  // Biggest mods first, by their file count in the last refresh, so a huge
+  // texture mod doesn't start last and finish long after everything else.
+  // Mods not seen before might be big and go first too.  With more than one
+  // thread, big mods are split up further below.
+  std::vector<std::size_t> lastSizes(entries.size(), SIZE_MAX);
+  {
+    std::scoped_lock lock(m_modSizesLock);
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+      auto it = m_modSizes.find(entries[i].absolutePath);
+      if (it != m_modSizes.end()) {
+        lastSizes[i] = it->second;
+      }
+    }
+  }
+
+  std::vector<std::size_t> order(entries.size());
+  std::iota(order.begin(), order.end(), std::size_t(0));
+  std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    return lastSizes[a] > lastSizes[b];
+  });
+
+  env::TaskGroup group(m_pool);
+
+  for (const std::size_t i : order) {
     const auto& e  = entries[i];
     const int prio = e.priority + 1;
 
@@ -414,45 +355,80 @@ void DirectoryRefresher::addMultipleModsFilesToStructure(
       stats[i].mod = entries[i].modName.toStdString();
     }
 
-    try {
-      if (e.stealFiles.length() > 0) {
-        stealModFilesIntoStructure(directoryStructure, e.modName, prio, e.absolutePath,
-                                   e.stealFiles);
+    if (e.stealFiles.length() > 0) {
+      continue;
+    }
 
-        if (progress) {
-          progress->addDone();
+    group.run([=, this, &e, &group, &stats, &lastSizes, &loadOrder, &enabledArchives] {
+      const std::wstring modName = e.modName.toStdWString();
+      const std::wstring path =
+          QDir::toNativeSeparators(e.absolutePath).toStdWString();
+
+      auto scan = std::make_shared<LayerScanObserver>(path);
+
+      auto done = [=, this, &e, &stats, &loadOrder, &enabledArchives] {
+        auto layer = scan->recorder().finish();
+        {
+          std::scoped_lock lock(m_modSizesLock);
+          m_modSizes[e.absolutePath] = layer->entries.size();
         }
-      } else {
-        auto& mt = g_threads.request();
-
-        mt.gameFeatures = &m_Core.gameFeatures();
-        mt.progress     = progress;
-        mt.ds           = directoryStructure;
-        mt.modName      = e.modName.toStdWString();
-        mt.path         = QDir::toNativeSeparators(e.absolutePath).toStdWString();
-        mt.prio         = prio;
-
-        mt.archives.clear();
-        for (auto&& a : e.archives) {
-          mt.archives.push_back(a.toStdWString());
+        addLayerScan(scan->recorder().root(), std::move(layer));
+
+        if (Settings::instance().archiveParsing()) {
+          std::vector<std::wstring> archives;
+          for (auto&& a : e.archives) {
+            archives.push_back(a.toStdWString());
+          }
+          directoryStructure->addFromAllBSAs(modName, path, prio, archives,
+                                             enabledArchives, loadOrder, stats[i]);
         }
 
-        mt.enabledArchives.clear();
-        for (auto&& a : m_EnabledArchives) {
-          mt.enabledArchives.insert(a.toStdWString());
+        if (progress) {
+          progress->addDone();
         }
+      };
+
+      if (m_threadCount > 1 && lastSizes[i] >= SplitModSize) {
+        // the top directories of the mod become tasks of their own, so a
+        // huge mod is walked by every thread instead of holding up the end
+        // of the refresh
+        directoryStructure->addFromOrigin(group, modName, path, prio, stats[i],
+                                          scan.get(), done);
+      } else {
+        // walkers keep their buffers between mods
+        thread_local env::DirectoryWalker walker;
+        directoryStructure->addFromOrigin(walker, modName, path, prio, stats[i],
+                                          scan.get());
+        done();
+      }
+    });
+  }
 
-        mt.loadOrder = &loadOrder;
-        mt.stats     = &stats[i];
+  // mods with stolen files are few and quick, this thread does them while the
+  // pool walks the others
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    const auto& e = entries[i];
+    if (e.stealFiles.length() == 0) {
+      continue;
+    }
 
-        mt.wakeup();
-      }
+    try {
+      stealModFilesIntoStructure(directoryStructure, e.modName, e.priority + 1,
+                                 e.absolutePath, e.stealFiles);
     } catch (const std::exception& ex) {
       emit error(tr("failed to read mod (%1): %2").arg(e.modName, ex.what()));
     }
+
+    if (progress) {
+      progress->addDone();
+    }
   }
 
-  g_threads.waitForAll();
+  try {
+    group.wait();
+  } catch (const std::exception& ex) {
+    emit error(tr("failed to read mods: %1").arg(ex.what()));
+  }
 
   if constexpr (DirectoryStats::EnableInstrumentation) {
     dumpStats(stats);
@@ -470,6 +446,9 @@ void DirectoryRefresher::refresh()
 
     m_Root.reset(new DirectoryEntry(L"data", nullptr, 0));
 
+    // scans from a refresh nobody picked up are stale now
+    stealLayerScans();
+
     IPluginGame* game = qApp->property("managed_game").value<IPluginGame*>();
 
     const QString dataPath = game->dataDirectory().absolutePath();
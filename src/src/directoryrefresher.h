@@ -23,9 +23,12 @@ along with Mod Organizer.  If not, see <http://www.gnu.org/licenses/>.
 #include "profile.h"
 #include "shared/directoryentry.h"
 #include "shared/fileregisterfwd.h"
+#include "vfs/vfslayers.h"
 #include <QMutex>
 #include <QObject>
 #include <QStringList>
+#include <map>
+#include <mutex>
 #include <set>
 #include <tuple>
 #include <vector>
@@ -68,6 +71,20 @@ public:
    **/
   MOShared::DirectoryEntry* stealDirectoryStructure();
 
+  /**
+   * @brief retrieve the scans of the mod directories made by the last refresh
+   *
+   * these are handed to the FUSE VFS so it doesn't walk the same directories
+   * again; the refresher keeps no copy
+   *
+   * @return scans by mod directory
+   **/
+  VfsLayerSet::ScanTable stealLayerScans();
+
+  // careful: called from multiple threads
+  void addLayerScan(const std::string& root,
+                    std::shared_ptr<const VfsLayerSet::Scan> scan);
+
   /**
    * @brief sets up the mods to be included in the directory structure
    *
@@ -153,10 +170,20 @@ private:
   std::vector<EntryInfo> m_Mods;
   std::set<QString> m_EnabledArchives;
   std::unique_ptr<MOShared::DirectoryEntry> m_Root;
+  VfsLayerSet::ScanTable m_LayerScans;
+  std::mutex m_LayerScansLock;
   QMutex m_RefreshLock;
   std::size_t m_threadCount;
   std::size_t m_lastFileCount;
 
+  // entries per mod directory in the last refresh, to start big mods first
+  std::map<QString, std::size_t> m_modSizes;
+  std::mutex m_modSizesLock;
+
+  // the workers; the refreshing thread helps them while it waits.  Last, so
+  // they are stopped before anything they use goes away
+  env::TaskPool m_pool;
+
   void stealModFilesIntoStructure(MOShared::DirectoryEntry* directoryStructure,
                                   const QString& modName, int priority,
                                   const QString& directory,
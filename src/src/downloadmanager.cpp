@@ -399,10 +399,11 @@ void DownloadManager::refreshList()
 
     env::forEachEntry(
         QDir::toNativeSeparators(m_OutputDirectory).toStdWString(), &cx, nullptr,
-        nullptr, [](void* data, std::wstring_view f, FILETIME, uint64_t size) {
+        nullptr, [](void* data, env::EntryName f, FILETIME, uint64_t size) {
           auto& cx = *static_cast<Context*>(data);
 
-          std::wstring lc = MOShared::ToLowerCopy(f);
+          const QString name = env::toQString(f);
+          std::wstring lc    = MOShared::ToLowerCopy(name.toStdWString());
 
           bool interestingExt = false;
           for (auto&& ext : cx.extensions) {
@@ -421,7 +422,7 @@ void DownloadManager::refreshList()
           }
 
           QString fileName = QDir::fromNativeSeparators(cx.self.m_OutputDirectory) +
-                             "/" + QString::fromWCharArray(f.data(), f.size());
+                             "/" + name;
 
           DownloadInfo* info = DownloadInfo::createFromMeta(
               fileName, cx.self.m_ShowHidden, cx.self.m_OutputDirectory, size);
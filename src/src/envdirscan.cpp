@@ -0,0 +1,208 @@
+#include "envdirscan.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace env
+{
+
+namespace
+{
+
+// enough for a few hundred entries per getdents64 call
+constexpr size_t ListingChunk = 32 * 1024;
+
+// layout of the records getdents64 returns (struct linux_dirent64)
+struct Dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+std::chrono::system_clock::time_point toTimePoint(const struct statx_timestamp& t)
+{
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec)));
+}
+
+// Fills in what d_type didn't tell; false if the entry isn't a file or a
+// directory (or a link to one).
+bool describe(int dirfd, unsigned char type, ScannedEntry& e)
+{
+  unsigned mask = STATX_SIZE | STATX_MTIME;
+  int flags     = AT_STATX_DONT_SYNC;
+
+  switch (type) {
+  case DT_DIR:
+    e.is_dir = true;
+    return true;
+  case DT_REG:
+    flags |= AT_SYMLINK_NOFOLLOW;
+    break;
+  case DT_LNK:
+    e.is_symlink = true;
+    mask |= STATX_TYPE;
+    break;
+  case DT_UNKNOWN:
+    // some filesystems don't fill d_type
+    mask |= STATX_TYPE;
+    flags |= AT_SYMLINK_NOFOLLOW;
+    break;
+  default:
+    return false;
+  }
+
+  // the name is NUL-terminated in the listing buffer
+  struct statx stx;
+  if (statx(dirfd, e.name.data(), flags, mask, &stx) != 0) {
+    return false;
+  }
+
+  if (type == DT_UNKNOWN && S_ISLNK(stx.stx_mode)) {
+    return describe(dirfd, DT_LNK, e);
+  }
+
+  if (type != DT_REG) {
+    if (S_ISDIR(stx.stx_mode)) {
+      e.is_dir = true;
+      return true;
+    }
+    if (!S_ISREG(stx.stx_mode)) {
+      return false;
+    }
+  }
+
+  e.size  = stx.stx_size;
+  e.mtime = toTimePoint(stx.stx_mtime);
+  return true;
+}
+
+struct Walker
+{
+  const std::function<void(std::string_view, const ScannedEntry&)>& visit;
+  std::string rel;  // of the directory being listed, reused throughout
+
+  // listing buffers per depth, so they are allocated once per level
+  struct Level
+  {
+    std::vector<char> buffer;
+    std::vector<ScannedEntry> entries;
+  };
+  std::vector<Level> levels;
+
+  void walk(int fd, size_t depth)
+  {
+    if (levels.size() <= depth) {
+      levels.resize(depth + 1);
+    }
+    // `levels` may grow below, so refer to this level by index
+    if (!scanDirectory(fd, levels[depth].buffer, levels[depth].entries)) {
+      return;
+    }
+
+    const size_t base = rel.size();
+    for (size_t i = 0; i < levels[depth].entries.size(); ++i) {
+      const ScannedEntry& e = levels[depth].entries[i];
+
+      if (base != 0) {
+        rel.push_back('/');
+      }
+      rel += e.name;
+      visit(rel, e);
+
+      if (e.is_dir && !e.is_symlink) {
+        const int child = openScanDirectory(fd, e.name.data());
+        if (child >= 0) {
+          walk(child, depth + 1);
+          close(child);
+        }
+      }
+      rel.resize(base);
+    }
+  }
+};
+
+}  // namespace
+
+bool scanFile(int at, const char* path, ScannedEntry& out)
+{
+  struct statx stx;
+  if (statx(at, path, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+            &stx) != 0 ||
+      !S_ISREG(stx.stx_mode)) {
+    return false;
+  }
+
+  out.size  = stx.stx_size;
+  out.mtime = toTimePoint(stx.stx_mtime);
+  return true;
+}
+
+int openScanDirectory(int at, const char* path)
+{
+  return openat(at, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+bool scanDirectory(int fd, std::vector<char>& buffer, std::vector<ScannedEntry>& out)
+{
+  out.clear();
+
+  // the whole listing first, so names stay put while entries point at them
+  size_t used = 0;
+  for (;;) {
+    if (buffer.size() < used + ListingChunk) {
+      buffer.resize(used + ListingChunk);
+    }
+    const long n = syscall(SYS_getdents64, fd, buffer.data() + used, buffer.size() - used);
+    if (n < 0) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    used += static_cast<size_t>(n);
+  }
+
+  for (size_t pos = 0; pos < used;) {
+    const auto* d = reinterpret_cast<const Dirent64*>(buffer.data() + pos);
+    pos += d->d_reclen;
+
+    const std::string_view name(d->d_name);
+    if (name == "." || name == "..") {
+      continue;
+    }
+
+    ScannedEntry e;
+    e.name = name;
+    if (describe(fd, d->d_type, e)) {
+      out.push_back(e);
+    }
+  }
+
+  return true;
+}
+
+void scanTree(
+    const std::string& root,
+    const std::function<void(std::string_view rel, const ScannedEntry& entry)>& visit)
+{
+  const int fd = openScanDirectory(AT_FDCWD, root.c_str());
+  if (fd < 0) {
+    return;
+  }
+
+  Walker walker{visit, {}, {}};
+  walker.walk(fd, 0);
+  close(fd);
+}
+
+}  // namespace env
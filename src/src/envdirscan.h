@@ -0,0 +1,57 @@
+#ifndef ENV_DIRSCAN_H
+#define ENV_DIRSCAN_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace env
+{
+
+// Linux directory listing for the directory refresher (DirectoryWalker) and
+// the VFS scanners, which list every directory of every mod and are
+// dominated by per-entry syscalls.  Names and types come from getdents64 in
+// large batches; only regular files (and symlinks or entries of unknown
+// type, to find out what they are) cost a statx, asking for the size and
+// mtime alone and without forcing a sync on network filesystems.
+//
+// What is listed matches recursive_directory_iterator with the checks the
+// scanners did on top: files and directories, symlinks resolved to what they
+// point to, and symlinked directories reported but not entered.  Anything
+// else (sockets, dangling links) is left out.
+struct ScannedEntry
+{
+  std::string_view name;  // points into the listing buffer
+  bool is_dir     = false;
+  bool is_symlink = false;
+  uint64_t size   = 0;  // files
+  std::chrono::system_clock::time_point mtime{};
+};
+
+// Reads the entries of the open directory `fd` into `out`, replacing its
+// contents; names point into `buffer`, which holds the raw listing until the
+// next call with it.  Returns false if the directory couldn't be read.
+bool scanDirectory(int fd, std::vector<char>& buffer, std::vector<ScannedEntry>& out);
+
+// Size and mtime of the file `path`, relative to the directory `at`, with
+// symlinks resolved as in a listing; false if it isn't a file (any more).
+bool scanFile(int at, const char* path, ScannedEntry& out);
+
+// Opens the directory `path`, relative to the directory `at` or AT_FDCWD;
+// -1 if it can't be opened.
+int openScanDirectory(int at, const char* path);
+
+// Walks everything below `root`, depth first, each directory reported before
+// its contents.  `rel` is the entry's path relative to `root`, '/'-separated,
+// and only valid during the call.  Directories are opened relative to their
+// parent, so no full path is resolved past the root.
+void scanTree(
+    const std::string& root,
+    const std::function<void(std::string_view rel, const ScannedEntry& entry)>& visit);
+
+}  // namespace env
+
+#endif  // ENV_DIRSCAN_H
@@ -149,63 +149,17 @@ QString toString(POBJECT_ATTRIBUTES poa)
   return QString::fromWCharArray(sv.data(), static_cast<int>(sv.size()));
 }
 
-class HandleCloserThread
-{
-public:
-  HandleCloserThread() : m_ready(false) { m_handles.reserve(50000); }
-
-  void shrink() { m_handles.shrink_to_fit(); }
-
-  void add(HANDLE h) { m_handles.push_back(h); }
-
-  void wakeup()
-  {
-    {
-      std::unique_lock lock(m_mutex);
-      m_ready = true;
-    }
-
-    m_cv.notify_one();
-  }
-
-  void run()
-  {
-    MOShared::SetThisThreadName("HandleCloserThread");
-
-    std::unique_lock lock(m_mutex);
-    m_cv.wait(lock, [&] {
-      return m_ready;
-    });
-
-    closeHandles();
-  }
-
-private:
-  std::vector<HANDLE> m_handles;
-  std::condition_variable m_cv;
-  std::mutex m_mutex;
-  bool m_ready;
-
-  void closeHandles()
-  {
-    for (auto& h : m_handles) {
-      NtClose(h);
-    }
-
-    m_handles.clear();
-    m_ready = false;
-  }
-};
-
 constexpr std::size_t AllocSize = 1024 * 1024;
-static ThreadPool<HandleCloserThread> g_handleClosers;
+
+// closing directory handles is slow, so it's left to the background
+static TaskPool g_handleClosers(1, "HandleCloserThread");
 
 void setHandleCloserThreadCount(std::size_t n)
 {
-  g_handleClosers.setMax(n);
+  g_handleClosers.setThreadCount(n);
 }
 
-void forEachEntryImpl(void* cx, HandleCloserThread& hc,
+void forEachEntryImpl(void* cx, std::vector<HANDLE>& handles,
                       std::vector<std::unique_ptr<unsigned char[]>>& buffers,
                       POBJECT_ATTRIBUTES poa, std::size_t depth, DirStartF* dirStartF,
                       DirEndF* dirEndF, FileF* fileF)
@@ -226,7 +180,7 @@ void forEachEntryImpl(void* cx, HandleCloserThread& hc,
     return;
   }
 
-  hc.add(oa.RootDirectory);
+  handles.push_back(oa.RootDirectory);
   unsigned char* buffer;
 
   if (depth >= buffers.size()) {
@@ -286,11 +240,13 @@ void forEachEntryImpl(void* cx, HandleCloserThread& hc,
         ObjectName.MaximumLength = ObjectName.Length;
 
         if (DirInfo->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-          if (dirStartF && dirEndF) {
-            dirStartF(cx, toStringView(&oa));
-            forEachEntryImpl(cx, hc, buffers, &oa, depth + 1, dirStartF, dirEndF,
-                             fileF);
-            dirEndF(cx, toStringView(&oa));
+          if (dirStartF) {
+            dirStartF(cx, toStringView(&oa), false);
+            if (dirEndF) {
+              forEachEntryImpl(cx, handles, buffers, &oa, depth + 1, dirStartF,
+                               dirEndF, fileF);
+              dirEndF(cx, toStringView(&oa));
+            }
           }
         } else {
           FILETIME ft;
@@ -331,8 +287,6 @@ std::wstring makeNtPath(const std::wstring& path)
 void DirectoryWalker::forEachEntry(const std::wstring& path, void* cx,
                                    DirStartF* dirStartF, DirEndF* dirEndF, FileF* fileF)
 {
-  auto& hc = g_handleClosers.request();
-
   if (!NtOpenFile) {
     LibraryPtr m(::LoadLibraryW(L"ntdll.dll"));
     NtOpenFile = (NtOpenFile_type)::GetProcAddress(m.get(), "NtOpenFile");
@@ -352,8 +306,24 @@ void DirectoryWalker::forEachEntry(const std::wstring& path, void* cx,
   oa.Length            = sizeof(oa);
   oa.ObjectName        = &ObjectName;
 
-  forEachEntryImpl(cx, hc, m_buffers, &oa, 0, dirStartF, dirEndF, fileF);
-  hc.wakeup();
+  std::vector<HANDLE> handles;
+  forEachEntryImpl(cx, handles, m_buffers, &oa, 0, dirStartF, dirEndF, fileF);
+
+  g_handleClosers.post([handles = std::move(handles)] {
+    for (HANDLE h : handles) {
+      NtClose(h);
+    }
+  });
+}
+
+QString toQString(EntryName name)
+{
+  return QString::fromWCharArray(name.data(), static_cast<qsizetype>(name.size()));
+}
+
+DirectoryStamp directoryStamp(const std::wstring&)
+{
+  return {};
 }
 
 void forEachEntry(const std::wstring& path, void* cx, DirStartF* dirStartF,
@@ -376,7 +346,7 @@ Directory getFilesAndDirs(const std::wstring& path)
 
   env::forEachEntry(
       path, &cx,
-      [](void* pcx, std::wstring_view path) {
+      [](void* pcx, std::wstring_view path, bool) {
         Context* cx = (Context*)pcx;
 
         cx->current.top()->dirs.push_back(Directory(path));
@@ -441,29 +411,33 @@ Directory getFilesAndDirsWithFind(const std::wstring& path)
 
 }  // namespace env
 
-#else // Linux
-
-#include <dirent.h>
-#include <QDir>
-#include <QProcess>
-#include <sys/stat.h>
-#include <cstring>
-#include <cctype>
-#include <stack>
-#include <filesystem>
-#include <fstream>
-#include <sstream>
+#else // Linux
+
+#include "envdirscan.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <QDir>
+#include <QProcess>
+#include <unistd.h>
+#include <cstring>
+#include <cctype>
+#include <stack>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 
 namespace env
 {
 
-// Convert timespec to FILETIME (100-nanosecond intervals since Jan 1, 1601)
-static FILETIME timespecToFiletime(const struct timespec& ts)
+// Convert a time point to FILETIME (100-nanosecond intervals since Jan 1, 1601)
+static FILETIME toFiletime(std::chrono::system_clock::time_point t)
 {
-  // Unix epoch to Windows epoch offset: 11644473600 seconds
-  constexpr uint64_t EPOCH_DIFF = 116444736000000000ULL;
-  uint64_t winTime = static_cast<uint64_t>(ts.tv_sec) * 10000000ULL +
-                     static_cast<uint64_t>(ts.tv_nsec) / 100ULL + EPOCH_DIFF;
+  // Unix epoch to Windows epoch offset: 11644473600 seconds; signed, so times
+  // before 1970 don't wrap
+  using Ticks = std::chrono::duration<int64_t, std::ratio<1, 10000000>>;
+  constexpr int64_t EPOCH_DIFF = 116444736000000000LL;
+  const int64_t ticks = std::chrono::floor<Ticks>(t.time_since_epoch()).count();
+  const uint64_t winTime = static_cast<uint64_t>(ticks + EPOCH_DIFF);
   FILETIME ft;
   ft.dwLowDateTime  = static_cast<DWORD>(winTime & 0xFFFFFFFF);
   ft.dwHighDateTime = static_cast<DWORD>(winTime >> 32);
@@ -476,183 +450,251 @@ static std::string toNarrow(const std::wstring& ws)
   return QString::fromStdWString(ws).toStdString();
 }
 
-// Convert narrow string to std::wstring
-static std::wstring toWide(const std::string& s)
-{
-  return QString::fromStdString(s).toStdWString();
-}
-
-static std::string decodeProcMountField(const std::string& in)
-{
-  std::string out;
-  out.reserve(in.size());
-
-  for (size_t i = 0; i < in.size();) {
-    if (in[i] == '\\' && i + 3 < in.size() && std::isdigit(in[i + 1]) &&
-        std::isdigit(in[i + 2]) && std::isdigit(in[i + 3])) {
-      const std::string oct = in.substr(i + 1, 3);
-      const int value       = std::stoi(oct, nullptr, 8);
-      out.push_back(static_cast<char>(value));
-      i += 4;
-      continue;
-    }
-
-    out.push_back(in[i]);
-    ++i;
-  }
-
-  return out;
-}
-
-static bool isMountPoint(const std::string& path)
-{
-  const std::string cleanPath = QDir::cleanPath(QString::fromStdString(path)).toStdString();
-  std::ifstream mounts("/proc/mounts");
-  if (!mounts.is_open()) {
-    return false;
-  }
-
-  std::string line;
-  while (std::getline(mounts, line)) {
-    std::istringstream iss(line);
-    std::string device;
-    std::string mountPoint;
-    if (!(iss >> device >> mountPoint)) {
-      continue;
-    }
-
-    const std::string decoded =
-        QDir::cleanPath(QString::fromStdString(decodeProcMountField(mountPoint)))
-            .toStdString();
-    if (decoded == cleanPath) {
-      return true;
-    }
-  }
-
-  return false;
-}
-
-static bool runUnmountCommand(const QString& program, const QStringList& args)
-{
-  QProcess p;
-  p.start(program, args);
-  if (!p.waitForFinished(3000)) {
-    p.kill();
-    return false;
-  }
-
-  return p.exitStatus() == QProcess::NormalExit && p.exitCode() == 0;
-}
-
-static bool tryRecoverStaleMount(const std::string& dirPath)
-{
-  if (!isMountPoint(dirPath)) {
-    return false;
-  }
-
-  const QString clean = QDir::cleanPath(QString::fromStdString(dirPath));
-  log::warn("stale mount detected at '{}', attempting recovery", clean);
-
-  runUnmountCommand("fusermount3", {"-u", clean});
-  runUnmountCommand("fusermount", {"-u", clean});
-  runUnmountCommand("umount", {clean});
-  runUnmountCommand("umount", {"-l", clean});
-  runUnmountCommand("fusermount3", {"-uz", clean});
-  runUnmountCommand("fusermount", {"-uz", clean});
-
-  const bool recovered = !isMountPoint(dirPath);
-  if (recovered) {
-    log::info("recovered stale mount at '{}'", clean);
-  } else {
-    log::warn("failed to recover stale mount at '{}'", clean);
-  }
-
-  return recovered;
-}
-
-// HandleCloserThread stub for Linux (no NT handles to close)
-class HandleCloserThread
-{
-public:
-  HandleCloserThread() : m_ready(false) {}
-  void shrink() {}
-  void add(void*) {}
-  void wakeup()
-  {
-    std::unique_lock lock(m_mutex);
-    m_ready = true;
-    m_cv.notify_one();
+// Decodes a UTF-8 name into `out`, which keeps its capacity from one name to
+// the next; bytes that aren't valid UTF-8 become U+FFFD, like with
+// QString::fromUtf8()
+static std::wstring_view toWide(std::string_view s, std::wstring& out)
+{
+  out.clear();
+
+  for (std::size_t i = 0; i < s.size();) {
+    const auto c = static_cast<unsigned char>(s[i]);
+    if (c < 0x80) {
+      out.push_back(c);
+      ++i;
+      continue;
+    }
+
+    std::size_t n  = 0;
+    char32_t cp    = 0;
+    char32_t least = 0;
+
+    if ((c & 0xE0) == 0xC0) {
+      n     = 1;
+      cp    = c & 0x1F;
+      least = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+      n     = 2;
+      cp    = c & 0x0F;
+      least = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+      n     = 3;
+      cp    = c & 0x07;
+      least = 0x10000;
+    }
+
+    bool valid = n != 0 && i + n < s.size();
+    for (std::size_t k = 1; valid && k <= n; ++k) {
+      const auto cc = static_cast<unsigned char>(s[i + k]);
+      valid         = (cc & 0xC0) == 0x80;
+      cp            = (cp << 6) | (cc & 0x3F);
+    }
+
+    if (!valid || cp < least || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+      out.push_back(0xFFFD);
+      ++i;
+      continue;
+    }
+
+    out.push_back(static_cast<wchar_t>(cp));
+    i += n + 1;
   }
-  void run()
-  {
-    std::unique_lock lock(m_mutex);
-    m_cv.wait(lock, [&] { return m_ready; });
-    m_ready = false;
+
+  return out;
+}
+
+static std::string decodeProcMountField(const std::string& in)
+{
+  std::string out;
+  out.reserve(in.size());
+
+  for (size_t i = 0; i < in.size();) {
+    if (in[i] == '\\' && i + 3 < in.size() && std::isdigit(in[i + 1]) &&
+        std::isdigit(in[i + 2]) && std::isdigit(in[i + 3])) {
+      const std::string oct = in.substr(i + 1, 3);
+      const int value       = std::stoi(oct, nullptr, 8);
+      out.push_back(static_cast<char>(value));
+      i += 4;
+      continue;
+    }
+
+    out.push_back(in[i]);
+    ++i;
   }
 
-private:
-  std::condition_variable m_cv;
-  std::mutex m_mutex;
-  bool m_ready;
-};
+  return out;
+}
 
-static ThreadPool<HandleCloserThread> g_handleClosers;
+static bool isMountPoint(const std::string& path)
+{
+  const std::string cleanPath = QDir::cleanPath(QString::fromStdString(path)).toStdString();
+  std::ifstream mounts("/proc/mounts");
+  if (!mounts.is_open()) {
+    return false;
+  }
 
-void setHandleCloserThreadCount(std::size_t n)
+  std::string line;
+  while (std::getline(mounts, line)) {
+    std::istringstream iss(line);
+    std::string device;
+    std::string mountPoint;
+    if (!(iss >> device >> mountPoint)) {
+      continue;
+    }
+
+    const std::string decoded =
+        QDir::cleanPath(QString::fromStdString(decodeProcMountField(mountPoint)))
+            .toStdString();
+    if (decoded == cleanPath) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool runUnmountCommand(const QString& program, const QStringList& args)
+{
+  QProcess p;
+  p.start(program, args);
+  if (!p.waitForFinished(3000)) {
+    p.kill();
+    return false;
+  }
+
+  return p.exitStatus() == QProcess::NormalExit && p.exitCode() == 0;
+}
+
+static bool tryRecoverStaleMount(const std::string& dirPath)
+{
+  if (!isMountPoint(dirPath)) {
+    return false;
+  }
+
+  const QString clean = QDir::cleanPath(QString::fromStdString(dirPath));
+  log::warn("stale mount detected at '{}', attempting recovery", clean);
+
+  runUnmountCommand("fusermount3", {"-u", clean});
+  runUnmountCommand("fusermount", {"-u", clean});
+  runUnmountCommand("umount", {clean});
+  runUnmountCommand("umount", {"-l", clean});
+  runUnmountCommand("fusermount3", {"-uz", clean});
+  runUnmountCommand("fusermount", {"-uz", clean});
+
+  const bool recovered = !isMountPoint(dirPath);
+  if (recovered) {
+    log::info("recovered stale mount at '{}'", clean);
+  } else {
+    log::warn("failed to recover stale mount at '{}'", clean);
+  }
+
+  return recovered;
+}
+
+// directories are closed as soon as they're listed, there are no handles to
+// close in the background
+void setHandleCloserThreadCount(std::size_t) {}
+
+// `path` is the full path of the directory, for recovering and logging
+static int openDirectory(int at, const char* name, const std::string& path)
+{
+  int fd = openScanDirectory(at, name);
+  if (fd < 0 && errno == ENOTCONN) {
+    if (tryRecoverStaleMount(path)) {
+      fd = openScanDirectory(at, name);
+    }
+  }
+
+  if (fd < 0) {
+    log::error("failed to open directory '{}': {}", QString::fromStdString(path),
+               strerror(errno));
+  }
+
+  return fd;
+}
+
+void DirectoryWalker::walk(int fd, std::size_t depth, void* cx, DirStartF* dirStartF,
+                           DirEndF* dirEndF, FileF* fileF)
 {
-  g_handleClosers.setMax(n);
-}
-
-// Recursive directory walker using POSIX opendir/readdir
-static void forEachEntryImpl(const std::string& dirPath, void* cx,
-                             DirStartF* dirStartF, DirEndF* dirEndF, FileF* fileF)
-{
-  DIR* dir = opendir(dirPath.c_str());
-  if (!dir && errno == ENOTCONN) {
-    if (tryRecoverStaleMount(dirPath)) {
-      dir = opendir(dirPath.c_str());
-    }
-  }
-  if (!dir) {
-    log::error("failed to open directory '{}': {}",
-               QString::fromStdString(dirPath), strerror(errno));
-    return;
-  }
-
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+  if (m_levels.size() <= depth) {
+    m_levels.resize(depth + 1);
+  }
+
+  // m_levels may grow below, so this level is always looked up again
+  if (!scanDirectory(fd, m_levels[depth].buffer, m_levels[depth].entries)) {
+    log::error("failed to read directory '{}': {}", QString::fromStdString(m_path),
+               strerror(errno));
+    return;
+  }
+
+  for (std::size_t i = 0; i < m_levels[depth].entries.size(); ++i) {
+    const ScannedEntry& e = m_levels[depth].entries[i];
+
+    if (!e.is_dir) {
+      fileF(cx, e.name, toFiletime(e.mtime), e.size);
+      continue;
+    }
+
+    if (!dirStartF) {
       continue;
     }
 
-    std::string fullPath = dirPath + "/" + entry->d_name;
-    std::wstring wname = toWide(entry->d_name);
+    dirStartF(cx, e.name, e.is_symlink);
 
-    struct stat st;
-    if (lstat(fullPath.c_str(), &st) != 0) {
+    if (!dirEndF) {
       continue;
     }
 
-    if (S_ISDIR(st.st_mode)) {
-      if (dirStartF && dirEndF) {
-        std::wstring_view nameView(wname);
-        dirStartF(cx, nameView);
-        forEachEntryImpl(fullPath, cx, dirStartF, dirEndF, fileF);
-        dirEndF(cx, nameView);
+    // symlinked directories aren't entered, so cycles can't happen
+    if (!e.is_symlink) {
+      const std::size_t parent = m_path.size();
+      m_path.push_back('/');
+      m_path += e.name;
+
+      const int child = openDirectory(fd, m_path.c_str() + parent + 1, m_path);
+      if (child >= 0) {
+        walk(child, depth + 1, cx, dirStartF, dirEndF, fileF);
+        close(child);
       }
-    } else {
-      FILETIME ft = timespecToFiletime(st.st_mtim);
-      fileF(cx, std::wstring_view(wname), ft, static_cast<uint64_t>(st.st_size));
+
+      m_path.resize(parent);
     }
-  }
 
-  closedir(dir);
+    dirEndF(cx, m_levels[depth].entries[i].name);
+  }
 }
 
 void DirectoryWalker::forEachEntry(const std::wstring& path, void* cx,
                                    DirStartF* dirStartF, DirEndF* dirEndF, FileF* fileF)
 {
-  forEachEntryImpl(toNarrow(path), cx, dirStartF, dirEndF, fileF);
+  m_path = toNarrow(path);
+
+  const int fd = openDirectory(AT_FDCWD, m_path.c_str(), m_path);
+  if (fd < 0) {
+    return;
+  }
+
+  walk(fd, 0, cx, dirStartF, dirEndF, fileF);
+  close(fd);
+}
+
+QString toQString(EntryName name)
+{
+  return QString::fromUtf8(name.data(), static_cast<qsizetype>(name.size()));
+}
+
+DirectoryStamp directoryStamp(const std::wstring& path)
+{
+  struct stat st;
+  if (::stat(toNarrow(path).c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return {};
+  }
+
+  DirectoryStamp stamp;
+  stamp.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  stamp.ctime = int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+  stamp.ino   = st.st_ino;
+  return stamp;
 }
 
 void forEachEntry(const std::wstring& path, void* cx, DirStartF* dirStartF,
@@ -666,6 +708,7 @@ Directory getFilesAndDirs(const std::wstring& path)
   struct Context
   {
     std::stack<Directory*> current;
+    std::wstring name;  // decoding buffer
   };
 
   Directory root;
@@ -675,20 +718,20 @@ Directory getFilesAndDirs(const std::wstring& path)
 
   env::forEachEntry(
       path, &cx,
-      [](void* pcx, std::wstring_view path) {
+      [](void* pcx, EntryName path, bool) {
         Context* cx = (Context*)pcx;
-        cx->current.top()->dirs.push_back(Directory(path));
+        cx->current.top()->dirs.push_back(Directory(toWide(path, cx->name)));
         cx->current.push(&cx->current.top()->dirs.back());
       },
 
-      [](void* pcx, std::wstring_view) {
+      [](void* pcx, EntryName) {
         Context* cx = (Context*)pcx;
         cx->current.pop();
       },
 
-      [](void* pcx, std::wstring_view path, FILETIME ft, uint64_t s) {
+      [](void* pcx, EntryName path, FILETIME ft, uint64_t s) {
         Context* cx = (Context*)pcx;
-        cx->current.top()->files.push_back(File(path, ft, s));
+        cx->current.top()->files.push_back(File(toWide(path, cx->name), ft, s));
       });
 
   return root;
@@ -719,4 +762,282 @@ Directory::Directory(std::wstring_view n)
     : name(n.begin(), n.end()), lcname(MOShared::ToLowerCopy(name))
 {}
 
+// per-worker queues only hold what one task spawns at a time; more than that
+// is run on the spot, which keeps the spawning worker busy anyway
+constexpr std::size_t WorkerQueueSize   = 1024;
+constexpr std::size_t InjectedQueueSize = 8192;
+
+struct TaskPool::Worker
+{
+  TaskQueue queue{WorkerQueueSize};
+  std::thread thread;
+};
+
+// the pool the current thread works for, if any
+static thread_local const TaskPool* t_pool = nullptr;
+
+bool TaskPool::TaskQueue::push(Task& t)
+{
+  std::scoped_lock lock(m_mutex);
+  if (m_size == m_ring.size()) {
+    return false;
+  }
+
+  m_ring[(m_head + m_size) % m_ring.size()] = std::move(t);
+  ++m_size;
+  return true;
+}
+
+bool TaskPool::TaskQueue::pop(Task& t)
+{
+  std::scoped_lock lock(m_mutex);
+  if (m_size == 0) {
+    return false;
+  }
+
+  --m_size;
+  t = std::move(m_ring[(m_head + m_size) % m_ring.size()]);
+  return true;
+}
+
+bool TaskPool::TaskQueue::steal(Task& t)
+{
+  std::scoped_lock lock(m_mutex);
+  if (m_size == 0) {
+    return false;
+  }
+
+  t      = std::move(m_ring[m_head]);
+  m_head = (m_head + 1) % m_ring.size();
+  --m_size;
+  return true;
+}
+
+void TaskGroup::run(std::function<void()> f)
+{
+  m_pool.submit({std::move(f), this});
+}
+
+void TaskGroup::wait()
+{
+  drain();
+
+  std::exception_ptr error;
+  {
+    std::scoped_lock lock(m_errorMutex);
+    error = std::exchange(m_error, nullptr);
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void TaskGroup::drain()
+{
+  while (m_pending.load(std::memory_order_acquire) != 0) {
+    TaskPool::Task t;
+    if (m_pool.take(t)) {
+      m_pool.execute(t);
+      continue;
+    }
+
+    std::unique_lock lock(m_pool.m_sleepMutex);
+    m_pool.m_wake.wait(lock, [&] {
+      return m_pending.load(std::memory_order_acquire) == 0 ||
+             m_pool.m_queued.load(std::memory_order_acquire) > 0;
+    });
+  }
+}
+
+TaskPool::TaskPool(std::size_t threads, QString name)
+    : m_name(std::move(name)), m_injected(InjectedQueueSize)
+{
+  start(threads);
+}
+
+TaskPool::~TaskPool()
+{
+  stop();
+}
+
+void TaskPool::setThreadCount(std::size_t n)
+{
+  if (n != m_workers.size()) {
+    stop();
+    start(n);
+  }
+}
+
+void TaskPool::post(std::function<void()> f)
+{
+  submit({std::move(f), nullptr});
+}
+
+void TaskPool::start(std::size_t n)
+{
+  m_stop = false;
+  m_workers.reserve(n);
+
+  for (std::size_t i = 0; i < n; ++i) {
+    m_workers.push_back(std::make_unique<Worker>());
+  }
+
+  // started once every queue exists, since workers steal from all of them
+  for (auto& w : m_workers) {
+    w->thread = MOShared::startSafeThread([this, self = w.get()] {
+      workerLoop(self);
+    });
+  }
+}
+
+void TaskPool::stop()
+{
+  {
+    std::scoped_lock lock(m_sleepMutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+
+  for (auto& w : m_workers) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+
+  m_workers.clear();
+}
+
+TaskPool::Worker*& TaskPool::threadWorker()
+{
+  static thread_local Worker* worker = nullptr;
+  return worker;
+}
+
+TaskPool::Worker* TaskPool::currentWorker() const
+{
+  return t_pool == this ? threadWorker() : nullptr;
+}
+
+void TaskPool::submit(Task t)
+{
+  if (t.group != nullptr) {
+    t.group->m_pending.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // counted first so a thief can't see the task before the count
+  m_queued.fetch_add(1, std::memory_order_release);
+
+  Worker* self = currentWorker();
+  const bool queued =
+      !m_workers.empty() && (self != nullptr ? self->queue.push(t) : m_injected.push(t));
+
+  if (!queued) {
+    m_queued.fetch_sub(1, std::memory_order_relaxed);
+    execute(t);
+    return;
+  }
+
+  {
+    // pairs with the predicate checks of sleeping threads
+    std::scoped_lock lock(m_sleepMutex);
+  }
+  m_wake.notify_one();
+}
+
+bool TaskPool::take(Task& t)
+{
+  Worker* self = currentWorker();
+
+  bool found = (self != nullptr && self->queue.pop(t)) || m_injected.steal(t);
+
+  if (!found && !m_workers.empty()) {
+    // start at different victims so thieves don't all pile on the first one
+    static std::atomic<std::size_t> nextVictim{0};
+    const std::size_t first = nextVictim.fetch_add(1, std::memory_order_relaxed);
+
+    for (std::size_t i = 0; i < m_workers.size() && !found; ++i) {
+      Worker* victim = m_workers[(first + i) % m_workers.size()].get();
+      found          = victim != self && victim->queue.steal(t);
+    }
+  }
+
+  if (found) {
+    m_queued.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  return found;
+}
+
+void TaskPool::execute(Task& t)
+{
+  TaskGroup* group = t.group;
+
+  // nothing may escape, the group's count has to go down below whatever the
+  // task did or its waiter never returns
+  try {
+    t.f();
+  } catch (...) {
+    try {
+      throw;
+    } catch (const std::exception& e) {
+      log::error("{}: unhandled exception in task: {}", m_name, e.what());
+    } catch (...) {
+      log::error("{}: unhandled exception in task", m_name);
+    }
+
+    if (group != nullptr) {
+      std::scoped_lock lock(group->m_errorMutex);
+      if (!group->m_error) {
+        group->m_error = std::current_exception();
+      }
+    }
+  }
+
+  t = {};
+
+  // the group may be gone as soon as its count is zero, so it's not touched
+  // after that
+  if (group != nullptr &&
+      group->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    wakeAll();
+  }
+}
+
+void TaskPool::wakeAll()
+{
+  {
+    std::scoped_lock lock(m_sleepMutex);
+  }
+  m_wake.notify_all();
+}
+
+void TaskPool::workerLoop(Worker* self)
+{
+  MOShared::SetThisThreadName(m_name);
+  t_pool         = this;
+  threadWorker() = self;
+
+  for (;;) {
+    Task t;
+    if (take(t)) {
+      execute(t);
+      continue;
+    }
+
+    std::unique_lock lock(m_sleepMutex);
+    m_wake.wait(lock, [&] {
+      return m_stop || m_queued.load(std::memory_order_acquire) > 0;
+    });
+
+    // queued work is still done when stopping
+    if (m_stop && m_queued.load(std::memory_order_acquire) <= 0) {
+      break;
+    }
+  }
+
+  t_pool         = nullptr;
+  threadWorker() = nullptr;
+}
+
 }  // namespace env
@@ -2,7 +2,18 @@
 #define ENV_ENVFS_H
 
 #include "thread_utils.h"
+#ifndef _WIN32
+#include "envdirscan.h"
+#endif
+#include <QString>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 namespace env
 {
@@ -29,148 +40,150 @@ struct Directory
   Directory(std::wstring_view name);
 };
 
-template <class T>
-class ThreadPool
+class TaskPool;
+
+// Counts the tasks started through it so they can be waited for.  A task may
+// start more tasks in its own group.
+class TaskGroup
 {
 public:
-  ThreadPool(std::size_t max = 1) { setMax(max); }
+  explicit TaskGroup(TaskPool& pool) : m_pool(pool) {}
 
-  ~ThreadPool() { stopAndJoin(); }
+  // waits too, but an exception wait() didn't rethrow is only logged
+  ~TaskGroup() { drain(); }
 
-  void setMax(std::size_t n) { m_threads.resize(n); }
+  TaskGroup(const TaskGroup&)            = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
 
-  void stopAndJoin()
-  {
-    for (auto& ti : m_threads) {
-      ti.stop = true;
-      ti.wakeup();
-    }
-
-    for (auto& ti : m_threads) {
-      if (ti.thread.joinable()) {
-        ti.thread.join();
-      }
-    }
-  }
-
-  void waitForAll()
-  {
-    for (;;) {
-      bool done = true;
+  void run(std::function<void()> f);
+
+  // runs queued tasks on the calling thread until every task of the group is
+  // done, so the waiting thread works instead of sleeping; then rethrows the
+  // first exception a task of the group threw
+  void wait();
 
-      for (auto& ti : m_threads) {
-        if (ti.busy) {
-          done = false;
-          break;
-        }
-      }
+private:
+  friend class TaskPool;
 
-      if (done) {
-        break;
-      }
+  TaskPool& m_pool;
+  std::atomic<std::size_t> m_pending{0};
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
-  }
+  std::mutex m_errorMutex;
+  std::exception_ptr m_error;
 
-  T& request()
-  {
-    if (m_threads.empty()) {
-      std::terminate();
-    }
-
-    for (;;) {
-      for (auto& ti : m_threads) {
-        bool expected = false;
-
-        if (ti.busy.compare_exchange_strong(expected, true)) {
-          ti.wakeup();
-          return ti.o;
-        }
-      }
-
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
-  }
-
-  template <class F>
-  void forEach(F&& f)
-  {
-    for (auto& ti : m_threads) {
-      f(ti.o);
-    }
-  }
+  void drain();
+};
+
+// Runs tasks on a fixed set of worker threads.  Every worker has its own
+// bounded queue: it takes its own tasks newest first, and a worker that runs
+// dry steals the oldest task of another, so a task that splits its work into
+// more tasks spreads it over every thread.  Tasks from threads outside the
+// pool go to a shared queue.  A task that finds its queue full is run right
+// away by the thread that started it.
+//
+// Idle workers and waiting threads sleep on a condition variable and are
+// woken when a task is queued or a group completes; nothing polls.
+class TaskPool
+{
+public:
+  explicit TaskPool(std::size_t threads = 1, QString name = "task pool");
+  ~TaskPool();
+
+  TaskPool(const TaskPool&)            = delete;
+  TaskPool& operator=(const TaskPool&) = delete;
+
+  // restarts the workers if the count changes; queued tasks finish first,
+  // and no tasks may be started while it runs
+  void setThreadCount(std::size_t n);
+  std::size_t threadCount() const { return m_workers.size(); }
+
+  // queues `f` without a way to wait for it
+  void post(std::function<void()> f);
 
 private:
-  struct ThreadInfo
+  friend class TaskGroup;
+
+  struct Task
+  {
+    std::function<void()> f;
+    TaskGroup* group = nullptr;
+  };
+
+  // fixed-capacity ring; the owner pushes and pops at the back, thieves take
+  // from the front
+  class TaskQueue
   {
-    std::thread thread;
-    std::atomic<bool> busy;
-    T o;
-
-    std::condition_variable cv;
-    std::mutex mutex;
-    bool ready;
-
-    std::atomic<bool> stop;
-
-    ThreadInfo() : busy(true), ready(false), stop(false)
-    {
-      thread = MOShared::startSafeThread([&] {
-        run();
-      });
-    }
-
-    ~ThreadInfo()
-    {
-      if (thread.joinable()) {
-        stop = true;
-        wakeup();
-        thread.join();
-      }
-    }
-
-    void wakeup()
-    {
-      {
-        std::scoped_lock lock(mutex);
-        ready = true;
-      }
-
-      cv.notify_one();
-    }
-
-    void run()
-    {
-      busy = false;
-
-      while (!stop) {
-        std::unique_lock lock(mutex);
-        cv.wait(lock, [&] {
-          return ready;
-        });
-
-        if (stop) {
-          break;
-        }
-
-        o.run();
-
-        ready = false;
-        busy  = false;
-      }
-    }
+  public:
+    explicit TaskQueue(std::size_t capacity) : m_ring(capacity) {}
+
+    bool push(Task& t);
+    bool pop(Task& t);
+    bool steal(Task& t);
+
+  private:
+    std::mutex m_mutex;
+    std::vector<Task> m_ring;
+    std::size_t m_head = 0;
+    std::size_t m_size = 0;
   };
 
-  std::list<ThreadInfo> m_threads;
+  struct Worker;
+
+  QString m_name;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  TaskQueue m_injected;
+
+  // tasks sitting in any queue; may briefly run ahead of the queues
+  std::atomic<std::ptrdiff_t> m_queued{0};
+  std::mutex m_sleepMutex;
+  std::condition_variable m_wake;
+  bool m_stop = false;
+
+  void start(std::size_t n);
+  void stop();
+
+  void submit(Task t);
+  bool take(Task& t);
+  void execute(Task& t);
+  void wakeAll();
+  void workerLoop(Worker* self);
+  Worker* currentWorker() const;
+  static Worker*& threadWorker();
+};
+
+// names as walks report them: UTF-8 as the filesystem has it on Linux, so
+// nothing is decoded per entry
+#ifdef _WIN32
+using EntryName = std::wstring_view;
+#else
+using EntryName = std::string_view;
+#endif
+
+QString toQString(EntryName name);
+
+// what a directory looked like when a walk got to it, so changes made after
+// it was listed can be noticed; all zero if it couldn't be read, and always
+// on Windows
+struct DirectoryStamp
+{
+  int64_t mtime = 0;  // nanoseconds
+  int64_t ctime = 0;
+  uint64_t ino  = 0;
 };
 
-using DirStartF = void(void*, std::wstring_view);
-using DirEndF   = void(void*, std::wstring_view);
-using FileF     = void(void*, std::wstring_view, FILETIME, uint64_t);
+DirectoryStamp directoryStamp(const std::wstring& path);
+
+using DirStartF = void(void*, EntryName, bool symlink);
+using DirEndF   = void(void*, EntryName);
+using FileF     = void(void*, EntryName, FILETIME, uint64_t);
 
 void setHandleCloserThreadCount(std::size_t n);
 
+// Walks `path` recursively, reporting directories to `dirStartF` before their
+// contents and to `dirEndF` after.  Without `dirEndF`, directories are
+// reported but not entered; without either, only the files in `path` are.
+// On Linux, symlinked directories are reported with `symlink` set and never
+// entered, so a caller walking them itself must skip those too.
 class DirectoryWalker
 {
 public:
@@ -178,7 +191,22 @@ public:
                     DirEndF* dirEndF, FileF* fileF);
 
 private:
+#ifdef _WIN32
   std::vector<std::unique_ptr<unsigned char[]>> m_buffers;
+#else
+  // listing buffers per depth, kept for the next walk
+  struct Level
+  {
+    std::vector<char> buffer;
+    std::vector<ScannedEntry> entries;
+  };
+
+  std::vector<Level> m_levels;
+  std::string m_path;  // of the directory being listed, for errors
+
+  void walk(int fd, std::size_t depth, void* cx, DirStartF* dirStartF,
+            DirEndF* dirEndF, FileF* fileF);
+#endif
 };
 
 void forEachEntry(const std::wstring& path, void* cx, DirStartF* dirStartF,
@@ -583,7 +583,7 @@ bool FileTreeModel::updateDirectories(FileTreeItem& parentItem,
   // removeDisappearingDirectories() will add directories that are in the
   // tree and still on the filesystem to this set; addNewDirectories() will
   // use this to figure out if a directory is new or not
-  std::unordered_set<std::wstring_view> seen;
+  std::unordered_set<const DirectoryEntry*> seen;
 
   removeDisappearingDirectories(parentItem, parentEntry, parentPath, seen, forFetching);
   return addNewDirectories(parentItem, parentEntry, parentPath, seen);
@@ -591,7 +591,7 @@ bool FileTreeModel::updateDirectories(FileTreeItem& parentItem,
 
 void FileTreeModel::removeDisappearingDirectories(
     FileTreeItem& parentItem, const MOShared::DirectoryEntry& parentEntry,
-    const std::wstring& parentPath, std::unordered_set<std::wstring_view>& seen,
+    const std::wstring& parentPath, std::unordered_set<const DirectoryEntry*>& seen,
     bool forFetching)
 {
   auto& children = parentItem.children();
@@ -617,7 +617,7 @@ void FileTreeModel::removeDisappearingDirectories(
       trace(log::debug("dir {} still there", item->filename()));
 
       // directory is still there
-      seen.emplace(d->getName());
+      seen.emplace(d);
 
       bool currentRemoved = false;
 
@@ -676,10 +676,10 @@ void FileTreeModel::removeDisappearingDirectories(
   range.remove();
 }
 
-bool FileTreeModel::addNewDirectories(FileTreeItem& parentItem,
-                                      const MOShared::DirectoryEntry& parentEntry,
-                                      const std::wstring& parentPath,
-                                      const std::unordered_set<std::wstring_view>& seen)
+bool FileTreeModel::addNewDirectories(
+    FileTreeItem& parentItem, const MOShared::DirectoryEntry& parentEntry,
+    const std::wstring& parentPath,
+    const std::unordered_set<const DirectoryEntry*>& seen)
 {
   // keeps track of the contiguous directories that need to be added to
   // avoid calling beginAddRows(), etc. for each item
@@ -689,7 +689,7 @@ bool FileTreeModel::addNewDirectories(FileTreeItem& parentItem,
 
   // for each directory on the filesystem
   for (auto&& d : parentEntry.getSubDirectories()) {
-    if (seen.contains(d->getName())) {
+    if (seen.contains(d)) {
       // already seen in the parent item
 
       // if there were directories before this row that need to be added,
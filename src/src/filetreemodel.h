@@ -121,16 +121,16 @@ private:
                          const MOShared::DirectoryEntry& parentEntry, bool forFetching);
 
   // for `forFetching`, see top of filetreemodel.cpp
-  void removeDisappearingDirectories(FileTreeItem& parentItem,
-                                     const MOShared::DirectoryEntry& parentEntry,
-                                     const std::wstring& parentPath,
-                                     std::unordered_set<std::wstring_view>& seen,
-                                     bool forFetching);
-
-  bool addNewDirectories(FileTreeItem& parentItem,
-                         const MOShared::DirectoryEntry& parentEntry,
-                         const std::wstring& parentPath,
-                         const std::unordered_set<std::wstring_view>& seen);
+  void removeDisappearingDirectories(
+      FileTreeItem& parentItem, const MOShared::DirectoryEntry& parentEntry,
+      const std::wstring& parentPath,
+      std::unordered_set<const MOShared::DirectoryEntry*>& seen, bool forFetching);
+
+  bool
+  addNewDirectories(FileTreeItem& parentItem,
+                    const MOShared::DirectoryEntry& parentEntry,
+                    const std::wstring& parentPath,
+                    const std::unordered_set<const MOShared::DirectoryEntry*>& seen);
 
   bool updateFiles(FileTreeItem& parentItem, const std::wstring& path,
                    const MOShared::DirectoryEntry& parentEntry);
@@ -2,6 +2,7 @@
 
 #include "fluorinepaths.h"
 #include "settings.h"
+#include "vfs/vfsmapping.h"
 #include "vfs/vfstree.h"
 
 #include <QCoreApplication>
@@ -21,6 +22,7 @@
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <set>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -55,10 +57,17 @@ bool isFlatpak()
   return result;
 }
 
-bool waitForHelperLine(QProcess* proc, const char* expected, int timeoutMs)
+using HelperProgress = std::function<void(size_t, size_t)>;
+
+// "progress <done> <total>" lines restart the timeout, so a long operation
+// only fails if the helper stops reporting.  "stats <text>" lines are
+// collected into `stats` if given.
+bool waitForHelperLine(QProcess* proc, const char* expected, int timeoutMs,
+                       const HelperProgress& progress = {},
+                       QStringList* stats = nullptr)
 {
   const QByteArray target(expected);
-  const auto deadline =
+  auto deadline =
       std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
 
   while (proc->state() == QProcess::Running) {
@@ -71,6 +80,17 @@ bool waitForHelperLine(QProcess* proc, const char* expected, int timeoutMs)
         log::error("VFS helper: {}", QString::fromUtf8(line));
         return false;
       }
+      if (line.startsWith("progress ")) {
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(timeoutMs);
+        const auto parts = line.split(' ');
+        if (progress && parts.size() == 3) {
+          progress(parts[1].toULongLong(), parts[2].toULongLong());
+        }
+      }
+      if (stats != nullptr && line.startsWith("stats ")) {
+        stats->append(QString::fromUtf8(line.mid(6)));
+      }
       continue;
     }
 
@@ -86,14 +106,16 @@ bool waitForHelperLine(QProcess* proc, const char* expected, int timeoutMs)
   return false;
 }
 
-bool sendHelperCommand(QProcess* proc, const char* command, int timeoutMs)
+bool sendHelperCommand(QProcess* proc, const char* command, int timeoutMs,
+                       const HelperProgress& progress = {},
+                       QStringList* stats = nullptr)
 {
   proc->write(command);
   proc->write("\n");
   if (!proc->waitForBytesWritten(1000)) {
     return false;
   }
-  return waitForHelperLine(proc, "ok", timeoutMs);
+  return waitForHelperLine(proc, "ok", timeoutMs, progress, stats);
 }
 
 std::string decodeProcMountField(const std::string& in)
@@ -213,18 +235,25 @@ buildModsFromMapping(const MappingType& mapping, const QString& dataDir,
 void setupFuseOps(struct fuse_lowlevel_ops* ops)
 {
   std::memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
-  ops->lookup  = mo2_lookup;
-  ops->getattr = mo2_getattr;
-  ops->readdir = mo2_readdir;
-  ops->open    = mo2_open;
-  ops->read    = mo2_read;
-  ops->write   = mo2_write;
-  ops->create  = mo2_create;
-  ops->rename  = mo2_rename;
-  ops->setattr = mo2_setattr;
-  ops->unlink  = mo2_unlink;
-  ops->mkdir   = mo2_mkdir;
-  ops->release = mo2_release;
+  ops->init         = mo2_init;
+  ops->lookup       = mo2_lookup;
+  ops->getattr      = mo2_getattr;
+  ops->opendir      = mo2_opendir;
+  ops->readdir      = mo2_readdir;
+  ops->readdirplus  = mo2_readdirplus;
+  ops->releasedir   = mo2_releasedir;
+  ops->open         = mo2_open;
+  ops->read         = mo2_read;
+  ops->write        = mo2_write;
+  ops->create       = mo2_create;
+  ops->rename       = mo2_rename;
+  ops->setattr      = mo2_setattr;
+  ops->unlink       = mo2_unlink;
+  ops->mkdir        = mo2_mkdir;
+  ops->flush        = mo2_flush;
+  ops->release      = mo2_release;
+  ops->forget       = mo2_forget;
+  ops->forget_multi = mo2_forget_multi;
 }
 
 }  // namespace
@@ -268,6 +297,10 @@ bool FuseConnector::mount(
 
   tryCleanupStaleMount(QString::fromStdString(m_mountPoint));
 
+  // the instance directory, where the staging area also lives
+  loadScanCache(
+      (fs::path(m_overwriteDir).parent_path() / "vfs_scans.cache").string());
+
   if (isFlatpak()) {
     return mountViaHelper(overwrite_dir, game_dir, data_dir_name, mods);
   }
@@ -282,19 +315,12 @@ bool FuseConnector::mount(
     fs::create_directories(m_customOutputDir, ec);
   }
 
-  // Scan + cache base game files BEFORE mounting (after mount they're hidden).
-  // Reuse the cache across mount/unmount cycles since base game files don't
-  // change between runs — this avoids a full recursive directory walk on
-  // every launch.
-  if (m_baseFileCache.empty() || m_dataDirPath != m_cachedDataDirPath) {
-    m_baseFileCache    = scanDataDir(m_dataDirPath);
-    m_cachedDataDirPath = m_dataDirPath;
-    log::debug("Scanned {} base game entries from {}", m_baseFileCache.size(),
-               QString::fromStdString(m_dataDirPath));
-  } else {
-    log::debug("Reusing cached {} base game entries for {}",
-               m_baseFileCache.size(), QString::fromStdString(m_dataDirPath));
-  }
+  // Scan base game files BEFORE mounting (after mount they're hidden).  The
+  // scan cache keeps them across mounts and sessions, so only directories
+  // that changed since are listed again.
+  const auto baseFiles = m_scanCache.dataDir(m_dataDirPath);
+  log::debug("{} base game entries in {}", baseFiles->entries.size(),
+             QString::fromStdString(m_dataDirPath));
 
   // Open fd to data dir BEFORE mounting so we can access original files
   m_backingFd = open(m_dataDirPath.c_str(), O_RDONLY | O_DIRECTORY);
@@ -304,16 +330,24 @@ bool FuseConnector::mount(
             .arg(QString::fromStdString(m_dataDirPath)));
   }
 
-  // Build tree using cached base files + mods + overwrite
-  auto tree = std::make_shared<VfsTree>(
-      buildDataDirVfs(m_baseFileCache, m_dataDirPath, mods, m_overwriteDir));
+  // Build tree using cached base files + mods + overwrite, plus file-level
+  // data-dir mappings (e.g. plugins.txt, loadorder.txt)
+  m_layers    = std::make_unique<VfsLayerSet>(baseFiles->entries);
+  auto update = m_layers->prepare(mods, m_overwriteDir, m_extraVfsFiles, knownScans());
+  log::debug("VFS built, walked {} of {} layers", update.rescanned,
+             update.layers.size());
+  auto tree = std::make_shared<VfsTree>(m_layers->build(std::move(update)));
 
-  // Inject file-level data-dir mappings (e.g. plugins.txt, loadorder.txt)
-  injectExtraFiles(*tree, m_extraVfsFiles);
+  m_scanCache.record(m_layers->layers());
+  saveScanCache();
 
   m_context                 = std::make_shared<Mo2FsContext>();
   m_context->tree           = tree;
-  m_context->inodes         = std::make_unique<InodeTable>();
+  m_context->negatives      = std::make_unique<NegativeCache>();
+  m_context->inodes         = std::make_unique<InodeTable>(
+      [negatives = m_context->negatives.get()](uint64_t ino) {
+        negatives->dropParent(ino);
+      });
   m_context->overwrite      = std::make_unique<OverwriteManager>(m_stagingDir, m_overwriteDir);
   m_context->backing_dir_fd = m_backingFd;
   m_context->uid            = ::getuid();
@@ -354,6 +388,8 @@ bool FuseConnector::mount(
             .arg(QString::fromStdString(m_mountPoint)));
   }
 
+  m_context->session.store(m_session, std::memory_order_release);
+
   m_fuseThread = std::thread([this]() {
     fuse_session_loop_mt(m_session, nullptr);
   });
@@ -382,11 +418,18 @@ void FuseConnector::unmount()
     m_mounted       = false;
     setFuseMountPointForCrashCleanup(nullptr);
     cleanupExternalMappings();
+    saveScanCache();
     log::debug("VFS helper stopped, FUSE unmounted from {}",
                QString::fromStdString(m_mountPoint));
     return;
   }
 
+  // no new invalidations once unmounting starts; the session itself is only
+  // destroyed after the loop's workers are joined
+  if (m_context) {
+    m_context->session.store(nullptr, std::memory_order_release);
+  }
+
   if (m_session != nullptr) {
     fuse_session_exit(m_session);
     fuse_session_unmount(m_session);
@@ -409,7 +452,9 @@ void FuseConnector::unmount()
   }
 
   m_context.reset();
+  m_layers.reset();
   m_mounted = false;
+  saveScanCache();
   setFuseMountPointForCrashCleanup(nullptr);
 
   // Clean up symlinks created for non-data-dir mappings.
@@ -423,6 +468,28 @@ bool FuseConnector::isMounted() const
   return m_mounted;
 }
 
+QStringList FuseConnector::diagnostics()
+{
+  QStringList lines;
+  if (!m_mounted) {
+    return lines;
+  }
+
+  if (m_helperProcess) {
+    if (!sendHelperCommand(m_helperProcess, "stats", 5000, {}, &lines)) {
+      log::warn("VFS helper did not answer the stats command");
+    }
+    return lines;
+  }
+
+  if (m_context) {
+    for (const std::string& line : mo2_stats_report(m_context.get(), 20)) {
+      lines.append(QString::fromStdString(line));
+    }
+  }
+  return lines;
+}
+
 void FuseConnector::rebuild(
     const std::vector<std::pair<std::string, std::string>>& mods,
     const QString& overwrite_dir, const QString& data_dir_name)
@@ -445,19 +512,69 @@ void FuseConnector::rebuild(
     return;
   }
 
-  if (m_context == nullptr) {
+  if (m_context == nullptr || m_layers == nullptr) {
     return;
   }
 
-  // Use cached base files - can't re-scan the data dir since it's behind our mount
-  auto newTree = std::make_shared<VfsTree>(
-      buildDataDirVfs(m_baseFileCache, m_dataDirPath, mods, m_overwriteDir));
+  // Scan only mods that are new or changed on disk, outside the tree lock,
+  // then patch the mounted tree in place.  Mods the directory refresher just
+  // walked aren't walked again.  The base game layer comes from the cache
+  // since the data dir is behind our mount.
+  auto update =
+      m_layers->prepare(mods, m_overwriteDir, m_extraVfsFiles, knownScans());
+  const size_t rescanned = update.rescanned;
+  mo2_patch_tree(m_context.get(), [&](VfsTree& tree) {
+    m_layers->apply(tree, std::move(update));
+  });
+  m_scanCache.record(m_layers->layers());
+
+  log::debug("VFS updated, walked {} of {} layers", rescanned, mods.size() + 1);
+}
+
+void FuseConnector::setLayerScans(VfsLayerSet::ScanTable scans)
+{
+  m_layerScans = std::move(scans);
+}
+
+void FuseConnector::loadScanCache(const std::string& path)
+{
+  if (path == m_scanCachePath) {
+    return;
+  }
+
+  m_scanCache     = {};
+  m_scanCachePath = path;
+
+  std::string error;
+  if (m_scanCache.load(path, error)) {
+    const auto stats = m_scanCache.stats();
+    log::debug("Loaded scan cache {}: {} roots, {} entries",
+               QString::fromStdString(path), stats.roots, stats.entries);
+  } else {
+    log::debug("No scan cache loaded: {}", QString::fromStdString(error));
+  }
+}
+
+void FuseConnector::saveScanCache()
+{
+  if (m_scanCachePath.empty()) {
+    return;
+  }
 
-  // Inject file-level data-dir mappings (e.g. plugins.txt, loadorder.txt)
-  injectExtraFiles(*newTree, m_extraVfsFiles);
+  std::string error;
+  if (!m_scanCache.save(m_scanCachePath, error)) {
+    log::warn("Failed to save scan cache: {}", QString::fromStdString(error));
+  }
+}
 
-  std::unique_lock lock(m_context->tree_mutex);
-  m_context->tree.swap(newTree);
+VfsLayerSet::ScanTable FuseConnector::knownScans() const
+{
+  // what the directory refresher walked is newer than anything cached
+  VfsLayerSet::ScanTable scans = m_scanCache.layers();
+  for (const auto& [root, scan] : m_layerScans) {
+    scans.add(root, scan);
+  }
+  return scans;
 }
 
 void FuseConnector::updateMapping(const MappingType& mapping)
@@ -660,38 +777,18 @@ void FuseConnector::flushStaging()
     return;
   }
 
-  std::error_code ec;
-  for (auto it = fs::recursive_directory_iterator(
-           staging, fs::directory_options::skip_permission_denied);
-       it != fs::recursive_directory_iterator(); ++it) {
-    const auto& entry = *it;
-    const fs::path rel = fs::relative(entry.path(), staging, ec);
-    if (ec || rel.empty()) {
-      continue;
-    }
-
-    const fs::path dest = overwrite / rel;
-    if (entry.is_directory(ec)) {
-      fs::create_directories(dest, ec);
-      continue;
-    }
-
-    if (!entry.is_regular_file(ec)) {
-      continue;
-    }
+  const auto result =
+      flushStagingDir(m_stagingDir, overwrite.string(), [this](size_t done, size_t total) {
+        emit stagingFlushProgress(done, total);
+      });
 
-    fs::create_directories(dest.parent_path(), ec);
-    fs::rename(entry.path(), dest, ec);
-    if (ec) {
-      ec.clear();
-      fs::copy_file(entry.path(), dest, fs::copy_options::overwrite_existing, ec);
-      if (!ec) {
-        fs::remove(entry.path(), ec);
-      }
-    }
+  log::debug("flushStaging: {} files, {} renamed, {} copied", result.files,
+             result.renamed, result.copied);
+  if (result.failed > 0) {
+    log::warn("{} staged files could not be moved to {}, they stay in {}",
+              result.failed, QString::fromStdString(overwrite.string()),
+              QString::fromStdString(m_stagingDir));
   }
-
-  fs::remove_all(staging, ec);
 }
 
 void FuseConnector::flushStagingLive()
@@ -701,11 +798,14 @@ void FuseConnector::flushStagingLive()
   }
 
   if (m_helperProcess) {
-    sendHelperCommand(m_helperProcess, "flush", 30000);
+    sendHelperCommand(m_helperProcess, "flush", 30000,
+                      [this](size_t done, size_t total) {
+                        emit stagingFlushProgress(done, total);
+                      });
     return;
   }
 
-  if (m_context == nullptr) {
+  if (m_context == nullptr || m_layers == nullptr) {
     return;
   }
 
@@ -716,14 +816,12 @@ void FuseConnector::flushStagingLive()
   std::error_code ec;
   fs::create_directories(m_stagingDir, ec);
 
-  // Rebuild the VFS tree to pick up new overwrite files
-  auto newTree = std::make_shared<VfsTree>(
-      buildDataDirVfs(m_baseFileCache, m_dataDirPath, m_lastMods, m_overwriteDir));
+  // Rebuild the VFS tree to pick up new overwrite files and drop the staged
+  // ones; mods that didn't change aren't rescanned
+  auto newTree = std::make_shared<VfsTree>(m_layers->build(
+      m_layers->prepare(m_lastMods, m_overwriteDir, m_extraVfsFiles, m_layerScans)));
 
-  {
-    std::unique_lock lock(m_context->tree_mutex);
-    m_context->tree.swap(newTree);
-  }
+  mo2_swap_tree(m_context.get(), std::move(newTree));
 
   // Re-create OverwriteManager with fresh staging dir
   m_context->overwrite = std::make_unique<OverwriteManager>(m_stagingDir, m_overwriteDir);
@@ -802,10 +900,18 @@ bool FuseConnector::mountViaHelper(
   writeVfsConfig(configPath, QString::fromStdString(m_mountPoint), overwrite_dir,
                  game_dir, data_dir_name, mods);
 
+  QStringList helperArgs = {QStringLiteral("--host"), helperBin, configPath};
+
+  // MO2_VFS_TRACE=<file> records the session for mo2-vfs-replay
+  const QString tracePath = qEnvironmentVariable("MO2_VFS_TRACE");
+  if (!tracePath.isEmpty()) {
+    helperArgs << QStringLiteral("--trace") << tracePath;
+    log::info("VFS helper tracing to {}", tracePath);
+  }
+
   m_helperProcess = new QProcess(this);
   m_helperProcess->setProcessChannelMode(QProcess::SeparateChannels);
-  m_helperProcess->start(QStringLiteral("flatpak-spawn"),
-                         {QStringLiteral("--host"), helperBin, configPath});
+  m_helperProcess->start(QStringLiteral("flatpak-spawn"), helperArgs);
 
   if (!m_helperProcess->waitForStarted(5000)) {
     const QString err = QString::fromUtf8(m_helperProcess->readAllStandardError());
@@ -868,4 +974,26 @@ void FuseConnector::writeVfsConfig(
     out << "extra_file=" << QString::fromStdString(relPath) << "|"
         << QString::fromStdString(realPath) << "\n";
   }
+
+  // the layers themselves go into a binary mapping next to the config, from
+  // the refresher's scans where it has them, so the helper doesn't have to
+  // walk the mod directories again
+  const QString mappingPath =
+      QFileInfo(configPath).absoluteDir().filePath("vfs.map");
+  const auto update = VfsLayerSet({}).prepare(mods, overwrite_dir.toStdString(),
+                                              m_extraVfsFiles, knownScans());
+  m_scanCache.record(update.layers);
+
+  std::string error;
+  if (writeVfsMapping(mappingPath.toStdString(), update, error)) {
+    out << "mapping=" << mappingPath << "\n";
+  } else {
+    log::warn("VFS helper will scan mods itself: {}",
+              QString::fromStdString(error));
+  }
+
+  // the helper scans the Data directory on the host and caches that itself
+  if (!m_scanCachePath.empty()) {
+    out << "scan_cache=" << QString::fromStdString(m_scanCachePath) << ".host\n";
+  }
 }
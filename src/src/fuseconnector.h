@@ -3,6 +3,8 @@
 
 #include "envdump.h"
 #include "vfs/mo2filesystem.h"
+#include "vfs/vfslayers.h"
+#include "vfs/vfsscancache.h"
 
 #include <QObject>
 #include <QString>
@@ -49,6 +51,14 @@ public:
 
   void flushStagingLive();
 
+  // Operation counts, latencies and the hottest paths of the mounted VFS, as
+  // report lines; empty if nothing is mounted.
+  QStringList diagnostics();
+
+  // Mod directory scans from the directory refresher.  The next mount or
+  // rebuild takes layers from them instead of walking the mods again.
+  void setLayerScans(VfsLayerSet::ScanTable scans);
+
   void updateMapping(const MappingType& mapping);
   void updateParams(MOBase::log::Levels logLevel, env::CoreDumpTypes coreDumpType,
                     const QString& crashDumpsPath, std::chrono::seconds spawnDelay,
@@ -59,6 +69,11 @@ public:
 
   static void tryCleanupStaleMount(const QString& path);
 
+signals:
+  // files moved so far while staged output is flushed to Overwrite, emitted
+  // every 250 ms on the thread calling unmount() or flushStagingLive()
+  void stagingFlushProgress(quint64 done, quint64 total);
+
 private:
   void flushStaging();
   void deployExternalMappings(const MappingType& mapping, const QString& dataDir);
@@ -72,8 +87,9 @@ private:
   std::string m_dataDirName;
   std::string m_dataDirPath;
   int m_backingFd = -1;
-  std::vector<CachedBaseFile> m_baseFileCache;
-  std::string m_cachedDataDirPath;
+  // scans of the Data directory and the mods, persisted per instance
+  VfsScanCache m_scanCache;
+  std::string m_scanCachePath;
 
   std::vector<std::pair<std::string, std::string>> m_lastMods;
 
@@ -84,6 +100,13 @@ private:
   std::vector<std::pair<std::string, std::string>> m_extraVfsFiles;
 
   std::shared_ptr<Mo2FsContext> m_context;
+  // scans behind the mounted tree, so rebuilds only touch what changed
+  std::unique_ptr<VfsLayerSet> m_layers;
+  VfsLayerSet::ScanTable m_layerScans;
+
+  void loadScanCache(const std::string& path);
+  void saveScanCache();
+  VfsLayerSet::ScanTable knownScans() const;
 
   struct fuse_session* m_session = nullptr;
   std::thread m_fuseThread;
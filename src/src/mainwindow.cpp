@@ -85,6 +85,7 @@ along with Mod Organizer.  If not, see <http://www.gnu.org/licenses/>.
 #include <usvfs/usvfs.h>
 #else
 #include "fluorinepaths.h"
+#include "vfsdiagnosticsdialog.h"
 #endif
 
 #include "directoryrefresher.h"
@@ -1129,6 +1130,12 @@ void MainWindow::createHelpMenu()
   connect(issueAction, SIGNAL(triggered()), this, SLOT(issueTriggered()));
   menu->addAction(issueAction);
 
+#ifndef _WIN32
+  QAction* vfsAction = new QAction(tr("VFS Diagnostics"), menu);
+  connect(vfsAction, &QAction::triggered, this, &MainWindow::vfsDiagnosticsTriggered);
+  menu->addAction(vfsAction);
+#endif
+
   QMenu* tutorialMenu = new QMenu(tr("Tutorials"), menu);
 
   typedef std::vector<std::pair<int, QAction*>> ActionList;
@@ -2385,6 +2392,19 @@ void MainWindow::issueTriggered()
   shell::Open(QUrl("https://github.com/Modorganizer2/modorganizer/issues"));
 }
 
+#ifndef _WIN32
+void MainWindow::vfsDiagnosticsTriggered()
+{
+  auto* dialog = new VfsDiagnosticsDialog(
+      [this] {
+        return m_OrganizerCore.vfsDiagnostics();
+      },
+      this);
+  dialog->setAttribute(Qt::WA_DeleteOnClose);
+  dialog->show();
+}
+#endif
+
 void MainWindow::tutorialTriggered()
 {
   QAction* tutorialAction = qobject_cast<QAction*>(sender());
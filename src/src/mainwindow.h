@@ -199,6 +199,9 @@ private:
   void setupToolbar();
   void setupActionMenu(QAction* a);
   void createHelpMenu();
+#ifndef _WIN32
+  void vfsDiagnosticsTriggered();
+#endif
   void createEndorseMenu();
 
   void updatePinnedExecutables();
@@ -473,7 +473,7 @@ std::vector<QAction*> ConflictsTab::createGotoActions(const ConflictItem* item)
     return {};
   }
 
-  auto file = origin()->findFile(item->fileIndex());
+  auto file = origin()->findFile(item->fileIndex(), item->fileGeneration());
   if (!file) {
     return {};
   }
@@ -649,7 +649,7 @@ bool GeneralConflictsTab::update()
 
         if (!alternatives.empty()) {
           m_overwriteModel->add(
-              createOverwriteItem(file->getIndex(), archive, std::move(fileName),
+              createOverwriteItem(*file, archive, std::move(fileName),
                                   std::move(relativeName), alternatives));
 
           ++m_counts.numOverwrite;
@@ -661,7 +661,7 @@ bool GeneralConflictsTab::update()
         } else {
           // otherwise, put the file in the noconflict tree
           m_noConflictModel->add(createNoConflictItem(
-              file->getIndex(), archive, std::move(fileName), std::move(relativeName)));
+              *file, archive, std::move(fileName), std::move(relativeName)));
 
           ++m_counts.numNonConflicting;
           if (archive) {
@@ -685,8 +685,8 @@ bool GeneralConflictsTab::update()
 
         bool currModFileArchive = currModAlt->isFromArchive();
 
-        m_overwrittenModel->add(createOverwrittenItem(file->getIndex(), fileOrigin,
-                                                      archive, std::move(fileName),
+        m_overwrittenModel->add(createOverwrittenItem(*file, fileOrigin, archive,
+                                                      std::move(fileName),
                                                       std::move(relativeName)));
 
         ++m_counts.numOverwritten;
@@ -711,7 +711,7 @@ bool GeneralConflictsTab::update()
 }
 
 ConflictItem GeneralConflictsTab::createOverwriteItem(
-    FileIndex index, bool archive, QString fileName, QString relativeName,
+    const FileEntry& file, bool archive, QString fileName, QString relativeName,
     const MOShared::AlternativesVector& alternatives)
 {
   const auto& ds = *m_core.directoryStructure();
@@ -727,20 +727,21 @@ ConflictItem GeneralConflictsTab::createOverwriteItem(
 
   auto origin = ToQString(ds.getOriginByID(alternatives.back().originID()).getName());
 
-  return ConflictItem(ToQString(altString), std::move(relativeName), QString(), index,
+  return ConflictItem(ToQString(altString), std::move(relativeName), QString(), file,
                       std::move(fileName), true, std::move(origin), archive);
 }
 
-ConflictItem GeneralConflictsTab::createNoConflictItem(FileIndex index, bool archive,
-                                                       QString fileName,
+ConflictItem GeneralConflictsTab::createNoConflictItem(const FileEntry& file,
+                                                       bool archive, QString fileName,
                                                        QString relativeName)
 {
-  return ConflictItem(QString(), std::move(relativeName), QString(), index,
+  return ConflictItem(QString(), std::move(relativeName), QString(), file,
                       std::move(fileName), false, QString(), archive);
 }
 
-ConflictItem GeneralConflictsTab::createOverwrittenItem(FileIndex index, int fileOrigin,
-                                                        bool archive, QString fileName,
+ConflictItem GeneralConflictsTab::createOverwrittenItem(const FileEntry& file,
+                                                        int fileOrigin, bool archive,
+                                                        QString fileName,
                                                         QString relativeName)
 {
   const auto& ds                = *m_core.directoryStructure();
@@ -749,7 +750,7 @@ ConflictItem GeneralConflictsTab::createOverwrittenItem(FileIndex index, int fil
   QString after     = ToQString(realOrigin.getName());
   QString altOrigin = after;
 
-  return ConflictItem(QString(), std::move(relativeName), std::move(after), index,
+  return ConflictItem(QString(), std::move(relativeName), std::move(after), file,
                       std::move(fileName), true, std::move(altOrigin), archive);
 }
 
@@ -991,7 +992,7 @@ void AdvancedConflictsTab::update()
       const int fileOrigin     = file->getOrigin(archive);
       const auto& alternatives = file->getAlternatives();
 
-      auto item = createItem(file->getIndex(), fileOrigin, archive, std::move(fileName),
+      auto item = createItem(*file, fileOrigin, archive, std::move(fileName),
                              std::move(relativeName), alternatives);
 
       if (item) {
@@ -1004,7 +1005,7 @@ void AdvancedConflictsTab::update()
 }
 
 std::optional<ConflictItem>
-AdvancedConflictsTab::createItem(FileIndex index, int fileOrigin, bool archive,
+AdvancedConflictsTab::createItem(const FileEntry& file, int fileOrigin, bool archive,
                                  QString fileName, QString relativeName,
                                  const MOShared::AlternativesVector& alternatives)
 {
@@ -1125,6 +1126,6 @@ AdvancedConflictsTab::createItem(FileIndex index, int fileOrigin, bool archive,
   auto afterQS  = QString::fromStdWString(after);
 
   return ConflictItem(std::move(beforeQS), std::move(relativeName), std::move(afterQS),
-                      index, std::move(fileName), hasAlts, QString(),
+                      file, std::move(fileName), hasAlts, QString(),
                       isCurrOrigArchive);
 }
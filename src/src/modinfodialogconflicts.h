@@ -70,14 +70,14 @@ private:
 
   GeneralConflictNumbers m_counts;
 
-  ConflictItem createOverwriteItem(MOShared::FileIndex index, bool archive,
+  ConflictItem createOverwriteItem(const MOShared::FileEntry& file, bool archive,
                                    QString fileName, QString relativeName,
                                    const MOShared::AlternativesVector& alternatives);
 
-  ConflictItem createNoConflictItem(MOShared::FileIndex index, bool archive,
+  ConflictItem createNoConflictItem(const MOShared::FileEntry& file, bool archive,
                                     QString fileName, QString relativeName);
 
-  ConflictItem createOverwrittenItem(MOShared::FileIndex index, int fileOrigin,
+  ConflictItem createOverwrittenItem(const MOShared::FileEntry& file, int fileOrigin,
                                      bool archive, QString fileName,
                                      QString relativeName);
 
@@ -111,8 +111,9 @@ private:
   ConflictListModel* m_model;
 
   std::optional<ConflictItem>
-  createItem(MOShared::FileIndex index, int fileOrigin, bool archive, QString fileName,
-             QString relativeName, const MOShared::AlternativesVector& alternatives);
+  createItem(const MOShared::FileEntry& file, int fileOrigin, bool archive,
+             QString fileName, QString relativeName,
+             const MOShared::AlternativesVector& alternatives);
 };
 
 class ConflictsTab : public ModInfoDialogTab
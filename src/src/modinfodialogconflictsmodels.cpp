@@ -5,10 +5,11 @@
 using MOBase::naturalCompare;
 
 ConflictItem::ConflictItem(QString before, QString relativeName, QString after,
-                           MOShared::FileIndex index, QString fileName,
+                           const MOShared::FileEntry& file, QString fileName,
                            bool hasAltOrigins, QString altOrigin, bool archive)
     : m_before(std::move(before)), m_relativeName(std::move(relativeName)),
-      m_after(std::move(after)), m_index(index), m_fileName(std::move(fileName)),
+      m_after(std::move(after)), m_index(file.getIndex()),
+      m_generation(file.getGeneration()), m_fileName(std::move(fileName)),
       m_hasAltOrigins(hasAltOrigins), m_altOrigin(std::move(altOrigin)),
       m_isArchive(archive)
 {}
@@ -53,6 +54,11 @@ MOShared::FileIndex ConflictItem::fileIndex() const
   return m_index;
 }
 
+MOShared::FileGeneration ConflictItem::fileGeneration() const
+{
+  return m_generation;
+}
+
 bool ConflictItem::canHide() const
 {
   return canHideFile(isArchive(), fileName());
@@ -6,7 +6,7 @@ class ConflictItem
 {
 public:
   ConflictItem(QString before, QString relativeName, QString after,
-               MOShared::FileIndex index, QString fileName, bool hasAltOrigins,
+               const MOShared::FileEntry& file, QString fileName, bool hasAltOrigins,
                QString altOrigin, bool archive);
 
   const QString& before() const;
@@ -19,7 +19,10 @@ public:
   bool hasAlts() const;
   bool isArchive() const;
 
+  // the index can be given to another file once this one is removed, so it
+  // must be looked up with the generation
   MOShared::FileIndex fileIndex() const;
+  MOShared::FileGeneration fileGeneration() const;
 
   bool canHide() const;
   bool canUnhide() const;
@@ -33,6 +36,7 @@ private:
   QString m_relativeName;
   QString m_after;
   MOShared::FileIndex m_index;
+  MOShared::FileGeneration m_generation;
   QString m_fileName;
   bool m_hasAltOrigins;
   QString m_altOrigin;
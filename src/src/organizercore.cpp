@@ -54,6 +54,7 @@
 #include <QMessageBox>
 #include <QNetworkInterface>
 #include <QProcess>
+#include <QProgressDialog>
 #include <QTextStream>
 #include <QTimer>
 #include <QUrl>
@@ -1744,6 +1745,11 @@ void OrganizerCore::onDirectoryRefreshed()
   std::swap(m_DirectoryStructure, newStructure);
   m_VirtualFileTree.invalidate();
 
+#ifndef _WIN32
+  // the FUSE VFS builds its layers from the same walk
+  m_USVFS.setLayerScans(m_DirectoryRefresher->stealLayerScans());
+#endif
+
   if (m_StructureDeleter.joinable()) {
     m_StructureDeleter.join();
   }
@@ -2283,8 +2289,27 @@ void OrganizerCore::afterRun(const QFileInfo& binary, DWORD exitCode)
   // flushes the staging directory (moves new/changed files to overwrite)
   // and tears down the FUSE session.  This mirrors Windows behaviour where
   // USVFS is only active while a hooked process is running.
+  //
+  // The files are moved by worker threads, or by the helper process, while
+  // this thread waits for them; progress comes in every 250 ms and a window
+  // modal dialog keeps processing events on each update.
+  QProgressDialog flushProgress(tr("Moving new files to Overwrite"), QString(), 0, 0,
+                                qApp->activeWindow());
+  flushProgress.setWindowModality(Qt::WindowModal);
+  flushProgress.setMinimumDuration(500);
+
+  const auto flushConnection = connect(
+      &m_USVFS, &FuseConnector::stagingFlushProgress, &flushProgress,
+      [&flushProgress](quint64 done, quint64 total) {
+        flushProgress.setMaximum(static_cast<int>(total));
+        flushProgress.setValue(static_cast<int>(done));
+      });
+
   m_USVFS.unmount();
 
+  disconnect(flushConnection);
+  flushProgress.reset();
+
   if (m_CurrentProfile != nullptr) {
     const QString prefixPathStr = resolveWinePrefixPath(m_Settings, managedGame());
     if (!prefixPathStr.isEmpty()) {
@@ -356,6 +356,11 @@ public:
                        QString executableBlacklist, const QStringList& skipFileSuffixes,
                        const QStringList& skipDirectories);
 
+#ifndef _WIN32
+  // operation statistics of the mounted VFS, see FuseConnector::diagnostics()
+  QStringList vfsDiagnostics() { return m_USVFS.diagnostics(); }
+#endif
+
   void setLogLevel(MOBase::log::Levels level);
 
   bool cycleDiagnostics();
@@ -24,6 +24,9 @@ along with Mod Organizer.  If not, see <http://www.gnu.org/licenses/>.
 #include "originconnection.h"
 #include "util.h"
 #include "windows_error.h"
+#include <QStringList>
+#include <atomic>
+#include <cstring>
 #include <filesystem>
 #include <log.h>
 #include <utility.h>
@@ -34,6 +37,96 @@ namespace MOShared
 using namespace MOBase;
 const int MAXPATH_UNICODE = 32767;
 
+DirectoryStats::DirectoryStats()
+{
+  std::memset(this, 0, sizeof(DirectoryStats));
+}
+
+DirectoryStats& DirectoryStats::operator+=(const DirectoryStats& o)
+{
+  dirTimes += o.dirTimes;
+  fileTimes += o.fileTimes;
+  sortTimes += o.sortTimes;
+
+  subdirLookupTimes += o.subdirLookupTimes;
+  addDirectoryTimes += o.addDirectoryTimes;
+
+  filesLookupTimes += o.filesLookupTimes;
+  addFileTimes += o.addFileTimes;
+  addOriginToFileTimes += o.addOriginToFileTimes;
+  addFileToOriginTimes += o.addFileToOriginTimes;
+  addFileToRegisterTimes += o.addFileToRegisterTimes;
+
+  originExists += o.originExists;
+  originCreate += o.originCreate;
+  originsNeededEnabled += o.originsNeededEnabled;
+
+  subdirExists += o.subdirExists;
+  subdirCreate += o.subdirCreate;
+
+  fileExists += o.fileExists;
+  fileCreate += o.fileCreate;
+  filesInsertedInRegister += o.filesInsertedInRegister;
+  filesAssignedInRegister += o.filesAssignedInRegister;
+
+  return *this;
+}
+
+std::string DirectoryStats::csvHeader()
+{
+  QStringList sl = {"dirTimes",
+                    "fileTimes",
+                    "sortTimes",
+                    "subdirLookupTimes",
+                    "addDirectoryTimes",
+                    "filesLookupTimes",
+                    "addFileTimes",
+                    "addOriginToFileTimes",
+                    "addFileToOriginTimes",
+                    "addFileToRegisterTimes",
+                    "originExists",
+                    "originCreate",
+                    "originsNeededEnabled",
+                    "subdirExists",
+                    "subdirCreate",
+                    "fileExists",
+                    "fileCreate",
+                    "filesInsertedInRegister",
+                    "filesAssignedInRegister"};
+
+  return sl.join(",").toStdString();
+}
+
+std::string DirectoryStats::toCsv() const
+{
+  QStringList oss;
+
+  auto s = [](auto ns) {
+    return ns.count() / 1000.0 / 1000.0 / 1000.0;
+  };
+
+  oss << QString::number(s(dirTimes)) << QString::number(s(fileTimes))
+      << QString::number(s(sortTimes))
+
+      << QString::number(s(subdirLookupTimes)) << QString::number(s(addDirectoryTimes))
+
+      << QString::number(s(filesLookupTimes)) << QString::number(s(addFileTimes))
+      << QString::number(s(addOriginToFileTimes))
+      << QString::number(s(addFileToOriginTimes))
+      << QString::number(s(addFileToRegisterTimes))
+
+      << QString::number(originExists) << QString::number(originCreate)
+      << QString::number(originsNeededEnabled)
+
+      << QString::number(subdirExists) << QString::number(subdirCreate)
+
+      << QString::number(fileExists) << QString::number(fileCreate)
+      << QString::number(filesInsertedInRegister)
+      << QString::number(filesAssignedInRegister);
+
+  return oss.join(",").toStdString();
+}
+
 template <class F>
 void elapsedImpl(std::chrono::nanoseconds& out, F&& f)
 {
@@ -47,6 +140,17 @@ void elapsedImpl(std::chrono::nanoseconds& out, F&& f)
   }
 }
 
+static bool pathExists(const std::wstring& path)
+{
+#ifdef _WIN32
+  return std::filesystem::exists(path);
+#else
+  // On Linux, convert wstring to narrow string for std::filesystem
+  // to avoid locale-dependent wchar_t conversion issues
+  return std::filesystem::exists(QString::fromStdWString(path).toStdString());
+#endif
+}
+
 // elapsed() is not optimized out when EnableInstrumentation is false even
 // though it's equivalent that this macro
 #define elapsed(OUT, F) (F)();
@@ -77,29 +181,35 @@ static bool SupportOptimizedFind()
 }
 #endif
 
+// UTF-8 sorts by code point, the same as the wide strings did
+static bool lessByName(NameID lhsLc, NameID rhsLc)
+{
+  const auto& pool = NamePool::instance();
+  return pool.utf8(lhsLc) < pool.utf8(rhsLc);
+}
+
 bool DirCompareByName::operator()(const DirectoryEntry* lhs,
                                   const DirectoryEntry* rhs) const
 {
-#ifdef _WIN32
-  return _wcsicmp(lhs->getName().c_str(), rhs->getName().c_str()) < 0;
-#else
-  return wcscasecmp(lhs->getName().c_str(), rhs->getName().c_str()) < 0;
-#endif
+  const auto& pool = NamePool::instance();
+  return lessByName(pool.folded(lhs->getNameID()), pool.folded(rhs->getNameID()));
 }
 
 DirectoryEntry::DirectoryEntry(std::wstring name, DirectoryEntry* parent, int originID)
-    : m_OriginConnection(new OriginConnection), m_Name(std::move(name)),
-      m_Parent(parent), m_Populated(false), m_TopLevel(true)
+    : m_OriginConnection(new OriginConnection),
+      m_Name(NamePool::instance().intern(name)), m_Parent(parent), m_Populated(false),
+      m_TopLevel(true), m_FilesSorted(true), m_SubDirectoriesSorted(true)
 {
   m_FileRegister.reset(new FileRegister(m_OriginConnection));
   m_Origins.insert(originID);
 }
 
-DirectoryEntry::DirectoryEntry(std::wstring name, DirectoryEntry* parent, int originID,
+DirectoryEntry::DirectoryEntry(NameID name, DirectoryEntry* parent, int originID,
                                boost::shared_ptr<FileRegister> fileRegister,
                                boost::shared_ptr<OriginConnection> originConnection)
-    : m_FileRegister(fileRegister), m_OriginConnection(originConnection),
-      m_Name(std::move(name)), m_Parent(parent), m_Populated(false), m_TopLevel(false)
+    : m_FileRegister(fileRegister), m_OriginConnection(originConnection), m_Name(name),
+      m_Parent(parent), m_Populated(false), m_TopLevel(false), m_FilesSorted(true),
+      m_SubDirectoriesSorted(true)
 {
   m_Origins.insert(originID);
 }
@@ -111,14 +221,16 @@ DirectoryEntry::~DirectoryEntry()
 
 void DirectoryEntry::clear()
 {
-  for (auto itor = m_SubDirectories.rbegin(); itor != m_SubDirectories.rend(); ++itor) {
-    delete *itor;
+  for (auto&& p : m_SubDirectoriesLookup) {
+    delete p.second;
   }
 
   m_Files.clear();
   m_FilesLookup.clear();
   m_SubDirectories.clear();
   m_SubDirectoriesLookup.clear();
+  m_FilesSorted          = true;
+  m_SubDirectoriesSorted = true;
 }
 
 void DirectoryEntry::addFromOrigin(const std::wstring& originName,
@@ -132,12 +244,12 @@ void DirectoryEntry::addFromOrigin(const std::wstring& originName,
 void DirectoryEntry::addFromOrigin(env::DirectoryWalker& walker,
                                    const std::wstring& originName,
                                    const std::wstring& directory, int priority,
-                                   DirectoryStats& stats)
+                                   DirectoryStats& stats, WalkObserver* observer)
 {
   FilesOrigin& origin = createOrigin(originName, directory, priority, stats);
 
   if (!directory.empty()) {
-    addFiles(walker, origin, directory, stats);
+    addFiles(walker, origin, directory, stats, observer);
   }
 
   m_Populated = true;
@@ -158,7 +270,7 @@ void DirectoryEntry::addDir(FilesOrigin& origin, env::Directory& d,
 {
   elapsed(stats.dirTimes, [&] {
     for (auto& sd : d.dirs) {
-      auto* sdirEntry = getSubDirectory(sd, true, stats, origin.getID());
+      auto* sdirEntry = getSubDirectory(sd.name, true, stats, origin.getID());
       sdirEntry->addDir(origin, sd, stats);
     }
   });
@@ -289,16 +401,16 @@ int DirectoryEntry::anyOrigin() const
 {
   bool ignore;
 
-  for (auto iter = m_Files.begin(); iter != m_Files.end(); ++iter) {
-    FileEntryPtr entry = m_FileRegister->getFile(iter->second);
-    if ((entry.get() != nullptr) && !entry->isFromArchive()) {
+  for (auto&& p : sortedFiles()) {
+    FileEntry* entry = m_FileRegister->fileAt(p.second);
+    if ((entry != nullptr) && !entry->isFromArchive()) {
       return entry->getOrigin(ignore);
     }
   }
 
   // if we got here, no file directly within this directory is a valid indicator for a
   // mod, thus we continue looking in subdirectories
-  for (DirectoryEntry* entry : m_SubDirectories) {
+  for (DirectoryEntry* entry : getSubDirectories()) {
     int res = entry->anyOrigin();
     if (res != InvalidOriginID) {
       return res;
@@ -310,26 +422,56 @@ int DirectoryEntry::anyOrigin() const
 
 std::vector<FileEntryPtr> DirectoryEntry::getFiles() const
 {
+  const auto& files = sortedFiles();
+
   std::vector<FileEntryPtr> result;
-  result.reserve(m_Files.size());
+  result.reserve(files.size());
 
-  for (auto iter = m_Files.begin(); iter != m_Files.end(); ++iter) {
-    result.push_back(m_FileRegister->getFile(iter->second));
+  for (auto&& p : files) {
+    result.push_back(m_FileRegister->getFile(p.second));
   }
 
   return result;
 }
 
-DirectoryEntry* DirectoryEntry::findSubDirectory(const std::wstring& name,
-                                                 bool alreadyLowerCase) const
+const DirectoryEntry::SubDirectories& DirectoryEntry::getSubDirectories() const
 {
-  SubDirectoriesLookup::const_iterator itor;
+  std::scoped_lock lock(m_SubDirMutex);
+  sortSubDirectories();
+  return m_SubDirectories;
+}
 
-  if (alreadyLowerCase) {
-    itor = m_SubDirectoriesLookup.find(name);
-  } else {
-    itor = m_SubDirectoriesLookup.find(ToLowerCopy(name));
+const DirectoryEntry::FilesList& DirectoryEntry::sortedFiles() const
+{
+  std::scoped_lock lock(m_FilesMutex);
+  sortFiles();
+  return m_Files;
+}
+
+void DirectoryEntry::sortFiles() const
+{
+  if (!m_FilesSorted) {
+    std::sort(m_Files.begin(), m_Files.end(), [](auto&& a, auto&& b) {
+      return lessByName(a.first, b.first);
+    });
+
+    m_FilesSorted = true;
+  }
+}
+
+void DirectoryEntry::sortSubDirectories() const
+{
+  if (!m_SubDirectoriesSorted) {
+    std::sort(m_SubDirectories.begin(), m_SubDirectories.end(), DirCompareByName());
+    m_SubDirectoriesSorted = true;
   }
+}
+
+DirectoryEntry* DirectoryEntry::findSubDirectory(const std::wstring& name,
+                                                 bool alreadyLowerCase) const
+{
+  const auto itor = m_SubDirectoriesLookup.find(
+      NamePool::instance().findFolded(name, alreadyLowerCase));
 
   if (itor == m_SubDirectoriesLookup.end()) {
     return nullptr;
@@ -347,13 +489,8 @@ DirectoryEntry* DirectoryEntry::findSubDirectoryRecursive(const std::wstring& pa
 const FileEntryPtr DirectoryEntry::findFile(const std::wstring& name,
                                             bool alreadyLowerCase) const
 {
-  FilesLookup::const_iterator iter;
-
-  if (alreadyLowerCase) {
-    iter = m_FilesLookup.find(DirectoryEntryFileKey(name));
-  } else {
-    iter = m_FilesLookup.find(DirectoryEntryFileKey(ToLowerCopy(name)));
-  }
+  const auto iter =
+      m_FilesLookup.find(NamePool::instance().findFolded(name, alreadyLowerCase));
 
   if (iter != m_FilesLookup.end()) {
     return m_FileRegister->getFile(iter->second);
@@ -364,7 +501,9 @@ const FileEntryPtr DirectoryEntry::findFile(const std::wstring& name,
 
 const FileEntryPtr DirectoryEntry::findFile(const DirectoryEntryFileKey& key) const
 {
-  auto iter = m_FilesLookup.find(key);
+  // the key is already lowercase, its id is the folded one
+  const NameID nameLc = NamePool::instance().find(key.value);
+  auto iter           = m_FilesLookup.find(nameLc);
 
   if (iter != m_FilesLookup.end()) {
     return m_FileRegister->getFile(iter->second);
@@ -375,14 +514,14 @@ const FileEntryPtr DirectoryEntry::findFile(const DirectoryEntryFileKey& key) co
 
 bool DirectoryEntry::hasFile(const std::wstring& name) const
 {
-  return m_Files.contains(ToLowerCopy(name));
+  return m_FilesLookup.contains(NamePool::instance().findFolded(name));
 }
 
 bool DirectoryEntry::containsArchive(std::wstring archiveName)
 {
-  for (auto iter = m_Files.begin(); iter != m_Files.end(); ++iter) {
-    FileEntryPtr entry = m_FileRegister->getFile(iter->second);
-    if (entry->isFromArchive(archiveName)) {
+  for (auto&& p : m_FilesLookup) {
+    FileEntry* entry = m_FileRegister->fileAt(p.second);
+    if (entry && entry->isFromArchive(archiveName)) {
       return true;
     }
   }
@@ -410,9 +549,9 @@ const FileEntryPtr DirectoryEntry::searchFile(const std::wstring& path,
 
   if (len == std::string::npos) {
     // no more path components
-    auto iter = m_Files.find(ToLowerCopy(path));
+    auto iter = m_FilesLookup.find(NamePool::instance().findFolded(path));
 
-    if (iter != m_Files.end()) {
+    if (iter != m_FilesLookup.end()) {
       return m_FileRegister->getFile(iter->second);
     } else if (directory != nullptr) {
       DirectoryEntry* temp = findSubDirectory(path);
@@ -469,15 +608,14 @@ void DirectoryEntry::removeDir(const std::wstring& path)
   size_t pos = path.find_first_of(L"\\/");
 
   if (pos == std::string::npos) {
-    for (auto iter = m_SubDirectories.begin(); iter != m_SubDirectories.end(); ++iter) {
-      DirectoryEntry* entry = *iter;
+    auto iter = m_SubDirectoriesLookup.find(NamePool::instance().findFolded(path));
 
-      if (CaseInsensitiveEqual(entry->getName(), path)) {
-        entry->removeDirRecursive();
-        removeDirectoryFromList(iter);
-        delete entry;
-        break;
-      }
+    if (iter != m_SubDirectoriesLookup.end()) {
+      DirectoryEntry* entry = iter->second;
+
+      entry->removeDirRecursive();
+      removeDirectoryFromList(entry);
+      delete entry;
     }
   } else {
     std::wstring dirName = path.substr(0, pos);
@@ -494,15 +632,13 @@ void DirectoryEntry::removeDir(const std::wstring& path)
 
 bool DirectoryEntry::remove(const std::wstring& fileName, int* origin)
 {
-  const auto lcFileName = ToLowerCopy(fileName);
-
-  auto iter = m_Files.find(lcFileName);
+  auto iter = m_FilesLookup.find(NamePool::instance().findFolded(fileName));
   bool b    = false;
 
-  if (iter != m_Files.end()) {
+  if (iter != m_FilesLookup.end()) {
     if (origin != nullptr) {
-      FileEntryPtr entry = m_FileRegister->getFile(iter->second);
-      if (entry.get() != nullptr) {
+      FileEntry* entry = m_FileRegister->fileAt(iter->second);
+      if (entry != nullptr) {
         bool ignore;
         *origin = entry->getOrigin(ignore);
       }
@@ -540,14 +676,20 @@ void DirectoryEntry::removeFiles(const std::set<FileIndex>& indices)
   removeFilesFromList(indices);
 }
 
-FileEntryPtr DirectoryEntry::insert(std::wstring_view fileName, FilesOrigin& origin,
-                                    FILETIME fileTime, std::wstring_view archive,
-                                    int order, DirectoryStats& stats)
+FileEntry* DirectoryEntry::insert(std::wstring_view fileName, FilesOrigin& origin,
+                                  FILETIME fileTime, std::wstring_view archive,
+                                  int order, DirectoryStats& stats)
 {
-  std::wstring fileNameLower = ToLowerCopy(fileName);
-  FileEntryPtr fe;
+  return insert(NamePool::instance().intern(fileName), origin, fileTime, archive,
+                order, stats);
+}
 
-  DirectoryEntryFileKey key(std::move(fileNameLower));
+FileEntry* DirectoryEntry::insert(NameID name, FilesOrigin& origin, FILETIME fileTime,
+                                  std::wstring_view archive, int order,
+                                  DirectoryStats& stats)
+{
+  const NameID nameLower = NamePool::instance().folded(name);
+  FileEntry* fe          = nullptr;
 
   {
     std::unique_lock lock(m_FilesMutex);
@@ -555,23 +697,20 @@ FileEntryPtr DirectoryEntry::insert(std::wstring_view fileName, FilesOrigin& ori
     FilesLookup::iterator itor;
 
     elapsed(stats.filesLookupTimes, [&] {
-      itor = m_FilesLookup.find(key);
+      itor = m_FilesLookup.find(nameLower);
     });
 
     if (itor != m_FilesLookup.end()) {
       lock.unlock();
       ++stats.fileExists;
-      fe = m_FileRegister->getFile(itor->second);
+      fe = m_FileRegister->fileAt(itor->second);
     } else {
       ++stats.fileCreate;
-      fe = m_FileRegister->createFile(std::wstring(fileName.begin(), fileName.end()),
-                                      this, stats);
+      fe = m_FileRegister->createFile(name, this, stats);
 
       elapsed(stats.addFileTimes, [&] {
-        addFileToList(std::move(key.value), fe->getIndex());
+        addFileToList(nameLower, fe->getIndex());
       });
-
-      // fileNameLower has moved from this point
     }
   }
 
@@ -586,110 +725,340 @@ FileEntryPtr DirectoryEntry::insert(std::wstring_view fileName, FilesOrigin& ori
   return fe;
 }
 
-FileEntryPtr DirectoryEntry::insert(env::File& file, FilesOrigin& origin,
-                                    std::wstring_view archive, int order,
-                                    DirectoryStats& stats)
+FileEntry* DirectoryEntry::insert(env::File& file, FilesOrigin& origin,
+                                  std::wstring_view archive, int order,
+                                  DirectoryStats& stats)
 {
-  FileEntryPtr fe;
-
-  {
-    std::unique_lock lock(m_FilesMutex);
-
-    FilesMap::iterator itor;
-
-    elapsed(stats.filesLookupTimes, [&] {
-      itor = m_Files.find(file.lcname);
-    });
-
-    if (itor != m_Files.end()) {
-      lock.unlock();
-      ++stats.fileExists;
-      fe = m_FileRegister->getFile(itor->second);
-    } else {
-      ++stats.fileCreate;
-      fe = m_FileRegister->createFile(std::move(file.name), this, stats);
-      // file.name has been moved from this point
-
-      elapsed(stats.addFileTimes, [&] {
-        addFileToList(std::move(file.lcname), fe->getIndex());
-      });
-
-      // file.lcname has been moved from this point
-    }
-  }
-
-  elapsed(stats.addOriginToFileTimes, [&] {
-    fe->addOrigin(origin.getID(), file.lastModified, archive, order);
-  });
-
-  elapsed(stats.addFileToOriginTimes, [&] {
-    origin.addFile(fe->getIndex());
-  });
-
-  return fe;
+  return insert(file.name, origin, file.lastModified, archive, order, stats);
 }
 
 struct DirectoryEntry::Context
 {
   FilesOrigin& origin;
   DirectoryStats& stats;
+  WalkObserver* observer;
   std::stack<DirectoryEntry*> current;
+
+  // of the current directory, only kept for the observer's stamps
+  std::wstring path;
+  std::vector<std::size_t> parents;
 };
 
 void DirectoryEntry::addFiles(env::DirectoryWalker& walker, FilesOrigin& origin,
-                              const std::wstring& path, DirectoryStats& stats)
+                              const std::wstring& path, DirectoryStats& stats,
+                              WalkObserver* observer)
 {
-  Context cx = {origin, stats};
+  Context cx = {origin, stats, observer};
   cx.current.push(this);
+  if (observer) {
+    cx.path = path;
+  }
 
-#ifdef _WIN32
-  const bool pathExists = std::filesystem::exists(path);
-#else
-  // On Linux, convert wstring to narrow string for std::filesystem
-  // to avoid locale-dependent wchar_t conversion issues
-  const bool pathExists =
-      std::filesystem::exists(QString::fromStdWString(path).toStdString());
-#endif
-
-  if (pathExists) {
+  if (pathExists(path)) {
     walker.forEachEntry(
         path, &cx,
-        [](void* pcx, std::wstring_view path) {
+        [](void* pcx, env::EntryName path, bool) {
           onDirectoryStart((Context*)pcx, path);
         },
 
-        [](void* pcx, std::wstring_view path) {
+        [](void* pcx, env::EntryName path) {
           onDirectoryEnd((Context*)pcx, path);
         },
 
-        [](void* pcx, std::wstring_view path, FILETIME ft, uint64_t) {
-          onFile((Context*)pcx, path, ft);
+        [](void* pcx, env::EntryName path, FILETIME ft, uint64_t size) {
+          onFile((Context*)pcx, path, ft, size);
         });
   }
 }
 
-void DirectoryEntry::onDirectoryStart(Context* cx, std::wstring_view path)
+void DirectoryEntry::onDirectoryStart(Context* cx, env::EntryName path)
 {
+  const NameID id = NamePool::instance().intern(path);
+
   elapsed(cx->stats.dirTimes, [&] {
-    auto* sd =
-        cx->current.top()->getSubDirectory(path, true, cx->stats, cx->origin.getID());
+    auto* sd = cx->current.top()->getSubDirectory(id, cx->stats, cx->origin.getID());
 
     cx->current.push(sd);
   });
+
+  if (cx->observer) {
+    // the walker lists the directory right after this returns
+    cx->parents.push_back(cx->path.size());
+    cx->path += NativeWPathSep;
+    cx->path += NamePool::instance().wide(id);
+
+    cx->observer->onDirectoryStart(path, env::directoryStamp(cx->path));
+  }
 }
 
-void DirectoryEntry::onDirectoryEnd(Context* cx, std::wstring_view path)
+void DirectoryEntry::onDirectoryEnd(Context* cx, env::EntryName path)
 {
   elapsed(cx->stats.dirTimes, [&] {
     cx->current.pop();
   });
+
+  if (cx->observer) {
+    cx->path.resize(cx->parents.back());
+    cx->parents.pop_back();
+
+    cx->observer->onDirectoryEnd();
+  }
 }
 
-void DirectoryEntry::onFile(Context* cx, std::wstring_view path, FILETIME ft)
+void DirectoryEntry::onFile(Context* cx, env::EntryName path, FILETIME ft,
+                            uint64_t size)
 {
   elapsed(cx->stats.fileTimes, [&] {
-    cx->current.top()->insert(path, cx->origin, ft, L"", -1, cx->stats);
+    cx->current.top()->insert(NamePool::instance().intern(path), cx->origin, ft, L"",
+                              -1, cx->stats);
   });
+
+  if (cx->observer) {
+    cx->observer->onFile(path, ft, size);
+  }
+}
+
+// directories this deep in a split walk are walked whole by one task, with
+// their subdirectories; the levels above are listed by a task per directory
+constexpr std::size_t SplitDepth = 3;
+
+// a pooled name as walkers report it
+static auto entryName(NameID id)
+{
+#ifdef _WIN32
+  return NamePool::instance().wide(id);
+#else
+  return NamePool::instance().utf8(id);
+#endif
+}
+
+// the part of a split walk's observer calls that one task saw; kept until the
+// whole origin is walked, then replayed in walk order
+struct DirectoryEntry::SplitDirectory
+{
+  struct Event
+  {
+    enum Type
+    {
+      DirectoryStart,
+      DirectoryEnd,
+      File,
+      Split  // a subdirectory listed by its own task
+    };
+
+    Type type;
+    NameID name       = InvalidNameID;  // as it was reported, not folded
+    FILETIME fileTime = {};
+    uint64_t size     = 0;
+    std::unique_ptr<SplitDirectory> split;
+    env::DirectoryStamp stamp = {};  // DirectoryStart
+  };
+
+  DirectoryEntry* entry;
+  std::wstring path;
+  std::size_t depth;
+  std::vector<Event> events;
+  env::DirectoryStamp stamp;  // taken by the task listing it
+
+  SplitDirectory(DirectoryEntry* e, std::wstring p, std::size_t d)
+      : entry(e), path(std::move(p)), depth(d)
+  {}
+
+  // records the calls of a walk done by one task
+  class Recorder : public WalkObserver
+  {
+  public:
+    explicit Recorder(std::vector<Event>& events) : m_events(events) {}
+
+    // the walk has just interned these names, so this only looks them up
+    void onDirectoryStart(env::EntryName name,
+                          const env::DirectoryStamp& stamp) override
+    {
+      Event e = {Event::DirectoryStart, NamePool::instance().intern(name)};
+      e.stamp = stamp;
+      m_events.push_back(std::move(e));
+    }
+
+    void onDirectoryEnd() override { m_events.push_back({Event::DirectoryEnd}); }
+
+    void onFile(env::EntryName name, FILETIME fileTime, uint64_t size) override
+    {
+      m_events.push_back(
+          {Event::File, NamePool::instance().intern(name), fileTime, size});
+    }
+
+  private:
+    std::vector<Event>& m_events;
+  };
+
+  void replay(WalkObserver& o) const
+  {
+    for (auto&& e : events) {
+      switch (e.type) {
+      case Event::DirectoryStart:
+        o.onDirectoryStart(entryName(e.name), e.stamp);
+        break;
+
+      case Event::DirectoryEnd:
+        o.onDirectoryEnd();
+        break;
+
+      case Event::File:
+        o.onFile(entryName(e.name), e.fileTime, e.size);
+        break;
+
+      case Event::Split:
+        o.onDirectoryStart(entryName(e.name), e.split->stamp);
+        e.split->replay(o);
+        o.onDirectoryEnd();
+        break;
+      }
+    }
+  }
+};
+
+// shared by the tasks of a split walk; the last one to finish hands the
+// results over
+struct DirectoryEntry::SplitWalk
+{
+  env::TaskGroup& group;
+  FilesOrigin& origin;
+  DirectoryStats& stats;
+  WalkObserver* observer;
+  std::function<void()> done;
+
+  std::unique_ptr<SplitDirectory> root;
+  std::atomic<std::size_t> pending{1};
+  std::mutex statsMutex;
+
+  SplitWalk(env::TaskGroup& g, FilesOrigin& o, DirectoryStats& s, WalkObserver* wo,
+            std::function<void()> d)
+      : group(g), origin(o), stats(s), observer(wo), done(std::move(d))
+  {}
+};
+
+void DirectoryEntry::addFromOrigin(env::TaskGroup& group, const std::wstring& originName,
+                                   const std::wstring& directory, int priority,
+                                   DirectoryStats& stats, WalkObserver* observer,
+                                   std::function<void()> done)
+{
+  FilesOrigin& origin = createOrigin(originName, directory, priority, stats);
+  m_Populated         = true;
+
+  if (directory.empty() || !pathExists(directory)) {
+    done();
+    return;
+  }
+
+  auto walk  = std::make_shared<SplitWalk>(group, origin, stats, observer, std::move(done));
+  walk->root = std::make_unique<SplitDirectory>(this, directory, 0);
+
+  group.run([walk] {
+    walkSplit(walk, walk->root.get());
+  });
+}
+
+void DirectoryEntry::walkSplit(std::shared_ptr<SplitWalk> walk, SplitDirectory* dir)
+{
+  // walkers keep their buffers between directories
+  thread_local env::DirectoryWalker walker;
+
+  using Event = SplitDirectory::Event;
+  DirectoryStats stats;
+
+  // the root's stamp is the observer's own business
+  if (walk->observer && dir->depth > 0) {
+    dir->stamp = env::directoryStamp(dir->path);
+  }
+
+  if (dir->depth < SplitDepth) {
+    // only this directory is listed here, its subdirectories are left to new
+    // tasks once the listing is done
+    struct ListContext
+    {
+      SplitWalk& walk;
+      SplitDirectory& dir;
+      DirectoryStats& stats;
+      std::vector<SplitDirectory*> subdirs;
+    };
+
+    ListContext cx = {*walk, *dir, stats};
+
+    walker.forEachEntry(
+        dir->path, &cx,
+        [](void* pcx, env::EntryName name, bool symlink) {
+          auto& cx        = *static_cast<ListContext*>(pcx);
+          const NameID id = NamePool::instance().intern(name);
+
+          auto* sd =
+              cx.dir.entry->getSubDirectory(id, cx.stats, cx.walk.origin.getID());
+
+          // only the top levels are split, so few paths are built
+          std::wstring path = cx.dir.path;
+          path += NativeWPathSep;
+          path += NamePool::instance().wide(id);
+
+          // a whole walk reports symlinked directories as empty instead of
+          // following them, so they don't get a task of their own either
+          if (symlink) {
+            if (cx.walk.observer) {
+              Event e = {Event::DirectoryStart, id};
+              e.stamp = env::directoryStamp(path);
+              cx.dir.events.push_back(std::move(e));
+              cx.dir.events.push_back({Event::DirectoryEnd});
+            }
+            return;
+          }
+
+          auto split =
+              std::make_unique<SplitDirectory>(sd, std::move(path), cx.dir.depth + 1);
+          cx.subdirs.push_back(split.get());
+
+          Event e = {Event::Split, id};
+          e.split = std::move(split);
+          cx.dir.events.push_back(std::move(e));
+        },
+
+        nullptr,
+
+        [](void* pcx, env::EntryName name, FILETIME ft, uint64_t size) {
+          auto& cx        = *static_cast<ListContext*>(pcx);
+          const NameID id = NamePool::instance().intern(name);
+
+          cx.dir.entry->insert(id, cx.walk.origin, ft, L"", -1, cx.stats);
+
+          if (cx.walk.observer) {
+            cx.dir.events.push_back({Event::File, id, ft, size});
+          }
+        });
+
+    // counted before this task is, so the count can't reach zero while
+    // subdirectories are still to be walked
+    walk->pending.fetch_add(cx.subdirs.size(), std::memory_order_relaxed);
+
+    for (auto* sd : cx.subdirs) {
+      walk->group.run([walk, sd] {
+        walkSplit(walk, sd);
+      });
+    }
+  } else {
+    SplitDirectory::Recorder recorder(dir->events);
+    dir->entry->addFiles(walker, walk->origin, dir->path, stats,
+                         walk->observer ? &recorder : nullptr);
+  }
+
+  {
+    std::scoped_lock lock(walk->statsMutex);
+    walk->stats += stats;
+  }
+
+  if (walk->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    if (walk->observer) {
+      walk->root->replay(*walk->observer);
+    }
+
+    walk->done();
+  }
 }
 
 void DirectoryEntry::addFiles(FilesOrigin& origin, const BSA::Folder::Ptr archiveFolder,
@@ -728,7 +1097,14 @@ void DirectoryEntry::addFiles(FilesOrigin& origin, const BSA::Folder::Ptr archiv
 DirectoryEntry* DirectoryEntry::getSubDirectory(std::wstring_view name, bool create,
                                                 DirectoryStats& stats, int originID)
 {
-  std::wstring nameLc = ToLowerCopy(name);
+  auto& pool = NamePool::instance();
+
+  // names are only added to the pool for directories that are created
+  if (create) {
+    return getSubDirectory(pool.intern(name), stats, originID);
+  }
+
+  const NameID nameLc = pool.findFolded(name);
 
   std::scoped_lock lock(m_SubDirMutex);
 
@@ -742,32 +1118,19 @@ DirectoryEntry* DirectoryEntry::getSubDirectory(std::wstring_view name, bool cre
     return itor->second;
   }
 
-  if (create) {
-    ++stats.subdirCreate;
-
-    auto* entry = new DirectoryEntry(std::wstring(name.begin(), name.end()), this,
-                                     originID, m_FileRegister, m_OriginConnection);
-
-    elapsed(stats.addDirectoryTimes, [&] {
-      addDirectoryToList(entry, std::move(nameLc));
-      // nameLc is moved from this point
-    });
-
-    return entry;
-  } else {
-    return nullptr;
-  }
+  return nullptr;
 }
 
-DirectoryEntry* DirectoryEntry::getSubDirectory(env::Directory& dir, bool create,
-                                                DirectoryStats& stats, int originID)
+DirectoryEntry* DirectoryEntry::getSubDirectory(NameID id, DirectoryStats& stats,
+                                                int originID)
 {
-  SubDirectoriesLookup::iterator itor;
+  const NameID nameLc = NamePool::instance().folded(id);
 
   std::scoped_lock lock(m_SubDirMutex);
 
+  SubDirectoriesLookup::iterator itor;
   elapsed(stats.subdirLookupTimes, [&] {
-    itor = m_SubDirectoriesLookup.find(dir.lcname);
+    itor = m_SubDirectoriesLookup.find(nameLc);
   });
 
   if (itor != m_SubDirectoriesLookup.end()) {
@@ -775,23 +1138,16 @@ DirectoryEntry* DirectoryEntry::getSubDirectory(env::Directory& dir, bool create
     return itor->second;
   }
 
-  if (create) {
-    ++stats.subdirCreate;
+  ++stats.subdirCreate;
 
-    auto* entry = new DirectoryEntry(std::move(dir.name), this, originID,
-                                     m_FileRegister, m_OriginConnection);
-    // dir.name is moved from this point
+  auto* entry =
+      new DirectoryEntry(id, this, originID, m_FileRegister, m_OriginConnection);
 
-    elapsed(stats.addDirectoryTimes, [&] {
-      addDirectoryToList(entry, std::move(dir.lcname));
-    });
-
-    // dir.lcname is moved from this point
+  elapsed(stats.addDirectoryTimes, [&] {
+    addDirectoryToList(entry, nameLc);
+  });
 
-    return entry;
-  } else {
-    return nullptr;
-  }
+  return entry;
 }
 
 DirectoryEntry* DirectoryEntry::getSubDirectoryRecursive(const std::wstring& path,
@@ -824,7 +1180,7 @@ DirectoryEntry* DirectoryEntry::getSubDirectoryRecursive(const std::wstring& pat
 void DirectoryEntry::removeDirRecursive()
 {
   while (!m_Files.empty()) {
-    m_FileRegister->removeFile(m_Files.begin()->second);
+    m_FileRegister->removeFile(m_Files.front().second);
   }
 
   m_FilesLookup.clear();
@@ -838,30 +1194,23 @@ void DirectoryEntry::removeDirRecursive()
   m_SubDirectoriesLookup.clear();
 }
 
-void DirectoryEntry::addDirectoryToList(DirectoryEntry* e, std::wstring nameLc)
+void DirectoryEntry::addDirectoryToList(DirectoryEntry* e, NameID nameLc)
 {
-  m_SubDirectories.insert(e);
-  m_SubDirectoriesLookup.emplace(std::move(nameLc), e);
+  m_SubDirectories.push_back(e);
+  m_SubDirectoriesLookup.emplace(nameLc, e);
+  m_SubDirectoriesSorted = false;
 }
 
-void DirectoryEntry::removeDirectoryFromList(SubDirectories::iterator itor)
+void DirectoryEntry::removeDirectoryFromList(DirectoryEntry* entry)
 {
-  const auto* entry = *itor;
+  const NameID nameLc = NamePool::instance().folded(entry->m_Name);
 
-  {
-    auto itor2 = std::find_if(m_SubDirectoriesLookup.begin(),
-                              m_SubDirectoriesLookup.end(), [&](auto&& d) {
-                                return (d.second == entry);
-                              });
-
-    if (itor2 == m_SubDirectoriesLookup.end()) {
-      log::error("entry {} not in sub directories map", entry->getName());
-    } else {
-      m_SubDirectoriesLookup.erase(itor2);
-    }
+  if (m_SubDirectoriesLookup.erase(nameLc) == 0) {
+    log::error("entry {} not in sub directories map", entry->getName());
   }
 
-  m_SubDirectories.erase(itor);
+  // erasing keeps the order, sorted or not
+  std::erase(m_SubDirectories, entry);
 }
 
 void DirectoryEntry::removeFileFromList(FileIndex index)
@@ -893,13 +1242,9 @@ void DirectoryEntry::removeFileFromList(FileIndex index)
 
 void DirectoryEntry::removeFilesFromList(const std::set<FileIndex>& indices)
 {
-  for (auto iter = m_Files.begin(); iter != m_Files.end();) {
-    if (indices.find(iter->second) != indices.end()) {
-      iter = m_Files.erase(iter);
-    } else {
-      ++iter;
-    }
-  }
+  std::erase_if(m_Files, [&](auto&& p) {
+    return indices.contains(p.second);
+  });
 
   for (auto iter = m_FilesLookup.begin(); iter != m_FilesLookup.end();) {
     if (indices.find(iter->second) != indices.end()) {
@@ -910,11 +1255,11 @@ void DirectoryEntry::removeFilesFromList(const std::set<FileIndex>& indices)
   }
 }
 
-void DirectoryEntry::addFileToList(std::wstring fileNameLower, FileIndex index)
+void DirectoryEntry::addFileToList(NameID fileNameLower, FileIndex index)
 {
   m_FilesLookup.emplace(fileNameLower, index);
-  m_Files.emplace(std::move(fileNameLower), index);
-  // fileNameLower has been moved from this point
+  m_Files.emplace_back(fileNameLower, index);
+  m_FilesSorted = false;
 }
 
 struct DumpFailed : public std::runtime_error
@@ -956,9 +1301,10 @@ void DirectoryEntry::dump(std::FILE* f, const std::wstring& parentPath) const
 {
   {
     std::scoped_lock lock(m_FilesMutex);
+    sortFiles();
 
     for (auto&& index : m_Files) {
-      const auto file = m_FileRegister->getFile(index.second);
+      const auto* file = m_FileRegister->fileAt(index.second);
       if (!file) {
         continue;
       }
@@ -983,8 +1329,10 @@ void DirectoryEntry::dump(std::FILE* f, const std::wstring& parentPath) const
 
   {
     std::scoped_lock lock(m_SubDirMutex);
+    sortSubDirectories();
+
     for (auto&& d : m_SubDirectories) {
-      const auto path = parentPath + NativeWPathSep + d->m_Name;
+      const auto path = parentPath + NativeWPathSep + d->getName();
       d->dump(f, path);
     }
   }
@@ -22,14 +22,11 @@ along with Mod Organizer.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <bsatk/bsatk.h>
 
+#include "../envfs.h"
 #include "fileregister.h"
+#include "namepool.h"
 
-namespace env
-{
-class DirectoryWalker;
-struct Directory;
-struct File;
-}  // namespace env
+#include <functional>
 
 namespace std
 {
@@ -46,6 +43,7 @@ struct hash<MOShared::DirectoryEntryFileKey>
 namespace MOShared
 {
 
+// case-insensitive, by the lowercase form of the names
 struct DirCompareByName
 {
   bool operator()(const DirectoryEntry* a, const DirectoryEntry* b) const;
@@ -54,11 +52,12 @@ struct DirCompareByName
 class DirectoryEntry
 {
 public:
-  using SubDirectories = std::set<DirectoryEntry*, DirCompareByName>;
+  // sorted with DirCompareByName
+  using SubDirectories = std::vector<DirectoryEntry*>;
 
   DirectoryEntry(std::wstring name, DirectoryEntry* parent, OriginID originID);
 
-  DirectoryEntry(std::wstring name, DirectoryEntry* parent, OriginID originID,
+  DirectoryEntry(NameID name, DirectoryEntry* parent, OriginID originID,
                  boost::shared_ptr<FileRegister> fileRegister,
                  boost::shared_ptr<OriginConnection> originConnection);
 
@@ -74,12 +73,32 @@ public:
 
   bool isTopLevel() const { return m_TopLevel; }
 
-  bool isEmpty() const { return m_Files.empty() && m_SubDirectories.empty(); }
+  bool isEmpty() const
+  {
+    return m_FilesLookup.empty() && m_SubDirectoriesLookup.empty();
+  }
 
-  bool hasFiles() const { return !m_Files.empty(); }
+  bool hasFiles() const { return !m_FilesLookup.empty(); }
 
   const DirectoryEntry* getParent() const { return m_Parent; }
 
+  // sees the raw walk of an origin as it is added, so other views of the same
+  // files can be built from this scan instead of walking the directory again;
+  // called from the thread adding the origin, or for a split walk from the
+  // thread finishing it, once the walk is done; directory stamps are taken
+  // before the directory is listed either way
+  class WalkObserver
+  {
+  public:
+    virtual ~WalkObserver() = default;
+
+    virtual void onDirectoryStart(env::EntryName name,
+                                  const env::DirectoryStamp& stamp) = 0;
+    virtual void onDirectoryEnd()                                   = 0;
+    virtual void onFile(env::EntryName name, FILETIME fileTime,
+                        uint64_t size)                              = 0;
+  };
+
   // add files to this directory (and subdirectories) from the specified origin.
   // That origin may exist or not
   void addFromOrigin(const std::wstring& originName, const std::wstring& directory,
@@ -87,7 +106,17 @@ public:
 
   void addFromOrigin(env::DirectoryWalker& walker, const std::wstring& originName,
                      const std::wstring& directory, int priority,
-                     DirectoryStats& stats);
+                     DirectoryStats& stats, WalkObserver* observer = nullptr);
+
+  // same, but the top levels of the origin are listed by separate tasks of
+  // `group`, a directory each, so one big origin is spread over the pool
+  // instead of being walked by one thread; returns right away and calls
+  // `done` from the last task, after which `stats` and `observer` are no
+  // longer used
+  void addFromOrigin(env::TaskGroup& group, const std::wstring& originName,
+                     const std::wstring& directory, int priority,
+                     DirectoryStats& stats, WalkObserver* observer,
+                     std::function<void()> done);
 
   void addFromAllBSAs(const std::wstring& originName, const std::wstring& directory,
                       int priority, const std::vector<std::wstring>& archives,
@@ -104,7 +133,9 @@ public:
 
   void propagateOrigin(OriginID origin);
 
-  const std::wstring& getName() const { return m_Name; }
+  std::wstring getName() const { return NamePool::instance().wide(m_Name); }
+
+  NameID getNameID() const { return m_Name; }
 
   boost::shared_ptr<FileRegister> getFileRegister() { return m_FileRegister; }
 
@@ -117,12 +148,12 @@ public:
 
   std::vector<FileEntryPtr> getFiles() const;
 
-  const SubDirectories& getSubDirectories() const { return m_SubDirectories; }
+  const SubDirectories& getSubDirectories() const;
 
   template <class F>
   void forEachDirectory(F&& f) const
   {
-    for (auto&& d : m_SubDirectories) {
+    for (auto&& d : getSubDirectories()) {
       if (!f(*d)) {
         break;
       }
@@ -132,8 +163,8 @@ public:
   template <class F>
   void forEachFile(F&& f) const
   {
-    for (auto&& p : m_Files) {
-      if (auto file = m_FileRegister->getFile(p.second)) {
+    for (auto&& p : sortedFiles()) {
+      if (auto* file = m_FileRegister->fileAt(p.second)) {
         if (!f(*file)) {
           break;
         }
@@ -144,7 +175,7 @@ public:
   template <class F>
   void forEachFileIndex(F&& f) const
   {
-    for (auto&& p : m_Files) {
+    for (auto&& p : sortedFiles()) {
       if (!f(p.second)) {
         break;
       }
@@ -206,36 +237,46 @@ public:
   void dump(const std::wstring& file) const;
 
 private:
-  using FilesMap             = std::map<std::wstring, FileIndex>;
-  using FilesLookup          = std::unordered_map<DirectoryEntryFileKey, FileIndex>;
-  using SubDirectoriesLookup = std::unordered_map<std::wstring, DirectoryEntry*>;
+  // keyed by the id of the lowercase name
+  using FilesLookup          = std::unordered_map<NameID, FileIndex>;
+  using SubDirectoriesLookup = std::unordered_map<NameID, DirectoryEntry*>;
+
+  // the same files, sorted by lowercase name when iterated
+  using FilesList = std::vector<std::pair<NameID, FileIndex>>;
 
   boost::shared_ptr<FileRegister> m_FileRegister;
   boost::shared_ptr<OriginConnection> m_OriginConnection;
 
-  std::wstring m_Name;
-  FilesMap m_Files;
+  NameID m_Name;
   FilesLookup m_FilesLookup;
-  SubDirectories m_SubDirectories;
+  mutable FilesList m_Files;
   SubDirectoriesLookup m_SubDirectoriesLookup;
+  mutable SubDirectories m_SubDirectories;
 
   DirectoryEntry* m_Parent;
   std::set<OriginID> m_Origins;
   bool m_Populated;
   bool m_TopLevel;
+  mutable bool m_FilesSorted;
+  mutable bool m_SubDirectoriesSorted;
   mutable std::mutex m_SubDirMutex;
   mutable std::mutex m_FilesMutex;
   mutable std::mutex m_OriginsMutex;
 
-  FileEntryPtr insert(std::wstring_view fileName, FilesOrigin& origin,
-                      FILETIME fileTime, std::wstring_view archive, int order,
-                      DirectoryStats& stats);
+  FileEntry* insert(std::wstring_view fileName, FilesOrigin& origin,
+                    FILETIME fileTime, std::wstring_view archive, int order,
+                    DirectoryStats& stats);
 
-  FileEntryPtr insert(env::File& file, FilesOrigin& origin, std::wstring_view archive,
-                      int order, DirectoryStats& stats);
+  // same, for a name already in the pool
+  FileEntry* insert(NameID name, FilesOrigin& origin, FILETIME fileTime,
+                    std::wstring_view archive, int order, DirectoryStats& stats);
+
+  FileEntry* insert(env::File& file, FilesOrigin& origin, std::wstring_view archive,
+                    int order, DirectoryStats& stats);
 
   void addFiles(env::DirectoryWalker& walker, FilesOrigin& origin,
-                const std::wstring& path, DirectoryStats& stats);
+                const std::wstring& path, DirectoryStats& stats,
+                WalkObserver* observer);
 
   void addFiles(FilesOrigin& origin, BSA::Folder::Ptr archiveFolder, FILETIME fileTime,
                 const std::wstring& archiveName, int order, DirectoryStats& stats);
@@ -246,9 +287,9 @@ private:
                                   DirectoryStats& stats,
                                   OriginID originID = InvalidOriginID);
 
-  DirectoryEntry* getSubDirectory(env::Directory& dir, bool create,
-                                  DirectoryStats& stats,
-                                  OriginID originID = InvalidOriginID);
+  // same with `create`, for a name already in the pool
+  DirectoryEntry* getSubDirectory(NameID name, DirectoryStats& stats,
+                                  OriginID originID);
 
   DirectoryEntry* getSubDirectoryRecursive(const std::wstring& path, bool create,
                                            DirectoryStats& stats,
@@ -256,17 +297,27 @@ private:
 
   void removeDirRecursive();
 
-  void addDirectoryToList(DirectoryEntry* e, std::wstring nameLc);
-  void removeDirectoryFromList(SubDirectories::iterator itor);
+  void addDirectoryToList(DirectoryEntry* e, NameID nameLc);
+  void removeDirectoryFromList(DirectoryEntry* e);
 
-  void addFileToList(std::wstring fileNameLower, FileIndex index);
+  void addFileToList(NameID fileNameLower, FileIndex index);
   void removeFileFromList(FileIndex index);
   void removeFilesFromList(const std::set<FileIndex>& indices);
 
+  // the lists are only sorted when something iterates over them; the
+  // mutex of the list must be held for sortFiles() and sortSubDirectories()
+  const FilesList& sortedFiles() const;
+  void sortFiles() const;
+  void sortSubDirectories() const;
+
   struct Context;
-  static void onDirectoryStart(Context* cx, std::wstring_view path);
-  static void onDirectoryEnd(Context* cx, std::wstring_view path);
-  static void onFile(Context* cx, std::wstring_view path, FILETIME ft);
+  struct SplitWalk;
+  struct SplitDirectory;
+  static void walkSplit(std::shared_ptr<SplitWalk> walk, SplitDirectory* dir);
+
+  static void onDirectoryStart(Context* cx, env::EntryName path);
+  static void onDirectoryEnd(Context* cx, env::EntryName path);
+  static void onFile(Context* cx, env::EntryName path, FILETIME ft, uint64_t size);
 
   void dump(std::FILE* f, const std::wstring& parentPath) const;
 };
@@ -6,20 +6,17 @@
 namespace MOShared
 {
 
-FileEntry::FileEntry()
-    : m_Index(InvalidFileIndex), m_Name(), m_Origin(-1), m_Parent(nullptr),
-      m_FileSize(NoFileSize), m_CompressedFileSize(NoFileSize)
-{}
-
-FileEntry::FileEntry(FileIndex index, std::wstring name, DirectoryEntry* parent)
-    : m_Index(index), m_Name(std::move(name)), m_Origin(-1), m_Archive(L"", -1),
-      m_Parent(parent), m_FileSize(NoFileSize), m_CompressedFileSize(NoFileSize)
+FileEntry::FileEntry(FileIndex index, FileGeneration generation, NameID name,
+                     DirectoryEntry* parent, std::mutex& lock)
+    : m_Index(index), m_Generation(generation), m_Name(name), m_Origin(-1), m_Archive(L"", -1), m_FileTime{},
+      m_Parent(parent), m_FileSize(NoFileSize), m_CompressedFileSize(NoFileSize),
+      m_OriginsMutex(&lock)
 {}
 
 void FileEntry::addOrigin(OriginID origin, FILETIME fileTime, std::wstring_view archive,
                           int order)
 {
-  std::scoped_lock lock(m_OriginsMutex);
+  std::scoped_lock lock(*m_OriginsMutex);
 
   if (m_Parent != nullptr) {
     m_Parent->propagateOrigin(origin);
@@ -30,7 +27,7 @@ void FileEntry::addOrigin(OriginID origin, FILETIME fileTime, std::wstring_view
     // alternatives
     m_Origin   = origin;
     m_FileTime = fileTime;
-    m_Archive  = DataArchiveOrigin(std::wstring(archive.begin(), archive.end()), order);
+    m_Archive  = DataArchiveOrigin(archive, order);
   } else if ((m_Parent != nullptr) &&
              ((m_Parent->getOriginByID(origin).getPriority() >
                m_Parent->getOriginByID(m_Origin).getPriority()) ||
@@ -50,7 +47,7 @@ void FileEntry::addOrigin(OriginID origin, FILETIME fileTime, std::wstring_view
 
     m_Origin   = origin;
     m_FileTime = fileTime;
-    m_Archive  = DataArchiveOrigin(std::wstring(archive.begin(), archive.end()), order);
+    m_Archive  = DataArchiveOrigin(archive, order);
   } else {
     // This mod is just an alternative
     bool found = false;
@@ -69,23 +66,21 @@ void FileEntry::addOrigin(OriginID origin, FILETIME fileTime, std::wstring_view
       if ((m_Parent != nullptr) &&
           (m_Parent->getOriginByID(iter->originID()).getPriority() <
            m_Parent->getOriginByID(origin).getPriority())) {
-        m_Alternatives.insert(
-            iter, {origin, {std::wstring(archive.begin(), archive.end()), order}});
+        m_Alternatives.insert(iter, {origin, {archive, order}});
         found = true;
         break;
       }
     }
 
     if (!found) {
-      m_Alternatives.push_back(
-          {origin, {std::wstring(archive.begin(), archive.end()), order}});
+      m_Alternatives.push_back({origin, {archive, order}});
     }
   }
 }
 
 bool FileEntry::removeOrigin(OriginID origin)
 {
-  std::scoped_lock lock(m_OriginsMutex);
+  std::scoped_lock lock(*m_OriginsMutex);
 
   if (m_Origin == origin) {
     if (!m_Alternatives.empty()) {
@@ -141,7 +136,7 @@ bool FileEntry::removeOrigin(OriginID origin)
 
 void FileEntry::sortOrigins()
 {
-  std::scoped_lock lock(m_OriginsMutex);
+  std::scoped_lock lock(*m_OriginsMutex);
 
   m_Alternatives.push_back({m_Origin, m_Archive});
 
@@ -187,18 +182,24 @@ void FileEntry::sortOrigins()
 
 bool FileEntry::isFromArchive(std::wstring archiveName) const
 {
-  std::scoped_lock lock(m_OriginsMutex);
+  std::scoped_lock lock(*m_OriginsMutex);
 
   if (archiveName.length() == 0) {
     return m_Archive.isValid();
   }
 
-  if (m_Archive.name().compare(archiveName) == 0) {
+  // an archive name that was never interned can't be the archive of any file
+  const NameID archive = NamePool::instance().find(archiveName);
+  if (archive == InvalidNameID) {
+    return false;
+  }
+
+  if (m_Archive.nameID() == archive) {
     return true;
   }
 
   for (const auto& alternative : m_Alternatives) {
-    if (alternative.archive().name().compare(archiveName) == 0) {
+    if (alternative.archive().nameID() == archive) {
       return true;
     }
   }
@@ -208,7 +209,7 @@ bool FileEntry::isFromArchive(std::wstring archiveName) const
 
 std::wstring FileEntry::getFullPath(OriginID originID) const
 {
-  std::scoped_lock lock(m_OriginsMutex);
+  std::scoped_lock lock(*m_OriginsMutex);
 
   if (originID == InvalidOriginID) {
     bool ignore = false;
@@ -226,7 +227,7 @@ std::wstring FileEntry::getFullPath(OriginID originID) const
   // all intermediate directories
   recurseParents(result, m_Parent);
 
-  return result + NativeWPathSep + m_Name;
+  return result + NativeWPathSep + getName();
 }
 
 std::wstring FileEntry::getRelativePath() const
@@ -236,7 +237,7 @@ std::wstring FileEntry::getRelativePath() const
   // all intermediate directories
   recurseParents(result, m_Parent);
 
-  return result + NativeWPathSep + m_Name;
+  return result + NativeWPathSep + getName();
 }
 
 bool FileEntry::recurseParents(std::wstring& path, const DirectoryEntry* parent) const
@@ -2,6 +2,7 @@
 #define MO_REGISTER_FILEENTRY_INCLUDED
 
 #include "fileregisterfwd.h"
+#include "namepool.h"
 
 namespace MOShared
 {
@@ -11,8 +12,9 @@ class FileEntry
 public:
   static constexpr uint64_t NoFileSize = std::numeric_limits<uint64_t>::max();
 
-  FileEntry();
-  FileEntry(FileIndex index, std::wstring name, DirectoryEntry* parent);
+  // `lock` guards the origins and is shared with other files, see FileRegister
+  FileEntry(FileIndex index, FileGeneration generation, NameID name,
+            DirectoryEntry* parent, std::mutex& lock);
 
   // noncopyable
   FileEntry(const FileEntry&)            = delete;
@@ -20,6 +22,9 @@ public:
 
   FileIndex getIndex() const { return m_Index; }
 
+  // tells this file apart from others given the same index after it is removed
+  FileGeneration getGeneration() const { return m_Generation; }
+
   void addOrigin(OriginID origin, FILETIME fileTime, std::wstring_view archive,
                  int order);
 
@@ -35,7 +40,12 @@ public:
   // (ascending)
   const AlternativesVector& getAlternatives() const { return m_Alternatives; }
 
-  const std::wstring& getName() const { return m_Name; }
+  std::wstring getName() const
+  {
+    return m_Name == InvalidNameID ? std::wstring() : NamePool::instance().wide(m_Name);
+  }
+
+  NameID getNameID() const { return m_Name; }
 
   OriginID getOrigin() const { return m_Origin; }
 
@@ -74,14 +84,15 @@ public:
 
 private:
   FileIndex m_Index;
-  std::wstring m_Name;
+  FileGeneration m_Generation;
+  NameID m_Name;
   OriginID m_Origin;
   DataArchiveOrigin m_Archive;
+  mutable FILETIME m_FileTime;
   AlternativesVector m_Alternatives;
   DirectoryEntry* m_Parent;
-  mutable FILETIME m_FileTime;
   uint64_t m_FileSize, m_CompressedFileSize;
-  mutable std::mutex m_OriginsMutex;
+  std::mutex* m_OriginsMutex;
 
   bool recurseParents(std::wstring& path, const DirectoryEntry* parent) const;
 };
@@ -3,6 +3,8 @@
 #include "fileentry.h"
 #include "filesorigin.h"
 #include "originconnection.h"
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
 #include <log.h>
 
 namespace MOShared
@@ -10,37 +12,194 @@ namespace MOShared
 
 using namespace MOBase;
 
-FileRegister::FileRegister(boost::shared_ptr<OriginConnection> originConnection)
-    : m_OriginConnection(originConnection), m_NextIndex(0)
-{}
+// files of a block share this many locks, consecutive files using different
+// ones so threads adding files at the same time rarely wait for each other
+constexpr std::size_t LocksPerBlock = 64;
 
-bool FileRegister::indexValid(FileIndex index) const
+// indices of destroyed entries, handed out again before new ones; shared with
+// the blocks, which may outlive the register
+struct FileRegister::FreeSlots
 {
-  std::scoped_lock lock(m_Mutex);
+  std::mutex mutex;
+  std::vector<FileIndex> indices;
+  std::atomic<std::size_t> count{0};
 
-  if (index < m_Files.size()) {
-    return (m_Files[index].get() != nullptr);
+  void put(FileIndex index)
+  {
+    std::scoped_lock lock(mutex);
+    indices.push_back(index);
+    count.store(indices.size(), std::memory_order_release);
   }
 
-  return false;
-}
+  bool take(FileIndex& index)
+  {
+    // a full refresh fills a new register and never gets here with a lock
+    if (count.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+
+    std::scoped_lock lock(mutex);
+    if (indices.empty()) {
+      return false;
+    }
+
+    index = indices.back();
+    indices.pop_back();
+    count.store(indices.size(), std::memory_order_release);
+    return true;
+  }
+};
 
-FileEntryPtr FileRegister::createFile(std::wstring name, DirectoryEntry* parent,
-                                      DirectoryStats& stats)
+struct FileRegister::Block : public boost::enable_shared_from_this<Block>
 {
-  const auto index = generateIndex();
-  auto p           = FileEntryPtr(new FileEntry(index, std::move(name), parent));
+  // a slot's state is in the top bits of its word and the number of
+  // FileEntryPtr referencing it in the others, so that the last reference to
+  // a removed file and a new one being taken can't both miss each other
+  enum State : std::uint32_t
+  {
+    Empty,
+    Alive,
+    Removed,    // destroyed when the last reference goes
+    Destroying  // the entry is being destroyed, the slot is empty after
+  };
+
+  static constexpr unsigned StateShift = 30;
+  static constexpr std::uint32_t RefMask = (std::uint32_t(1) << StateShift) - 1;
+
+  // kept apart from the entries so scans for live files don't touch them
+  std::array<std::atomic<std::uint32_t>, BlockSize> slots{};
+
+  // files created in each slot so far, only touched when one is created, by
+  // the one thread that took the slot
+  std::array<FileGeneration, BlockSize> generations{};
+  std::array<std::mutex, LocksPerBlock> locks;
+  alignas(FileEntry) std::byte storage[BlockSize * sizeof(FileEntry)];
+  std::shared_ptr<FreeSlots> free;
 
+  // the entries are constructed when their files are created
+  explicit Block(std::shared_ptr<FreeSlots> f) : free(std::move(f)) {}
+
+  ~Block()
   {
-    std::scoped_lock lock(m_Mutex);
+    for (std::size_t i = 0; i < BlockSize; ++i) {
+      const auto s = state(slots[i].load(std::memory_order_relaxed));
+      if (s == Alive || s == Removed) {
+        entry(i)->~FileEntry();
+      }
+    }
+  }
+
+  // noncopyable
+  Block(const Block&)            = delete;
+  Block& operator=(const Block&) = delete;
 
-    if (index >= m_Files.size()) {
-      m_Files.resize(index + 1);
+  static State state(std::uint32_t word) { return State(word >> StateShift); }
+
+  FileEntry* entry(std::size_t i)
+  {
+    return std::launder(reinterpret_cast<FileEntry*>(storage) + i);
+  }
+
+  // the entry at `i` if the file hasn't been removed
+  FileEntry* alive(std::size_t i)
+  {
+    return state(slots[i].load(std::memory_order_acquire)) == Alive ? entry(i)
+                                                                     : nullptr;
+  }
+
+  // the entry at `i` has just been constructed
+  void created(std::size_t i)
+  {
+    slots[i].fetch_add(std::uint32_t(Alive) << StateShift, std::memory_order_release);
+  }
+
+  // takes a reference on the file at `i` if it is alive
+  bool acquire(std::size_t i)
+  {
+    const auto word = slots[i].fetch_add(1, std::memory_order_acquire);
+    if (state(word) == Alive) {
+      return true;
     }
 
-    m_Files[index] = p;
+    release(i);
+    return false;
+  }
+
+  // marks the alive file at `i` removed and takes a reference on it, so it
+  // isn't destroyed before the caller is done unregistering it
+  void markRemoved(std::size_t i)
+  {
+    slots[i].fetch_add((std::uint32_t(Removed - Alive) << StateShift) + 1,
+                       std::memory_order_acq_rel);
+  }
+
+  void release(std::size_t i)
+  {
+    const auto word = slots[i].fetch_sub(1, std::memory_order_acq_rel);
+    if ((word & RefMask) != 1 || state(word) != Removed) {
+      return;
+    }
+
+    // fails if a reference was taken in the meantime, whose release comes
+    // back here
+    auto expected = std::uint32_t(Removed) << StateShift;
+    if (!slots[i].compare_exchange_strong(expected,
+                                          std::uint32_t(Destroying) << StateShift,
+                                          std::memory_order_acq_rel)) {
+      return;
+    }
+
+    FileEntry* e      = entry(i);
+    const auto index  = e->getIndex();
+    e->~FileEntry();
+
+    slots[i].fetch_sub(std::uint32_t(Destroying) << StateShift,
+                       std::memory_order_release);
+    free->put(index);
+  }
+};
+
+// the reference of a FileEntryPtr, which also keeps the block alive
+struct FileRegister::Reference
+{
+  boost::shared_ptr<Block> block;
+  std::size_t slot;
+
+  void operator()(FileEntry*) const { block->release(slot); }
+};
+
+FileRegister::FileRegister(boost::shared_ptr<OriginConnection> originConnection)
+    : m_Blocks(new std::atomic<Block*>[MaxBlocks]()),
+      m_Free(std::make_shared<FreeSlots>()), m_OriginConnection(originConnection),
+      m_NextIndex(0)
+{}
+
+// out of line for Block
+FileRegister::~FileRegister() = default;
+
+bool FileRegister::indexValid(FileIndex index) const
+{
+  return (fileAt(index) != nullptr);
+}
+
+FileEntry* FileRegister::createFile(NameID name, DirectoryEntry* parent,
+                                    DirectoryStats& stats)
+{
+  FileIndex index;
+  if (!m_Free->take(index)) {
+    index = generateIndex();
   }
 
+  Block& block = getOrCreateBlock(index);
+  const auto i = index & (BlockSize - 1);
+
+  // a slot is only handed out again once its entry is destroyed, nothing else
+  // can be using it
+  auto* p = new (block.entry(i)) FileEntry(index, block.generations[i]++, name,
+                                           parent, block.locks[i % LocksPerBlock]);
+
+  block.created(i);
+
   return p;
 }
 
@@ -49,27 +208,91 @@ FileIndex FileRegister::generateIndex()
   return m_NextIndex++;
 }
 
+FileRegister::Block* FileRegister::blockFor(FileIndex index) const
+{
+  const std::size_t b = index >> BlockBits;
+
+  if (b >= MaxBlocks) {
+    return nullptr;
+  }
+
+  return m_Blocks[b].load(std::memory_order_acquire);
+}
+
+FileRegister::Block& FileRegister::getOrCreateBlock(FileIndex index)
+{
+  const std::size_t b = index >> BlockBits;
+
+  if (b >= MaxBlocks) {
+    throw std::runtime_error("too many files in the directory structure");
+  }
+
+  Block* block = m_Blocks[b].load(std::memory_order_acquire);
+
+  if (!block) {
+    std::scoped_lock lock(m_BlocksMutex);
+
+    block = m_Blocks[b].load(std::memory_order_relaxed);
+    if (!block) {
+      auto p = boost::make_shared<Block>(m_Free);
+      block  = p.get();
+
+      m_Owners.push_back(std::move(p));
+      m_Blocks[b].store(block, std::memory_order_release);
+    }
+  }
+
+  return *block;
+}
+
 FileEntryPtr FileRegister::getFile(FileIndex index) const
 {
-  std::scoped_lock lock(m_Mutex);
+  Block* block = blockFor(index);
+  if (!block) {
+    return {};
+  }
 
-  if (index < m_Files.size()) {
-    return m_Files[index];
-  } else {
+  const auto i = index & (BlockSize - 1);
+  if (!block->acquire(i)) {
     return {};
   }
+
+  return FileEntryPtr(block->entry(i), Reference{block->shared_from_this(), i});
+}
+
+FileEntryPtr FileRegister::getFile(FileIndex index, FileGeneration generation) const
+{
+  // the reference keeps the slot from being given to another file while the
+  // generation is compared
+  FileEntryPtr file = getFile(index);
+  if (!file || file->getGeneration() != generation) {
+    return {};
+  }
+
+  return file;
+}
+
+FileEntry* FileRegister::fileAt(FileIndex index) const
+{
+  Block* block = blockFor(index);
+  if (!block) {
+    return nullptr;
+  }
+
+  return block->alive(index & (BlockSize - 1));
 }
 
 bool FileRegister::removeFile(FileIndex index)
 {
   std::scoped_lock lock(m_Mutex);
 
-  if (index < m_Files.size()) {
-    FileEntryPtr p;
-    m_Files[index].swap(p);
+  if (Block* block = blockFor(index)) {
+    const auto i = index & (BlockSize - 1);
 
-    if (p) {
-      unregisterFile(p);
+    if (FileEntry* e = block->alive(i)) {
+      block->markRemoved(i);
+      unregisterFile(*e);
+      block->release(i);
       return true;
     }
   }
@@ -82,14 +305,15 @@ void FileRegister::removeOrigin(FileIndex index, OriginID originID)
 {
   std::unique_lock lock(m_Mutex);
 
-  if (index < m_Files.size()) {
-    FileEntryPtr& p = m_Files[index];
+  if (Block* block = blockFor(index)) {
+    const auto i = index & (BlockSize - 1);
 
-    if (p) {
-      if (p->removeOrigin(originID)) {
-        m_Files[index] = {};
+    if (FileEntry* e = block->alive(i)) {
+      if (e->removeOrigin(originID)) {
+        block->markRemoved(i);
         lock.unlock();
-        unregisterFile(p);
+        unregisterFile(*e);
+        block->release(i);
         return;
       }
     }
@@ -101,7 +325,9 @@ void FileRegister::removeOrigin(FileIndex index, OriginID originID)
 
 void FileRegister::removeOriginMulti(std::set<FileIndex> indices, OriginID originID)
 {
-  std::vector<FileEntryPtr> removedFiles;
+  // referenced until their parents are done with them, so their indices
+  // can't be reused before
+  std::vector<std::pair<Block*, std::size_t>> removedFiles;
 
   {
     std::scoped_lock lock(m_Mutex);
@@ -109,12 +335,13 @@ void FileRegister::removeOriginMulti(std::set<FileIndex> indices, OriginID origi
     for (auto iter = indices.begin(); iter != indices.end();) {
       const auto index = *iter;
 
-      if (index < m_Files.size()) {
-        const auto& p = m_Files[index];
+      if (Block* block = blockFor(index)) {
+        const auto i = index & (BlockSize - 1);
+        FileEntry* e = block->alive(i);
 
-        if (p && p->removeOrigin(originID)) {
-          removedFiles.push_back(p);
-          m_Files[index] = {};
+        if (e && e->removeOrigin(originID)) {
+          block->markRemoved(i);
+          removedFiles.push_back({block, i});
           ++iter;
           continue;
         }
@@ -139,44 +366,57 @@ void FileRegister::removeOriginMulti(std::set<FileIndex> indices, OriginID origi
   // frequently the case
 
   std::set<DirectoryEntry*> parents;
-  for (const FileEntryPtr& file : removedFiles) {
-    if (file->getParent() != nullptr) {
-      parents.insert(file->getParent());
+  for (auto [block, i] : removedFiles) {
+    if (block->entry(i)->getParent() != nullptr) {
+      parents.insert(block->entry(i)->getParent());
     }
   }
 
   for (DirectoryEntry* parent : parents) {
     parent->removeFiles(indices);
   }
+
+  for (auto [block, i] : removedFiles) {
+    block->release(i);
+  }
 }
 
 void FileRegister::sortOrigins()
 {
   std::scoped_lock lock(m_Mutex);
 
-  for (auto&& p : m_Files) {
-    if (p) {
-      p->sortOrigins();
+  const std::size_t count = highestCount();
+
+  for (std::size_t b = 0; b * BlockSize < count; ++b) {
+    Block* block = m_Blocks[b].load(std::memory_order_acquire);
+    if (!block) {
+      continue;
+    }
+
+    for (std::size_t i = 0; i < BlockSize; ++i) {
+      if (FileEntry* e = block->alive(i)) {
+        e->sortOrigins();
+      }
     }
   }
 }
 
-void FileRegister::unregisterFile(FileEntryPtr file)
+void FileRegister::unregisterFile(FileEntry& file)
 {
   bool ignore;
 
   // unregister from origin
-  OriginID originID = file->getOrigin(ignore);
-  m_OriginConnection->getByID(originID).removeFile(file->getIndex());
-  const auto& alternatives = file->getAlternatives();
+  OriginID originID = file.getOrigin(ignore);
+  m_OriginConnection->getByID(originID).removeFile(file.getIndex());
+  const auto& alternatives = file.getAlternatives();
 
   for (const auto& alt : alternatives) {
-    m_OriginConnection->getByID(alt.originID()).removeFile(file->getIndex());
+    m_OriginConnection->getByID(alt.originID()).removeFile(file.getIndex());
   }
 
   // unregister from directory
-  if (file->getParent() != nullptr) {
-    file->getParent()->removeFile(file->getIndex());
+  if (file.getParent() != nullptr) {
+    file.getParent()->removeFile(file.getIndex());
   }
 }
 
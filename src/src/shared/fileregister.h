@@ -3,15 +3,30 @@
 
 #include "fileregisterfwd.h"
 #include <boost/shared_ptr.hpp>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace MOShared
 {
 
+// all the files of a directory structure, by index
+//
+// entries are stored contiguously in blocks of consecutive indices instead of
+// each being its own allocation; a FileEntryPtr keeps its file and the block
+// it is in alive, so it stays valid after the file is removed or the register
+// is gone, as it did when every entry had its own shared_ptr
+//
+// a removed file's entry is destroyed once the last FileEntryPtr to it is
+// gone, and its index is then given to the next file created; an index kept
+// past that (in a model built from the files, say) must be looked up with the
+// file's generation, or it finds whichever file has the index now
 class FileRegister
 {
 public:
   FileRegister(boost::shared_ptr<OriginConnection> originConnection);
+  ~FileRegister();
 
   // noncopyable
   FileRegister(const FileRegister&)            = delete;
@@ -19,16 +34,20 @@ public:
 
   bool indexValid(FileIndex index) const;
 
-  FileEntryPtr createFile(std::wstring name, DirectoryEntry* parent,
-                          DirectoryStats& stats);
+  // the new file lives until it is removed, see fileAt()
+  FileEntry* createFile(NameID name, DirectoryEntry* parent, DirectoryStats& stats);
 
   FileEntryPtr getFile(FileIndex index) const;
 
-  size_t highestCount() const
-  {
-    std::scoped_lock lock(m_Mutex);
-    return m_Files.size();
-  }
+  // same as getFile(), but null if the file was removed and its index given to
+  // another since `generation` was taken from it
+  FileEntryPtr getFile(FileIndex index, FileGeneration generation) const;
+
+  // same as getFile(), but without taking a reference, for loops over many
+  // files; the entry stays valid until the file is removed
+  FileEntry* fileAt(FileIndex index) const;
+
+  size_t highestCount() const { return m_NextIndex.load(std::memory_order_relaxed); }
 
   bool removeFile(FileIndex index);
   void removeOrigin(FileIndex index, OriginID originID);
@@ -37,14 +56,31 @@ public:
   void sortOrigins();
 
 private:
-  using FileMap = std::deque<FileEntryPtr>;
+  struct Block;
+  struct FreeSlots;
+  struct Reference;
+
+  static constexpr std::size_t BlockBits = 12;
+  static constexpr std::size_t BlockSize = std::size_t(1) << BlockBits;
+  static constexpr std::size_t MaxBlocks = 16384;
 
+  // removals
   mutable std::mutex m_Mutex;
-  FileMap m_Files;
+
+  // blocks are looked up without a lock; m_Owners keeps them alive and is
+  // only touched with m_BlocksMutex held, when a block is added
+  std::unique_ptr<std::atomic<Block*>[]> m_Blocks;
+  std::vector<boost::shared_ptr<Block>> m_Owners;
+  std::mutex m_BlocksMutex;
+  std::shared_ptr<FreeSlots> m_Free;
+
   boost::shared_ptr<OriginConnection> m_OriginConnection;
   std::atomic<FileIndex> m_NextIndex;
 
-  void unregisterFile(FileEntryPtr file);
+  Block* blockFor(FileIndex index) const;
+  Block& getOrCreateBlock(FileIndex index);
+
+  void unregisterFile(FileEntry& file);
   FileIndex generateIndex();
 };
 
@@ -1,6 +1,8 @@
 #ifndef MO_REGISTER_FILEREGISTERFWD_INCLUDED
 #define MO_REGISTER_FILEREGISTERFWD_INCLUDED
 
+#include "namepool.h"
+
 class DirectoryRefreshProgress;
 
 namespace MOShared
@@ -32,6 +34,9 @@ using FileEntryPtr = boost::shared_ptr<FileEntry>;
 using FileIndex    = unsigned int;
 using OriginID     = int;
 
+// how many files had the same FileIndex before, see FileRegister
+using FileGeneration = unsigned int;
+
 constexpr FileIndex InvalidFileIndex = UINT_MAX;
 constexpr OriginID InvalidOriginID   = -1;
 
@@ -41,17 +46,24 @@ constexpr OriginID InvalidOriginID   = -1;
 // -1
 class DataArchiveOrigin
 {
-  std::wstring name_ = L"";
-  int order_         = -1;
+  NameID name_ = InvalidNameID;
+  int order_   = -1;
 
 public:
   int order() const { return order_; }
-  const std::wstring& name() const { return name_; }
 
-  bool isValid() const { return name_.size() > 0; }
+  std::wstring name() const
+  {
+    return isValid() ? NamePool::instance().wide(name_) : std::wstring();
+  }
+
+  NameID nameID() const { return name_; }
+
+  bool isValid() const { return name_ != InvalidNameID; }
 
-  DataArchiveOrigin(std::wstring name, int order)
-      : name_(std::move(name)), order_(order)
+  DataArchiveOrigin(std::wstring_view name, int order)
+      : name_(name.empty() ? InvalidNameID : NamePool::instance().intern(name)),
+        order_(order)
   {}
 
   DataArchiveOrigin() = default;
@@ -50,9 +50,12 @@ std::vector<FileEntryPtr> FilesOrigin::getFiles() const
 
   {
     std::scoped_lock lock(m_Mutex);
+    const auto fileRegister = m_FileRegister.lock();
+
+    result.reserve(m_Files.size());
 
     for (FileIndex fileIdx : m_Files) {
-      if (FileEntryPtr p = m_FileRegister.lock()->getFile(fileIdx)) {
+      if (FileEntryPtr p = fileRegister->getFile(fileIdx)) {
         result.push_back(p);
       }
     }
@@ -61,9 +64,9 @@ std::vector<FileEntryPtr> FilesOrigin::getFiles() const
   return result;
 }
 
-FileEntryPtr FilesOrigin::findFile(FileIndex index) const
+FileEntryPtr FilesOrigin::findFile(FileIndex index, FileGeneration generation) const
 {
-  return m_FileRegister.lock()->getFile(index);
+  return m_FileRegister.lock()->getFile(index, generation);
 }
 
 void FilesOrigin::enable(bool enabled)
@@ -106,8 +109,10 @@ bool FilesOrigin::containsArchive(std::wstring archiveName)
 {
   std::scoped_lock lock(m_Mutex);
 
+  const auto fileRegister = m_FileRegister.lock();
+
   for (FileIndex fileIdx : m_Files) {
-    if (FileEntryPtr p = m_FileRegister.lock()->getFile(fileIdx)) {
+    if (FileEntry* p = fileRegister->fileAt(fileIdx)) {
       if (p->isFromArchive(archiveName)) {
         return true;
       }
@@ -34,7 +34,9 @@ public:
   const std::wstring& getPath() const { return m_Path; }
 
   std::vector<FileEntryPtr> getFiles() const;
-  FileEntryPtr findFile(FileIndex index) const;
+  // null if the file was removed since `generation` was taken from it, even if
+  // another has its index now
+  FileEntryPtr findFile(FileIndex index, FileGeneration generation) const;
 
   void enable(bool enabled, DirectoryStats& stats);
   void enable(bool enabled);
@@ -0,0 +1,444 @@
+#include "namepool.h"
+#include "util.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace MOShared
+{
+
+// names are copied into chunks this big, a bigger one for longer names
+constexpr std::size_t NameChunkSize = 16 * 1024;
+
+// initial size of a shard's hash table
+constexpr std::size_t MinSlots = 256;
+
+static void toUtf8(std::wstring_view s, std::string& out)
+{
+  out.clear();
+
+  for (std::size_t i = 0; i < s.size(); ++i) {
+    char32_t c = static_cast<char32_t>(s[i]);
+
+    if constexpr (sizeof(wchar_t) == 2) {
+      // a surrogate pair; lone surrogates are encoded as they are so the
+      // name still round-trips
+      if (c >= 0xD800 && c < 0xDC00 && i + 1 < s.size()) {
+        const auto low = static_cast<char32_t>(s[i + 1]);
+        if (low >= 0xDC00 && low < 0xE000) {
+          c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+          ++i;
+        }
+      }
+    }
+
+    if (c < 0x80) {
+      out.push_back(static_cast<char>(c));
+    } else if (c < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else if (c < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else if (c < 0x110000) {
+      out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else {
+      // not a code point, U+FFFD
+      out += "\xEF\xBF\xBD";
+    }
+  }
+}
+
+// length of the UTF-8 sequence at s[i], 0 if it isn't a valid one
+static std::size_t sequenceAt(std::string_view s, std::size_t i)
+{
+  const auto b = static_cast<unsigned char>(s[i]);
+  if (b < 0x80) {
+    return 1;
+  }
+
+  std::size_t n;
+  char32_t c;
+  char32_t least;
+
+  if ((b & 0xE0) == 0xC0) {
+    n     = 2;
+    c     = b & 0x1F;
+    least = 0x80;
+  } else if ((b & 0xF0) == 0xE0) {
+    n     = 3;
+    c     = b & 0x0F;
+    least = 0x800;
+  } else if ((b & 0xF8) == 0xF0) {
+    n     = 4;
+    c     = b & 0x07;
+    least = 0x10000;
+  } else {
+    return 0;
+  }
+
+  if (i + n > s.size()) {
+    return 0;
+  }
+
+  for (std::size_t k = 1; k < n; ++k) {
+    const auto cc = static_cast<unsigned char>(s[i + k]);
+    if ((cc & 0xC0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (cc & 0x3F);
+  }
+
+  if (c < least || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+    return 0;
+  }
+
+  return n;
+}
+
+// UTF-8 from a directory walk, with invalid bytes replaced by U+FFFD like
+// QString::fromUtf8() does; false if it was valid already and `out` is unused
+static bool sanitize(std::string_view s, std::string& out)
+{
+  std::size_t i = 0;
+  while (i < s.size()) {
+    const std::size_t n = sequenceAt(s, i);
+    if (n == 0) {
+      break;
+    }
+    i += n;
+  }
+
+  if (i == s.size()) {
+    return false;
+  }
+
+  out.assign(s.substr(0, i));
+
+  while (i < s.size()) {
+    const std::size_t n = sequenceAt(s, i);
+    if (n == 0) {
+      out += "\xEF\xBF\xBD";
+      ++i;
+    } else {
+      out.append(s.substr(i, n));
+      i += n;
+    }
+  }
+
+  return true;
+}
+
+// only ever decodes what toUtf8() or sanitize() produced, so there's nothing
+// to validate
+static std::wstring fromUtf8(std::string_view s)
+{
+  std::wstring out;
+  out.reserve(s.size());
+
+  for (std::size_t i = 0; i < s.size();) {
+    const auto b = static_cast<unsigned char>(s[i]);
+    char32_t c;
+
+    if (b < 0x80) {
+      c = b;
+      i += 1;
+    } else if (b < 0xE0) {
+      c = ((b & 0x1F) << 6) | (s[i + 1] & 0x3F);
+      i += 2;
+    } else if (b < 0xF0) {
+      c = ((b & 0x0F) << 12) | ((s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F);
+      i += 3;
+    } else {
+      c = ((b & 0x07) << 18) | ((s[i + 1] & 0x3F) << 12) | ((s[i + 2] & 0x3F) << 6) |
+          (s[i + 3] & 0x3F);
+      i += 4;
+    }
+
+    if constexpr (sizeof(wchar_t) == 2) {
+      if (c >= 0x10000) {
+        c -= 0x10000;
+        out.push_back(static_cast<wchar_t>(0xD800 + (c >> 10)));
+        out.push_back(static_cast<wchar_t>(0xDC00 + (c & 0x3FF)));
+        continue;
+      }
+    }
+
+    out.push_back(static_cast<wchar_t>(c));
+  }
+
+  return out;
+}
+
+// lowercase form of a name, which only has to be decoded if it isn't ASCII
+static std::string lowerCase(std::string_view utf8)
+{
+  std::string lower(utf8);
+
+  for (char& c : lower) {
+    if (static_cast<unsigned char>(c) >= 0x80) {
+      toUtf8(ToLowerCopy(fromUtf8(utf8)), lower);
+      break;
+    }
+
+    if (c >= 'A' && c <= 'Z') {
+      c = static_cast<char>(c - 'A' + 'a');
+    }
+  }
+
+  return lower;
+}
+
+// buffer for the UTF-8 form of names being looked up
+static std::string& lookupBuffer()
+{
+  thread_local std::string s;
+  return s;
+}
+
+NamePool& NamePool::instance()
+{
+  static NamePool pool;
+  return pool;
+}
+
+NamePool::NamePool() : m_next(0)
+{
+  for (auto& b : m_blocks) {
+    b.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+NamePool::~NamePool()
+{
+  for (auto& b : m_blocks) {
+    delete[] b.load(std::memory_order_relaxed);
+  }
+}
+
+NameID NamePool::intern(std::wstring_view name)
+{
+  std::string& utf8 = lookupBuffer();
+  toUtf8(name, utf8);
+
+  return internValid(utf8);
+}
+
+NameID NamePool::intern(std::string_view utf8)
+{
+  std::string& clean = lookupBuffer();
+  if (sanitize(utf8, clean)) {
+    return internValid(clean);
+  }
+
+  return internValid(utf8);
+}
+
+NameID NamePool::internValid(std::string_view utf8)
+{
+  const std::size_t hash = hashOf(utf8);
+  Shard& s               = shardFor(hash);
+
+  {
+    std::shared_lock lock(s.mutex);
+    const NameID id = findIn(s, utf8, hash);
+    if (id != InvalidNameID) {
+      return id;
+    }
+  }
+
+  // the lowercase form goes in first, without holding this shard's lock
+  NameID folded = InvalidNameID;
+  {
+    const std::string lower = lowerCase(utf8);
+    if (lower != utf8) {
+      folded = internValid(lower);
+    }
+  }
+
+  std::unique_lock lock(s.mutex);
+
+  // another thread might have added it in the meantime
+  const NameID id = findIn(s, utf8, hash);
+  if (id != InvalidNameID) {
+    return id;
+  }
+
+  return add(s, utf8, hash, folded);
+}
+
+NameID NamePool::find(std::wstring_view name) const
+{
+  std::string& utf8 = lookupBuffer();
+  toUtf8(name, utf8);
+
+  const std::size_t hash = hashOf(utf8);
+  const Shard& s         = shardFor(hash);
+  std::shared_lock lock(s.mutex);
+
+  return findIn(s, utf8, hash);
+}
+
+NameID NamePool::findFolded(std::wstring_view name, bool alreadyLowerCase) const
+{
+  const NameID id = find(name);
+  if (id != InvalidNameID) {
+    return folded(id);
+  }
+
+  if (alreadyLowerCase) {
+    return InvalidNameID;
+  }
+
+  // no name with this exact case was seen, but other cases may have been
+  return find(ToLowerCopy(name));
+}
+
+std::wstring NamePool::wide(NameID id) const
+{
+  return fromUtf8(utf8(id));
+}
+
+std::size_t NamePool::size() const
+{
+  return m_next.load(std::memory_order_relaxed);
+}
+
+std::size_t NamePool::bytes() const
+{
+  const std::size_t names = size();
+  std::size_t total = ((names + BlockSize - 1) / BlockSize) * BlockSize * sizeof(Entry);
+
+  for (auto&& s : m_shards) {
+    std::shared_lock lock(s.mutex);
+    total += s.bytes + s.slots.size() * sizeof(NameID);
+  }
+
+  return total;
+}
+
+NamePool::Shard& NamePool::shardFor(std::size_t hash)
+{
+  return m_shards[hash >> (sizeof(std::size_t) * 8 - ShardBits)];
+}
+
+const NamePool::Shard& NamePool::shardFor(std::size_t hash) const
+{
+  return m_shards[hash >> (sizeof(std::size_t) * 8 - ShardBits)];
+}
+
+NameID NamePool::findIn(const Shard& s, std::string_view utf8, std::size_t hash) const
+{
+  if (s.slots.empty()) {
+    return InvalidNameID;
+  }
+
+  const std::size_t mask = s.slots.size() - 1;
+
+  for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+    const NameID id = s.slots[i];
+    if (id == InvalidNameID) {
+      return InvalidNameID;
+    }
+
+    const Entry& e = entry(id);
+    if (e.hash == hash && e.size == utf8.size() &&
+        std::memcmp(e.data, utf8.data(), utf8.size()) == 0) {
+      return id;
+    }
+  }
+}
+
+NameID NamePool::add(Shard& s, std::string_view utf8, std::size_t hash, NameID folded)
+{
+  if ((s.count + 1) * 2 > s.slots.size()) {
+    grow(s);
+  }
+
+  NameID id;
+  Entry& e = newEntry(id);
+
+  e.data   = store(s, utf8);
+  e.size   = static_cast<std::uint32_t>(utf8.size());
+  e.folded = (folded == InvalidNameID ? id : folded);
+  e.hash   = hash;
+
+  const std::size_t mask = s.slots.size() - 1;
+  std::size_t i          = hash & mask;
+
+  while (s.slots[i] != InvalidNameID) {
+    i = (i + 1) & mask;
+  }
+
+  s.slots[i] = id;
+  ++s.count;
+
+  return id;
+}
+
+NamePool::Entry& NamePool::newEntry(NameID& id)
+{
+  id = m_next.fetch_add(1, std::memory_order_relaxed);
+
+  const std::size_t block = id >> BlockBits;
+  if (block >= MaxBlocks) {
+    throw std::runtime_error("too many names in the directory structure");
+  }
+
+  Entry* entries = m_blocks[block].load(std::memory_order_acquire);
+
+  if (!entries) {
+    std::scoped_lock lock(m_blocksMutex);
+
+    entries = m_blocks[block].load(std::memory_order_relaxed);
+    if (!entries) {
+      entries = new Entry[BlockSize];
+      m_blocks[block].store(entries, std::memory_order_release);
+    }
+  }
+
+  return entries[id & (BlockSize - 1)];
+}
+
+const char* NamePool::store(Shard& s, std::string_view utf8)
+{
+  if (s.chunks.empty() || s.chunkSize - s.chunkUsed < utf8.size()) {
+    s.chunkSize = std::max(NameChunkSize, utf8.size());
+    s.chunkUsed = 0;
+    s.chunks.push_back(std::make_unique<char[]>(s.chunkSize));
+    s.bytes += s.chunkSize;
+  }
+
+  char* p = s.chunks.back().get() + s.chunkUsed;
+  std::memcpy(p, utf8.data(), utf8.size());
+  s.chunkUsed += utf8.size();
+
+  return p;
+}
+
+void NamePool::grow(Shard& s)
+{
+  std::vector<NameID> slots(std::max(MinSlots, s.slots.size() * 2), InvalidNameID);
+  const std::size_t mask = slots.size() - 1;
+
+  // hashes are kept with the names, nothing is hashed again
+  for (const NameID id : s.slots) {
+    if (id == InvalidNameID) {
+      continue;
+    }
+
+    std::size_t i = entry(id).hash & mask;
+    while (slots[i] != InvalidNameID) {
+      i = (i + 1) & mask;
+    }
+
+    slots[i] = id;
+  }
+
+  s.slots = std::move(slots);
+}
+
+}  // namespace MOShared
@@ -0,0 +1,134 @@
+#ifndef MO_REGISTER_NAMEPOOL_INCLUDED
+#define MO_REGISTER_NAMEPOOL_INCLUDED
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace MOShared
+{
+
+using NameID = std::uint32_t;
+
+constexpr NameID InvalidNameID = UINT32_MAX;
+
+// every file and directory name of the directory structure, stored once as
+// UTF-8 no matter how many mods or refreshes it shows up in; entries refer to
+// names by id
+//
+// each name knows the id of its lowercase form, which is interned along with
+// it, so case-insensitive lookups compare ids instead of strings
+//
+// names are never removed, the pool only grows with names never seen before;
+// safe to use from any thread
+class NamePool
+{
+public:
+  static NamePool& instance();
+
+  NamePool();
+  ~NamePool();
+
+  // noncopyable
+  NamePool(const NamePool&)            = delete;
+  NamePool& operator=(const NamePool&) = delete;
+
+  // id of the given name, added if it's not in the pool yet; the second
+  // overload takes UTF-8 as directory walks report it, bytes that aren't
+  // valid UTF-8 are stored as U+FFFD
+  NameID intern(std::wstring_view name);
+  NameID intern(std::string_view utf8);
+
+  // id of the given name, InvalidNameID if it was never interned
+  NameID find(std::wstring_view name) const;
+
+  // id of the lowercase form of the given name, InvalidNameID if no name
+  // with that lowercase form was ever interned
+  NameID findFolded(std::wstring_view name, bool alreadyLowerCase = false) const;
+
+  // id of the lowercase form of `id`, which is `id` itself for names that
+  // are already lowercase
+  NameID folded(NameID id) const { return entry(id).folded; }
+
+  std::size_t hash(NameID id) const { return entry(id).hash; }
+
+  std::string_view utf8(NameID id) const
+  {
+    const Entry& e = entry(id);
+    return {e.data, e.size};
+  }
+
+  std::wstring wide(NameID id) const;
+
+  // number of names and bytes used by the pool
+  std::size_t size() const;
+  std::size_t bytes() const;
+
+private:
+  struct Entry
+  {
+    const char* data;
+    std::uint32_t size;
+    NameID folded;
+    std::size_t hash;
+  };
+
+  // entries are in fixed blocks that never move, so they can be read without
+  // a lock once their id is known
+  static constexpr std::size_t BlockBits = 14;
+  static constexpr std::size_t BlockSize = std::size_t(1) << BlockBits;
+  static constexpr std::size_t MaxBlocks = 16384;
+
+  // the hash table is split by the top bits of the hash so threads adding
+  // names rarely wait for each other
+  static constexpr std::size_t ShardBits = 6;
+
+  struct Shard
+  {
+    mutable std::shared_mutex mutex;
+    std::vector<NameID> slots;  // open addressing, a power of two in size
+    std::size_t count = 0;
+
+    // UTF-8 of the names in this shard
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::size_t chunkUsed = 0;
+    std::size_t chunkSize = 0;
+    std::size_t bytes     = 0;
+  };
+
+  std::array<std::atomic<Entry*>, MaxBlocks> m_blocks;
+  std::atomic<NameID> m_next;
+  std::mutex m_blocksMutex;
+  std::array<Shard, std::size_t(1) << ShardBits> m_shards;
+
+  const Entry& entry(NameID id) const
+  {
+    return m_blocks[id >> BlockBits].load(std::memory_order_acquire)
+        [id & (BlockSize - 1)];
+  }
+
+  static std::size_t hashOf(std::string_view utf8)
+  {
+    return std::hash<std::string_view>()(utf8);
+  }
+
+  Shard& shardFor(std::size_t hash);
+  const Shard& shardFor(std::size_t hash) const;
+
+  NameID internValid(std::string_view utf8);
+  NameID findIn(const Shard& s, std::string_view utf8, std::size_t hash) const;
+  NameID add(Shard& s, std::string_view utf8, std::size_t hash, NameID folded);
+  Entry& newEntry(NameID& id);
+  const char* store(Shard& s, std::string_view utf8);
+  void grow(Shard& s);
+};
+
+}  // namespace MOShared
+
+#endif  // MO_REGISTER_NAMEPOOL_INCLUDED
@@ -0,0 +1,150 @@
+#include "fuse_replay_shim.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+
+// FUSE_NAME_OFFSET and FUSE_NAME_OFFSET_DIRENTPLUS from the kernel protocol,
+// so readdir pages fill up the way they would on a mount
+constexpr size_t DirentHeader     = 24;
+constexpr size_t DirentPlusHeader = 152;
+
+size_t direntSize(size_t header, const char* name)
+{
+  return (header + std::strlen(name) + 7) & ~size_t(7);
+}
+
+int reply(fuse_req_t req, int error)
+{
+  req->replied = true;
+  req->error   = error;
+  return 0;
+}
+
+}  // namespace
+
+void* fuse_req_userdata(fuse_req_t req)
+{
+  return req->ctx;
+}
+
+int fuse_reply_err(fuse_req_t req, int err)
+{
+  return reply(req, err);
+}
+
+void fuse_reply_none(fuse_req_t req)
+{
+  reply(req, 0);
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param* e)
+{
+  req->ino = e->ino;
+  return reply(req, 0);
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param* e,
+                      const struct fuse_file_info* /*fi*/)
+{
+  req->ino = e->ino;
+  return reply(req, 0);
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat* /*attr*/, double /*attr_timeout*/)
+{
+  return reply(req, 0);
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info* /*fi*/)
+{
+  return reply(req, 0);
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count)
+{
+  req->bytes = count;
+  return reply(req, 0);
+}
+
+int fuse_reply_buf(fuse_req_t req, const char* /*buf*/, size_t size)
+{
+  req->bytes = size;
+  return reply(req, 0);
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec* bufv,
+                    enum fuse_buf_copy_flags /*flags*/)
+{
+  thread_local std::vector<char> sink;
+
+  uint64_t total = 0;
+  for (size_t i = bufv->idx; i < bufv->count; ++i) {
+    const fuse_buf& buf = bufv->buf[i];
+    if ((buf.flags & FUSE_BUF_IS_FD) == 0) {
+      total += buf.size;
+      continue;
+    }
+
+    sink.resize(buf.size);
+    const ssize_t n = pread(buf.fd, sink.data(), buf.size, buf.pos);
+    if (n < 0) {
+      return reply(req, errno);
+    }
+    total += static_cast<uint64_t>(n);
+  }
+
+  req->bytes = total;
+  return reply(req, 0);
+}
+
+size_t fuse_add_direntry(fuse_req_t /*req*/, char* buf, size_t bufsize, const char* name,
+                         const struct stat* /*stbuf*/, off_t /*off*/)
+{
+  const size_t size = direntSize(DirentHeader, name);
+  if (buf != nullptr && size <= bufsize) {
+    std::memset(buf, 0, size);
+  }
+  return size;
+}
+
+size_t fuse_add_direntry_plus(fuse_req_t /*req*/, char* buf, size_t bufsize,
+                              const char* name, const struct fuse_entry_param* /*e*/,
+                              off_t /*off*/)
+{
+  const size_t size = direntSize(DirentPlusHeader, name);
+  if (buf != nullptr && size <= bufsize) {
+    std::memset(buf, 0, size);
+  }
+  return size;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_session* /*se*/, fuse_ino_t /*ino*/,
+                                     off_t /*off*/, off_t /*len*/)
+{
+  return 0;
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_session* /*se*/, fuse_ino_t /*parent*/,
+                                     const char* /*name*/, size_t /*namelen*/)
+{
+  return 0;
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+// the replay never enables passthrough; there is no kernel to hand files to
+int fuse_passthrough_open(fuse_req_t /*req*/, int /*fd*/)
+{
+  return -ENOSYS;
+}
+
+int fuse_passthrough_close(fuse_req_t /*req*/, int /*backing_id*/)
+{
+  return 0;
+}
+#endif
@@ -0,0 +1,27 @@
+#ifndef VFS_BENCH_FUSE_REPLAY_SHIM_H
+#define VFS_BENCH_FUSE_REPLAY_SHIM_H
+
+// Stand-in for the part of libfuse the handlers in mo2filesystem.cpp call,
+// so mo2-vfs-replay can drive them directly: a request is a plain struct the
+// replies are written into, and nothing is mounted or sent to a kernel.
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <cstdint>
+
+struct Mo2FsContext;
+
+struct fuse_req
+{
+  Mo2FsContext* ctx = nullptr;
+
+  bool replied = false;
+  int error    = 0;
+  // lookup/create/mkdir entry, 0 if none was handed out
+  fuse_ino_t ino = 0;
+  // data replied to a read (spliced data is read from its fd to match what
+  // the kernel would pull through the pipe), or bytes accepted by a write
+  uint64_t bytes = 0;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Writes the synthetic trace CI replays with mo2-vfs-replay.
+
+The load looks like a game starting on a modded Data directory: four FUSE
+workers look up, stat, open and read archives, meshes and textures, probe
+for files no mod has (the loose file checks games do before falling back to
+archives), list a few directories, and write some logs.  The output is
+deterministic, so the checked-in trace only changes when this script does.
+
+Usage:
+  make_replay_trace.py OUT
+"""
+
+import os
+import random
+import struct
+import sys
+
+MAGIC = b"MO2VTRC\0"
+VERSION = 1
+
+# vfstrace::Op
+PATH, LOOKUP, GETATTR, OPENDIR, READDIR, READDIRPLUS, RELEASEDIR, OPEN, READ, \
+    WRITE, FLUSH, RELEASE, CREATE, MKDIR, UNLINK, RENAME, SETATTR, FORGET = range(18)
+
+# vfstrace::PathKind
+MISSING, FILE, DIRECTORY = 0, 1, 2
+
+THREADS = 4
+READ_SIZE = 131072
+RECORD = struct.Struct("<QQQIIIIHB5x")  # vfstrace::TraceRecord
+
+
+class Trace:
+    def __init__(self):
+        self.out = bytearray(struct.pack("<8sII", MAGIC, VERSION, 0))
+        self.ids = {}
+        self.kinds = {}
+        self.sizes = {}
+        self.clock = [0] * THREADS
+        self.next_fh = 1
+
+    def declare(self, path, kind, size=0):
+        self.kinds[path] = kind
+        self.sizes[path] = size
+
+    def path_id(self, path):
+        if path not in self.ids:
+            pid = len(self.ids)
+            self.ids[path] = pid
+            name = path.encode("utf-8")
+            self.out += RECORD.pack(0, 0, self.sizes.get(path, 0), pid, 0, len(name),
+                                    self.kinds.get(path, MISSING), 0, PATH)
+            self.out += name
+        return self.ids[path]
+
+    def add(self, thread, op, path, fh=0, offset=0, size=0, flags=0, path2=None):
+        self.clock[thread] += random.randint(2000, 40000)
+        pid = self.path_id(path)
+        pid2 = self.path_id(path2) if path2 is not None else 0
+        self.out += RECORD.pack(self.clock[thread], fh, offset, pid, pid2, size, flags,
+                                thread, op)
+
+    def handle(self):
+        fh = self.next_fh
+        self.next_fh += 1
+        return fh
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__.strip().splitlines()[-1].strip(), file=sys.stderr)
+        return 2
+
+    random.seed(20261016)
+    t = Trace()
+
+    dirs = ["", "meshes", "meshes/actors", "meshes/actors/character",
+            "meshes/architecture", "meshes/clutter", "textures", "textures/actors",
+            "textures/actors/character", "textures/architecture", "textures/clutter",
+            "scripts", "sound", "sound/fx", "interface", "skse", "skse/plugins"]
+    for d in dirs:
+        t.declare(d, DIRECTORY)
+
+    files = []
+    for i in range(12):
+        files.append((f"Mod{i:02}.bsa", random.randint(64, 512) << 20))
+    for d, ext, count, lo, hi in [
+            ("meshes/actors/character", "nif", 40, 20, 900),
+            ("meshes/architecture", "nif", 40, 20, 2000),
+            ("meshes/clutter", "nif", 40, 5, 300),
+            ("textures/actors/character", "dds", 40, 256, 16384),
+            ("textures/architecture", "dds", 40, 256, 8192),
+            ("textures/clutter", "dds", 30, 64, 2048),
+            ("scripts", "pex", 40, 1, 60),
+            ("sound/fx", "wav", 20, 30, 900),
+            ("interface", "swf", 6, 50, 3000),
+            ("skse/plugins", "dll", 6, 100, 4000)]:
+        for i in range(count):
+            files.append((f"{d}/{ext}{i:03}.{ext}", random.randint(lo, hi) << 10))
+    for path, size in files:
+        t.declare(path, FILE, size)
+
+    # the launcher lists the top of the tree first
+    for d in dirs[:8]:
+        fh = t.handle()
+        t.add(0, OPENDIR, d, fh)
+        t.add(0, READDIRPLUS, d, fh, 0, 4096)
+        t.add(0, RELEASEDIR, d, fh)
+
+    random.shuffle(files)
+    for n, (path, size) in enumerate(files):
+        thread = n % THREADS
+        t.add(thread, LOOKUP, path)
+        t.add(thread, GETATTR, path)
+        fh = t.handle()
+        t.add(thread, OPEN, path, fh, flags=os.O_RDONLY)
+        for off in range(0, min(size, 2 * READ_SIZE), READ_SIZE):
+            t.add(thread, READ, path, fh, off, READ_SIZE)
+        t.add(thread, RELEASE, path, fh)
+
+        # loose files the game looks for and no mod has, some twice
+        if n % 3 == 0:
+            base, _, ext = path.rpartition(".")
+            missing = f"{base}_1stperson.{ext}"
+            t.declare(missing, MISSING)
+            t.add(thread, LOOKUP, missing)
+            if n % 2 == 0:
+                t.add(thread, LOOKUP, missing)
+
+    # logs written while the game runs
+    for i in range(4):
+        path = f"skse/plugins/plugin{i}.log"
+        t.declare(path, MISSING)
+        fh = t.handle()
+        t.add(3, CREATE, path, fh, flags=os.O_WRONLY | os.O_CREAT | os.O_TRUNC)
+        for off in range(0, 8 * 4096, 4096):
+            t.add(3, WRITE, path, fh, off, 4096)
+        t.add(3, FLUSH, path, fh)
+        t.add(3, RELEASE, path, fh)
+
+    with open(sys.argv[1], "wb") as f:
+        f.write(t.out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
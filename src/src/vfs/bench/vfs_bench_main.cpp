@@ -0,0 +1,407 @@
+// Multithreaded replay benchmark for the VFS lookup/read path.
+//
+// Replays a lookup/read trace against a VfsTree + InodeTable from N threads,
+// the way the FUSE session loop drives them, without mounting anything.  The
+// tree comes from a helper vfs.cfg (mods + overwrite) or is synthesized.
+//
+// Trace format, one request per line:
+//   lookup <relative path>
+//   read <relative path> <offset> <size>
+//
+// Usage:
+//   mo2-vfs-bench [--config vfs.cfg | --synthetic FILES] [--trace FILE]
+//                 [--record FILE] [--threads 1,2,4,8] [--rounds N]
+
+#include "inodetable.h"
+#include "vfstree.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct TraceOp
+{
+  bool is_read = false;
+  std::vector<std::string> components;
+  uint64_t offset = 0;
+  uint32_t size   = 0;
+};
+
+struct Options
+{
+  std::string config;
+  size_t synthetic = 200000;
+  std::string trace;
+  std::string record;
+  std::vector<unsigned> threads;
+  unsigned rounds = 3;
+};
+
+std::vector<std::string> splitPath(const std::string& path)
+{
+  std::vector<std::string> out;
+  std::stringstream ss(path);
+  std::string part;
+  while (std::getline(ss, part, '/')) {
+    if (!part.empty()) {
+      out.push_back(part);
+    }
+  }
+  return out;
+}
+
+std::string joinComponents(const std::vector<std::string>& components)
+{
+  std::string out;
+  for (const auto& c : components) {
+    if (!out.empty()) {
+      out.push_back('/');
+    }
+    out += c;
+  }
+  return out;
+}
+
+VfsTree treeFromConfig(const std::string& path)
+{
+  std::vector<std::pair<std::string, std::string>> mods;
+  std::string overwrite;
+
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    const auto eq = line.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+
+    const std::string key = line.substr(0, eq);
+    const std::string val = line.substr(eq + 1);
+    if (key == "overwrite_dir") {
+      overwrite = val;
+    } else if (key == "mod") {
+      const auto bar = val.find('|');
+      if (bar != std::string::npos) {
+        mods.emplace_back(val.substr(0, bar), val.substr(bar + 1));
+      }
+    }
+  }
+
+  return buildVfsTree(mods, overwrite);
+}
+
+// A mod-list-shaped tree: a few hundred mods spreading files over the usual
+// top-level folders, with plenty of shared directories and overrides.
+VfsTree syntheticTree(size_t files)
+{
+  static const char* top[] = {"textures", "meshes", "scripts", "sound", "interface",
+                              "seq",      "SKSE",   "Strings", "music", "lodsettings"};
+  VfsTree tree;
+  for (size_t i = 0; i < files; ++i) {
+    const size_t mod = i % 300;
+    std::vector<std::string> components = {
+        top[i % std::size(top)], "set" + std::to_string((i / 7) % 97),
+        "group" + std::to_string((i / 3) % 41),
+        "file" + std::to_string(i % (files / 2 + 1)) + ".dds"};
+    tree.insertFile(components, "/nonexistent/" + std::to_string(mod), 4096, {},
+                    "mod" + std::to_string(mod));
+    ++tree.file_count;
+  }
+  return tree;
+}
+
+void collectFiles(const VfsTree& tree, VfsNodeId dir, std::vector<std::string>& prefix,
+                  std::vector<TraceOp>& out)
+{
+  for (const VfsNodeId id : tree.children(dir)) {
+    const VfsNode& node = tree.node(id);
+    prefix.emplace_back(tree.name(node));
+    if (node.is_directory) {
+      collectFiles(tree, id, prefix, out);
+    } else {
+      out.push_back({false, prefix, 0, 0});
+      out.push_back({true, prefix, 0, 64 * 1024});
+    }
+    prefix.pop_back();
+  }
+}
+
+std::vector<TraceOp> loadTrace(const std::string& path)
+{
+  std::vector<TraceOp> ops;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    std::string verb;
+    std::string rel;
+    ss >> verb >> std::ws;
+
+    TraceOp op;
+    if (verb == "lookup") {
+      std::getline(ss, rel);
+    } else if (verb == "read") {
+      // the path may contain spaces; offset and size are the last two fields
+      std::string rest;
+      std::getline(ss, rest);
+      const auto sizeAt   = rest.rfind(' ');
+      const auto offsetAt = rest.rfind(' ', sizeAt - 1);
+      if (sizeAt == std::string::npos || offsetAt == std::string::npos) {
+        continue;
+      }
+      rel        = rest.substr(0, offsetAt);
+      op.is_read = true;
+      op.offset  = std::strtoull(rest.c_str() + offsetAt + 1, nullptr, 10);
+      op.size =
+          static_cast<uint32_t>(std::strtoul(rest.c_str() + sizeAt + 1, nullptr, 10));
+    } else {
+      continue;
+    }
+
+    op.components = splitPath(rel);
+    ops.push_back(std::move(op));
+  }
+  return ops;
+}
+
+void writeTrace(const std::string& path, const std::vector<TraceOp>& ops)
+{
+  std::ofstream out(path);
+  for (const auto& op : ops) {
+    if (op.is_read) {
+      out << "read " << joinComponents(op.components) << ' ' << op.offset << ' '
+          << op.size << '\n';
+    } else {
+      out << "lookup " << joinComponents(op.components) << '\n';
+    }
+  }
+}
+
+// Same steps as lookupChild() in mo2filesystem.cpp: one folded child lookup
+// per component, registering inodes on the way.
+uint64_t lookupPath(const VfsTree& tree, std::shared_mutex& treeMutex,
+                    InodeTable& inodes, const std::vector<std::string>& components,
+                    VfsNodeId* nodeOut)
+{
+  thread_local std::string key;
+
+  uint64_t ino   = InodeTable::RootInode;
+  VfsNodeId node = VfsTree::Root;
+  for (const auto& part : components) {
+    vfsFoldName(part, key);
+    const uint32_t hash = vfsNameHash(key);
+
+    std::shared_lock lock(treeMutex);
+    const VfsNodeId dir = inodes.node(ino, tree);
+    if (dir == InvalidVfsNode) {
+      return 0;
+    }
+    node = tree.findFolded(dir, key, hash);
+    if (node == InvalidVfsNode) {
+      return 0;
+    }
+    ino = inodes.getOrCreate(ino, part, key, hash, tree, node);
+  }
+
+  *nodeOut = node;
+  return ino;
+}
+
+struct RunResult
+{
+  double seconds = 0;
+  uint64_t ops   = 0;
+  uint64_t misses = 0;
+  uint64_t bytes  = 0;
+};
+
+RunResult replay(const VfsTree& tree, const std::vector<TraceOp>& ops, unsigned threadCount)
+{
+  std::shared_mutex treeMutex;
+  InodeTable inodes;
+
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<bool> go{false};
+
+  std::vector<std::thread> threads;
+  threads.reserve(threadCount);
+
+  // every thread replays the whole trace from a different starting point, so
+  // they contend on the same hot directories without running in lockstep
+  for (unsigned t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&, t] {
+      std::vector<char> buffer;
+      uint64_t localMisses = 0;
+      uint64_t localBytes  = 0;
+
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+
+      const size_t start = ops.size() * t / threadCount;
+      for (size_t i = 0; i < ops.size(); ++i) {
+        const TraceOp& op = ops[(start + i) % ops.size()];
+
+        VfsNodeId node = InvalidVfsNode;
+        if (lookupPath(tree, treeMutex, inodes, op.components, &node) == 0) {
+          ++localMisses;
+          continue;
+        }
+
+        if (!op.is_read) {
+          continue;
+        }
+
+        std::string real;
+        {
+          std::shared_lock lock(treeMutex);
+          real = tree.realPath(tree.node(node));
+        }
+
+        const int fd = open(real.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          continue;
+        }
+        buffer.resize(op.size);
+        const ssize_t n = pread(fd, buffer.data(), op.size, static_cast<off_t>(op.offset));
+        close(fd);
+        if (n > 0) {
+          localBytes += static_cast<uint64_t>(n);
+        }
+      }
+
+      misses.fetch_add(localMisses, std::memory_order_relaxed);
+      bytes.fetch_add(localBytes, std::memory_order_relaxed);
+    });
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  RunResult result;
+  result.seconds = std::chrono::duration<double>(end - begin).count();
+  result.ops     = static_cast<uint64_t>(ops.size()) * threadCount;
+  result.misses  = misses.load();
+  result.bytes   = bytes.load();
+  return result;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool hasValue   = i + 1 < argc;
+
+    if (arg == "--config" && hasValue) {
+      opts.config = argv[++i];
+    } else if (arg == "--synthetic" && hasValue) {
+      opts.synthetic = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--trace" && hasValue) {
+      opts.trace = argv[++i];
+    } else if (arg == "--record" && hasValue) {
+      opts.record = argv[++i];
+    } else if (arg == "--rounds" && hasValue) {
+      opts.rounds = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+    } else if (arg == "--threads" && hasValue) {
+      std::stringstream ss(argv[++i]);
+      std::string n;
+      while (std::getline(ss, n, ',')) {
+        opts.threads.push_back(static_cast<unsigned>(std::max(1, std::atoi(n.c_str()))));
+      }
+    } else {
+      return false;
+    }
+  }
+
+  if (opts.threads.empty()) {
+    const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned n = 1; n < hw; n *= 2) {
+      opts.threads.push_back(n);
+    }
+    opts.threads.push_back(hw);
+  }
+
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    std::cerr << "usage: mo2-vfs-bench [--config vfs.cfg | --synthetic FILES] "
+                 "[--trace FILE] [--record FILE] [--threads 1,2,4] [--rounds N]\n";
+    return 2;
+  }
+
+  const auto buildStart = std::chrono::steady_clock::now();
+  const VfsTree tree =
+      opts.config.empty() ? syntheticTree(opts.synthetic) : treeFromConfig(opts.config);
+  const double buildSeconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+  std::vector<TraceOp> ops;
+  if (!opts.trace.empty()) {
+    ops = loadTrace(opts.trace);
+  } else {
+    std::vector<std::string> prefix;
+    collectFiles(tree, VfsTree::Root, prefix, ops);
+  }
+
+  if (!opts.record.empty()) {
+    writeTrace(opts.record, ops);
+  }
+
+  if (ops.empty()) {
+    std::cerr << "trace is empty\n";
+    return 1;
+  }
+
+  std::printf("tree: %zu files, %zu dirs, built in %.3fs; trace: %zu ops\n",
+              tree.file_count, tree.dir_count, buildSeconds, ops.size());
+  std::printf("%8s %12s %14s %9s %8s\n", "threads", "seconds", "ops/s", "speedup",
+              "misses");
+
+  double baseline = 0;  // per-thread rate of the first run
+  for (const unsigned threads : opts.threads) {
+    // best of N rounds, each with a cold inode table
+    RunResult best;
+    for (unsigned round = 0; round < opts.rounds; ++round) {
+      const RunResult r = replay(tree, ops, threads);
+      if (best.seconds == 0 || r.seconds < best.seconds) {
+        best = r;
+      }
+    }
+
+    const double rate = static_cast<double>(best.ops) / best.seconds;
+    if (baseline == 0) {
+      baseline = rate / threads;
+    }
+
+    std::printf("%8u %12.3f %14.0f %8.2fx %8llu\n", threads, best.seconds, rate,
+                rate / baseline, static_cast<unsigned long long>(best.misses));
+  }
+
+  return 0;
+}
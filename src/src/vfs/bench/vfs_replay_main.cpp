@@ -0,0 +1,657 @@
+// Offline replay of a recorded FUSE session against the VFS handlers.
+//
+// Reads a trace written by `mo2-vfs-helper --trace` and feeds every request
+// to the mo2_* handlers from as many threads as served it, each thread in its
+// recorded order, through fuse_replay_shim instead of a mount.  The tree is
+// synthesized from the paths the trace names (sparse files of the recorded
+// sizes), so a trace taken on one machine replays anywhere, CI included.
+//
+// Usage:
+//   mo2-vfs-replay TRACE [--rounds N] [--read-mode copy|splice] [--realtime]
+//                  [--max-errors N] [--min-ops-per-sec N]
+//
+// --realtime keeps the recorded gaps between requests instead of issuing
+// them back to back, to look at latency under the original load.
+//
+// --max-errors and --min-ops-per-sec make the exit status 1 if a round saw
+// more errors, or the fastest round was slower, than that; CI replays a
+// checked-in trace with them.
+
+#include "bench/fuse_replay_shim.h"
+
+#include "inodetable.h"
+#include "mo2filesystem.h"
+#include "negativecache.h"
+#include "overwritemanager.h"
+#include "vfstrace.h"
+#include "vfstree.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+using vfstrace::Op;
+using vfstrace::TraceRecord;
+
+namespace
+{
+
+// how long a request waits for another thread to open the handle it uses
+constexpr auto HandleWait = std::chrono::seconds(2);
+
+struct Options
+{
+  std::string trace;
+  unsigned rounds = 3;
+  Mo2FsContext::ReadMode read_mode = Mo2FsContext::ReadMode::Copy;
+  bool realtime = false;
+  std::optional<uint64_t> max_errors;
+  double min_ops_per_sec = 0;
+};
+
+struct RunResult
+{
+  double seconds   = 0;
+  uint64_t ops     = 0;
+  uint64_t skipped = 0;  // node or handle unknown, or a forget
+  uint64_t errors  = 0;  // handlers that replied with an error, except
+                         // lookups of paths that were missing when recorded
+  uint64_t bytes   = 0;
+};
+
+std::vector<std::string> splitPath(const std::string& path)
+{
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= path.size()) {
+    const size_t slash = path.find('/', start);
+    const size_t end   = slash == std::string::npos ? path.size() : slash;
+    if (end > start) {
+      out.emplace_back(path, start, end - start);
+    }
+    start = end + 1;
+  }
+  return out;
+}
+
+// Backing files for every file the trace saw, created once and shared by all
+// rounds; writes never reach them since the handlers copy them to staging.
+bool createBackingFiles(const VfsTrace& trace, const fs::path& dir)
+{
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+
+  for (size_t id = 0; id < trace.paths.size(); ++id) {
+    if (trace.kinds[id] != vfstrace::PathFile) {
+      continue;
+    }
+
+    const std::string real = (dir / std::to_string(id)).string();
+    const int fd = open(real.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::cerr << "cannot create " << real << "\n";
+      return false;
+    }
+    const int rc = ftruncate(fd, static_cast<off_t>(trace.sizes[id]));
+    close(fd);
+    if (rc != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<VfsTree> treeFromTrace(const VfsTrace& trace, const fs::path& files)
+{
+  auto tree = std::make_shared<VfsTree>();
+  for (size_t id = 0; id < trace.paths.size(); ++id) {
+    const auto components = splitPath(trace.paths[id]);
+    if (components.empty()) {
+      continue;
+    }
+
+    if (trace.kinds[id] == vfstrace::PathFile) {
+      tree->insertFile(components, (files / std::to_string(id)).string(),
+                       trace.sizes[id], {}, "trace");
+      ++tree->file_count;
+    } else if (trace.kinds[id] == vfstrace::PathDirectory) {
+      tree->insertDirectory(components);
+      ++tree->dir_count;
+    }
+  }
+  return tree;
+}
+
+// State shared by the replay threads: the inode the replay got for each path
+// (what the kernel's dentry cache holds during the recording) and the handle
+// it got for each recorded one.
+class Replay
+{
+public:
+  Replay(const VfsTrace& trace, Mo2FsContext* ctx) : m_trace(trace), m_ctx(ctx) {}
+
+  void run(const std::vector<const TraceRecord*>& records, const Options& opts,
+           std::chrono::steady_clock::time_point start, RunResult& result);
+
+private:
+  const VfsTrace& m_trace;
+  Mo2FsContext* m_ctx;
+
+  std::mutex m_mutex;
+  std::condition_variable m_opened;
+  std::unordered_map<std::string, fuse_ino_t> m_inodes;
+  std::unordered_map<uint64_t, uint64_t> m_handles;
+
+  fuse_req request() { return fuse_req{.ctx = m_ctx}; }
+
+  fuse_ino_t lookup(fuse_ino_t parent, const std::string& name)
+  {
+    fuse_req req = request();
+    mo2_lookup(&req, parent, name.c_str());
+    return req.error == 0 ? req.ino : 0;
+  }
+
+  // inode of `path`, looked up one component at a time like the kernel would
+  // if it isn't known yet
+  fuse_ino_t inode(const std::string& path);
+  fuse_ino_t inode(uint32_t id)
+  {
+    return id < m_trace.paths.size() ? inode(m_trace.paths[id]) : 0;
+  }
+
+  // the parent's inode and the last component of a path
+  fuse_ino_t parentOf(uint32_t id, std::string& name);
+
+  void remember(const std::string& path, fuse_ino_t ino);
+  void forget(const std::string& path);
+
+  void opened(uint64_t traced, uint64_t fh);
+  bool handle(uint64_t traced, uint64_t& fh);
+  void closed(uint64_t traced);
+
+  // replays one record; false if it had to be skipped
+  bool replay(const TraceRecord& r, RunResult& result);
+};
+
+fuse_ino_t Replay::inode(const std::string& path)
+{
+  if (path.empty()) {
+    return InodeTable::RootInode;
+  }
+
+  {
+    std::scoped_lock lock(m_mutex);
+    if (auto it = m_inodes.find(path); it != m_inodes.end()) {
+      return it->second;
+    }
+  }
+
+  fuse_ino_t ino = InodeTable::RootInode;
+  std::string prefix;
+  for (const std::string& part : splitPath(path)) {
+    if (!prefix.empty()) {
+      prefix.push_back('/');
+    }
+    prefix += part;
+
+    {
+      std::scoped_lock lock(m_mutex);
+      if (auto it = m_inodes.find(prefix); it != m_inodes.end()) {
+        ino = it->second;
+        continue;
+      }
+    }
+
+    ino = lookup(ino, part);
+    if (ino == 0) {
+      return 0;
+    }
+    remember(prefix, ino);
+  }
+  return ino;
+}
+
+fuse_ino_t Replay::parentOf(uint32_t id, std::string& name)
+{
+  if (id >= m_trace.paths.size()) {
+    return 0;
+  }
+
+  const std::string& path = m_trace.paths[id];
+  const size_t slash      = path.rfind('/');
+  if (slash == std::string::npos) {
+    name = path;
+    return InodeTable::RootInode;
+  }
+  name = path.substr(slash + 1);
+  return inode(path.substr(0, slash));
+}
+
+void Replay::remember(const std::string& path, fuse_ino_t ino)
+{
+  std::scoped_lock lock(m_mutex);
+  m_inodes[path] = ino;
+}
+
+void Replay::forget(const std::string& path)
+{
+  std::scoped_lock lock(m_mutex);
+  m_inodes.erase(path);
+}
+
+void Replay::opened(uint64_t traced, uint64_t fh)
+{
+  {
+    std::scoped_lock lock(m_mutex);
+    m_handles[traced] = fh;
+  }
+  m_opened.notify_all();
+}
+
+bool Replay::handle(uint64_t traced, uint64_t& fh)
+{
+  std::unique_lock lock(m_mutex);
+  const bool found = m_opened.wait_for(lock, HandleWait, [&] {
+    return m_handles.contains(traced);
+  });
+  if (found) {
+    fh = m_handles[traced];
+  }
+  return found;
+}
+
+void Replay::closed(uint64_t traced)
+{
+  std::scoped_lock lock(m_mutex);
+  m_handles.erase(traced);
+}
+
+bool Replay::replay(const TraceRecord& r, RunResult& result)
+{
+  thread_local std::vector<char> zeros;
+
+  fuse_req req = request();
+  fuse_file_info fi{};
+  std::string name;
+
+  switch (r.op) {
+  case Op::Lookup: {
+    const fuse_ino_t parent = parentOf(r.path, name);
+    if (parent == 0) {
+      return false;
+    }
+    mo2_lookup(&req, parent, name.c_str());
+    if (req.error == 0) {
+      remember(m_trace.paths[r.path], req.ino);
+    } else if (req.error == ENOENT &&
+               m_trace.kinds[r.path] == vfstrace::PathMissing) {
+      return true;  // a miss the recording saw too
+    }
+    break;
+  }
+
+  case Op::Getattr: {
+    const fuse_ino_t ino = inode(r.path);
+    if (ino == 0) {
+      return false;
+    }
+    mo2_getattr(&req, ino, nullptr);
+    break;
+  }
+
+  case Op::Opendir:
+  case Op::Open: {
+    const fuse_ino_t ino = inode(r.path);
+    if (ino == 0) {
+      return false;
+    }
+    fi.flags = static_cast<int>(r.flags);
+    if (r.op == Op::Opendir) {
+      mo2_opendir(&req, ino, &fi);
+    } else {
+      mo2_open(&req, ino, &fi);
+    }
+    if (req.error == 0) {
+      opened(r.fh, fi.fh);
+    }
+    break;
+  }
+
+  case Op::Readdir:
+  case Op::Readdirplus:
+  case Op::Read:
+  case Op::Write:
+  case Op::Flush: {
+    const fuse_ino_t ino = inode(r.path);
+    if (ino == 0 || !handle(r.fh, fi.fh)) {
+      return false;
+    }
+
+    const auto off = static_cast<off_t>(r.offset);
+    if (r.op == Op::Readdir) {
+      mo2_readdir(&req, ino, r.size, off, &fi);
+    } else if (r.op == Op::Readdirplus) {
+      mo2_readdirplus(&req, ino, r.size, off, &fi);
+    } else if (r.op == Op::Read) {
+      mo2_read(&req, ino, r.size, off, &fi);
+    } else if (r.op == Op::Write) {
+      zeros.resize(std::max<size_t>(zeros.size(), r.size));
+      mo2_write(&req, ino, zeros.data(), r.size, off, &fi);
+    } else {
+      mo2_flush(&req, ino, &fi);
+    }
+    result.bytes += req.bytes;
+    break;
+  }
+
+  case Op::Releasedir:
+  case Op::Release: {
+    const fuse_ino_t ino = inode(r.path);
+    if (ino == 0 || !handle(r.fh, fi.fh)) {
+      return false;
+    }
+    if (r.op == Op::Releasedir) {
+      mo2_releasedir(&req, ino, &fi);
+    } else {
+      mo2_release(&req, ino, &fi);
+    }
+    closed(r.fh);
+    break;
+  }
+
+  case Op::Create: {
+    const fuse_ino_t parent = parentOf(r.path, name);
+    if (parent == 0) {
+      return false;
+    }
+    fi.flags = static_cast<int>(r.flags);
+    mo2_create(&req, parent, name.c_str(), 0644, &fi);
+    if (req.error == 0) {
+      remember(m_trace.paths[r.path], req.ino);
+      opened(r.fh, fi.fh);
+    }
+    break;
+  }
+
+  case Op::Mkdir: {
+    const fuse_ino_t parent = parentOf(r.path, name);
+    if (parent == 0) {
+      return false;
+    }
+    mo2_mkdir(&req, parent, name.c_str(), 0755);
+    if (req.error == 0) {
+      remember(m_trace.paths[r.path], req.ino);
+    }
+    break;
+  }
+
+  case Op::Unlink: {
+    const fuse_ino_t parent = parentOf(r.path, name);
+    if (parent == 0) {
+      return false;
+    }
+    mo2_unlink(&req, parent, name.c_str());
+    forget(m_trace.paths[r.path]);
+    break;
+  }
+
+  case Op::Rename: {
+    std::string newName;
+    const fuse_ino_t parent    = parentOf(r.path, name);
+    const fuse_ino_t newParent = parentOf(r.path2, newName);
+    if (parent == 0 || newParent == 0) {
+      return false;
+    }
+    mo2_rename(&req, parent, name.c_str(), newParent, newName.c_str(), r.flags);
+    forget(m_trace.paths[r.path]);
+    forget(m_trace.paths[r.path2]);
+    break;
+  }
+
+  case Op::Setattr: {
+    // only size changes are recorded
+    if ((r.flags & FUSE_SET_ATTR_SIZE) == 0) {
+      return false;
+    }
+    const fuse_ino_t ino = inode(r.path);
+    if (ino == 0) {
+      return false;
+    }
+    const bool withHandle = r.fh != 0 && handle(r.fh, fi.fh);
+    struct stat attr{};
+    attr.st_size = static_cast<off_t>(r.offset);
+    mo2_setattr(&req, ino, &attr, FUSE_SET_ATTR_SIZE, withHandle ? &fi : nullptr);
+    break;
+  }
+
+  case Op::Forget:
+  case Op::Path:
+  case Op::Count:
+    // the replay's lookup counts differ from the kernel's, so forgets
+    // recorded for the kernel's counts can't be applied
+    return false;
+  }
+
+  if (req.error != 0) {
+    ++result.errors;
+  }
+  return true;
+}
+
+void Replay::run(const std::vector<const TraceRecord*>& records, const Options& opts,
+                 std::chrono::steady_clock::time_point start, RunResult& result)
+{
+  for (const TraceRecord* r : records) {
+    if (opts.realtime) {
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds(r->time_ns));
+    }
+
+    if (replay(*r, result)) {
+      ++result.ops;
+    } else {
+      ++result.skipped;
+    }
+  }
+}
+
+struct Round
+{
+  std::unique_ptr<Mo2FsContext> ctx;
+  RunResult result;
+};
+
+Round runRound(const VfsTrace& trace, const Options& opts, const fs::path& work,
+               unsigned round)
+{
+  const fs::path roundDir  = work / ("round" + std::to_string(round));
+  const fs::path staging   = roundDir / "staging";
+  const fs::path overwrite = roundDir / "overwrite";
+  std::error_code ec;
+  fs::create_directories(staging, ec);
+  fs::create_directories(overwrite, ec);
+
+  Round out;
+  out.ctx            = std::make_unique<Mo2FsContext>();
+  Mo2FsContext* ctx  = out.ctx.get();
+  ctx->tree          = treeFromTrace(trace, work / "files");
+  ctx->negatives     = std::make_unique<NegativeCache>();
+  ctx->inodes        = std::make_unique<InodeTable>(
+      [negatives = ctx->negatives.get()](uint64_t ino) {
+        negatives->dropParent(ino);
+      });
+  ctx->overwrite     = std::make_unique<OverwriteManager>(staging.string(),
+                                                          overwrite.string());
+  ctx->read_mode     = opts.read_mode;
+  ctx->uid           = ::getuid();
+  ctx->gid           = ::getgid();
+
+  std::vector<std::vector<const TraceRecord*>> perThread(std::max(1u, trace.threads));
+  for (const TraceRecord& r : trace.records) {
+    perThread[r.thread].push_back(&r);
+  }
+
+  Replay replay(trace, ctx);
+  std::vector<RunResult> results(perThread.size());
+  std::vector<std::thread> threads;
+  threads.reserve(perThread.size());
+
+  const auto begin = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < perThread.size(); ++t) {
+    threads.emplace_back([&, t] {
+      replay.run(perThread[t], opts, begin, results[t]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  out.result.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  for (const RunResult& r : results) {
+    out.result.ops += r.ops;
+    out.result.skipped += r.skipped;
+    out.result.errors += r.errors;
+    out.result.bytes += r.bytes;
+  }
+
+  fs::remove_all(roundDir, ec);
+  return out;
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const bool hasValue   = i + 1 < argc;
+
+    if (arg == "--rounds" && hasValue) {
+      opts.rounds = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+    } else if (arg == "--read-mode" && hasValue) {
+      const std::string mode = argv[++i];
+      if (mode == "copy") {
+        opts.read_mode = Mo2FsContext::ReadMode::Copy;
+      } else if (mode == "splice") {
+        opts.read_mode = Mo2FsContext::ReadMode::Splice;
+      } else {
+        return false;
+      }
+    } else if (arg == "--realtime") {
+      opts.realtime = true;
+    } else if (arg == "--max-errors" && hasValue) {
+      opts.max_errors = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--min-ops-per-sec" && hasValue) {
+      opts.min_ops_per_sec = std::atof(argv[++i]);
+    } else if (opts.trace.empty() && !arg.starts_with("--")) {
+      opts.trace = arg;
+    } else {
+      return false;
+    }
+  }
+
+  return !opts.trace.empty();
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    std::cerr << "usage: mo2-vfs-replay TRACE [--rounds N] [--read-mode copy|splice] "
+                 "[--realtime] [--max-errors N] [--min-ops-per-sec N]\n";
+    return 2;
+  }
+
+  std::string error;
+  const auto trace = readVfsTrace(opts.trace, error);
+  if (!trace) {
+    std::cerr << opts.trace << ": " << error << "\n";
+    return 1;
+  }
+  if (trace->records.empty()) {
+    std::cerr << "trace is empty\n";
+    return 1;
+  }
+
+  std::string workTemplate = (fs::temp_directory_path() / "mo2-vfs-replay-XXXXXX").string();
+  if (mkdtemp(workTemplate.data()) == nullptr) {
+    std::cerr << "cannot create a work directory\n";
+    return 1;
+  }
+  const fs::path work = workTemplate;
+
+  if (!createBackingFiles(*trace, work / "files")) {
+    std::error_code ec;
+    fs::remove_all(work, ec);
+    return 1;
+  }
+
+  uint64_t lastNs = 0;
+  for (const TraceRecord& r : trace->records) {
+    lastNs = std::max(lastNs, r.time_ns);
+  }
+  const double span = static_cast<double>(lastNs) / 1e9;
+  std::printf("trace: %zu requests from %u threads over %.3fs, %zu paths\n",
+              trace->records.size(), trace->threads, span, trace->paths.size());
+  std::printf("%6s %10s %14s %9s %8s %12s\n", "round", "seconds", "ops/s", "skipped",
+              "errors", "bytes");
+
+  Round best;
+  uint64_t mostErrors = 0;
+  for (unsigned round = 0; round < opts.rounds; ++round) {
+    Round r = runRound(*trace, opts, work, round);
+    const RunResult& res = r.result;
+    mostErrors           = std::max(mostErrors, res.errors);
+    std::printf("%6u %10.3f %14.0f %9llu %8llu %12llu\n", round, res.seconds,
+                static_cast<double>(res.ops) / res.seconds,
+                static_cast<unsigned long long>(res.skipped),
+                static_cast<unsigned long long>(res.errors),
+                static_cast<unsigned long long>(res.bytes));
+
+    if (best.ctx == nullptr || res.seconds < best.result.seconds) {
+      best = std::move(r);
+    }
+  }
+
+  std::printf("\nfastest round:\n");
+  for (const std::string& line : mo2_stats_report(best.ctx.get(), 10)) {
+    std::printf("  %s\n", line.c_str());
+  }
+
+  std::error_code ec;
+  fs::remove_all(work, ec);
+
+  bool failed = false;
+  if (opts.max_errors && mostErrors > *opts.max_errors) {
+    std::printf("\nFAILED: %llu errors in a round, at most %llu allowed\n",
+                static_cast<unsigned long long>(mostErrors),
+                static_cast<unsigned long long>(*opts.max_errors));
+    failed = true;
+  }
+
+  const double bestRate =
+      static_cast<double>(best.result.ops) / best.result.seconds;
+  if (bestRate < opts.min_ops_per_sec) {
+    std::printf("\nFAILED: %.0f ops/s in the fastest round, at least %.0f required\n",
+                bestRate, opts.min_ops_per_sec);
+    failed = true;
+  }
+
+  return failed ? 1 : 0;
+}
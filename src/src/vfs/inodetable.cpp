@@ -1,99 +1,517 @@
 #include "inodetable.h"
 
-#include "vfstree.h"
-
+#include <algorithm>
 #include <vector>
 
 namespace
 {
-std::string canonicalizePath(const std::string& path)
+// Locks two shard mutexes in address order (once if they are the same).
+class PairLock
 {
-  std::string canonical = path;
-  for (char& c : canonical) {
-    if (c == '\\') {
-      c = '/';
+public:
+  PairLock(std::mutex& a, std::mutex& b)
+  {
+    std::mutex* first  = &a < &b ? &a : &b;
+    std::mutex* second = &a < &b ? &b : &a;
+    m_first            = std::unique_lock(*first);
+    if (second != first) {
+      m_second = std::unique_lock(*second);
     }
   }
 
-  while (!canonical.empty() && canonical.front() == '/') {
-    canonical.erase(canonical.begin());
+private:
+  std::unique_lock<std::mutex> m_first;
+  std::unique_lock<std::mutex> m_second;
+};
+}  // namespace
+
+InodeTable::InodeTable(std::function<void(uint64_t)> dropped)
+    : m_dropped(std::move(dropped))
+{
+  Entry& root  = m_shards[shardOf(RootInode)].entries[RootInode];
+  root.node    = VfsTree::Root;
+  root.nlookup = 1;
+}
+
+// Calls f(iterator, entryShard, keyShard) with both the shard holding the
+// entry and the shard its child key hashes to locked.  The key shard is only
+// known after reading the entry, so it is peeked first and re-checked once
+// both are held.
+template <class F>
+bool InodeTable::withEntry(uint64_t ino, F&& f)
+{
+  const size_t index = shardOf(ino);
+  Shard& shard       = m_shards[index];
+
+  for (;;) {
+    size_t keyIndex = index;
+    {
+      std::scoped_lock lock(shard.mutex);
+      auto it = shard.entries.find(ino);
+      if (it == shard.entries.end()) {
+        return false;
+      }
+      if (it->second.parent != 0) {
+        keyIndex = shardOf(keyOf(it->second));
+      }
+    }
+
+    Shard& keyShard = m_shards[keyIndex];
+    PairLock lock(shard.mutex, keyShard.mutex);
+
+    auto it = shard.entries.find(ino);
+    if (it == shard.entries.end()) {
+      return false;
+    }
+    if (it->second.parent != 0 && shardOf(keyOf(it->second)) != keyIndex) {
+      continue;
+    }
+
+    f(it, shard, keyShard);
+    return true;
   }
-  while (!canonical.empty() && canonical.back() == '/') {
-    canonical.pop_back();
+}
+
+uint64_t InodeTable::getOrCreate(uint64_t parent, std::string_view name,
+                                 std::string_view key, uint32_t hash,
+                                 const VfsTree& tree, VfsNodeId node,
+                                 uint64_t* generation)
+{
+  const ChildKey probe{parent, key, hash};
+  const size_t index = shardOf(probe);
+  Shard& shard       = m_shards[index];
+
+  uint64_t ino = 0;
+  {
+    std::scoped_lock lock(shard.mutex);
+
+    auto existing = shard.children.find(probe);
+    if (existing != shard.children.end()) {
+      ino = existing->second;
+      if (shardOf(ino) == index) {
+        Entry& e = shard.entries[ino];
+        e.node   = node;
+        e.epoch  = tree.epoch();
+        ++e.nlookup;
+        addSpelling(e, name);
+        if (generation != nullptr) {
+          *generation = e.generation;
+        }
+        return ino;
+      }
+    } else {
+      ino          = (shard.next++ << ShardBits) | index;
+      Entry& e     = shard.entries[ino];
+      e.parent     = parent;
+      e.name       = name;
+      e.key        = key;
+      e.hash       = hash;
+      e.node       = node;
+      e.epoch      = tree.epoch();
+      e.nlookup    = 1;
+      e.generation = this->generation();
+      if (generation != nullptr) {
+        *generation = e.generation;
+      }
+
+      shard.children.emplace(keyOf(e), ino);
+    }
+  }
+
+  if (shardOf(ino) == index) {
+    // new entry; the parent must outlive it
+    pin(parent);
+    return ino;
   }
 
-  return canonical;
+  // the key was renamed here from another shard
+  refresh(ino, tree, node, name, true);
+  if (generation != nullptr) {
+    const Shard& owner = m_shards[shardOf(ino)];
+    std::scoped_lock lock(owner.mutex);
+    auto it     = owner.entries.find(ino);
+    *generation = it != owner.entries.end() ? it->second.generation : this->generation();
+  }
+  return ino;
 }
-}  // namespace
 
-InodeTable::InodeTable()
+uint64_t InodeTable::find(uint64_t parent, std::string_view key, uint32_t hash) const
 {
-  m_pathToInode.emplace("", 1);
-  m_inodeToPath.emplace(1, "");
+  return peek({parent, key, hash});
 }
 
-uint64_t InodeTable::getOrCreate(const std::string& path)
+void InodeTable::refresh(uint64_t ino, const VfsTree& tree, VfsNodeId node,
+                         std::string_view name, bool counted)
 {
-  const std::string key = normalizeForLookup(path);
-  auto existing         = m_pathToInode.find(key);
-  if (existing != m_pathToInode.end()) {
-    return existing->second;
+  Shard& shard = m_shards[shardOf(ino)];
+  std::scoped_lock lock(shard.mutex);
+
+  auto it = shard.entries.find(ino);
+  if (it != shard.entries.end()) {
+    it->second.node  = node;
+    it->second.epoch = tree.epoch();
+    if (counted) {
+      ++it->second.nlookup;
+      addSpelling(it->second, name);
+    }
   }
+}
 
-  const uint64_t ino = m_nextInode++;
-  m_pathToInode.emplace(key, ino);
-  m_inodeToPath.emplace(ino, canonicalizePath(path));
-  return ino;
+void InodeTable::addSpelling(Entry& e, std::string_view name)
+{
+  if (name != e.name &&
+      std::find(e.spellings.begin(), e.spellings.end(), name) == e.spellings.end()) {
+    e.spellings.emplace_back(name);
+  }
 }
 
-std::string InodeTable::getPath(uint64_t ino) const
+void InodeTable::takeNames(Entry& e, std::string_view except,
+                           std::vector<std::string>& out)
 {
-  auto it = m_inodeToPath.find(ino);
-  if (it == m_inodeToPath.end()) {
-    return "";
+  if (e.name != except) {
+    out.push_back(e.name);
   }
-  return it->second;
+  for (std::string& s : e.spellings) {
+    if (s != except) {
+      out.push_back(std::move(s));
+    }
+  }
+  e.spellings.clear();
 }
 
-void InodeTable::rename(const std::string& old_path, const std::string& new_path)
+VfsNodeId InodeTable::node(uint64_t ino, const VfsTree& tree)
 {
-  const std::string oldCanonical = canonicalizePath(old_path);
-  const std::string newCanonical = canonicalizePath(new_path);
-  const std::string oldKey       = normalizeForLookup(oldCanonical);
-  const std::string newKey       = normalizeForLookup(newCanonical);
+  if (ino == RootInode) {
+    return VfsTree::Root;
+  }
+
+  uint64_t parent = 0;
+  std::string key;
+  uint32_t hash = 0;
+  {
+    Shard& shard = m_shards[shardOf(ino)];
+    std::scoped_lock lock(shard.mutex);
+
+    auto it = shard.entries.find(ino);
+    if (it == shard.entries.end() || it->second.parent == 0) {
+      return InvalidVfsNode;
+    }
+
+    const Entry& e = it->second;
+    if (e.epoch == tree.epoch()) {
+      return e.node;
+    }
 
-  auto it = m_pathToInode.find(oldKey);
-  if (it != m_pathToInode.end()) {
-    const uint64_t ino = it->second;
-    m_pathToInode.erase(it);
-    m_pathToInode.emplace(newKey, ino);
-    m_inodeToPath[ino] = newCanonical;
+    // stale after a rebuild or removal; resolve through the parent without
+    // holding this shard, since the parent may live in the same one
+    parent = e.parent;
+    key    = e.key;
+    hash   = e.hash;
   }
 
-  std::vector<std::pair<std::string, uint64_t>> descendants;
-  descendants.reserve(m_pathToInode.size());
+  const VfsNodeId dir = node(parent, tree);
+  if (dir == InvalidVfsNode) {
+    return InvalidVfsNode;
+  }
+
+  const VfsNodeId found = tree.findFolded(dir, key, hash);
+  if (found != InvalidVfsNode) {
+    refresh(ino, tree, found, {}, false);
+  } else {
+    // the name is gone from a live directory; if it reappears it is a
+    // different file and gets a new inode
+    detach(ino);
+  }
+
+  return found;
+}
+
+bool InodeTable::path(uint64_t ino, std::string& out) const
+{
+  out.clear();
+
+  std::vector<std::string> parts;
+  while (ino != RootInode) {
+    const Shard& shard = m_shards[shardOf(ino)];
+    std::scoped_lock lock(shard.mutex);
 
-  const std::string oldPrefix = oldKey.empty() ? oldKey : oldKey + "/";
-  for (const auto& [key, ino] : m_pathToInode) {
-    if (oldPrefix.empty() || key.rfind(oldPrefix, 0) == 0) {
-      descendants.emplace_back(key, ino);
+    auto it = shard.entries.find(ino);
+    if (it == shard.entries.end() || it->second.parent == 0) {
+      return false;
     }
+    parts.push_back(it->second.name);
+    ino = it->second.parent;
   }
 
-  for (const auto& [descKey, ino] : descendants) {
-    if (descKey == oldKey) {
+  for (auto part = parts.rbegin(); part != parts.rend(); ++part) {
+    if (!out.empty()) {
+      out.push_back('/');
+    }
+    out += *part;
+  }
+
+  return true;
+}
+
+std::vector<InodeTable::Link> InodeTable::rename(uint64_t parent, std::string_view name,
+                                                 uint64_t newparent,
+                                                 std::string_view newname)
+{
+  std::vector<Link> stale;
+
+  std::string key;
+  std::string newkey;
+  vfsFoldName(name, key);
+  vfsFoldName(newname, newkey);
+  const ChildKey source{parent, key, vfsNameHash(key)};
+  const ChildKey target{newparent, newkey, vfsNameHash(newkey)};
+
+  // Renames are rare, so simply take every shard involved, in index order.
+  // Which shards hold the two inodes is only known after peeking at the keys,
+  // so peek first, then lock everything and retry if something moved.
+  uint64_t ino      = 0;
+  uint64_t replaced = 0;
+  for (;;) {
+    ino      = peek(source);
+    replaced = peek(target);
+    if (ino == 0) {
+      return stale;
+    }
+
+    std::vector<size_t> indices = {shardOf(source), shardOf(target), shardOf(ino)};
+    if (replaced != 0) {
+      indices.push_back(shardOf(replaced));
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const size_t index : indices) {
+      locks.emplace_back(m_shards[index].mutex);
+    }
+
+    Shard& sourceShard = m_shards[shardOf(source)];
+    Shard& targetShard = m_shards[shardOf(target)];
+    auto sourceIt      = sourceShard.children.find(source);
+    auto targetIt      = targetShard.children.find(target);
+
+    if (sourceIt == sourceShard.children.end() || sourceIt->second != ino ||
+        (targetIt == targetShard.children.end()) != (replaced == 0) ||
+        (replaced != 0 && targetIt->second != replaced)) {
       continue;
     }
 
-    const std::string suffix = descKey.substr(oldPrefix.size());
-    const std::string nextKey = newKey.empty() ? suffix : newKey + "/" + suffix;
-    m_pathToInode.erase(descKey);
-    m_pathToInode.emplace(nextKey, ino);
+    if (replaced == ino) {
+      // only the spelling changed, which the entry picks up below
+      targetIt = targetShard.children.end();
+      replaced = 0;
+    }
 
-    auto inodeIt = m_inodeToPath.find(ino);
-    if (inodeIt != m_inodeToPath.end()) {
-      const std::string suffixCanonical = inodeIt->second.substr(oldCanonical.size());
-      inodeIt->second = newCanonical + suffixCanonical;
+    sourceShard.children.erase(sourceIt);
+
+    // whatever was at the destination is replaced; its inode stays valid for
+    // the kernel but no longer resolves to anything
+    if (targetIt != targetShard.children.end()) {
+      targetShard.children.erase(targetIt);
+
+      Shard& replacedShard = m_shards[shardOf(replaced)];
+      auto replacedIt      = replacedShard.entries.find(replaced);
+      if (replacedIt != replacedShard.entries.end()) {
+        Link& link = stale.emplace_back(Link{replaced, newparent, {}});
+        takeNames(replacedIt->second, newname, link.names);
+        replacedIt->second.parent = 0;
+        if (replacedIt->second.nlookup == 0 && replacedIt->second.children == 0) {
+          replacedShard.entries.erase(replacedIt);
+        }
+      }
+    }
+
+    // descendants only reference their parent inode, so they follow along;
+    // other spellings of a moved name are gone, those of a name that only
+    // changed case still find the inode
+    Entry& e = m_shards[shardOf(ino)].entries[ino];
+    if (e.parent != newparent || e.key != newkey) {
+      Link& link = stale.emplace_back(Link{ino, parent, {}});
+      takeNames(e, name, link.names);
+    } else if (e.name != newname) {
+      e.spellings.push_back(e.name);
+      std::erase(e.spellings, newname);
+    }
+    e.parent = newparent;
+    e.name   = newname;
+    e.key    = newkey;
+    e.hash   = target.hash;
+    e.epoch  = 0;
+
+    targetShard.children.emplace(keyOf(e), ino);
+    break;
+  }
+
+  // move the pin before dropping the old ones so newparent can't be freed in
+  // between
+  if (parent != newparent) {
+    pin(newparent);
+    unpin(parent);
+  }
+  if (replaced != 0) {
+    unpin(newparent);
+    dropped(replaced);
+  }
+
+  std::erase_if(stale, [](const Link& l) { return l.names.empty(); });
+  return stale;
+}
+
+std::vector<std::string> InodeTable::remove(uint64_t parent, std::string_view name)
+{
+  std::string key;
+  vfsFoldName(name, key);
+
+  std::vector<std::string> names;
+  const uint64_t ino = peek({parent, key, vfsNameHash(key)});
+  if (ino != 0) {
+    detach(ino, &names);
+    std::erase(names, name);
+  }
+  return names;
+}
+
+void InodeTable::forget(uint64_t ino, uint64_t nlookup)
+{
+  if (ino == RootInode) {
+    return;
+  }
+
+  uint64_t parent = 0;
+  bool freed      = false;
+  withEntry(ino, [&](auto it, Shard& shard, Shard& keyShard) {
+    Entry& e  = it->second;
+    e.nlookup = e.nlookup > nlookup ? e.nlookup - nlookup : 0;
+    if (e.nlookup != 0 || e.children != 0) {
+      return;
+    }
+
+    if (e.parent != 0) {
+      keyShard.children.erase(keyOf(e));
+      parent = e.parent;
+    }
+    shard.entries.erase(it);
+    freed = true;
+  });
+
+  if (freed) {
+    dropped(ino);
+  }
+  if (parent != 0) {
+    unpin(parent);
+  }
+}
+
+void InodeTable::detach(uint64_t ino, std::vector<std::string>* names)
+{
+  uint64_t parent = 0;
+  withEntry(ino, [&](auto it, Shard& shard, Shard& keyShard) {
+    Entry& e = it->second;
+    if (e.parent == 0) {
+      return;
+    }
+
+    if (names != nullptr) {
+      takeNames(e, {}, *names);
+    }
+
+    keyShard.children.erase(keyOf(e));
+    parent   = e.parent;
+    e.parent = 0;
+
+    if (e.nlookup == 0 && e.children == 0) {
+      shard.entries.erase(it);
+    }
+  });
+
+  if (parent != 0) {
+    dropped(ino);
+    unpin(parent);
+  }
+}
+
+void InodeTable::pin(uint64_t ino)
+{
+  Shard& shard = m_shards[shardOf(ino)];
+  std::scoped_lock lock(shard.mutex);
+
+  auto it = shard.entries.find(ino);
+  if (it != shard.entries.end()) {
+    ++it->second.children;
+  }
+}
+
+void InodeTable::unpin(uint64_t ino)
+{
+  // freeing an entry unpins its parent in turn
+  while (ino != 0 && ino != RootInode) {
+    uint64_t parent = 0;
+    bool freed      = false;
+    withEntry(ino, [&](auto it, Shard& shard, Shard& keyShard) {
+      Entry& e = it->second;
+      if (e.children > 0) {
+        --e.children;
+      }
+      if (e.nlookup != 0 || e.children != 0) {
+        return;
+      }
+
+      if (e.parent != 0) {
+        keyShard.children.erase(keyOf(e));
+        parent = e.parent;
+      }
+      shard.entries.erase(it);
+      freed = true;
+    });
+    if (freed) {
+      dropped(ino);
+    }
+    ino = parent;
+  }
+}
+
+void InodeTable::dropped(uint64_t ino) const
+{
+  if (m_dropped) {
+    m_dropped(ino);
+  }
+}
+
+uint64_t InodeTable::peek(const ChildKey& key) const
+{
+  const Shard& shard = m_shards[shardOf(key)];
+  std::scoped_lock lock(shard.mutex);
+
+  auto it = shard.children.find(key);
+  return it == shard.children.end() ? 0 : it->second;
+}
+
+size_t InodeTable::size() const
+{
+  size_t total = 0;
+  for (const Shard& shard : m_shards) {
+    std::scoped_lock lock(shard.mutex);
+    total += shard.entries.size();
+  }
+  return total;
+}
+
+std::vector<InodeTable::Link> InodeTable::links() const
+{
+  std::vector<Link> out;
+  for (const Shard& shard : m_shards) {
+    std::scoped_lock lock(shard.mutex);
+    for (const auto& [ino, e] : shard.entries) {
+      if (e.parent != 0) {
+        Link& link = out.emplace_back(Link{ino, e.parent, {e.name}});
+        link.names.insert(link.names.end(), e.spellings.begin(), e.spellings.end());
+      }
     }
   }
+  return out;
 }
@@ -1,23 +1,181 @@
 #ifndef VFS_INODETABLE_H
 #define VFS_INODETABLE_H
 
+#include "vfstree.h"
+
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
+// Maps FUSE inode numbers to (parent inode, name) pairs and caches the tree
+// node each one currently resolves to, so lookups and getattr never build or
+// split path strings.  Paths are only reconstructed, from the parent chain,
+// for operations that touch the real filesystem.
+//
+// The kernel caches an entry per spelling it asked for, while the tree and
+// this table are case-insensitive, so each entry also keeps the other
+// spellings it was handed out under; all of them have to be invalidated once
+// the name goes or changes.
+//
+// Entries are reference counted the way the kernel expects: every entry reply
+// adds a lookup, FUSE forget drops them, and an entry is freed once the
+// kernel has forgotten it and no remembered child still needs it for its
+// path.  Names that disappear (unlink, rename over, gone after a rebuild) are
+// detached, so if they come back they get a fresh inode instead of reviving
+// the old one.
+//
+// The table is internally synchronized and split into shards with their own
+// locks so the multithreaded FUSE loop doesn't serialize on it.  The low bits
+// of an inode number are its shard, and a new inode is placed in the shard its
+// (parent, name) key hashes to, so the common lookup touches a single lock.
 class InodeTable
 {
 public:
-  InodeTable();
+  static constexpr uint64_t RootInode = 1;
+
+  // `dropped` is called with every inode that stops resolving, because the
+  // kernel forgot it or its name was detached, after the table's locks are
+  // released.
+  explicit InodeTable(std::function<void(uint64_t)> dropped = {});
+
+  InodeTable(const InodeTable&)            = delete;
+  InodeTable& operator=(const InodeTable&) = delete;
+
+  // Inode for `name` inside `parent`, created on first use, with one more
+  // kernel lookup counted against it.  `key` and `hash` are the folded name
+  // and its vfsNameHash(); `node` is the child's id in `tree` and is cached on
+  // the entry.
+  uint64_t getOrCreate(uint64_t parent, std::string_view name, std::string_view key,
+                       uint32_t hash, const VfsTree& tree, VfsNodeId node,
+                       uint64_t* generation = nullptr);
+
+  // Existing inode for the name, or 0; doesn't count a lookup.
+  uint64_t find(uint64_t parent, std::string_view key, uint32_t hash) const;
+
+  // Tree node for the inode.  The cached id is used while the tree's epoch is
+  // unchanged, otherwise it is re-resolved through the parents.  Returns
+  // InvalidVfsNode for unknown inodes or ones that no longer exist.
+  VfsNodeId node(uint64_t ino, const VfsTree& tree);
+
+  // Relative path of the inode; false if it is unknown or was detached by a
+  // rename over it.
+  bool path(uint64_t ino, std::string& out) const;
+
+  struct Link
+  {
+    uint64_t ino;
+    uint64_t parent;
+    std::vector<std::string> names;  // every spelling handed out, first is the
+                                     // one the path is built from
+  };
+
+  // Returns the spellings the kernel may still have cached for the moved
+  // inode and for one it replaced, besides the two names it renamed itself.
+  std::vector<Link> rename(uint64_t parent, std::string_view name,
+                           uint64_t newparent, std::string_view newname);
+
+  // The name was deleted; its inode stays valid until forgotten.  Returns the
+  // spellings other than `name` the kernel may still have cached for it.
+  std::vector<std::string> remove(uint64_t parent, std::string_view name);
+
+  // drops `nlookup` kernel references, freeing the entry when none are left
+  void forget(uint64_t ino, uint64_t nlookup);
+
+  // Generation reported with new inodes.  Advanced on every tree rebuild so
+  // (inode, generation) pairs from before a rebuild are recognizably stale.
+  uint64_t generation() const { return m_generation.load(std::memory_order_relaxed); }
+  void advanceGeneration() { m_generation.fetch_add(1, std::memory_order_relaxed); }
+
+  size_t size() const;
 
-  uint64_t getOrCreate(const std::string& path);
-  std::string getPath(uint64_t ino) const;
-  void rename(const std::string& old_path, const std::string& new_path);
+  // Every attached inode with the names the kernel knows it by, for telling
+  // the kernel which of its cached entries a tree change invalidated.
+  std::vector<Link> links() const;
 
 private:
-  std::unordered_map<std::string, uint64_t> m_pathToInode;
-  std::unordered_map<uint64_t, std::string> m_inodeToPath;
-  uint64_t m_nextInode = 2;
+  static constexpr unsigned ShardBits = 6;
+  static constexpr size_t ShardCount  = size_t(1) << ShardBits;
+
+  struct Entry
+  {
+    uint64_t parent = 0;  // 0 once detached
+    std::string name;
+    std::vector<std::string> spellings;  // other names handed out for `key`
+    std::string key;
+    uint32_t hash       = 0;
+    VfsNodeId node      = InvalidVfsNode;
+    uint64_t epoch      = 0;
+    uint64_t nlookup    = 0;  // kernel references
+    uint32_t children   = 0;  // attached child entries, which need our path
+    uint64_t generation = 0;
+  };
+
+  // views into Entry::key for stored keys, into the caller's buffer for probes
+  struct ChildKey
+  {
+    uint64_t parent;
+    std::string_view key;
+    uint32_t hash;
+
+    bool operator==(const ChildKey& o) const
+    {
+      return parent == o.parent && key == o.key;
+    }
+  };
+
+  struct ChildKeyHash
+  {
+    size_t operator()(const ChildKey& k) const
+    {
+      return static_cast<size_t>(k.parent * 0x9E3779B97F4A7C15ull) ^ k.hash;
+    }
+  };
+
+  // A shard owns the entries whose inode number maps to it and the child keys
+  // that hash to it.  These are the same shard until a rename moves a key.
+  // Aligned so neighbouring locks don't share a cache line.
+  struct alignas(64) Shard
+  {
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::unordered_map<ChildKey, uint64_t, ChildKeyHash> children;
+    uint64_t next = 1;
+  };
+
+  std::array<Shard, ShardCount> m_shards;
+  std::atomic<uint64_t> m_generation{1};
+  std::function<void(uint64_t)> m_dropped;
+
+  static size_t shardOf(uint64_t ino) { return ino & (ShardCount - 1); }
+  static size_t shardOf(const ChildKey& key)
+  {
+    return (ChildKeyHash{}(key) >> 16) & (ShardCount - 1);
+  }
+
+  static ChildKey keyOf(const Entry& e) { return {e.parent, e.key, e.hash}; }
+
+  static void addSpelling(Entry& e, std::string_view name);
+
+  // moves the entry's spellings other than `except` into `out`
+  static void takeNames(Entry& e, std::string_view except,
+                        std::vector<std::string>& out);
+
+  template <class F>
+  bool withEntry(uint64_t ino, F&& f);
+
+  uint64_t peek(const ChildKey& key) const;
+  void refresh(uint64_t ino, const VfsTree& tree, VfsNodeId node,
+               std::string_view name, bool counted);
+  void detach(uint64_t ino, std::vector<std::string>* names = nullptr);
+  void pin(uint64_t ino);
+  void unpin(uint64_t ino);
+  void dropped(uint64_t ino) const;
 };
 
 #endif
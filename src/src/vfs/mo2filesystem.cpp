@@ -1,20 +1,31 @@
 #include "mo2filesystem.h"
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <chrono>
 #include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <string_view>
+#include <vector>
 
 namespace
 {
 namespace fs = std::filesystem;
 
-constexpr double TTL_SECONDS = 1.0;
+// Nothing changes behind the kernel's back without an invalidation (see
+// invalidateChanged), so entries and attributes can be cached for long.
+constexpr double TTL_SECONDS = 24 * 60 * 60;
+
+// d_ino for directory entries that have no inode yet (same value libfuse's
+// high-level API uses)
+constexpr fuse_ino_t UNKNOWN_INO = 0xffffffff;
 
 struct NodeSnapshot
 {
@@ -31,6 +42,38 @@ Mo2FsContext* getContext(fuse_req_t req)
   return static_cast<Mo2FsContext*>(fuse_req_userdata(req));
 }
 
+// Tree lock acquisition; only one that has to wait reads the clock.
+std::shared_lock<std::shared_mutex> readTree(const Mo2FsContext* ctx)
+{
+  std::shared_lock lock(ctx->tree_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    const auto start = std::chrono::steady_clock::now();
+    lock.lock();
+    ctx->stats.addLockWait(std::chrono::steady_clock::now() - start);
+  }
+  return lock;
+}
+
+std::unique_lock<std::shared_mutex> writeTree(const Mo2FsContext* ctx)
+{
+  std::unique_lock lock(ctx->tree_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    const auto start = std::chrono::steady_clock::now();
+    lock.lock();
+    ctx->stats.addLockWait(std::chrono::steady_clock::now() - start);
+  }
+  return lock;
+}
+
+// counts a copy-on-write into staging that just produced `staged`
+void recordCopy(const Mo2FsContext* ctx, const std::string& staged)
+{
+  struct stat st;
+  if (::stat(staged.c_str(), &st) == 0) {
+    ctx->stats.addCopy(static_cast<uint64_t>(st.st_size));
+  }
+}
+
 std::vector<std::string> splitPath(const std::string& path)
 {
   std::vector<std::string> out;
@@ -67,58 +110,237 @@ std::string joinPath(const std::string& base, const std::string& name)
 
 std::string inodeToPath(const Mo2FsContext* ctx, fuse_ino_t ino, bool* ok)
 {
-  std::scoped_lock lock(ctx->inode_mutex);
-  const std::string path = ctx->inodes->getPath(ino);
+  std::string path;
+  *ok = ctx->inodes->path(ino, path);
+  return path;
+}
 
-  if (ino == 1) {
-    *ok = true;
-    return "";
+// withRealPath is only needed by handlers that open the file; lookups and
+// getattr skip rebuilding it.
+NodeSnapshot snapshotForNode(const VfsTree& tree, const VfsNode& node, bool withRealPath)
+{
+  NodeSnapshot snap;
+  snap.found        = true;
+  snap.is_directory = node.is_directory;
+  if (!node.is_directory) {
+    if (withRealPath) {
+      snap.real_path = tree.realPath(node);
+    }
+    snap.size       = node.file_info.size;
+    snap.mtime      = node.file_info.mtime;
+    snap.is_backing = tree.isBacking(node);
   }
+  return snap;
+}
 
-  *ok = !path.empty();
-  return path;
+NodeSnapshot snapshotForInode(const Mo2FsContext* ctx, fuse_ino_t ino, bool withRealPath)
+{
+  auto lock = readTree(ctx);
+
+  const VfsTree& tree = *ctx->tree;
+  const VfsNodeId id  = ctx->inodes->node(ino, tree);
+  if (id == InvalidVfsNode) {
+    return {};
+  }
+
+  return snapshotForNode(tree, tree.node(id), withRealPath);
+}
+
+// A failed lookup that may be answered with a negative entry.  It is recorded
+// in the negative cache under the same tree lock that found the name
+// missing, so a patch or create can't land in between and leave the kernel
+// with an entry nobody invalidates.
+struct Miss
+{
+  bool cached = false;
+  std::vector<NegativeCache::Name> evicted;  // to invalidate after replying
+};
+
+// Resolves `name` inside `parent` with a single child lookup and returns its
+// inode (0 if it doesn't exist, recorded in `miss` if given).  The folded
+// name lives in a per-thread buffer, so the common case doesn't allocate.  A
+// kernel lookup is counted on the inode, so the caller must follow up with an
+// entry reply.
+fuse_ino_t lookupChild(const Mo2FsContext* ctx, fuse_ino_t parent, const char* name,
+                       NodeSnapshot* snap, uint64_t* generation, Miss* miss = nullptr)
+{
+  thread_local std::string key;
+  vfsFoldName(name, key);
+  const uint32_t hash = vfsNameHash(key);
+
+  auto lock = readTree(ctx);
+
+  const VfsTree& tree = *ctx->tree;
+  const VfsNodeId dir = ctx->inodes->node(parent, tree);
+  if (dir == InvalidVfsNode) {
+    return 0;
+  }
+
+  const VfsNodeId child = tree.findFolded(dir, key, hash);
+  if (child == InvalidVfsNode) {
+    if (miss != nullptr && ctx->session.load(std::memory_order_acquire) != nullptr) {
+      miss->cached  = true;
+      miss->evicted = ctx->negatives->add(parent, name, key, hash);
+    }
+    return 0;
+  }
+
+  *snap = snapshotForNode(tree, tree.node(child), false);
+  return ctx->inodes->getOrCreate(parent, name, key, hash, tree, child, generation);
 }
 
 NodeSnapshot snapshotForPath(const Mo2FsContext* ctx, const std::string& path)
 {
-  NodeSnapshot snap;
-  std::shared_lock lock(ctx->tree_mutex);
+  auto lock = readTree(ctx);
 
-  const VfsNode* node = path.empty() ? &ctx->tree->root : ctx->tree->root.resolve(splitPath(path));
+  const VfsNode* node = path.empty() ? &ctx->tree->root() : ctx->tree->resolve(splitPath(path));
   if (node == nullptr) {
-    return snap;
+    return {};
   }
 
-  snap.found        = true;
-  snap.is_directory = node->is_directory;
-  if (!node->is_directory) {
-    snap.real_path  = node->file_info.real_path;
-    snap.size       = node->file_info.size;
-    snap.mtime      = node->file_info.mtime;
-    snap.is_backing = node->file_info.is_backing;
+  return snapshotForNode(*ctx->tree, *node, true);
+}
+
+// An inode the kernel may have cached, with what it resolved to before a tree
+// change.
+struct CachedInode
+{
+  InodeTable::Link link;
+  NodeSnapshot snap;
+};
+
+struct Invalidation
+{
+  fuse_ino_t ino    = 0;
+  fuse_ino_t parent = 0;
+  std::string name;
+  bool entry = false;  // the name is gone or changed type, not just its data
+};
+
+// Caller holds the tree lock.  Empty when there is no session to notify.
+std::vector<CachedInode> cachedInodes(Mo2FsContext* ctx)
+{
+  std::vector<CachedInode> cached;
+  if (ctx->session.load(std::memory_order_acquire) == nullptr) {
+    return cached;
   }
 
-  return snap;
+  const VfsTree& tree = *ctx->tree;
+  for (InodeTable::Link& link : ctx->inodes->links()) {
+    const VfsNodeId id = ctx->inodes->node(link.ino, tree);
+    if (id != InvalidVfsNode) {
+      NodeSnapshot snap = snapshotForNode(tree, tree.node(id), true);
+      cached.push_back({std::move(link), std::move(snap)});
+    }
+  }
+  return cached;
 }
 
-std::vector<std::pair<std::string, bool>> listChildrenSnapshot(
-    const Mo2FsContext* ctx, const std::string& path, bool* ok)
+// Caller holds the tree lock, which now guards the changed tree.  Of the
+// names that are new, only those the kernel holds a negative entry for need
+// invalidating; directory listings aren't cached.
+std::vector<Invalidation> staleInodes(Mo2FsContext* ctx, std::vector<CachedInode> cached)
 {
-  std::vector<std::pair<std::string, bool>> out;
-  std::shared_lock lock(ctx->tree_mutex);
+  std::vector<Invalidation> stale;
+
+  const VfsTree& tree = *ctx->tree;
+  for (CachedInode& c : cached) {
+    const VfsNodeId id = ctx->inodes->node(c.link.ino, tree);
+    const NodeSnapshot now =
+        id == InvalidVfsNode ? NodeSnapshot{} : snapshotForNode(tree, tree.node(id), true);
+
+    if (!now.found || now.is_directory != c.snap.is_directory) {
+      // every spelling the kernel was given is a cached entry of its own
+      for (size_t i = 0; i < c.link.names.size(); ++i) {
+        stale.push_back({i == 0 ? c.link.ino : 0, c.link.parent,
+                         std::move(c.link.names[i]), true});
+      }
+    } else if (!now.is_directory &&
+               (now.size != c.snap.size || now.mtime != c.snap.mtime ||
+                now.real_path != c.snap.real_path)) {
+      stale.push_back({c.link.ino, c.link.parent, {}, false});
+    }
+  }
 
-  const VfsNode* node = path.empty() ? &ctx->tree->root : ctx->tree->root.resolve(splitPath(path));
-  if (node == nullptr || !node->is_directory) {
-    *ok = false;
-    return out;
+  if (ctx->session.load(std::memory_order_acquire) != nullptr) {
+    const VfsTree& tree = *ctx->tree;
+    auto appeared = ctx->negatives->takeExisting(
+        [&](uint64_t parent, std::string_view key, uint32_t hash) {
+          const VfsNodeId dir = ctx->inodes->node(parent, tree);
+          return dir != InvalidVfsNode && tree.findFolded(dir, key, hash) != InvalidVfsNode;
+        });
+    for (NegativeCache::Name& n : appeared) {
+      stale.push_back({0, n.parent, std::move(n.name), true});
+    }
   }
 
-  *ok = true;
-  for (const auto& [name, child] : node->listChildren()) {
-    out.emplace_back(name, child->is_directory);
+  return stale;
+}
+
+// Must run without the tree lock: the kernel may call back into the
+// filesystem while it processes a notification.
+void invalidateKernelCache(Mo2FsContext* ctx, const std::vector<Invalidation>& stale)
+{
+  struct fuse_session* session = ctx->session.load(std::memory_order_acquire);
+  if (session == nullptr) {
+    return;
   }
 
-  return out;
+  for (const Invalidation& inv : stale) {
+    // ENOENT only means the kernel already dropped it
+    if (inv.entry) {
+      fuse_lowlevel_notify_inval_entry(session, inv.parent, inv.name.c_str(),
+                                       inv.name.size());
+    }
+    if (inv.ino != 0) {
+      fuse_lowlevel_notify_inval_inode(session, inv.ino, 0, 0);
+    }
+  }
+}
+
+// Answers a failed lookup with a negative entry the kernel keeps until
+// invalidated, or with a plain ENOENT if the miss wasn't recorded.  Names
+// evicted to make room are invalidated afterwards, since nothing else will.
+void replyNegative(fuse_req_t req, Mo2FsContext* ctx, const Miss& miss)
+{
+  if (!miss.cached) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  std::memset(&e, 0, sizeof(e));
+  e.ino           = 0;
+  e.entry_timeout = TTL_SECONDS;
+  fuse_reply_entry(req, &e);
+
+  struct fuse_session* session = ctx->session.load(std::memory_order_acquire);
+  if (session == nullptr) {
+    return;
+  }
+
+  for (const NegativeCache::Name& n : miss.evicted) {
+    fuse_lowlevel_notify_inval_entry(session, n.parent, n.name.c_str(), n.name.size());
+  }
+}
+
+// `name` was just created in `parent` by the kernel, which doesn't know that
+// its other casings now exist too.  Call after replying: the kernel holds
+// the directory while the operation is in flight.
+void dropNegatives(Mo2FsContext* ctx, fuse_ino_t parent, const char* name)
+{
+  struct fuse_session* session = ctx->session.load(std::memory_order_acquire);
+  if (session == nullptr || ctx->negatives->size() == 0) {
+    return;
+  }
+
+  std::string key;
+  vfsFoldName(name, key);
+  for (const NegativeCache::Name& n : ctx->negatives->take(parent, key, vfsNameHash(key))) {
+    if (n.name != name) {
+      fuse_lowlevel_notify_inval_entry(session, parent, n.name.c_str(), n.name.size());
+    }
+  }
 }
 
 void fillStatForDir(struct stat* st, fuse_ino_t ino, uid_t uid, gid_t gid)
@@ -150,29 +372,151 @@ void fillStatForFile(struct stat* st, fuse_ino_t ino, uid_t uid, gid_t gid,
   st->st_atim.tv_sec = secs.count();
 }
 
-void replyEntryFromSnapshot(fuse_req_t req, const Mo2FsContext* ctx, fuse_ino_t ino,
-                            const NodeSnapshot& snap)
+void fillEntry(struct fuse_entry_param* e, const Mo2FsContext* ctx, fuse_ino_t ino,
+               uint64_t generation, const NodeSnapshot& snap)
 {
-  struct fuse_entry_param e;
-  std::memset(&e, 0, sizeof(e));
-  e.ino           = ino;
-  e.attr_timeout  = TTL_SECONDS;
-  e.entry_timeout = TTL_SECONDS;
+  std::memset(e, 0, sizeof(*e));
+  e->ino           = ino;
+  e->generation    = generation;
+  e->attr_timeout  = TTL_SECONDS;
+  e->entry_timeout = TTL_SECONDS;
 
   if (snap.is_directory) {
-    fillStatForDir(&e.attr, ino, ctx->uid, ctx->gid);
+    fillStatForDir(&e->attr, ino, ctx->uid, ctx->gid);
   } else {
-    fillStatForFile(&e.attr, ino, ctx->uid, ctx->gid, snap.size, snap.mtime);
+    fillStatForFile(&e->attr, ino, ctx->uid, ctx->gid, snap.size, snap.mtime);
   }
+}
 
+void replyEntryFromSnapshot(fuse_req_t req, const Mo2FsContext* ctx, fuse_ino_t ino,
+                            uint64_t generation, const NodeSnapshot& snap)
+{
+  struct fuse_entry_param e;
+  fillEntry(&e, ctx, ino, generation, snap);
   fuse_reply_entry(req, &e);
 }
 
+// The children of a directory as they were at opendir.  readdir and
+// readdirplus page through it by index, so a big directory is listed once
+// per open instead of once per buffer the kernel asks for.  Names created
+// after opendir show up on the next one; names removed since are skipped by
+// readdirplus, which has to hand out inodes for them.
+//
+// Owned by the kernel's directory handle through fi->fh; nothing else refers
+// to it, so unlike OpenFile it needs no table.
+struct DirHandle
+{
+  struct Entry
+  {
+    std::string name;
+    VfsNodeId node;  // valid while the tree's epoch is `epoch`
+    uint32_t hash;
+    bool is_directory;
+  };
+
+  uint64_t epoch = 0;
+  std::vector<Entry> entries;
+};
+
+// "." and ".." come first; an offset is the index of the next entry
+constexpr size_t DirHandleDots = 2;
+
+DirHandle* dirHandle(const struct fuse_file_info* fi)
+{
+  return fi == nullptr ? nullptr : reinterpret_cast<DirHandle*>(fi->fh);
+}
+
+// Current node and key of a snapshotted child.  Caller holds the tree lock;
+// `dir` is only needed (and only resolved by the caller) once the epoch
+// moved on.
+VfsNodeId currentChild(const VfsTree& tree, VfsNodeId dir, const DirHandle& handle,
+                       const DirHandle::Entry& entry, std::string& keyBuf,
+                       std::string_view& key)
+{
+  if (handle.epoch == tree.epoch()) {
+    key = tree.key(tree.node(entry.node));
+    return entry.node;
+  }
+
+  if (dir == InvalidVfsNode) {
+    return InvalidVfsNode;
+  }
+
+  vfsFoldName(entry.name, keyBuf);
+  key = keyBuf;
+  return tree.findFolded(dir, key, entry.hash);
+}
+
+void fillDotEntry(struct stat* st, size_t index, fuse_ino_t ino)
+{
+  std::memset(st, 0, sizeof(*st));
+  st->st_ino  = index == 0 ? ino : 1;
+  st->st_mode = S_IFDIR | 0755;
+}
+
 bool isWritableOpen(int flags)
 {
   return (flags & O_WRONLY) != 0 || (flags & O_RDWR) != 0;
 }
 
+int openRealFile(const Mo2FsContext* ctx, const std::string& realPath,
+                 bool isBacking, bool writable)
+{
+  const int flags = (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+  if (isBacking && ctx->backing_dir_fd >= 0) {
+    return openat(ctx->backing_dir_fd, realPath.c_str(), flags);
+  }
+  return open(realPath.c_str(), flags);
+}
+
+std::shared_ptr<Mo2FsContext::OpenFile> findOpenFile(const Mo2FsContext* ctx,
+                                                     uint64_t fh)
+{
+  std::scoped_lock lock(ctx->open_files_mutex);
+  auto it = ctx->open_files.find(fh);
+  if (it == ctx->open_files.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+uint64_t registerOpenFile(Mo2FsContext* ctx,
+                          std::shared_ptr<Mo2FsContext::OpenFile> file)
+{
+  const uint64_t fh = ctx->next_fh.fetch_add(1, std::memory_order_relaxed);
+  std::scoped_lock lock(ctx->open_files_mutex);
+  ctx->open_files[fh] = std::move(file);
+  return fh;
+}
+
+Mo2FsContext::ReadMode readModeLimit()
+{
+  const char* env = std::getenv("MO2_VFS_READ_MODE");
+  if (env == nullptr) {
+    return Mo2FsContext::ReadMode::Passthrough;
+  }
+
+  const std::string_view mode(env);
+  if (mode == "copy") {
+    return Mo2FsContext::ReadMode::Copy;
+  }
+  if (mode == "splice") {
+    return Mo2FsContext::ReadMode::Splice;
+  }
+  return Mo2FsContext::ReadMode::Passthrough;
+}
+
+// Per-worker read buffer; grows to the largest request seen and is then
+// reused, so steady-state reads don't allocate.
+char* threadReadBuffer(size_t size)
+{
+  thread_local std::vector<char> buffer;
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+  return buffer.data();
+}
+
 std::chrono::system_clock::time_point fileMtimeOrNow(const std::string& path)
 {
   std::error_code ec;
@@ -194,13 +538,112 @@ void updateFileNode(Mo2FsContext* ctx, const std::string& relative,
   const uint64_t size = static_cast<uint64_t>(fs::file_size(realPath, ec));
   const auto mtime    = fileMtimeOrNow(realPath);
 
-  std::unique_lock lock(ctx->tree_mutex);
-  ctx->tree->root.insertFile(splitPath(relative), realPath, ec ? 0 : size, mtime,
-                             origin);
+  auto lock = writeTree(ctx);
+  ctx->tree->insertFile(splitPath(relative), realPath, ec ? 0 : size, mtime, origin);
+}
+
+void markDirty(Mo2FsContext* ctx, Mo2FsContext::OpenFile& file)
+{
+  if (!file.dirty.exchange(true, std::memory_order_acq_rel)) {
+    ctx->dirty_files.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// Puts the size and mtime that writes through `file` left on disk into the
+// tree.  Skipped if the path was renamed or removed since, so a late release
+// can't bring the old name back.
+void commitWrites(Mo2FsContext* ctx, Mo2FsContext::OpenFile& file)
+{
+  if (!file.dirty.exchange(false, std::memory_order_acq_rel)) {
+    return;
+  }
+  ctx->dirty_files.fetch_sub(1, std::memory_order_relaxed);
+
+  struct stat st;
+  if (fstat(file.fd, &st) != 0) {
+    return;
+  }
+
+  const auto mtime = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::seconds(st.st_mtim.tv_sec) +
+          std::chrono::nanoseconds(st.st_mtim.tv_nsec)));
+  const auto components = splitPath(file.relative_path);
+
+  auto lock = writeTree(ctx);
+  const VfsNode* node = ctx->tree->resolve(components);
+  if (node == nullptr || node->is_directory ||
+      ctx->tree->realPath(*node) != file.real_path) {
+    return;
+  }
+  ctx->tree->insertFile(components, file.real_path, static_cast<uint64_t>(st.st_size),
+                        mtime, "Staging");
+}
+
+// Commits every dirty handle on `ino`, or on any inode if `ino` is 0; true if
+// there was one.
+bool commitPendingWrites(Mo2FsContext* ctx, fuse_ino_t ino)
+{
+  if (ctx->dirty_files.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+
+  std::vector<std::shared_ptr<Mo2FsContext::OpenFile>> pending;
+  {
+    std::scoped_lock lock(ctx->open_files_mutex);
+    for (const auto& [fh, file] : ctx->open_files) {
+      if ((ino == 0 || file->ino == ino) &&
+          file->dirty.load(std::memory_order_acquire)) {
+        pending.push_back(file);
+      }
+    }
+  }
+
+  for (const auto& file : pending) {
+    commitWrites(ctx, *file);
+  }
+  return !pending.empty();
 }
 
 }  // namespace
 
+Mo2FsContext::OpenFile::~OpenFile()
+{
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void mo2_init(void* userdata, struct fuse_conn_info* conn)
+{
+  auto* ctx = static_cast<Mo2FsContext*>(userdata);
+  if (ctx == nullptr || conn == nullptr) {
+    return;
+  }
+
+  using ReadMode      = Mo2FsContext::ReadMode;
+  const ReadMode limit = readModeLimit();
+  ctx->read_mode       = ReadMode::Copy;
+
+  if (limit >= ReadMode::Splice && (conn->capable & FUSE_CAP_SPLICE_WRITE) != 0) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if ((conn->capable & FUSE_CAP_SPLICE_MOVE) != 0) {
+      conn->want |= FUSE_CAP_SPLICE_MOVE;
+    }
+    ctx->read_mode = ReadMode::Splice;
+  }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (limit >= ReadMode::Passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH) != 0) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    ctx->read_mode = ReadMode::Passthrough;
+  }
+#endif
+
+  ctx->passthrough_enabled.store(ctx->read_mode == ReadMode::Passthrough,
+                                 std::memory_order_relaxed);
+}
+
 void mo2_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
   Mo2FsContext* ctx = getContext(req);
@@ -209,27 +652,27 @@ void mo2_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
     return;
   }
 
-  bool ok = false;
-  const std::string parentPath = inodeToPath(ctx, parent, &ok);
-  if (!ok) {
-    fuse_reply_err(req, ENOENT);
-    return;
-  }
+  VfsStats::Timer timer(ctx->stats, VfsOp::Lookup);
 
-  const std::string childPath = joinPath(parentPath, name);
-  const auto snap             = snapshotForPath(ctx, childPath);
-  if (!snap.found) {
-    fuse_reply_err(req, ENOENT);
+  NodeSnapshot snap;
+  Miss miss;
+  uint64_t generation       = 0;
+  const fuse_ino_t childIno = lookupChild(ctx, parent, name, &snap, &generation, &miss);
+  if (childIno == 0) {
+    replyNegative(req, ctx, miss);
     return;
   }
 
-  fuse_ino_t childIno;
-  {
-    std::scoped_lock lock(ctx->inode_mutex);
-    childIno = ctx->inodes->getOrCreate(childPath);
+  ctx->stats.touch(childIno);
+
+  // the entry carries attributes too, which must include pending writes
+  if (commitPendingWrites(ctx, childIno)) {
+    if (const auto fresh = snapshotForInode(ctx, childIno, false); fresh.found) {
+      snap = fresh;
+    }
   }
 
-  replyEntryFromSnapshot(req, ctx, childIno, snap);
+  replyEntryFromSnapshot(req, ctx, childIno, generation, snap);
 }
 
 void mo2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /*fi*/)
@@ -240,6 +683,9 @@ void mo2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /*fi*/)
     return;
   }
 
+  VfsStats::Timer timer(ctx->stats, VfsOp::Getattr);
+  ctx->stats.touch(ino);
+
   if (ino == 1) {
     struct stat st;
     fillStatForDir(&st, 1, ctx->uid, ctx->gid);
@@ -247,14 +693,9 @@ void mo2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /*fi*/)
     return;
   }
 
-  bool ok = false;
-  const std::string path = inodeToPath(ctx, ino, &ok);
-  if (!ok) {
-    fuse_reply_err(req, ENOENT);
-    return;
-  }
+  commitPendingWrites(ctx, ino);
 
-  const auto snap = snapshotForPath(ctx, path);
+  const auto snap = snapshotForInode(ctx, ino, false);
   if (!snap.found) {
     fuse_reply_err(req, ENOENT);
     return;
@@ -270,70 +711,186 @@ void mo2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /*fi*/)
   fuse_reply_attr(req, &st, TTL_SECONDS);
 }
 
-void mo2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                 struct fuse_file_info* /*fi*/)
+void mo2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
   Mo2FsContext* ctx = getContext(req);
-  if (ctx == nullptr || off < 0) {
+  if (ctx == nullptr || fi == nullptr) {
     fuse_reply_err(req, EINVAL);
     return;
   }
 
-  bool ok = false;
-  const std::string path = inodeToPath(ctx, ino, &ok);
-  if (!ok) {
-    fuse_reply_err(req, ENOENT);
-    return;
+  auto handle = std::make_unique<DirHandle>();
+  {
+    auto lock = readTree(ctx);
+
+    const VfsTree& tree = *ctx->tree;
+    const VfsNodeId dir = ctx->inodes->node(ino, tree);
+    if (dir == InvalidVfsNode) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    if (!tree.node(dir).is_directory) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+    }
+
+    const auto children = tree.children(dir);
+    handle->epoch       = tree.epoch();
+    handle->entries.reserve(children.size());
+    for (const VfsNodeId child : children) {
+      const VfsNode& node = tree.node(child);
+      handle->entries.push_back(
+          {std::string(tree.name(node)), child, node.hash, node.is_directory});
+    }
   }
 
-  bool listOk = false;
-  auto children = listChildrenSnapshot(ctx, path, &listOk);
-  if (!listOk) {
-    fuse_reply_err(req, ENOTDIR);
+  fi->fh = reinterpret_cast<uint64_t>(handle.get());
+  if (fuse_reply_open(req, fi) == 0) {
+    // owned by the kernel's handle until mo2_releasedir
+    handle.release();
+  }
+}
+
+void mo2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info* fi)
+{
+  Mo2FsContext* ctx = getContext(req);
+  DirHandle* handle = dirHandle(fi);
+  if (ctx == nullptr || handle == nullptr || off < 0) {
+    fuse_reply_err(req, EINVAL);
     return;
   }
 
-  struct Entry
+  VfsStats::Timer timer(ctx->stats, VfsOp::Readdir);
+
+  std::vector<char> buf(size);
+  size_t used = 0;
+  std::string keyBuf;
   {
-    fuse_ino_t ino;
-    std::string name;
-    bool isDir;
-  };
+    auto lock = readTree(ctx);
 
-  std::vector<Entry> entries;
-  entries.reserve(children.size() + 2);
-  entries.push_back({ino, ".", true});
-  entries.push_back({1, "..", true});
+    const VfsTree& tree = *ctx->tree;
+    const VfsNodeId dir =
+        handle->epoch == tree.epoch() ? InvalidVfsNode : ctx->inodes->node(ino, tree);
 
-  {
-    std::scoped_lock lock(ctx->inode_mutex);
-    for (const auto& [name, isDir] : children) {
-      const std::string childPath = joinPath(path, name);
-      entries.push_back({ctx->inodes->getOrCreate(childPath), name, isDir});
+    const size_t count = handle->entries.size() + DirHandleDots;
+    for (size_t i = static_cast<size_t>(off); i < count; ++i) {
+      struct stat st;
+      const char* name = nullptr;
+
+      if (i < DirHandleDots) {
+        fillDotEntry(&st, i, ino);
+        name = i == 0 ? "." : "..";
+      } else {
+        const DirHandle::Entry& entry = handle->entries[i - DirHandleDots];
+
+        // Plain readdir doesn't count as a kernel lookup, so it reports the
+        // inode of names that were already looked up and registers nothing;
+        // otherwise listing a big directory would pin an entry per child.
+        std::string_view key;
+        fuse_ino_t known = 0;
+        if (currentChild(tree, dir, *handle, entry, keyBuf, key) != InvalidVfsNode) {
+          known = ctx->inodes->find(ino, key, entry.hash);
+        }
+
+        std::memset(&st, 0, sizeof(st));
+        st.st_ino  = known != 0 ? known : UNKNOWN_INO;
+        st.st_mode = entry.is_directory ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+        name       = entry.name.c_str();
+      }
+
+      const size_t ent = fuse_add_direntry(req, buf.data() + used, size - used, name,
+                                           &st, static_cast<off_t>(i + 1));
+      if (ent > size - used) {
+        break;
+      }
+      used += ent;
     }
   }
 
+  fuse_reply_buf(req, buf.data(), used);
+}
+
+void mo2_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info* fi)
+{
+  Mo2FsContext* ctx = getContext(req);
+  DirHandle* handle = dirHandle(fi);
+  if (ctx == nullptr || handle == nullptr || off < 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  VfsStats::Timer timer(ctx->stats, VfsOp::Readdir);
+
+  // the entries carry attributes, which must include pending writes
+  commitPendingWrites(ctx, 0);
+
   std::vector<char> buf(size);
   size_t used = 0;
+  std::string keyBuf;
+  {
+    auto lock = readTree(ctx);
+
+    const VfsTree& tree = *ctx->tree;
+    const VfsNodeId dir =
+        handle->epoch == tree.epoch() ? InvalidVfsNode : ctx->inodes->node(ino, tree);
+
+    const size_t count = handle->entries.size() + DirHandleDots;
+    for (size_t i = static_cast<size_t>(off); i < count; ++i) {
+      struct fuse_entry_param e;
+      const off_t next = static_cast<off_t>(i + 1);
+
+      if (i < DirHandleDots) {
+        // the kernel takes no reference on "." and "..", so no inode is
+        // counted for them either
+        std::memset(&e, 0, sizeof(e));
+        fillDotEntry(&e.attr, i, ino);
+        const size_t ent = fuse_add_direntry_plus(req, buf.data() + used, size - used,
+                                                  i == 0 ? "." : "..", &e, next);
+        if (ent > size - used) {
+          break;
+        }
+        used += ent;
+        continue;
+      }
 
-  for (size_t i = static_cast<size_t>(off); i < entries.size(); ++i) {
-    struct stat st;
-    std::memset(&st, 0, sizeof(st));
-    st.st_ino  = entries[i].ino;
-    st.st_mode = entries[i].isDir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
-
-    const size_t ent = fuse_add_direntry(req, buf.data() + used, size - used,
-                                         entries[i].name.c_str(), &st,
-                                         static_cast<off_t>(i + 1));
-    if (ent > size - used) {
-      break;
+      const DirHandle::Entry& entry = handle->entries[i - DirHandleDots];
+
+      std::string_view key;
+      const VfsNodeId child = currentChild(tree, dir, *handle, entry, keyBuf, key);
+      if (child == InvalidVfsNode) {
+        continue;
+      }
+
+      // every entry in the reply is a kernel lookup, so only count one once
+      // the entry is known to fit
+      const size_t ent =
+          fuse_add_direntry_plus(req, nullptr, 0, entry.name.c_str(), nullptr, 0);
+      if (ent > size - used) {
+        break;
+      }
+
+      uint64_t generation   = 0;
+      const fuse_ino_t cino = ctx->inodes->getOrCreate(ino, entry.name, key, entry.hash,
+                                                       tree, child, &generation);
+      fillEntry(&e, ctx, cino, generation,
+                snapshotForNode(tree, tree.node(child), false));
+      fuse_add_direntry_plus(req, buf.data() + used, size - used, entry.name.c_str(),
+                             &e, next);
+      used += ent;
     }
-    used += ent;
   }
 
   fuse_reply_buf(req, buf.data(), used);
 }
 
+void mo2_releasedir(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info* fi)
+{
+  delete dirHandle(fi);
+  fuse_reply_err(req, 0);
+}
+
 void mo2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
   Mo2FsContext* ctx = getContext(req);
@@ -342,14 +899,10 @@ void mo2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
     return;
   }
 
-  bool ok = false;
-  const std::string path = inodeToPath(ctx, ino, &ok);
-  if (!ok) {
-    fuse_reply_err(req, ENOENT);
-    return;
-  }
+  VfsStats::Timer timer(ctx->stats, VfsOp::Open);
+  ctx->stats.touch(ino);
 
-  const auto snap = snapshotForPath(ctx, path);
+  const auto snap = snapshotForInode(ctx, ino, true);
   if (!snap.found || snap.is_directory) {
     fuse_reply_err(req, ENOENT);
     return;
@@ -359,13 +912,23 @@ void mo2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
   const bool writable  = isWritableOpen(fi->flags);
   bool isBacking       = snap.is_backing;
 
+  // only writable handles need the relative path, for staging
+  std::string path;
   if (writable) {
+    bool ok = false;
+    path    = inodeToPath(ctx, ino, &ok);
+    if (!ok) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+
     try {
       if (isBacking && ctx->backing_dir_fd >= 0) {
         realPath = ctx->overwrite->copyOnWriteFromFd(ctx->backing_dir_fd, path);
       } else {
         realPath = ctx->overwrite->copyOnWrite(realPath, path);
       }
+      recordCopy(ctx, realPath);
       isBacking = false;
       updateFileNode(ctx, path, realPath, "Staging");
     } catch (...) {
@@ -374,18 +937,38 @@ void mo2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
     }
   }
 
-  const uint64_t fh = ctx->next_fh.fetch_add(1, std::memory_order_relaxed);
-  {
-    std::scoped_lock lock(ctx->open_files_mutex);
-    Mo2FsContext::OpenFile of;
-    of.real_path     = realPath;
-    of.writable      = writable;
-    of.is_backing    = isBacking;
-    of.relative_path = path;
-    ctx->open_files[fh] = std::move(of);
+  auto of           = std::make_shared<Mo2FsContext::OpenFile>();
+  of->real_path     = realPath;
+  of->writable      = writable;
+  of->is_backing    = isBacking;
+  of->relative_path = path;
+  of->ino           = ino;
+  of->fd            = openRealFile(ctx, realPath, isBacking, writable);
+  if (of->fd < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+  // Read-only handles on mod/game files are handed to the kernel outright;
+  // writable ones stay on the FUSE path so staging bookkeeping keeps working.
+  if (!writable && ctx->passthrough_enabled.load(std::memory_order_relaxed)) {
+    const int backingId = fuse_passthrough_open(req, of->fd);
+    const int err       = errno;
+    if (backingId > 0) {
+      of->backing_id = backingId;
+      fi->backing_id = backingId;
+    } else if (err == EPERM || err == EOPNOTSUPP || err == ENOTSUP || err == ENOTTY ||
+               err == ENOSYS) {
+      // the mount can't do it at all
+      ctx->passthrough_enabled.store(false, std::memory_order_relaxed);
+    }
+    // otherwise only this file couldn't be registered, say one on a
+    // filesystem that is stacked too deep; its handle falls back
   }
+#endif
 
-  fi->fh         = fh;
+  fi->fh         = registerOpenFile(ctx, std::move(of));
   fi->keep_cache = 1;
   fuse_reply_open(req, fi);
 }
@@ -399,41 +982,39 @@ void mo2_read(fuse_req_t req, fuse_ino_t /*ino*/, size_t size, off_t off,
     return;
   }
 
-  std::string realPath;
-  bool isBacking = false;
-  {
-    std::scoped_lock lock(ctx->open_files_mutex);
-    auto it = ctx->open_files.find(fi->fh);
-    if (it == ctx->open_files.end()) {
-      fuse_reply_err(req, EBADF);
-      return;
-    }
-    realPath   = it->second.real_path;
-    isBacking  = it->second.is_backing;
-  }
+  VfsStats::Timer timer(ctx->stats, VfsOp::Read);
 
-  int fd = -1;
-  if (isBacking && ctx->backing_dir_fd >= 0) {
-    fd = openat(ctx->backing_dir_fd, realPath.c_str(), O_RDONLY);
-  } else {
-    fd = open(realPath.c_str(), O_RDONLY);
+  const auto open = findOpenFile(ctx, fi->fh);
+  if (open == nullptr) {
+    fuse_reply_err(req, EBADF);
+    return;
   }
 
-  if (fd < 0) {
-    fuse_reply_err(req, EIO);
+  if (ctx->read_mode != Mo2FsContext::ReadMode::Copy) {
+    // Let libfuse splice straight from the backing fd into the FUSE device;
+    // it falls back to a plain read itself if splicing fails.
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags =
+        static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd  = open->fd;
+    buf.buf[0].pos = off;
+    ctx->stats.touch(open->ino);
+    // what was asked for; libfuse doesn't say how much it spliced
+    ctx->stats.addRead(size);
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
     return;
   }
 
-  std::vector<char> out(size);
-  const ssize_t n = pread(fd, out.data(), size, off);
-  close(fd);
-
+  char* out       = threadReadBuffer(size);
+  const ssize_t n = pread(open->fd, out, size, off);
   if (n < 0) {
-    fuse_reply_err(req, EIO);
+    fuse_reply_err(req, errno);
     return;
   }
 
-  fuse_reply_buf(req, out.data(), static_cast<size_t>(n));
+  ctx->stats.touch(open->ino);
+  ctx->stats.addRead(static_cast<uint64_t>(n));
+  fuse_reply_buf(req, out, static_cast<size_t>(n));
 }
 
 void mo2_write(fuse_req_t req, fuse_ino_t /*ino*/, const char* buf, size_t size,
@@ -445,44 +1026,40 @@ void mo2_write(fuse_req_t req, fuse_ino_t /*ino*/, const char* buf, size_t size,
     return;
   }
 
-  Mo2FsContext::OpenFile open;
-  {
-    std::scoped_lock lock(ctx->open_files_mutex);
-    auto it = ctx->open_files.find(fi->fh);
-    if (it == ctx->open_files.end()) {
-      fuse_reply_err(req, EBADF);
-      return;
-    }
-    open = it->second;
-  }
+  VfsStats::Timer timer(ctx->stats, VfsOp::Write);
 
-  if (!open.writable) {
-    fuse_reply_err(req, EACCES);
+  const auto open = findOpenFile(ctx, fi->fh);
+  if (open == nullptr) {
+    fuse_reply_err(req, EBADF);
     return;
   }
 
-  std::fstream io(open.real_path, std::ios::binary | std::ios::in | std::ios::out);
-  if (!io) {
-    io.open(open.real_path, std::ios::binary | std::ios::out);
-    io.close();
-    io.open(open.real_path, std::ios::binary | std::ios::in | std::ios::out);
-  }
-
-  if (!io) {
-    fuse_reply_err(req, EIO);
+  if (!open->writable) {
+    fuse_reply_err(req, EACCES);
     return;
   }
 
-  io.seekp(off, std::ios::beg);
-  io.write(buf, static_cast<std::streamsize>(size));
-  io.flush();
-  if (!io) {
-    fuse_reply_err(req, EIO);
-    return;
+  size_t written = 0;
+  while (written < size) {
+    const ssize_t n = pwrite(open->fd, buf + written, size - written,
+                             off + static_cast<off_t>(written));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (written == 0) {
+        fuse_reply_err(req, errno);
+        return;
+      }
+      break;
+    }
+    written += static_cast<size_t>(n);
   }
 
-  updateFileNode(ctx, open.relative_path, open.real_path, "Staging");
-  fuse_reply_write(req, size);
+  markDirty(ctx, *open);
+  ctx->stats.touch(open->ino);
+  ctx->stats.addWrite(written);
+  fuse_reply_write(req, written);
 }
 
 void mo2_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t /*mode*/,
@@ -513,44 +1090,46 @@ void mo2_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t /*mo
 
   updateFileNode(ctx, relative, realPath, "Staging");
   {
-    std::unique_lock lock(ctx->tree_mutex);
+    auto lock = writeTree(ctx);
     ++ctx->tree->file_count;
   }
 
-  fuse_ino_t newIno;
-  {
-    std::scoped_lock lock(ctx->inode_mutex);
-    newIno = ctx->inodes->getOrCreate(relative);
+  auto of           = std::make_shared<Mo2FsContext::OpenFile>();
+  of->real_path     = realPath;
+  of->writable      = true;
+  of->is_backing    = false;
+  of->relative_path = relative;
+  of->fd            = openRealFile(ctx, realPath, false, true);
+  if (of->fd < 0) {
+    fuse_reply_err(req, errno);
+    return;
   }
 
-  const auto snap = snapshotForPath(ctx, relative);
-  if (!snap.found || snap.is_directory) {
+  NodeSnapshot snap;
+  uint64_t generation     = 0;
+  const fuse_ino_t newIno = lookupChild(ctx, parent, name, &snap, &generation);
+  if (newIno == 0 || snap.is_directory) {
+    if (newIno != 0) {
+      ctx->inodes->forget(newIno, 1);
+    }
     fuse_reply_err(req, EIO);
     return;
   }
 
-  const uint64_t fh = ctx->next_fh.fetch_add(1, std::memory_order_relaxed);
-  {
-    std::scoped_lock lock(ctx->open_files_mutex);
-    Mo2FsContext::OpenFile of;
-    of.real_path     = realPath;
-    of.writable      = true;
-    of.is_backing    = false;
-    of.relative_path = relative;
-    ctx->open_files[fh] = std::move(of);
-  }
-
-  fi->fh         = fh;
+  of->ino        = newIno;
+  fi->fh         = registerOpenFile(ctx, std::move(of));
   fi->keep_cache = 1;
 
   struct fuse_entry_param e;
   std::memset(&e, 0, sizeof(e));
   e.ino           = newIno;
+  e.generation    = generation;
   e.attr_timeout  = TTL_SECONDS;
   e.entry_timeout = TTL_SECONDS;
   fillStatForFile(&e.attr, newIno, ctx->uid, ctx->gid, snap.size, snap.mtime);
 
   fuse_reply_create(req, &e, fi);
+  dropNegatives(ctx, parent, name);
 }
 
 void mo2_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
@@ -586,26 +1165,30 @@ void mo2_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
   }
 
   {
-    std::unique_lock lock(ctx->tree_mutex);
-    ctx->tree->root.removeFromTree(splitPath(oldRelative));
+    auto lock = writeTree(ctx);
+    ctx->tree->removeFromTree(splitPath(oldRelative));
 
     if (oldSnap.is_directory) {
-      ctx->tree->root.insertDirectory(splitPath(newRelative));
+      ctx->tree->insertDirectory(splitPath(newRelative));
     } else {
       const std::string staged = ctx->overwrite->stagingPath(newRelative);
       const std::string over   = ctx->overwrite->overwritePath(newRelative);
       const std::string real   = fs::exists(staged) ? staged : over;
-      ctx->tree->root.insertFile(splitPath(newRelative), real, oldSnap.size,
-                                 oldSnap.mtime, "Staging");
+      ctx->tree->insertFile(splitPath(newRelative), real, oldSnap.size, oldSnap.mtime,
+                            "Staging");
     }
   }
 
-  {
-    std::scoped_lock lock(ctx->inode_mutex);
-    ctx->inodes->rename(oldRelative, newRelative);
+  std::vector<Invalidation> stale;
+  for (InodeTable::Link& link : ctx->inodes->rename(parent, name, newparent, newname)) {
+    for (std::string& n : link.names) {
+      stale.push_back({0, link.parent, std::move(n), true});
+    }
   }
 
   fuse_reply_err(req, 0);
+  dropNegatives(ctx, newparent, newname);
+  invalidateKernelCache(ctx, stale);
 }
 
 void mo2_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
@@ -638,11 +1221,9 @@ void mo2_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 
     if (fi != nullptr) {
       fh = fi->fh;
-      std::scoped_lock lock(ctx->open_files_mutex);
-      auto it = ctx->open_files.find(fh);
-      if (it != ctx->open_files.end()) {
-        target          = it->second.real_path;
-        targetIsBacking = it->second.is_backing;
+      if (const auto open = findOpenFile(ctx, fh)) {
+        target          = open->real_path;
+        targetIsBacking = open->is_backing;
       }
     }
 
@@ -665,17 +1246,31 @@ void mo2_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
         } else {
           target = ctx->overwrite->copyOnWrite(target, path);
         }
+        recordCopy(ctx, target);
       } catch (...) {
         fuse_reply_err(req, EIO);
         return;
       }
 
       if (fi != nullptr) {
+        // The handle now refers to the staged copy; give it a fresh writable
+        // fd.  The old record stays alive for any handler still using it.
+        auto retargeted           = std::make_shared<Mo2FsContext::OpenFile>();
+        retargeted->real_path     = target;
+        retargeted->writable      = true;
+        retargeted->is_backing    = false;
+        retargeted->relative_path = path;
+        retargeted->ino           = ino;
+        retargeted->fd            = openRealFile(ctx, target, false, true);
+        if (retargeted->fd < 0) {
+          fuse_reply_err(req, errno);
+          return;
+        }
+
         std::scoped_lock lock(ctx->open_files_mutex);
         auto it = ctx->open_files.find(fh);
         if (it != ctx->open_files.end()) {
-          it->second.real_path = target;
-          it->second.writable  = true;
+          it->second = std::move(retargeted);
         }
       }
     }
@@ -765,13 +1360,20 @@ void mo2_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
   }
 
   {
-    std::unique_lock lock(ctx->tree_mutex);
-    if (ctx->tree->root.removeFromTree(splitPath(relative))) {
+    auto lock = writeTree(ctx);
+    if (ctx->tree->removeFromTree(splitPath(relative))) {
       ctx->tree->file_count = ctx->tree->file_count > 0 ? ctx->tree->file_count - 1 : 0;
     }
   }
 
+  // the kernel drops the entry it unlinked, not the other spellings of it
+  std::vector<Invalidation> stale;
+  for (std::string& n : ctx->inodes->remove(parent, name)) {
+    stale.push_back({0, parent, std::move(n), true});
+  }
+
   fuse_reply_err(req, 0);
+  invalidateKernelCache(ctx, stale);
 }
 
 void mo2_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t /*mode*/)
@@ -796,24 +1398,38 @@ void mo2_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t /*mod
   }
 
   {
-    std::unique_lock lock(ctx->tree_mutex);
-    ctx->tree->root.insertDirectory(splitPath(relative));
+    auto lock = writeTree(ctx);
+    ctx->tree->insertDirectory(splitPath(relative));
     ++ctx->tree->dir_count;
   }
 
-  fuse_ino_t dirIno;
-  {
-    std::scoped_lock lock(ctx->inode_mutex);
-    dirIno = ctx->inodes->getOrCreate(relative);
+  NodeSnapshot snap;
+  uint64_t generation     = 0;
+  const fuse_ino_t dirIno = lookupChild(ctx, parent, name, &snap, &generation);
+  if (dirIno == 0) {
+    fuse_reply_err(req, EIO);
+    return;
   }
 
-  const auto snap = snapshotForPath(ctx, relative);
-  if (!snap.found) {
-    fuse_reply_err(req, EIO);
+  replyEntryFromSnapshot(req, ctx, dirIno, generation, snap);
+  dropNegatives(ctx, parent, name);
+}
+
+void mo2_flush(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info* fi)
+{
+  Mo2FsContext* ctx = getContext(req);
+  if (ctx == nullptr || fi == nullptr) {
+    fuse_reply_err(req, EINVAL);
     return;
   }
 
-  replyEntryFromSnapshot(req, ctx, dirIno, snap);
+  // sent on every close(), so whatever the caller does next (rename, stat)
+  // sees the written size
+  if (const auto open = findOpenFile(ctx, fi->fh)) {
+    commitWrites(ctx, *open);
+  }
+
+  fuse_reply_err(req, 0);
 }
 
 void mo2_release(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info* fi)
@@ -824,10 +1440,170 @@ void mo2_release(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info* fi)
     return;
   }
 
+  std::shared_ptr<Mo2FsContext::OpenFile> closed;
   {
     std::scoped_lock lock(ctx->open_files_mutex);
-    ctx->open_files.erase(fi->fh);
+    auto it = ctx->open_files.find(fi->fh);
+    if (it != ctx->open_files.end()) {
+      closed = std::move(it->second);
+      ctx->open_files.erase(it);
+    }
   }
 
+  if (closed != nullptr) {
+    commitWrites(ctx, *closed);
+  }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (closed != nullptr && closed->backing_id > 0) {
+    fuse_passthrough_close(req, closed->backing_id);
+  }
+#endif
+
   fuse_reply_err(req, 0);
 }
+
+void mo2_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  if (Mo2FsContext* ctx = getContext(req)) {
+    ctx->inodes->forget(ino, nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+void mo2_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+  if (Mo2FsContext* ctx = getContext(req)) {
+    for (size_t i = 0; i < count; ++i) {
+      ctx->inodes->forget(forgets[i].ino, forgets[i].nlookup);
+    }
+  }
+  fuse_reply_none(req);
+}
+
+void mo2_swap_tree(Mo2FsContext* ctx, std::shared_ptr<VfsTree> tree)
+{
+  std::vector<Invalidation> stale;
+  {
+    auto lock = writeTree(ctx);
+    std::vector<CachedInode> cached = cachedInodes(ctx);
+    ctx->tree.swap(tree);
+    stale = staleInodes(ctx, std::move(cached));
+  }
+
+  // inodes re-resolve lazily against the new tree (its epoch differs); new
+  // ones are issued under a fresh generation
+  ctx->inodes->advanceGeneration();
+
+  invalidateKernelCache(ctx, stale);
+
+  // the old tree is released here, outside the lock
+}
+
+void mo2_patch_tree(Mo2FsContext* ctx, const std::function<void(VfsTree&)>& patch)
+{
+  // nodes that disappear change the tree's epoch, so cached inodes
+  // re-resolve; everything else stays valid
+  std::vector<Invalidation> stale;
+  {
+    auto lock = writeTree(ctx);
+    std::vector<CachedInode> cached = cachedInodes(ctx);
+    patch(*ctx->tree);
+    stale = staleInodes(ctx, std::move(cached));
+  }
+
+  invalidateKernelCache(ctx, stale);
+}
+
+namespace
+{
+std::string formatBytes(uint64_t bytes)
+{
+  char buf[32];
+  if (bytes < 1024 * 1024) {
+    std::snprintf(buf, sizeof(buf), "%.1f KiB", bytes / 1024.0);
+  } else if (bytes < 1024ull * 1024 * 1024) {
+    std::snprintf(buf, sizeof(buf), "%.1f MiB", bytes / (1024.0 * 1024));
+  } else {
+    std::snprintf(buf, sizeof(buf), "%.2f GiB", bytes / (1024.0 * 1024 * 1024));
+  }
+  return buf;
+}
+
+// upper bound of the bucket holding the q-quantile, in microseconds
+std::string latencyQuantile(const VfsStats::OpTotals& op, double q)
+{
+  if (op.count == 0) {
+    return "-";
+  }
+
+  const uint64_t target = static_cast<uint64_t>(q * static_cast<double>(op.count - 1)) + 1;
+  uint64_t seen         = 0;
+  for (size_t i = 0; i < VfsStats::LatencyBuckets; ++i) {
+    seen += op.buckets[i];
+    if (seen >= target) {
+      if (i + 1 == VfsStats::LatencyBuckets) {
+        return ">=" + std::to_string(uint64_t(1) << (i - 1));
+      }
+      return "<" + std::to_string(uint64_t(1) << i);
+    }
+  }
+  return "-";
+}
+}  // namespace
+
+std::vector<std::string> mo2_stats_report(Mo2FsContext* ctx, size_t hot)
+{
+  const VfsStats::Snapshot snap = ctx->stats.snapshot(hot);
+  std::vector<std::string> lines;
+  char buf[160];
+
+  static constexpr const char* modes[] = {"copy", "splice", "passthrough"};
+  lines.push_back(std::string("read mode: ") + modes[static_cast<int>(ctx->read_mode)] +
+                  (ctx->read_mode == Mo2FsContext::ReadMode::Passthrough
+                       ? " (reads of passthrough files bypass the VFS)"
+                       : ""));
+
+  std::snprintf(buf, sizeof(buf), "%-8s %10s %10s %8s %8s %10s", "op", "count",
+                "avg us", "p50 us", "p99 us", "max us");
+  lines.push_back(buf);
+
+  for (size_t i = 0; i < snap.ops.size(); ++i) {
+    const VfsStats::OpTotals& op = snap.ops[i];
+    const double avg = op.count == 0 ? 0.0 : op.total_ns / 1000.0 / op.count;
+    std::snprintf(buf, sizeof(buf), "%-8s %10llu %10.1f %8s %8s %10llu",
+                  vfsOpName(static_cast<VfsOp>(i)),
+                  static_cast<unsigned long long>(op.count), avg,
+                  latencyQuantile(op, 0.5).c_str(), latencyQuantile(op, 0.99).c_str(),
+                  static_cast<unsigned long long>(op.max_ns / 1000));
+    lines.push_back(buf);
+  }
+
+  lines.push_back("bytes read: " + formatBytes(snap.bytes_read) +
+                  ", written: " + formatBytes(snap.bytes_written));
+  lines.push_back("copy-on-write: " + std::to_string(snap.copies) + " files, " +
+                  formatBytes(snap.copy_bytes));
+
+  std::snprintf(buf, sizeof(buf), "tree lock waits: %llu, %.1f ms total",
+                static_cast<unsigned long long>(snap.lock_waits),
+                snap.lock_wait_ns / 1e6);
+  lines.push_back(buf);
+  lines.push_back("open inodes: " + std::to_string(ctx->inodes->size()) +
+                  ", cached misses: " + std::to_string(ctx->negatives->size()));
+
+  if (!snap.hot.empty()) {
+    lines.push_back("hottest paths (approximate operation counts):");
+    for (const auto& [ino, count] : snap.hot) {
+      std::string path;
+      if (ino == InodeTable::RootInode) {
+        path = ".";
+      } else if (!ctx->inodes->path(ino, path)) {
+        path = "(forgotten inode " + std::to_string(ino) + ")";
+      }
+      std::snprintf(buf, sizeof(buf), "%10llu  ", static_cast<unsigned long long>(count));
+      lines.push_back(buf + path);
+    }
+  }
+
+  return lines;
+}
@@ -4,48 +4,107 @@
 #include <fuse3/fuse_lowlevel.h>
 
 #include "inodetable.h"
+#include "negativecache.h"
 #include "overwritemanager.h"
+#include "vfsstats.h"
 #include "vfstree.h"
 
 #include <atomic>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 struct Mo2FsContext
 {
   std::shared_ptr<VfsTree> tree;
   mutable std::shared_mutex tree_mutex;
 
+  // internally synchronized; see InodeTable
   std::unique_ptr<InodeTable> inodes;
-  mutable std::mutex inode_mutex;
+
+  // internally synchronized; see NegativeCache
+  std::unique_ptr<NegativeCache> negatives;
 
   std::unique_ptr<OverwriteManager> overwrite;
 
   int backing_dir_fd = -1;
 
+  // Set once the session is mounted.  Entries and attributes are handed out
+  // with long timeouts, so tree changes the kernel didn't make itself (swaps
+  // and patches) are pushed to it as invalidations through this session.
+  // Cleared on unmount while workers may still read it.
+  std::atomic<struct fuse_session*> session{nullptr};
+
+  // How file data is handed back to the kernel.  mo2_init picks the best mode
+  // the running kernel supports, capped by MO2_VFS_READ_MODE
+  // (copy/splice/passthrough) for troubleshooting.
+  enum class ReadMode
+  {
+    Copy,         // pread() into a buffer, then fuse_reply_buf()
+    Splice,       // fuse_reply_data() with an fd buffer, spliced by libfuse
+    Passthrough,  // kernel reads the backing file directly (FUSE_PASSTHROUGH)
+  };
+
+  ReadMode read_mode = ReadMode::Copy;
+
+  // Cleared at runtime if the kernel refuses to register backing files at
+  // all (e.g. unprivileged mounts), so later opens go straight to
+  // splice/copy.  A file the kernel only refuses on its own merits falls back
+  // for its handle alone.
+  std::atomic<bool> passthrough_enabled{false};
+
+  // One record per FUSE file handle.  The descriptor is opened in
+  // mo2_open/mo2_create and owned by the record, so the read path only has to
+  // pread() it.  Records are shared so a handler that is still using the fd
+  // keeps it alive if the handle is re-targeted (copy-on-write) meanwhile.
+  //
+  // Writes go straight to the fd and only mark the record dirty; the new size
+  // and mtime reach the tree on flush, release, or a getattr of the inode, so
+  // a stream of small writes doesn't take the tree lock for each one.
   struct OpenFile
   {
     std::string real_path;
     bool writable    = false;
     bool is_backing  = false;
     std::string relative_path;
+    fuse_ino_t ino   = 0;
+    int fd           = -1;
+    int backing_id   = 0;  // passthrough registration, released in mo2_release
+    std::atomic<bool> dirty{false};
+
+    OpenFile() = default;
+    ~OpenFile();
+
+    OpenFile(const OpenFile&)            = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
   };
 
-  std::unordered_map<uint64_t, OpenFile> open_files;
+  std::unordered_map<uint64_t, std::shared_ptr<OpenFile>> open_files;
   mutable std::mutex open_files_mutex;
   std::atomic<uint64_t> next_fh{1};
+  // dirty OpenFile records, so getattr only looks for them when there are any
+  std::atomic<size_t> dirty_files{0};
+
+  // per-op counters for the stats command and the diagnostics pane
+  mutable VfsStats stats;
 
   uid_t uid = 0;
   gid_t gid = 0;
 };
 
+void mo2_init(void* userdata, struct fuse_conn_info* conn);
 void mo2_lookup(fuse_req_t req, fuse_ino_t parent, const char* name);
 void mo2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void mo2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
 void mo2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                  struct fuse_file_info* fi);
+void mo2_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info* fi);
+void mo2_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
 void mo2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
 void mo2_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
               struct fuse_file_info* fi);
@@ -59,6 +118,23 @@ void mo2_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
                  struct fuse_file_info* fi);
 void mo2_unlink(fuse_req_t req, fuse_ino_t parent, const char* name);
 void mo2_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode);
+void mo2_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
 void mo2_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
+void mo2_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+void mo2_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets);
+
+// Replaces the mounted tree after a rebuild.  Inodes the kernel still holds
+// are re-resolved against the new tree on next use, and the kernel is told to
+// drop the entries and cached data of the ones that changed.
+void mo2_swap_tree(Mo2FsContext* ctx, std::shared_ptr<VfsTree> tree);
+
+// Runs `patch` on the mounted tree under the exclusive lock, for incremental
+// updates that are cheaper than building and swapping a whole tree.  Kernel
+// caches are invalidated as for mo2_swap_tree().
+void mo2_patch_tree(Mo2FsContext* ctx, const std::function<void(VfsTree&)>& patch);
+
+// Operation counts and latencies, bytes served, copy-on-write and tree lock
+// waits since mount, plus the `hot` most used paths, as lines of text.
+std::vector<std::string> mo2_stats_report(Mo2FsContext* ctx, size_t hot);
 
 #endif
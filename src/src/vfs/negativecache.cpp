@@ -0,0 +1,146 @@
+#include "negativecache.h"
+
+#include <algorithm>
+#include <iterator>
+
+NegativeCache::NegativeCache(size_t capacity) : m_capacity(capacity) {}
+
+NegativeCache::Shard& NegativeCache::shardOf(uint64_t parent)
+{
+  const uint64_t mixed = parent * 0x9E3779B97F4A7C15ull;
+  return m_shards[(mixed >> 32) % ShardCount];
+}
+
+void NegativeCache::erase(Shard& shard, Spellings& s, std::vector<Name>* out)
+{
+  if (out != nullptr) {
+    for (std::string& name : s.names) {
+      out->push_back({s.parent, std::move(name)});
+    }
+  }
+  m_size.fetch_sub(s.names.size(), std::memory_order_relaxed);
+  shard.lru.erase(s.used);
+
+  auto dir = shard.dirs.find(s.parent);
+  dir->second.erase(dir->second.find(s.key));
+  if (dir->second.empty()) {
+    shard.dirs.erase(dir);
+  }
+}
+
+std::vector<NegativeCache::Name> NegativeCache::add(uint64_t parent,
+                                                    std::string_view name,
+                                                    std::string_view key,
+                                                    uint32_t hash)
+{
+  std::vector<Name> evicted;
+
+  Shard& shard = shardOf(parent);
+  std::scoped_lock lock(shard.mutex);
+
+  Directory& dir = shard.dirs[parent];
+  auto it        = dir.find(key);
+  if (it == dir.end()) {
+    it = dir.emplace(std::string(key), Spellings{parent, std::string(key), hash, {}, {}})
+             .first;
+    it->second.used = shard.lru.insert(shard.lru.begin(), &it->second);
+  } else {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.used);
+  }
+
+  Spellings& s = it->second;
+  if (std::find(s.names.begin(), s.names.end(), name) != s.names.end()) {
+    return evicted;
+  }
+  s.names.emplace_back(name);
+
+  // only this shard is locked, so its own least recently missed name makes
+  // room, even if other shards hold older ones
+  if (m_size.fetch_add(1, std::memory_order_relaxed) >= m_capacity &&
+      shard.lru.back() != &s) {
+    erase(shard, *shard.lru.back(), &evicted);
+  }
+
+  return evicted;
+}
+
+std::vector<NegativeCache::Name> NegativeCache::take(uint64_t parent,
+                                                     std::string_view key,
+                                                     uint32_t /*hash*/)
+{
+  std::vector<Name> out;
+
+  Shard& shard = shardOf(parent);
+  std::scoped_lock lock(shard.mutex);
+
+  auto dir = shard.dirs.find(parent);
+  if (dir == shard.dirs.end()) {
+    return out;
+  }
+
+  auto it = dir->second.find(key);
+  if (it != dir->second.end()) {
+    erase(shard, it->second, &out);
+  }
+  return out;
+}
+
+std::vector<NegativeCache::Name> NegativeCache::takeExisting(
+    const std::function<bool(uint64_t, std::string_view, uint32_t)>& exists)
+{
+  std::vector<Name> out;
+
+  struct Candidate
+  {
+    uint64_t parent;
+    std::string key;
+    uint32_t hash;
+  };
+  std::vector<Candidate> candidates;
+
+  for (Shard& shard : m_shards) {
+    // `exists` resolves inodes, which may drop a parent here in turn, so
+    // it runs on a copy of the keys
+    candidates.clear();
+    {
+      std::scoped_lock lock(shard.mutex);
+      for (const auto& [parent, dir] : shard.dirs) {
+        for (const auto& [key, s] : dir) {
+          candidates.push_back({parent, key, s.hash});
+        }
+      }
+    }
+
+    for (const Candidate& c : candidates) {
+      if (exists(c.parent, c.key, c.hash)) {
+        auto names = take(c.parent, c.key, c.hash);
+        std::move(names.begin(), names.end(), std::back_inserter(out));
+      }
+    }
+  }
+
+  return out;
+}
+
+void NegativeCache::dropParent(uint64_t parent)
+{
+  if (size() == 0) {
+    return;
+  }
+
+  Shard& shard = shardOf(parent);
+  std::scoped_lock lock(shard.mutex);
+
+  auto dir = shard.dirs.find(parent);
+  if (dir == shard.dirs.end()) {
+    return;
+  }
+
+  size_t dropped = 0;
+  for (auto& [key, s] : dir->second) {
+    dropped += s.names.size();
+    shard.lru.erase(s.used);
+  }
+  m_size.fetch_sub(dropped, std::memory_order_relaxed);
+  shard.dirs.erase(dir);
+}
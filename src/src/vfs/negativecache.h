@@ -0,0 +1,105 @@
+#ifndef VFS_NEGATIVECACHE_H
+#define VFS_NEGATIVECACHE_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Names the kernel was told don't exist, as negative entries with a timeout.
+// Wine and Proton probe a lot of those (other casings, DLL search paths), and
+// a cached negative entry answers the repeat without a lookup.
+//
+// The kernel only forgets such an entry on its own when it times out, so
+// every name recorded here must be invalidated once it starts to exist: after
+// a tree patch or swap, and for the other casings of a name the kernel
+// creates itself, since the tree is case-insensitive and the kernel isn't.
+// Names are keyed by (parent inode, folded name) and keep each spelling the
+// kernel asked for.
+//
+// Once a parent inode is forgotten or stops resolving, the kernel has no
+// entries left below it and its names are dropped.  Beyond that the cache
+// holds about `capacity` spellings: recording a miss in a full cache evicts
+// the least recently missed names, which the caller has to invalidate in the
+// kernel since nothing would do so later.  Sharded by parent inode, so that
+// dropping a directory's names touches a single shard.
+class NegativeCache
+{
+public:
+  struct Name
+  {
+    uint64_t parent;
+    std::string name;
+  };
+
+  explicit NegativeCache(size_t capacity = 64 * 1024);
+
+  NegativeCache(const NegativeCache&)            = delete;
+  NegativeCache& operator=(const NegativeCache&) = delete;
+
+  // Records a miss and returns the names evicted to make room for it.
+  std::vector<Name> add(uint64_t parent, std::string_view name, std::string_view key,
+                        uint32_t hash);
+
+  // Removes and returns every spelling of (parent, key).
+  std::vector<Name> take(uint64_t parent, std::string_view key, uint32_t hash);
+
+  // Removes and returns every spelling whose (parent, key, hash) now exists.
+  // `exists` is called without any of the cache's locks held.
+  std::vector<Name>
+  takeExisting(const std::function<bool(uint64_t, std::string_view, uint32_t)>& exists);
+
+  // Forgets every name inside `parent`, without returning them.
+  void dropParent(uint64_t parent);
+
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t ShardCount = 16;
+
+  struct Spellings
+  {
+    uint64_t parent;
+    std::string key;
+    uint32_t hash;
+    std::vector<std::string> names;
+    std::list<Spellings*>::iterator used;  // position in Shard::lru
+  };
+
+  struct KeyHash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const
+    {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  // folded name -> spellings, for one parent
+  using Directory =
+      std::unordered_map<std::string, Spellings, KeyHash, std::equal_to<>>;
+
+  struct alignas(64) Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Directory> dirs;
+    std::list<Spellings*> lru;  // most recently missed first
+  };
+
+  size_t m_capacity;
+  std::atomic<size_t> m_size{0};
+  std::array<Shard, ShardCount> m_shards;
+
+  Shard& shardOf(uint64_t parent);
+
+  // removes `s` from `shard`, moving its spellings into `out` if given
+  void erase(Shard& shard, Spellings& s, std::vector<Name>* out);
+};
+
+#endif
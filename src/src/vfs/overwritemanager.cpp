@@ -1,10 +1,22 @@
 #include "overwritemanager.h"
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace
 {
@@ -23,6 +35,175 @@ std::string sanitizeRelative(const std::string& relative)
   }
   return out;
 }
+
+// errors that mean "this kernel or filesystem can't do that", as opposed to
+// an I/O error on the data
+bool unsupported(int err)
+{
+  return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV ||
+         err == EINVAL || err == ENOTTY;
+}
+
+// Copies the rest of `src` to `dst` from their current offsets with the
+// cheapest mechanism that works: a reflink shares the extents outright on
+// btrfs/XFS, copy_file_range lets the kernel (or the filesystem) copy without
+// a round trip through userspace, and sendfile still avoids the buffer copies.
+// Plain read/write is the last resort.  A mechanism that stops short, as
+// copy_file_range does on some filesystems by returning 0, hands the rest to
+// the next one.  Returns 0 once `size` bytes are copied, or an errno value.
+int copyData(int src, int dst, uint64_t size)
+{
+#ifdef FICLONE
+  if (ioctl(dst, FICLONE, src) == 0) {
+    return 0;
+  }
+#endif
+
+  uint64_t done = 0;
+
+  while (done < size) {
+    const ssize_t n = copy_file_range(src, nullptr, dst, nullptr, size - done, 0);
+    if (n > 0) {
+      done += static_cast<uint64_t>(n);
+      continue;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!unsupported(errno)) {
+      return errno;
+    }
+    break;
+  }
+
+  while (done < size) {
+    const ssize_t n = sendfile(dst, src, nullptr, size - done);
+    if (n > 0) {
+      done += static_cast<uint64_t>(n);
+      continue;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!unsupported(errno)) {
+      return errno;
+    }
+    break;
+  }
+
+  char buf[65536];
+  while (done < size) {
+    const ssize_t n = read(src, buf, sizeof(buf));
+    if (n == 0) {
+      break;  // source got shorter
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+
+    for (ssize_t off = 0; off < n;) {
+      const ssize_t w = write(dst, buf + off, static_cast<size_t>(n - off));
+      if (w < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      off += w;
+    }
+    done += static_cast<uint64_t>(n);
+  }
+
+  return done == size ? 0 : EIO;
+}
+
+// Copies the open file `src` to a new file at `dest`.  A partial copy is
+// removed again, since it would shadow the original in the VFS.
+void copyToStaging(int src, const fs::path& dest, const char* what)
+{
+  struct stat st;
+  if (fstat(src, &st) != 0) {
+    throw fs::filesystem_error(what, dest,
+                               std::error_code(errno, std::generic_category()));
+  }
+
+  // writable whatever the original's mode, the copy is made to be written to
+  const int dst = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       (st.st_mode & 0777) | S_IWUSR);
+  if (dst < 0) {
+    throw fs::filesystem_error(what, dest,
+                               std::error_code(errno, std::generic_category()));
+  }
+
+  const int err = copyData(src, dst, static_cast<uint64_t>(st.st_size));
+  close(dst);
+
+  if (err != 0) {
+    std::error_code ec;
+    fs::remove(dest, ec);
+    throw fs::filesystem_error(what, dest, std::error_code(err, std::generic_category()));
+  }
+}
+
+// files of one staging directory, moved by one worker
+struct FlushBatch
+{
+  std::string dir;  // relative, "" for the staging root
+  std::vector<std::string> names;
+};
+
+// splits huge directories so they don't end up on a single worker
+constexpr size_t FlushBatchSize = 256;
+
+// more concurrent moves than this mostly add seeks on spinning disks
+unsigned flushThreads()
+{
+  return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+}
+
+// Copies `name` across filesystems under a temporary name and renames it
+// into place, so a failed copy leaves the old destination file alone.
+bool copyAcross(int src_dir, int dst_dir, const std::string& name)
+{
+  const int in = openat(src_dir, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+
+  struct stat st;
+  const std::string tmp = name + ".mo2tmp";
+  const int out =
+      fstat(in, &st) != 0
+          ? -1
+          : openat(dst_dir, tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   st.st_mode & 0777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  const int err = copyData(in, out, static_cast<uint64_t>(st.st_size));
+  close(in);
+  close(out);
+
+  if (err != 0 || renameat(dst_dir, tmp.c_str(), dst_dir, name.c_str()) != 0) {
+    unlinkat(dst_dir, tmp.c_str(), 0);
+    return false;
+  }
+
+  unlinkat(src_dir, name.c_str(), 0);
+  return true;
+}
+
 }  // namespace
 
 OverwriteManager::OverwriteManager(const std::string& staging_dir,
@@ -56,16 +237,26 @@ std::string OverwriteManager::copyOnWrite(const std::string& source_path,
     return dest.string();
   }
 
-  if (!source_path.empty() && fs::exists(source_path, ec)) {
-    fs::copy_file(source_path, dest, fs::copy_options::overwrite_existing, ec);
-    if (ec) {
-      throw fs::filesystem_error("copyOnWrite", fs::path(source_path), dest, ec);
-    }
-  } else {
+  const int src_fd =
+      source_path.empty() ? -1 : open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0 && !source_path.empty() && errno != ENOENT) {
+    throw fs::filesystem_error("copyOnWrite", fs::path(source_path), dest,
+                               std::error_code(errno, std::generic_category()));
+  }
+  if (src_fd < 0) {
     std::ofstream out(dest, std::ios::binary);
     out.close();
+    return dest.string();
+  }
+
+  try {
+    copyToStaging(src_fd, dest, "copyOnWrite");
+  } catch (...) {
+    close(src_fd);
+    throw;
   }
 
+  close(src_fd);
   return dest.string();
 }
 
@@ -82,7 +273,7 @@ std::string OverwriteManager::copyOnWriteFromFd(int dir_fd,
   }
 
   const std::string rel = sanitizeRelative(relative_path);
-  const int src_fd      = openat(dir_fd, rel.c_str(), O_RDONLY);
+  const int src_fd      = openat(dir_fd, rel.c_str(), O_RDONLY | O_CLOEXEC);
   if (src_fd < 0) {
     // Source doesn't exist in backing dir, create empty file
     std::ofstream out(dest, std::ios::binary);
@@ -90,17 +281,11 @@ std::string OverwriteManager::copyOnWriteFromFd(int dir_fd,
     return dest.string();
   }
 
-  std::ofstream out(dest, std::ios::binary);
-  if (!out) {
+  try {
+    copyToStaging(src_fd, dest, "copyOnWriteFromFd");
+  } catch (...) {
     close(src_fd);
-    throw fs::filesystem_error("copyOnWriteFromFd", dest,
-                               std::error_code(errno, std::generic_category()));
-  }
-
-  char buf[65536];
-  ssize_t n;
-  while ((n = read(src_fd, buf, sizeof(buf))) > 0) {
-    out.write(buf, n);
+    throw;
   }
 
   close(src_fd);
@@ -176,3 +361,134 @@ bool OverwriteManager::exists(const std::string& relative_path) const
   return fs::exists(stagingPath(relative_path), ec) ||
          fs::exists(overwritePath(relative_path), ec);
 }
+
+StagingFlushResult flushStagingDir(const std::string& staging_dir,
+                                   const std::string& dest_dir,
+                                   const std::function<void(size_t, size_t)>& progress)
+{
+  StagingFlushResult result;
+
+  const fs::path staging(staging_dir);
+  const fs::path dest(dest_dir);
+  std::error_code ec;
+  if (!fs::exists(staging, ec)) {
+    return result;
+  }
+
+  // one walk to learn the shape; directories come out parents first, so
+  // each destination directory is a single mkdir
+  fs::create_directories(dest, ec);
+
+  std::vector<FlushBatch> batches;
+  std::unordered_map<std::string, size_t> openBatch;
+
+  for (auto it = fs::recursive_directory_iterator(
+           staging, fs::directory_options::skip_permission_denied, ec);
+       it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (ec) {
+      break;
+    }
+
+    const auto& entry = *it;
+    std::error_code entryEc;
+    const std::string rel = entry.path().lexically_relative(staging).generic_string();
+
+    if (entry.is_directory(entryEc)) {
+      fs::create_directory(dest / rel, entryEc);
+      continue;
+    }
+    if (!entry.is_regular_file(entryEc)) {
+      continue;
+    }
+
+    const size_t slash = rel.rfind('/');
+    std::string dir    = slash == std::string::npos ? std::string() : rel.substr(0, slash);
+
+    auto [batch, added] = openBatch.try_emplace(dir, batches.size());
+    if (added || batches[batch->second].names.size() >= FlushBatchSize) {
+      batch->second = batches.size();
+      batches.push_back({std::move(dir), {}});
+    }
+    batches[batch->second].names.push_back(entry.path().filename().string());
+    ++result.files;
+  }
+
+  std::atomic<size_t> done{0};
+  std::atomic<size_t> renamed{0};
+  std::atomic<size_t> copied{0};
+  std::atomic<size_t> next{0};
+
+  auto worker = [&] {
+    for (size_t i = next++; i < batches.size(); i = next++) {
+      const FlushBatch& batch = batches[i];
+      const fs::path from     = batch.dir.empty() ? staging : staging / batch.dir;
+      const fs::path to       = batch.dir.empty() ? dest : dest / batch.dir;
+
+      const int src = open(from.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      const int dst = open(to.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+      for (const std::string& name : batch.names) {
+        if (src >= 0 && dst >= 0) {
+          if (renameat(src, name.c_str(), dst, name.c_str()) == 0) {
+            ++renamed;
+          } else if (errno == EXDEV && copyAcross(src, dst, name)) {
+            ++copied;
+          }
+        }
+        ++done;
+      }
+
+      if (src >= 0) {
+        close(src);
+      }
+      if (dst >= 0) {
+        close(dst);
+      }
+    }
+  };
+
+  const size_t threadCount = std::min<size_t>(flushThreads(), batches.size());
+  std::mutex mutex;
+  std::condition_variable finished;
+  size_t running = threadCount;
+
+  std::vector<std::thread> threads;
+  threads.reserve(threadCount);
+  for (size_t i = 0; i < threadCount; ++i) {
+    threads.emplace_back([&] {
+      worker();
+      std::scoped_lock lock(mutex);
+      --running;
+      finished.notify_one();
+    });
+  }
+
+  {
+    std::unique_lock lock(mutex);
+    while (!finished.wait_for(lock, std::chrono::milliseconds(250),
+                              [&] { return running == 0; })) {
+      if (progress) {
+        lock.unlock();
+        progress(done.load(), result.files);
+        lock.lock();
+      }
+    }
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  result.renamed = renamed;
+  result.copied  = copied;
+  result.failed  = result.files - result.renamed - result.copied;
+  if (progress) {
+    progress(result.files, result.files);
+  }
+
+  // whatever couldn't be moved stays staged for the next flush
+  if (result.failed == 0) {
+    fs::remove_all(staging, ec);
+  }
+  return result;
+}
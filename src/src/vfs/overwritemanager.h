@@ -2,6 +2,7 @@
 #define VFS_OVERWRITEMANAGER_H
 
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -31,4 +32,23 @@ private:
   std::string m_overwriteDir;
 };
 
+struct StagingFlushResult
+{
+  size_t files   = 0;
+  size_t renamed = 0;
+  size_t copied  = 0;  // dest_dir is on another filesystem
+  size_t failed  = 0;
+};
+
+// Moves everything under `staging_dir` into `dest_dir`, replacing files that
+// are already there, and removes `staging_dir` afterwards unless some files
+// couldn't be moved.  Directories are created up front; files are then moved
+// directory by directory on a few threads, with renames relative to
+// directory fds and copies where a rename can't cross filesystems.
+// `progress` is called on the calling thread with the number of files done
+// so far and the total.
+StagingFlushResult
+flushStagingDir(const std::string& staging_dir, const std::string& dest_dir,
+                const std::function<void(size_t, size_t)>& progress = {});
+
 #endif
@@ -5,6 +5,10 @@
 #include "inodetable.h"
 #include "mo2filesystem.h"
 #include "overwritemanager.h"
+#include "vfslayers.h"
+#include "vfsmapping.h"
+#include "vfsscancache.h"
+#include "vfstrace.h"
 #include "vfstree.h"
 
 #include <fuse3/fuse_lowlevel.h>
@@ -20,6 +24,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -32,6 +37,8 @@ struct HelperConfig
   std::string data_dir_name;
   std::string overwrite_dir;
   std::string output_dir;
+  std::string mapping;
+  std::string scan_cache;
   std::vector<std::pair<std::string, std::string>> mods;
   std::vector<std::pair<std::string, std::string>> extra_files;
 };
@@ -65,6 +72,10 @@ static HelperConfig readConfig(const std::string& path)
       cfg.overwrite_dir = val;
     } else if (key == "output_dir") {
       cfg.output_dir = val;
+    } else if (key == "mapping") {
+      cfg.mapping = val;
+    } else if (key == "scan_cache") {
+      cfg.scan_cache = val;
     } else if (key == "mod") {
       const auto pipe = val.find('|');
       if (pipe != std::string::npos) {
@@ -81,6 +92,23 @@ static HelperConfig readConfig(const std::string& path)
   return cfg;
 }
 
+// Layers from the GUI's mapping file when there is a usable one, otherwise
+// from scanning the mod directories listed in the config
+static VfsLayerSet::Update prepareLayers(const VfsLayerSet& layers,
+                                         const HelperConfig& cfg)
+{
+  if (!cfg.mapping.empty()) {
+    std::string error;
+    if (auto update = readVfsMapping(cfg.mapping, layers, error)) {
+      return std::move(*update);
+    }
+    std::cerr << "mo2-vfs-helper: ignoring " << cfg.mapping << ": " << error
+              << std::endl;
+  }
+
+  return layers.prepare(cfg.mods, cfg.overwrite_dir, cfg.extra_files);
+}
+
 static void tryUnmountStale(const std::string& path)
 {
   pid_t pid = fork();
@@ -99,67 +127,46 @@ static void tryUnmountStale(const std::string& path)
   }
 }
 
+// Reports progress as "progress <done> <total>" lines, which also tell the
+// GUI the helper is still busy.
 static void flushStaging(const std::string& stagingDir,
                          const std::string& overwriteDir,
                          const std::string& outputDir = {})
 {
-  const fs::path staging(stagingDir);
-  const fs::path overwrite = outputDir.empty()
-                                 ? fs::path(overwriteDir)
-                                 : fs::path(outputDir);
-  if (!fs::exists(staging)) {
-    return;
+  const auto result = flushStagingDir(
+      stagingDir, outputDir.empty() ? overwriteDir : outputDir,
+      [](size_t done, size_t total) {
+        std::cout << "progress " << done << " " << total << std::endl;
+      });
+
+  if (result.failed > 0) {
+    std::cerr << "mo2-vfs-helper: " << result.failed << " of " << result.files
+              << " staged files could not be moved" << std::endl;
   }
-
-  std::error_code ec;
-  for (auto it = fs::recursive_directory_iterator(
-           staging, fs::directory_options::skip_permission_denied);
-       it != fs::recursive_directory_iterator(); ++it) {
-    const auto& entry = *it;
-    const fs::path rel = fs::relative(entry.path(), staging, ec);
-    if (ec || rel.empty()) {
-      continue;
-    }
-
-    const fs::path dest = overwrite / rel;
-    if (entry.is_directory(ec)) {
-      fs::create_directories(dest, ec);
-      continue;
-    }
-
-    if (!entry.is_regular_file(ec)) {
-      continue;
-    }
-
-    fs::create_directories(dest.parent_path(), ec);
-    fs::rename(entry.path(), dest, ec);
-    if (ec) {
-      ec.clear();
-      fs::copy_file(entry.path(), dest, fs::copy_options::overwrite_existing, ec);
-      if (!ec) {
-        fs::remove(entry.path(), ec);
-      }
-    }
-  }
-
-  fs::remove_all(staging, ec);
 }
 
 static void setupFuseOps(struct fuse_lowlevel_ops* ops)
 {
   std::memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
-  ops->lookup  = mo2_lookup;
-  ops->getattr = mo2_getattr;
-  ops->readdir = mo2_readdir;
-  ops->open    = mo2_open;
-  ops->read    = mo2_read;
-  ops->write   = mo2_write;
-  ops->create  = mo2_create;
-  ops->rename  = mo2_rename;
-  ops->setattr = mo2_setattr;
-  ops->unlink  = mo2_unlink;
-  ops->mkdir   = mo2_mkdir;
-  ops->release = mo2_release;
+  ops->init         = mo2_init;
+  ops->lookup       = mo2_lookup;
+  ops->getattr      = mo2_getattr;
+  ops->opendir      = mo2_opendir;
+  ops->readdir      = mo2_readdir;
+  ops->readdirplus  = mo2_readdirplus;
+  ops->releasedir   = mo2_releasedir;
+  ops->open         = mo2_open;
+  ops->read         = mo2_read;
+  ops->write        = mo2_write;
+  ops->create       = mo2_create;
+  ops->rename       = mo2_rename;
+  ops->setattr      = mo2_setattr;
+  ops->unlink       = mo2_unlink;
+  ops->mkdir        = mo2_mkdir;
+  ops->flush        = mo2_flush;
+  ops->release      = mo2_release;
+  ops->forget       = mo2_forget;
+  ops->forget_multi = mo2_forget_multi;
 }
 
 static struct fuse_session* g_session = nullptr;
@@ -171,16 +178,63 @@ static void signalHandler(int /*sig*/)
   }
 }
 
+// mo2-vfs-helper --scan-cache <file> [--validate]: prints what a scan cache
+// holds and, with --validate, which of its roots changed on disk since
+static int dumpScanCache(const std::string& path, bool validate)
+{
+  VfsScanCache cache;
+  std::string error;
+  if (!cache.load(path, error)) {
+    std::cout << "error: " << error << std::endl;
+    return 1;
+  }
+
+  const auto stats = cache.stats();
+  std::error_code ec;
+  std::cout << "file: " << path << " (" << fs::file_size(path, ec) << " bytes)\n"
+            << "roots: " << stats.roots << "\n"
+            << "entries: " << stats.entries << "\n"
+            << "directories: " << stats.dirs << std::endl;
+
+  if (!validate) {
+    return 0;
+  }
+
+  const auto stale = cache.validate();
+  for (const auto& root : stale) {
+    std::cout << "stale: " << root << "\n";
+  }
+  std::cout << stale.size() << " of " << stats.roots << " roots changed"
+            << std::endl;
+  return stale.empty() ? 0 : 2;
+}
+
 int main(int argc, char* argv[])
 {
   if (argc < 2) {
-    std::cerr << "Usage: mo2-vfs-helper <config-file>\n";
+    std::cerr << "Usage: mo2-vfs-helper <config-file> [--trace <file>]\n"
+                 "       mo2-vfs-helper --scan-cache <file> [--validate]\n";
     return 1;
   }
 
+  if (std::string_view(argv[1]) == "--scan-cache") {
+    if (argc < 3) {
+      std::cerr << "Usage: mo2-vfs-helper --scan-cache <file> [--validate]\n";
+      return 1;
+    }
+    return dumpScanCache(argv[2],
+                         argc > 3 && std::string_view(argv[3]) == "--validate");
+  }
+
   const std::string configPath = argv[1];
   auto config                  = readConfig(configPath);
 
+  // every request the mount serves is logged for mo2-vfs-replay
+  std::string tracePath;
+  if (argc > 3 && std::string_view(argv[2]) == "--trace") {
+    tracePath = argv[3];
+  }
+
   if (config.mount_point.empty()) {
     std::cout << "error: mount_point not set in config" << std::endl;
     return 1;
@@ -204,7 +258,20 @@ int main(int argc, char* argv[])
   }
 
   // Scan base game files BEFORE mounting (after mount they're hidden)
-  auto baseFileCache = scanDataDir(dataDirPath);
+  VfsScanCache scanCache;
+  if (!config.scan_cache.empty()) {
+    std::string error;
+    if (!scanCache.load(config.scan_cache, error)) {
+      std::cerr << "mo2-vfs-helper: no scan cache: " << error << std::endl;
+    }
+  }
+  VfsLayerSet layers(scanCache.dataDir(dataDirPath)->entries);
+  if (!config.scan_cache.empty()) {
+    std::string error;
+    if (!scanCache.save(config.scan_cache, error)) {
+      std::cerr << "mo2-vfs-helper: " << error << std::endl;
+    }
+  }
 
   // Open fd to data dir BEFORE mounting so we can access original files
   int backingFd = open(dataDirPath.c_str(), O_RDONLY | O_DIRECTORY);
@@ -218,14 +285,15 @@ int main(int argc, char* argv[])
   tryUnmountStale(dataDirPath);
 
   // Build VFS tree
-  auto tree = std::make_shared<VfsTree>(
-      buildDataDirVfs(baseFileCache, dataDirPath, config.mods,
-                      config.overwrite_dir));
-  injectExtraFiles(*tree, config.extra_files);
+  auto tree = std::make_shared<VfsTree>(layers.build(prepareLayers(layers, config)));
 
   auto context            = std::make_shared<Mo2FsContext>();
   context->tree           = tree;
-  context->inodes         = std::make_unique<InodeTable>();
+  context->negatives      = std::make_unique<NegativeCache>();
+  context->inodes         = std::make_unique<InodeTable>(
+      [negatives = context->negatives.get()](uint64_t ino) {
+        negatives->dropParent(ino);
+      });
   context->overwrite =
       std::make_unique<OverwriteManager>(stagingDir, config.overwrite_dir);
   context->backing_dir_fd = backingFd;
@@ -249,6 +317,16 @@ int main(int argc, char* argv[])
   struct fuse_lowlevel_ops ops;
   setupFuseOps(&ops);
 
+  VfsTraceWriter trace;
+  if (!tracePath.empty()) {
+    std::string error;
+    if (trace.open(tracePath, error)) {
+      installVfsTrace(&ops, &trace);
+    } else {
+      std::cerr << "mo2-vfs-helper: not tracing: " << error << std::endl;
+    }
+  }
+
   struct fuse_session* session =
       fuse_session_new(&args, &ops, sizeof(ops), context.get());
   if (session == nullptr) {
@@ -265,6 +343,7 @@ int main(int argc, char* argv[])
   }
 
   g_session = session;
+  context->session.store(session, std::memory_order_release);
 
   // Handle signals for clean shutdown
   struct sigaction sa;
@@ -285,15 +364,13 @@ int main(int argc, char* argv[])
   std::string line;
   while (std::getline(std::cin, line)) {
     if (line == "rebuild") {
+      // only mods that were added or changed are read from the mapping (or
+      // scanned without one), and the mounted tree is patched in place
       auto newConfig = readConfig(configPath);
-      auto newTree   = std::make_shared<VfsTree>(buildDataDirVfs(
-          baseFileCache, dataDirPath, newConfig.mods, newConfig.overwrite_dir));
-      injectExtraFiles(*newTree, newConfig.extra_files);
-
-      {
-        std::unique_lock lock(context->tree_mutex);
-        context->tree.swap(newTree);
-      }
+      auto update    = prepareLayers(layers, newConfig);
+      mo2_patch_tree(context.get(), [&](VfsTree& current) {
+        layers.apply(current, std::move(update));
+      });
 
       config = newConfig;
       std::cout << "ok" << std::endl;
@@ -301,24 +378,28 @@ int main(int argc, char* argv[])
       flushStaging(stagingDir, config.overwrite_dir, config.output_dir);
       fs::create_directories(stagingDir, ec);
 
-      auto newTree = std::make_shared<VfsTree>(buildDataDirVfs(
-          baseFileCache, dataDirPath, config.mods, config.overwrite_dir));
-      injectExtraFiles(*newTree, config.extra_files);
+      // staged files moved, so start from a fresh tree; unchanged mods come
+      // from their previous scans
+      auto newTree = std::make_shared<VfsTree>(layers.build(
+          layers.prepare(config.mods, config.overwrite_dir, config.extra_files)));
 
-      {
-        std::unique_lock lock(context->tree_mutex);
-        context->tree.swap(newTree);
-      }
+      mo2_swap_tree(context.get(), std::move(newTree));
 
       context->overwrite =
           std::make_unique<OverwriteManager>(stagingDir, config.overwrite_dir);
       std::cout << "ok" << std::endl;
+    } else if (line == "stats") {
+      for (const std::string& stat : mo2_stats_report(context.get(), 20)) {
+        std::cout << "stats " << stat << "\n";
+      }
+      std::cout << "ok" << std::endl;
     } else if (line == "quit") {
       break;
     }
   }
 
   // Clean shutdown
+  context->session.store(nullptr, std::memory_order_release);
   fuse_session_exit(session);
   fuse_session_unmount(session);
 
@@ -328,6 +409,7 @@ int main(int argc, char* argv[])
 
   fuse_session_destroy(session);
   g_session = nullptr;
+  trace.close();
 
   flushStaging(stagingDir, config.overwrite_dir, config.output_dir);
   close(backingFd);
@@ -0,0 +1,650 @@
+#include "vfslayers.h"
+
+#include "../envdirscan.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace
+{
+namespace fs = std::filesystem;
+
+std::vector<std::string> splitPath(const std::string& path)
+{
+  std::vector<std::string> out;
+
+  size_t start = 0;
+  while (start < path.size()) {
+    const size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      out.push_back(path.substr(start));
+      break;
+    }
+    if (end > start) {
+      out.push_back(path.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+
+  return out;
+}
+
+std::pair<std::string_view, std::string_view> splitDirName(std::string_view path)
+{
+  const size_t slash = path.rfind('/');
+  if (slash == std::string_view::npos) {
+    return {{}, path};
+  }
+  return {path.substr(0, slash), path.substr(slash + 1)};
+}
+
+// Inserts one entry of a layer's scan, counting what is new.
+void insertEntry(VfsTree& tree, VfsOriginId origin, const CachedBaseFile& e)
+{
+  const auto components = splitPath(e.relative_path);
+  if (e.is_dir) {
+    if (tree.insertDirectory(components)) {
+      ++tree.dir_count;
+    }
+  } else {
+    const auto [dir, name] = splitDirName(e.relative_path);
+    if (tree.insertFile(components, origin, dir, name, e.size, e.mtime)) {
+      ++tree.file_count;
+    }
+  }
+}
+
+// Scans recorded from the directory refresher's walk have FILETIME mtimes,
+// in whole 100ns ticks, while stat gives nanoseconds; mtimes are compared at
+// the coarser precision so the same file doesn't look modified.
+bool sameMtime(std::chrono::system_clock::time_point a,
+               std::chrono::system_clock::time_point b)
+{
+  using Ticks = std::chrono::duration<int64_t, std::ratio<1, 10000000>>;
+  return std::chrono::floor<Ticks>(a) == std::chrono::floor<Ticks>(b);
+}
+
+std::string layerKey(const std::string& name, const std::string& root)
+{
+  std::string key = name;
+  key.push_back('\0');
+  key += root;
+  return key;
+}
+
+VfsLayerSet::DirStamp stampOf(const struct stat& st)
+{
+  VfsLayerSet::DirStamp stamp;
+  stamp.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  stamp.ctime = int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+  stamp.ino   = st.st_ino;
+  return stamp;
+}
+
+VfsLayerSet::DirStamp dirStamp(const fs::path& dir)
+{
+  struct stat st;
+  if (::stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return {};
+  }
+  return stampOf(st);
+}
+
+// Walks a layer the way addDirectoryToTree() does, remembering directory
+// stamps so unchanged layers can be recognized later.  Directories whose
+// stamp is the same as in `previous` aren't listed again; their entries are
+// taken from it and only their subdirectories are visited.
+class LayerScanner
+{
+public:
+  LayerScanner(const std::string& root, const VfsLayerSet::Scan* previous,
+               bool skip_meta)
+      : m_root(root), m_skipMeta(skip_meta)
+  {
+    if (previous == nullptr) {
+      return;
+    }
+
+    for (const auto& [rel, stamp] : previous->dirs) {
+      m_stamps.emplace(rel, stamp);
+    }
+    for (const CachedBaseFile& e : previous->entries) {
+      const size_t slash = e.relative_path.rfind('/');
+      const std::string_view parent =
+          slash == std::string::npos
+              ? std::string_view()
+              : std::string_view(e.relative_path).substr(0, slash);
+      m_children[parent].push_back(&e);
+    }
+  }
+
+  VfsLayerSet::Scan run()
+  {
+    // the root may be a symlink, mod directories sometimes are
+    visit(env::openScanDirectory(AT_FDCWD, m_root.c_str()), std::string(), 0);
+    return std::move(m_scan);
+  }
+
+private:
+  fs::path m_root;
+  bool m_skipMeta;
+  std::unordered_map<std::string_view, VfsLayerSet::DirStamp> m_stamps;
+  std::unordered_map<std::string_view, std::vector<const CachedBaseFile*>> m_children;
+  VfsLayerSet::Scan m_scan;
+
+  struct Listing
+  {
+    std::vector<char> buffer;
+    std::vector<env::ScannedEntry> entries;
+  };
+  std::vector<Listing> m_listings;
+
+  // Stamps the open directory `fd`, which is `rel` in the layer, and walks
+  // it; closes `fd`.  A directory that couldn't be opened (-1) gets an empty
+  // stamp.
+  void visit(int fd, const std::string& rel, size_t depth)
+  {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      m_scan.dirs.emplace_back(rel, VfsLayerSet::DirStamp());
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+
+    const VfsLayerSet::DirStamp stamp = stampOf(st);
+    m_scan.dirs.emplace_back(rel, stamp);
+    walk(fd, rel, depth, stamp);
+    close(fd);
+  }
+
+  // `name` is the last component of `rel`, opened relative to `parent`; a
+  // directory replaced by a symlink since it was listed isn't followed
+  void enter(int parent, const std::string& rel, const char* name, size_t depth)
+  {
+    visit(openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), rel,
+          depth);
+  }
+
+  void walk(int fd, const std::string& rel, size_t depth,
+            const VfsLayerSet::DirStamp& stamp)
+  {
+    auto known = m_stamps.find(rel);
+    if (known != m_stamps.end() && known->second == stamp) {
+      auto children = m_children.find(rel);
+      if (children == m_children.end()) {
+        return;
+      }
+      const size_t nameStart = rel.empty() ? 0 : rel.size() + 1;
+      for (const CachedBaseFile* e : children->second) {
+        m_scan.entries.push_back(*e);
+        // symlinked directories have no stamp of their own
+        if (e->is_dir && m_stamps.contains(e->relative_path)) {
+          enter(fd, e->relative_path, e->relative_path.c_str() + nameStart, depth + 1);
+        }
+      }
+      return;
+    }
+
+    // one listing per depth, reused for every directory at that depth
+    if (m_listings.size() <= depth) {
+      m_listings.resize(depth + 1);
+    }
+    Listing& listing = m_listings[depth];
+    if (!env::scanDirectory(fd, listing.buffer, listing.entries)) {
+      return;
+    }
+
+    // entries stay valid while deeper levels are listed, `listing` might not
+    for (size_t i = 0; i < m_listings[depth].entries.size(); ++i) {
+      const env::ScannedEntry& e = m_listings[depth].entries[i];
+      if (rel.empty() && m_skipMeta && e.name == "meta.ini") {
+        continue;
+      }
+
+      CachedBaseFile cf;
+      cf.relative_path.reserve(rel.size() + 1 + e.name.size());
+      cf.relative_path = rel;
+      if (!rel.empty()) {
+        cf.relative_path.push_back('/');
+      }
+      cf.relative_path += e.name;
+      cf.is_dir = e.is_dir;
+
+      if (cf.is_dir) {
+        // like recursive_directory_iterator, symlinked directories are
+        // listed but not followed
+        m_scan.entries.push_back(cf);
+        if (!e.is_symlink) {
+          enter(fd, cf.relative_path, e.name.data(), depth + 1);
+        }
+        continue;
+      }
+
+      cf.size  = e.size;
+      cf.mtime = e.mtime;
+      m_scan.entries.push_back(std::move(cf));
+    }
+  }
+};
+
+// Listing is bound by metadata latency rather than CPU, and SSDs and the page
+// cache serve many directory reads at once, so this may exceed the core count
+// on small machines.
+unsigned scanThreads()
+{
+  return std::clamp(std::thread::hardware_concurrency() * 2, 2u, 16u);
+}
+
+std::string normalizedRoot(const std::string& root)
+{
+  std::string out = fs::path(root).lexically_normal().generic_string();
+  while (out.size() > 1 && out.back() == '/') {
+    out.pop_back();
+  }
+  return out;
+}
+
+}  // namespace
+
+void VfsLayerSet::ScanTable::add(const std::string& root,
+                                 std::shared_ptr<const Scan> scan, bool check_files)
+{
+  std::string key = normalizedRoot(root);
+  if (check_files) {
+    m_unchecked.insert(key);
+  } else {
+    m_unchecked.erase(key);
+  }
+  m_scans[std::move(key)] = std::move(scan);
+}
+
+std::shared_ptr<const VfsLayerSet::Scan>
+VfsLayerSet::ScanTable::find(const std::string& root) const
+{
+  if (m_scans.empty()) {
+    return nullptr;
+  }
+
+  auto it = m_scans.find(normalizedRoot(root));
+  return it == m_scans.end() ? nullptr : it->second;
+}
+
+bool VfsLayerSet::ScanTable::needsFileCheck(const std::string& root) const
+{
+  return !m_unchecked.empty() && m_unchecked.contains(normalizedRoot(root));
+}
+
+VfsScanRecorder::VfsScanRecorder(std::string root) : m_root(std::move(root))
+{
+  // stamped before the walk lists anything, so changes made during it are
+  // seen as changes later
+  m_scan.dirs.emplace_back(std::string(), dirStamp(fs::path(m_root)));
+}
+
+void VfsScanRecorder::enterDirectory(std::string_view name,
+                                     const VfsLayerSet::DirStamp& stamp)
+{
+  m_parents.push_back(m_path.size());
+  if (!m_path.empty()) {
+    m_path.push_back('/');
+  }
+  m_path += name;
+
+  CachedBaseFile cf;
+  cf.relative_path = m_path;
+  cf.is_dir        = true;
+  m_scan.entries.push_back(std::move(cf));
+  m_scan.dirs.emplace_back(m_path, stamp);
+}
+
+void VfsScanRecorder::leaveDirectory()
+{
+  if (!m_parents.empty()) {
+    m_path.resize(m_parents.back());
+    m_parents.pop_back();
+  }
+}
+
+void VfsScanRecorder::addFile(std::string_view name, uint64_t size,
+                              std::chrono::system_clock::time_point mtime)
+{
+  if (m_path.empty() && name == "meta.ini") {
+    return;
+  }
+
+  CachedBaseFile cf;
+  cf.relative_path = m_path;
+  if (!cf.relative_path.empty()) {
+    cf.relative_path.push_back('/');
+  }
+  cf.relative_path += name;
+  cf.size  = size;
+  cf.mtime = mtime;
+  m_scan.entries.push_back(std::move(cf));
+}
+
+std::shared_ptr<const VfsLayerSet::Scan> VfsScanRecorder::finish()
+{
+  return std::make_shared<const VfsLayerSet::Scan>(std::move(m_scan));
+}
+
+VfsLayerSet::VfsLayerSet(const std::vector<CachedBaseFile>& base_files)
+{
+  m_base.entries = base_files;
+}
+
+VfsLayerSet::Update VfsLayerSet::prepare(
+    const std::vector<std::pair<std::string, std::string>>& mods,
+    const std::string& overwrite_dir,
+    const std::vector<std::pair<std::string, std::string>>& extra_files,
+    const ScanTable& prescanned) const
+{
+  std::unordered_map<std::string, const Layer*> current;
+  for (const Layer& layer : m_layers) {
+    current.emplace(layerKey(layer.name, layer.root), &layer);
+  }
+
+  Update update;
+  update.layers.reserve(mods.size() + 1);
+  update.layers.push_back({"Overwrite", overwrite_dir, nullptr});
+  for (const auto& [modName, modPath] : mods) {
+    update.layers.push_back({modName, modPath, nullptr});
+  }
+
+  // Checking and walking the layers is all filesystem work and layers don't
+  // share anything, so they are scanned in parallel, each into its own Scan.
+  // Their order only matters once they are merged into a tree by priority in
+  // build() or apply(), so the result is the same as scanning one by one.
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> rescanned{0};
+
+  auto worker = [&] {
+    for (size_t i = next.fetch_add(1); i < update.layers.size(); i = next.fetch_add(1)) {
+      Layer& layer = update.layers[i];
+
+      auto it = current.find(layerKey(layer.name, layer.root));
+      std::shared_ptr<const Scan> previous =
+          it != current.end() ? it->second->scan : nullptr;
+      auto scan = prescanned.find(layer.root);
+      if (scan && prescanned.needsFileCheck(layer.root)) {
+        scan = checkFiles(std::move(scan), layer.root);
+      }
+
+      // a scan made elsewhere is at least as new as the layer's own and may
+      // have seen files rewritten in place, which leave no trace in the
+      // directory stamps, so the layer's own is only used without one
+      const std::shared_ptr<const Scan>& best = scan ? scan : previous;
+
+      if (best && unchanged(*best, layer.root)) {
+        layer.scan = best;
+      } else {
+        const Scan* base = best.get();
+        layer.scan =
+            std::make_shared<const Scan>(LayerScanner(layer.root, base, true).run());
+        rescanned.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  const size_t threadCount =
+      std::min<size_t>(scanThreads(), update.layers.size());
+  std::vector<std::thread> threads;
+  threads.reserve(threadCount);
+  for (size_t i = 1; i < threadCount; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+  update.rescanned = rescanned.load();
+
+  for (const auto& [relPath, realPath] : extra_files) {
+    std::error_code ec;
+    const auto size = fs::file_size(realPath, ec);
+    update.extra_files.push_back({relPath, realPath, ec ? 0ULL : size});
+  }
+
+  return update;
+}
+
+std::shared_ptr<const VfsLayerSet::Scan>
+VfsLayerSet::scanDataDir(const std::string& root, const Scan* previous)
+{
+  return std::make_shared<const Scan>(LayerScanner(root, previous, false).run());
+}
+
+bool VfsLayerSet::unchanged(const Scan& scan, const std::string& root)
+{
+  const fs::path rootPath(root);
+  for (const auto& [rel, stamp] : scan.dirs) {
+    if (dirStamp(rel.empty() ? rootPath : rootPath / rel) != stamp) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const VfsLayerSet::Scan>
+VfsLayerSet::checkFiles(std::shared_ptr<const Scan> scan, const std::string& root)
+{
+  const int fd = env::openScanDirectory(AT_FDCWD, root.c_str());
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  std::shared_ptr<Scan> fixed;
+  bool gone = false;
+  for (size_t i = 0; i < scan->entries.size() && !gone; ++i) {
+    const CachedBaseFile& e = scan->entries[i];
+    if (e.is_dir) {
+      continue;
+    }
+
+    env::ScannedEntry now;
+    if (!env::scanFile(fd, e.relative_path.c_str(), now)) {
+      gone = true;
+    } else if (now.size != e.size || !sameMtime(now.mtime, e.mtime)) {
+      if (!fixed) {
+        fixed = std::make_shared<Scan>(*scan);
+        // no longer what the mapping it came from holds
+        fixed->fingerprint = 0;
+      }
+      fixed->entries[i].size  = now.size;
+      fixed->entries[i].mtime = now.mtime;
+    }
+  }
+  close(fd);
+
+  if (gone) {
+    return nullptr;
+  }
+  return fixed ? std::move(fixed) : std::move(scan);
+}
+
+void VfsLayerSet::apply(VfsTree& tree, Update update)
+{
+  std::unordered_map<std::string, const Layer*> previous;
+  for (const Layer& layer : m_layers) {
+    previous.emplace(layerKey(layer.name, layer.root), &layer);
+  }
+
+  // priorities go first, so that anything uncovered below is picked by the
+  // new order
+  std::vector<const Scan*> before(update.layers.size(), nullptr);
+  bool reordered = false;
+  for (size_t i = 0; i < update.layers.size(); ++i) {
+    const Layer& layer     = update.layers[i];
+    const VfsOriginId id   = tree.addOrigin(layer.name, layer.root);
+    const int32_t priority = static_cast<int32_t>(i + 1);
+
+    auto it = previous.find(layerKey(layer.name, layer.root));
+    if (it != previous.end()) {
+      before[i]  = it->second->scan.get();
+      reordered |= tree.origin(id).priority != priority;
+      previous.erase(it);
+    }
+    tree.setPriority(id, priority);
+  }
+
+  // whatever is left was disabled or removed
+  for (const auto& [key, layer] : previous) {
+    patchLayer(tree, tree.addOrigin(layer->name, layer->root), layer->scan.get(),
+               nullptr);
+  }
+
+  for (size_t i = 0; i < update.layers.size(); ++i) {
+    const Layer& layer = update.layers[i];
+    if (before[i] != layer.scan.get()) {
+      patchLayer(tree, tree.addOrigin(layer.name, layer.root), before[i],
+                 layer.scan.get());
+    }
+  }
+
+  if (reordered) {
+    tree.reresolveConflicts();
+  }
+
+  // extra files are few and rewritten all the time, so always re-insert them
+  const VfsOriginId profile = tree.addOrigin("_profile", {});
+  std::unordered_set<std::string_view> keep;
+  for (const ExtraFile& f : update.extra_files) {
+    keep.insert(f.path);
+  }
+  for (const ExtraFile& f : m_extraFiles) {
+    if (!keep.contains(f.path) && tree.removeFile(splitPath(f.path), profile)) {
+      --tree.file_count;
+    }
+  }
+
+  refillUncovered(tree, update.layers);
+
+  for (const ExtraFile& f : update.extra_files) {
+    if (tree.insertFile(splitPath(f.path), f.real, f.size,
+                        std::chrono::system_clock::now(), "_profile")) {
+      ++tree.file_count;
+    }
+  }
+
+  m_layers     = std::move(update.layers);
+  m_extraFiles = std::move(update.extra_files);
+}
+
+VfsTree VfsLayerSet::build(Update update)
+{
+  VfsTree tree;
+
+  // the base origin has no root, so realPath() is the relative path and the
+  // FUSE handler uses openat(backing_fd, rel)
+  const VfsOriginId base = tree.addOrigin("_base_game", {}, /*is_backing=*/true);
+  tree.setPriority(base, 0);
+  patchLayer(tree, base, nullptr, &m_base);
+
+  for (size_t i = 0; i < update.layers.size(); ++i) {
+    const Layer& layer   = update.layers[i];
+    const VfsOriginId id = tree.addOrigin(layer.name, layer.root);
+    tree.setPriority(id, static_cast<int32_t>(i + 1));
+    patchLayer(tree, id, nullptr, layer.scan.get());
+  }
+
+  for (const ExtraFile& f : update.extra_files) {
+    if (tree.insertFile(splitPath(f.path), f.real, f.size,
+                        std::chrono::system_clock::now(), "_profile")) {
+      ++tree.file_count;
+    }
+  }
+
+  m_layers     = std::move(update.layers);
+  m_extraFiles = std::move(update.extra_files);
+  return tree;
+}
+
+// Moves the tree from one scan of a layer to another: what the layer no
+// longer has is released, deepest first, and everything it has now is
+// (re)inserted, which also refreshes sizes and mtimes.  Either side may be
+// null for a layer that is being added or dropped.
+void VfsLayerSet::patchLayer(VfsTree& tree, VfsOriginId origin, const Scan* before,
+                             const Scan* after)
+{
+  std::unordered_set<std::string_view> files;
+  std::unordered_set<std::string_view> dirs;
+  if (after != nullptr) {
+    for (const CachedBaseFile& e : after->entries) {
+      (e.is_dir ? dirs : files).insert(e.relative_path);
+    }
+  }
+
+  std::unordered_set<std::string_view> hadDirs;
+  if (before != nullptr) {
+    for (auto it = before->entries.rbegin(); it != before->entries.rend(); ++it) {
+      if (it->is_dir) {
+        hadDirs.insert(it->relative_path);
+        if (!dirs.contains(it->relative_path) &&
+            tree.releaseDirectory(splitPath(it->relative_path))) {
+          --tree.dir_count;
+        }
+      } else if (!files.contains(it->relative_path) &&
+                 tree.removeFile(splitPath(it->relative_path), origin)) {
+        --tree.file_count;
+      }
+    }
+  }
+
+  if (after == nullptr) {
+    return;
+  }
+
+  for (const CachedBaseFile& e : after->entries) {
+    if (!e.is_dir || !hadDirs.contains(e.relative_path)) {
+      insertEntry(tree, origin, e);
+    }
+  }
+}
+
+// A directory a file had taken the place of lost its contents then; once the
+// file is gone, every layer's entries below it are inserted again, in
+// priority order like build() does, so the same providers end up visible.
+void VfsLayerSet::refillUncovered(VfsTree& tree, const std::vector<Layer>& layers) const
+{
+  std::vector<std::string> prefixes;
+  for (const std::string& dir : tree.takeUncovered()) {
+    // a file may have taken its place again since
+    const VfsNode* node = tree.resolve(splitPath(dir));
+    if (node != nullptr && node->is_directory) {
+      prefixes.push_back(normalizeForLookup(dir) + '/');
+    }
+  }
+
+  if (prefixes.empty()) {
+    return;
+  }
+
+  std::string folded;
+  const auto refill = [&](VfsOriginId origin, const Scan& scan) {
+    for (const CachedBaseFile& e : scan.entries) {
+      vfsFoldName(e.relative_path, folded);
+      if (std::any_of(prefixes.begin(), prefixes.end(), [&](const std::string& p) {
+            return folded.starts_with(p);
+          })) {
+        insertEntry(tree, origin, e);
+      }
+    }
+  };
+
+  refill(tree.addOrigin("_base_game", {}, /*is_backing=*/true), m_base);
+  for (const Layer& layer : layers) {
+    if (layer.scan) {
+      refill(tree.addOrigin(layer.name, layer.root), *layer.scan);
+    }
+  }
+}
@@ -0,0 +1,164 @@
+#ifndef VFS_VFSLAYERS_H
+#define VFS_VFSLAYERS_H
+
+#include "vfstree.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Keeps the scan of every layer of a data-dir VFS (base game, Overwrite, mods)
+// so a changed mod list can be applied to the mounted tree as a patch instead
+// of re-walking every mod directory.
+//
+// Updating is split in two: prepare() does all filesystem work (scanning
+// added mods and mods whose directories changed, several layers at a time)
+// without touching the tree, then apply() patches only the affected paths
+// and re-resolves overrides by priority, which is what the caller holds the
+// tree lock for.  build() turns the same prepared state into a fresh tree
+// instead.
+//
+// Layer priorities match buildDataDirVfs(): base game, then Overwrite, then
+// mods in list order.  Extra file mappings are on top of everything.
+class VfsLayerSet
+{
+public:
+  // what a directory looked like when it was listed; all zero if it didn't
+  // exist
+  struct DirStamp
+  {
+    int64_t mtime = 0;  // nanoseconds
+    int64_t ctime = 0;
+    uint64_t ino  = 0;
+
+    bool operator==(const DirStamp&) const = default;
+  };
+
+  struct Scan
+  {
+    std::vector<CachedBaseFile> entries;  // pre-order, as walked
+    // directory stamps (relative path, "" for the root) at scan time; only
+    // the directories whose stamp changed are listed again on a rescan
+    std::vector<std::pair<std::string, DirStamp>> dirs;
+    // content hash, for scans that came through a mapping file; 0 if unknown
+    uint64_t fingerprint = 0;
+  };
+
+  struct Layer
+  {
+    std::string name;
+    std::string root;
+    std::shared_ptr<const Scan> scan;
+  };
+
+  struct ExtraFile
+  {
+    std::string path;  // VFS-relative
+    std::string real;  // absolute
+    uint64_t size = 0;
+  };
+
+  // Scans of layer roots made elsewhere, see VfsScanRecorder.  Roots are
+  // compared after normalization.
+  class ScanTable
+  {
+  public:
+    // `check_files` is for scans from an earlier session: files may have
+    // been rewritten in place since, which the directory stamps don't show,
+    // so prepare() checks their size and mtime before using the scan
+    void add(const std::string& root, std::shared_ptr<const Scan> scan,
+             bool check_files = false);
+    std::shared_ptr<const Scan> find(const std::string& root) const;
+    bool needsFileCheck(const std::string& root) const;
+    size_t size() const { return m_scans.size(); }
+
+    auto begin() const { return m_scans.begin(); }
+    auto end() const { return m_scans.end(); }
+
+  private:
+    std::unordered_map<std::string, std::shared_ptr<const Scan>> m_scans;
+    std::unordered_set<std::string> m_unchecked;
+  };
+
+  struct Update
+  {
+    std::vector<Layer> layers;  // Overwrite first, then the mods
+    std::vector<ExtraFile> extra_files;
+    size_t rescanned = 0;
+  };
+
+  explicit VfsLayerSet(const std::vector<CachedBaseFile>& base_files);
+
+  // Layers with a scan in `prescanned` use it while it is still up to date,
+  // the others keep their current scan if it is; anything else is walked,
+  // listing only the directories that changed since the best scan it has.
+  Update prepare(const std::vector<std::pair<std::string, std::string>>& mods,
+                 const std::string& overwrite_dir,
+                 const std::vector<std::pair<std::string, std::string>>& extra_files,
+                 const ScanTable& prescanned = {}) const;
+
+  // Patches `tree`, which must have been built by this set, to the prepared
+  // state.
+  void apply(VfsTree& tree, Update update);
+
+  // Builds a new tree from the prepared state; later updates apply to it.
+  VfsTree build(Update update);
+
+  // the current stack, Overwrite first
+  const std::vector<Layer>& layers() const { return m_layers; }
+
+  // Scans the game's Data directory, which unlike a mod keeps its meta.ini,
+  // relisting only the directories that changed since `previous`.
+  static std::shared_ptr<const Scan> scanDataDir(const std::string& root,
+                                                 const Scan* previous = nullptr);
+
+  // Whether every directory of `scan` still has the stamp it was listed with.
+  static bool unchanged(const Scan& scan, const std::string& root);
+
+  // Stats every file of `scan` again.  Returns `scan` itself if they all
+  // still have the size and mtime it lists, a corrected copy otherwise, and
+  // null if one of them is gone, in which case the root has to be walked.
+  static std::shared_ptr<const Scan> checkFiles(std::shared_ptr<const Scan> scan,
+                                                const std::string& root);
+
+private:
+  Scan m_base;
+  std::vector<Layer> m_layers;
+  std::vector<ExtraFile> m_extraFiles;
+
+  static void patchLayer(VfsTree& tree, VfsOriginId origin, const Scan* before,
+                         const Scan* after);
+  void refillUncovered(VfsTree& tree, const std::vector<Layer>& layers) const;
+};
+
+// Builds the Scan of a layer from a depth-first walk someone else is doing
+// anyway, such as the directory refresher's, so the VFS doesn't have to walk
+// the same directory again.  Calls must follow the walk: directories are
+// entered before their contents are reported and left afterwards.
+class VfsScanRecorder
+{
+public:
+  explicit VfsScanRecorder(std::string root);
+
+  // `stamp` is what the directory looked like before the walk listed it
+  void enterDirectory(std::string_view name, const VfsLayerSet::DirStamp& stamp);
+  void leaveDirectory();
+  void addFile(std::string_view name, uint64_t size,
+               std::chrono::system_clock::time_point mtime);
+
+  const std::string& root() const { return m_root; }
+  std::shared_ptr<const VfsLayerSet::Scan> finish();
+
+private:
+  std::string m_root;
+  std::string m_path;  // relative path of the current directory
+  std::vector<size_t> m_parents;
+  VfsLayerSet::Scan m_scan;
+};
+
+#endif
@@ -0,0 +1,369 @@
+#include "vfsmapping.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+#include <unordered_map>
+
+using namespace vfsmapping;
+
+namespace
+{
+namespace fs = std::filesystem;
+
+static_assert(sizeof(MapHeader) == 32);
+static_assert(sizeof(MapLayer) == 40);
+static_assert(sizeof(MapEntry) == 32);
+static_assert(sizeof(MapDir) == 32);
+static_assert(sizeof(MapExtra) == 24);
+
+class StringTable
+{
+public:
+  MapString add(std::string_view s)
+  {
+    auto it = m_offsets.find(s);
+    if (it != m_offsets.end()) {
+      return it->second;
+    }
+
+    const MapString ref{static_cast<uint32_t>(m_bytes.size()),
+                        static_cast<uint32_t>(s.size())};
+    m_bytes.append(s);
+    m_offsets.emplace(s, ref);
+    return ref;
+  }
+
+  const std::string& bytes() const { return m_bytes; }
+
+private:
+  std::string m_bytes;
+  // keys view the callers' strings, which outlive the table
+  std::unordered_map<std::string_view, MapString> m_offsets;
+};
+
+class Fingerprint
+{
+public:
+  void add(const void* data, size_t size)
+  {
+    const auto* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      m_hash ^= p[i];
+      m_hash *= 1099511628211ull;
+    }
+  }
+
+  void add(std::string_view s)
+  {
+    add(s.data(), s.size());
+    add(uint8_t(0));
+  }
+
+  template <class T>
+    requires std::is_arithmetic_v<T>
+  void add(T value)
+  {
+    add(&value, sizeof(value));
+  }
+
+  // 0 means "unknown" to VfsLayerSet
+  uint64_t value() const { return m_hash == 0 ? 1 : m_hash; }
+
+private:
+  uint64_t m_hash = 14695981039346656037ull;
+};
+
+template <class T>
+void append(std::string& out, const T& record)
+{
+  out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+// read-only mapping of a whole file, unmapped on destruction
+class MappedFile
+{
+public:
+  MappedFile(const MappedFile&)            = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  explicit MappedFile(const std::string& path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        m_data = static_cast<const char*>(p);
+        m_size = static_cast<size_t>(st.st_size);
+        ::madvise(p, m_size, MADV_SEQUENTIAL);
+      }
+    }
+
+    ::close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (m_data != nullptr) {
+      ::munmap(const_cast<char*>(m_data), m_size);
+    }
+  }
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const char* m_data = nullptr;
+  size_t m_size      = 0;
+};
+
+template <class T>
+const T* records(const char* base, uint64_t& offset, uint32_t count)
+{
+  const auto* p = reinterpret_cast<const T*>(base + offset);
+  offset += uint64_t(count) * sizeof(T);
+  return p;
+}
+
+}  // namespace
+
+bool writeVfsMapping(const std::string& path, const VfsLayerSet::Update& update,
+                     std::string& error)
+{
+  StringTable strings;
+  std::vector<MapLayer> layers;
+  std::vector<MapEntry> entries;
+  std::vector<MapDir> dirs;
+  std::vector<MapExtra> extras;
+
+  for (const VfsLayerSet::Layer& layer : update.layers) {
+    MapLayer l{};
+    l.name       = strings.add(layer.name);
+    l.root       = strings.add(layer.root);
+    l.firstEntry = static_cast<uint32_t>(entries.size());
+    l.firstDir   = static_cast<uint32_t>(dirs.size());
+
+    Fingerprint fp;
+    for (const CachedBaseFile& e : layer.scan->entries) {
+      MapEntry m{};
+      m.size  = e.size;
+      m.mtime = e.mtime.time_since_epoch().count();
+      m.path  = strings.add(e.relative_path);
+      m.flags = e.is_dir ? uint32_t(EntryDirectory) : 0;
+      entries.push_back(m);
+
+      fp.add(e.relative_path);
+      fp.add(m.size);
+      fp.add(m.mtime);
+      fp.add(m.flags);
+    }
+
+    for (const auto& [rel, stamp] : layer.scan->dirs) {
+      const MapDir d{stamp.mtime, stamp.ctime, stamp.ino, strings.add(rel)};
+      dirs.push_back(d);
+
+      fp.add(rel);
+      fp.add(d.mtime);
+      fp.add(d.ctime);
+      fp.add(d.ino);
+    }
+
+    l.entryCount  = static_cast<uint32_t>(entries.size()) - l.firstEntry;
+    l.dirCount    = static_cast<uint32_t>(dirs.size()) - l.firstDir;
+    l.fingerprint = fp.value();
+    layers.push_back(l);
+  }
+
+  for (const VfsLayerSet::ExtraFile& f : update.extra_files) {
+    extras.push_back({f.size, strings.add(f.path), strings.add(f.real)});
+  }
+
+  if (strings.bytes().size() > UINT32_MAX) {
+    error = "mapping too large";
+    return false;
+  }
+
+  MapHeader header{};
+  std::memcpy(header.magic, Magic, sizeof(Magic));
+  header.version     = Version;
+  header.layerCount  = static_cast<uint32_t>(layers.size());
+  header.entryCount  = static_cast<uint32_t>(entries.size());
+  header.dirCount    = static_cast<uint32_t>(dirs.size());
+  header.extraCount  = static_cast<uint32_t>(extras.size());
+  header.stringBytes = static_cast<uint32_t>(strings.bytes().size());
+
+  std::string out;
+  out.reserve(sizeof(header) + layers.size() * sizeof(MapLayer) +
+              entries.size() * sizeof(MapEntry) + dirs.size() * sizeof(MapDir) +
+              extras.size() * sizeof(MapExtra) + strings.bytes().size());
+
+  append(out, header);
+  for (const MapLayer& l : layers) {
+    append(out, l);
+  }
+  for (const MapEntry& e : entries) {
+    append(out, e);
+  }
+  for (const MapDir& d : dirs) {
+    append(out, d);
+  }
+  for (const MapExtra& x : extras) {
+    append(out, x);
+  }
+  out += strings.bytes();
+
+  // the helper may read the old file until the rename
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file || !file.write(out.data(), static_cast<std::streamsize>(out.size()))) {
+      error = "failed to write " + tmp;
+      return false;
+    }
+  }
+
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    error = "failed to replace " + path + ": " + ec.message();
+    return false;
+  }
+
+  return true;
+}
+
+std::optional<VfsLayerSet::Update> readVfsMapping(const std::string& path,
+                                                  const VfsLayerSet& layers,
+                                                  std::string& error)
+{
+  const MappedFile file(path);
+  if (file.data() == nullptr) {
+    error = "cannot map " + path;
+    return std::nullopt;
+  }
+
+  MapHeader header;
+  if (file.size() < sizeof(header)) {
+    error = "truncated header";
+    return std::nullopt;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+    error = "not a VFS mapping";
+    return std::nullopt;
+  }
+  if (header.version != Version) {
+    error = "unsupported version " + std::to_string(header.version);
+    return std::nullopt;
+  }
+
+  const uint64_t expected =
+      sizeof(header) + uint64_t(header.layerCount) * sizeof(MapLayer) +
+      uint64_t(header.entryCount) * sizeof(MapEntry) +
+      uint64_t(header.dirCount) * sizeof(MapDir) +
+      uint64_t(header.extraCount) * sizeof(MapExtra) + header.stringBytes;
+  if (expected != file.size()) {
+    error = "size mismatch";
+    return std::nullopt;
+  }
+
+  // every record is 8-byte sized and mmap is page aligned, so the arrays are
+  // suitably aligned in place
+  uint64_t offset      = sizeof(header);
+  const auto* mLayers  = records<MapLayer>(file.data(), offset, header.layerCount);
+  const auto* mEntries = records<MapEntry>(file.data(), offset, header.entryCount);
+  const auto* mDirs    = records<MapDir>(file.data(), offset, header.dirCount);
+  const auto* mExtras  = records<MapExtra>(file.data(), offset, header.extraCount);
+  const char* strings  = file.data() + offset;
+
+  bool valid = true;
+  auto str   = [&](MapString s) {
+    if (uint64_t(s.offset) + s.length > header.stringBytes) {
+      valid = false;
+      return std::string_view();
+    }
+    return std::string_view(strings + s.offset, s.length);
+  };
+
+  std::unordered_map<std::string, std::shared_ptr<const VfsLayerSet::Scan>> current;
+  for (const VfsLayerSet::Layer& layer : layers.layers()) {
+    if (layer.scan->fingerprint != 0) {
+      current.emplace(layer.name + '\0' + layer.root + '\0' +
+                          std::to_string(layer.scan->fingerprint),
+                      layer.scan);
+    }
+  }
+
+  VfsLayerSet::Update update;
+  update.layers.reserve(header.layerCount);
+
+  for (uint32_t i = 0; i < header.layerCount; ++i) {
+    const MapLayer& l = mLayers[i];
+    if (uint64_t(l.firstEntry) + l.entryCount > header.entryCount ||
+        uint64_t(l.firstDir) + l.dirCount > header.dirCount) {
+      error = "layer out of range";
+      return std::nullopt;
+    }
+
+    VfsLayerSet::Layer layer{std::string(str(l.name)), std::string(str(l.root)),
+                             nullptr};
+
+    auto it = current.find(layer.name + '\0' + layer.root + '\0' +
+                           std::to_string(l.fingerprint));
+    if (it != current.end()) {
+      layer.scan = it->second;
+      update.layers.push_back(std::move(layer));
+      continue;
+    }
+
+    auto scan         = std::make_shared<VfsLayerSet::Scan>();
+    scan->fingerprint = l.fingerprint;
+
+    scan->entries.reserve(l.entryCount);
+    for (uint32_t e = l.firstEntry; e < l.firstEntry + l.entryCount; ++e) {
+      const MapEntry& m = mEntries[e];
+      CachedBaseFile cf;
+      cf.relative_path = str(m.path);
+      cf.size          = m.size;
+      cf.mtime         = std::chrono::system_clock::time_point(
+          std::chrono::system_clock::duration(m.mtime));
+      cf.is_dir = (m.flags & EntryDirectory) != 0;
+      scan->entries.push_back(std::move(cf));
+    }
+
+    scan->dirs.reserve(l.dirCount);
+    for (uint32_t d = l.firstDir; d < l.firstDir + l.dirCount; ++d) {
+      const MapDir& m = mDirs[d];
+      scan->dirs.emplace_back(str(m.path),
+                              VfsLayerSet::DirStamp{m.mtime, m.ctime, m.ino});
+    }
+
+    layer.scan = std::move(scan);
+    update.layers.push_back(std::move(layer));
+  }
+
+  for (uint32_t i = 0; i < header.extraCount; ++i) {
+    update.extra_files.push_back({std::string(str(mExtras[i].path)),
+                                  std::string(str(mExtras[i].real)), mExtras[i].size});
+  }
+
+  if (!valid) {
+    error = "string out of range";
+    return std::nullopt;
+  }
+
+  return update;
+}
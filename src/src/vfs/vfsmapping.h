@@ -0,0 +1,104 @@
+#ifndef VFS_VFSMAPPING_H
+#define VFS_VFSMAPPING_H
+
+#include "vfslayers.h"
+
+#include <optional>
+#include <string>
+
+// Binary form of a prepared VFS layer stack, written by the GUI next to
+// vfs.cfg and mapped by mo2-vfs-helper, so the helper can build or patch its
+// tree without touching the mod directories.
+//
+// The file is a header followed by fixed-size records and a string table:
+//
+//   MapHeader
+//   MapLayer[layerCount]    Overwrite first, then mods by ascending priority
+//   MapEntry[entryCount]    each layer's entries, contiguous and pre-order
+//   MapDir[dirCount]        each layer's directory stamps, contiguous
+//   MapExtra[extraCount]    file mappings on top of all layers
+//   char[stringBytes]       UTF-8, referenced by (offset, length)
+//
+// Entries stay grouped by layer rather than reduced to the winning files;
+// the tree resolves overrides by priority as it inserts them, and keeping the
+// layers lets the helper patch only the ones whose fingerprint changed.
+// Records use native byte order and are only exchanged between the GUI and
+// the helper built alongside it; a different version is rejected and the
+// helper falls back to scanning.
+namespace vfsmapping
+{
+
+constexpr char Magic[8]  = {'M', 'O', '2', 'V', 'M', 'A', 'P', '\0'};
+constexpr uint32_t Version = 2;
+
+struct MapString
+{
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct MapHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t layerCount;
+  uint32_t entryCount;
+  uint32_t dirCount;
+  uint32_t extraCount;
+  uint32_t stringBytes;
+};
+
+struct MapLayer
+{
+  MapString name;
+  MapString root;
+  uint32_t firstEntry;
+  uint32_t entryCount;
+  uint32_t firstDir;
+  uint32_t dirCount;
+  uint64_t fingerprint;
+};
+
+enum EntryFlags : uint32_t
+{
+  EntryDirectory = 1,
+};
+
+struct MapEntry
+{
+  uint64_t size;
+  int64_t mtime;  // system_clock ticks
+  MapString path;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct MapDir
+{
+  int64_t mtime;  // VfsLayerSet::DirStamp
+  int64_t ctime;
+  uint64_t ino;
+  MapString path;
+};
+
+struct MapExtra
+{
+  uint64_t size;
+  MapString path;
+  MapString real;
+};
+
+}  // namespace vfsmapping
+
+// Writes `update` to `path`, atomically replacing an existing file.
+bool writeVfsMapping(const std::string& path, const VfsLayerSet::Update& update,
+                     std::string& error);
+
+// Reads a mapping into an update for `layers`.  Layers whose fingerprint
+// matches the one `layers` currently has keep their existing scan, so
+// VfsLayerSet::apply() skips them.
+std::optional<VfsLayerSet::Update> readVfsMapping(const std::string& path,
+                                                  const VfsLayerSet& layers,
+                                                  std::string& error);
+
+#endif
@@ -0,0 +1,124 @@
+#include "vfsscancache.h"
+#include "vfsmapping.h"
+
+#include <filesystem>
+
+namespace
+{
+namespace fs = std::filesystem;
+
+constexpr const char* DataDirLayer = "_base_game";
+
+}  // namespace
+
+bool VfsScanCache::load(const std::string& path, std::string& error)
+{
+  auto update = readVfsMapping(path, VfsLayerSet({}), error);
+  if (!update) {
+    return false;
+  }
+
+  m_dataRoot.clear();
+  m_data.reset();
+  m_dataChecked = false;
+  m_layers      = {};
+
+  for (VfsLayerSet::Layer& layer : update->layers) {
+    if (layer.name == DataDirLayer) {
+      m_dataRoot = std::move(layer.root);
+      m_data     = std::move(layer.scan);
+    } else {
+      m_layers.add(layer.root, std::move(layer.scan), /*check_files=*/true);
+    }
+  }
+
+  return true;
+}
+
+bool VfsScanCache::save(const std::string& path, std::string& error) const
+{
+  VfsLayerSet::Update update;
+
+  std::error_code ec;
+  if (m_data && fs::is_directory(m_dataRoot, ec)) {
+    update.layers.push_back({DataDirLayer, m_dataRoot, m_data});
+  }
+
+  // mods that were deleted since they were cached are dropped here
+  for (const auto& [root, scan] : m_layers) {
+    if (fs::is_directory(root, ec)) {
+      update.layers.push_back({root, root, scan});
+    }
+  }
+
+  return writeVfsMapping(path, update, error);
+}
+
+std::shared_ptr<const VfsLayerSet::Scan>
+VfsScanCache::dataDir(const std::string& root)
+{
+  auto previous = root == m_dataRoot ? m_data : nullptr;
+  if (previous && !m_dataChecked) {
+    previous = VfsLayerSet::checkFiles(std::move(previous), root);
+  }
+
+  if (previous && VfsLayerSet::unchanged(*previous, root)) {
+    m_data = std::move(previous);
+  } else {
+    m_data = VfsLayerSet::scanDataDir(root, previous.get());
+  }
+  m_dataRoot    = root;
+  m_dataChecked = true;
+
+  return m_data;
+}
+
+void VfsScanCache::record(const std::vector<VfsLayerSet::Layer>& layers)
+{
+  for (const VfsLayerSet::Layer& layer : layers) {
+    m_layers.add(layer.root, layer.scan);
+  }
+}
+
+std::vector<std::string> VfsScanCache::validate() const
+{
+  std::vector<std::string> stale;
+
+  auto changed = [](const std::shared_ptr<const VfsLayerSet::Scan>& scan,
+                    const std::string& root) {
+    return !VfsLayerSet::unchanged(*scan, root) ||
+           VfsLayerSet::checkFiles(scan, root) != scan;
+  };
+
+  if (m_data && changed(m_data, m_dataRoot)) {
+    stale.push_back(m_dataRoot);
+  }
+
+  for (const auto& [root, scan] : m_layers) {
+    if (changed(scan, root)) {
+      stale.push_back(root);
+    }
+  }
+
+  return stale;
+}
+
+VfsScanCache::Stats VfsScanCache::stats() const
+{
+  Stats stats;
+
+  auto count = [&](const VfsLayerSet::Scan& scan) {
+    ++stats.roots;
+    stats.entries += scan.entries.size();
+    stats.dirs += scan.dirs.size();
+  };
+
+  if (m_data) {
+    count(*m_data);
+  }
+  for (const auto& [root, scan] : m_layers) {
+    count(*scan);
+  }
+
+  return stats;
+}
@@ -0,0 +1,58 @@
+#ifndef VFS_VFSSCANCACHE_H
+#define VFS_VFSSCANCACHE_H
+
+#include "vfslayers.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Layer scans kept on disk between sessions, one file per instance, so that a
+// cold mount only lists the directories that changed since the last session
+// instead of walking the game's Data directory and every mod.
+//
+// The file uses the mapping format from vfsmapping.h, one layer per cached
+// root; the Data directory is the layer named "_base_game".  Directory
+// stamps only tell which directories gained or lost entries, not which files
+// were edited in place while MO2 was closed, so before a loaded scan is used
+// its files are stat'ed again (see VfsLayerSet::checkFiles()).
+class VfsScanCache
+{
+public:
+  struct Stats
+  {
+    size_t roots   = 0;  // including the Data directory
+    size_t entries = 0;
+    size_t dirs    = 0;
+  };
+
+  bool load(const std::string& path, std::string& error);
+
+  // Writes every cached root that still exists.
+  bool save(const std::string& path, std::string& error) const;
+
+  // Up-to-date scan of the game's Data directory; only the directories that
+  // changed since the cached scan are listed again, and only the first call
+  // after load() stats the files.
+  std::shared_ptr<const VfsLayerSet::Scan> dataDir(const std::string& root);
+
+  // cached scans of mods and Overwrite, for VfsLayerSet::prepare(); those
+  // from load() are marked for a file check
+  const VfsLayerSet::ScanTable& layers() const { return m_layers; }
+
+  // Remembers the scans of `layers`, replacing older ones of the same roots.
+  void record(const std::vector<VfsLayerSet::Layer>& layers);
+
+  // Roots whose directories or files changed since they were cached.
+  std::vector<std::string> validate() const;
+
+  Stats stats() const;
+
+private:
+  std::string m_dataRoot;
+  std::shared_ptr<const VfsLayerSet::Scan> m_data;
+  bool m_dataChecked = true;  // files of m_data stat'ed this session
+  VfsLayerSet::ScanTable m_layers;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "vfsstats.h"
+
+#include <algorithm>
+#include <bit>
+#include <unordered_map>
+
+namespace
+{
+constexpr size_t HotSlots = 256;
+
+// Only the owning thread writes a counter, so a plain load and store is
+// enough and avoids a locked read-modify-write.
+void bump(std::atomic<uint64_t>& counter, uint64_t value = 1)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+void raise(std::atomic<uint64_t>& counter, uint64_t value)
+{
+  if (value > counter.load(std::memory_order_relaxed)) {
+    counter.store(value, std::memory_order_relaxed);
+  }
+}
+
+uint64_t read(const std::atomic<uint64_t>& counter)
+{
+  return counter.load(std::memory_order_relaxed);
+}
+
+std::atomic<uint64_t> g_nextStatsId{1};
+}  // namespace
+
+struct VfsStats::Block
+{
+  struct Op
+  {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    std::array<std::atomic<uint64_t>, LatencyBuckets> buckets{};
+  };
+
+  // One counter per slot, shared by the inodes hashing to it: a different
+  // inode wears the count down before it takes the slot over, so inodes that
+  // are touched often keep their slot (a per-slot Misra-Gries summary).
+  struct HotSlot
+  {
+    std::atomic<uint64_t> ino{0};
+    std::atomic<uint64_t> count{0};
+  };
+
+  std::array<Op, size_t(VfsOp::Count)> ops;
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> copies{0};
+  std::atomic<uint64_t> copy_bytes{0};
+  std::atomic<uint64_t> lock_waits{0};
+  std::atomic<uint64_t> lock_wait_ns{0};
+  std::array<HotSlot, HotSlots> hot;
+};
+
+const char* vfsOpName(VfsOp op)
+{
+  switch (op) {
+  case VfsOp::Lookup:
+    return "lookup";
+  case VfsOp::Getattr:
+    return "getattr";
+  case VfsOp::Readdir:
+    return "readdir";
+  case VfsOp::Open:
+    return "open";
+  case VfsOp::Read:
+    return "read";
+  case VfsOp::Write:
+    return "write";
+  case VfsOp::Count:
+    break;
+  }
+  return "?";
+}
+
+VfsStats::VfsStats() : m_id(g_nextStatsId.fetch_add(1, std::memory_order_relaxed)) {}
+
+VfsStats::~VfsStats() = default;
+
+VfsStats::Block& VfsStats::local()
+{
+  // the block of the instance this thread recorded into last; a thread only
+  // ever serves one mount, so this almost never misses
+  thread_local uint64_t cachedId = 0;
+  thread_local Block* cached     = nullptr;
+
+  if (cachedId != m_id) {
+    auto block = std::make_unique<Block>();
+    cached     = block.get();
+    cachedId   = m_id;
+
+    std::scoped_lock lock(m_mutex);
+    m_blocks.push_back(std::move(block));
+  }
+
+  return *cached;
+}
+
+void VfsStats::record(VfsOp op, std::chrono::nanoseconds elapsed)
+{
+  const uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(elapsed.count(), 0));
+  const uint64_t us = ns / 1000;
+  const size_t bucket =
+      std::min<size_t>(us == 0 ? 0 : std::bit_width(us), LatencyBuckets - 1);
+
+  Block::Op& o = local().ops[size_t(op)];
+  bump(o.count);
+  bump(o.total_ns, ns);
+  raise(o.max_ns, ns);
+  bump(o.buckets[bucket]);
+}
+
+void VfsStats::addRead(uint64_t bytes)
+{
+  bump(local().bytes_read, bytes);
+}
+
+void VfsStats::addWrite(uint64_t bytes)
+{
+  bump(local().bytes_written, bytes);
+}
+
+void VfsStats::addCopy(uint64_t bytes)
+{
+  Block& b = local();
+  bump(b.copies);
+  bump(b.copy_bytes, bytes);
+}
+
+void VfsStats::addLockWait(std::chrono::nanoseconds elapsed)
+{
+  Block& b = local();
+  bump(b.lock_waits);
+  bump(b.lock_wait_ns, static_cast<uint64_t>(std::max<int64_t>(elapsed.count(), 0)));
+}
+
+void VfsStats::touch(uint64_t ino)
+{
+  Block::HotSlot& slot =
+      local().hot[(ino * 0x9E3779B97F4A7C15ull) >> (64 - std::countr_zero(HotSlots))];
+
+  const uint64_t count = read(slot.count);
+  if (read(slot.ino) == ino) {
+    slot.count.store(count + 1, std::memory_order_relaxed);
+  } else if (count == 0) {
+    slot.ino.store(ino, std::memory_order_relaxed);
+    slot.count.store(1, std::memory_order_relaxed);
+  } else {
+    slot.count.store(count - 1, std::memory_order_relaxed);
+  }
+}
+
+VfsStats::Snapshot VfsStats::snapshot(size_t hot) const
+{
+  Snapshot out;
+  std::unordered_map<uint64_t, uint64_t> inodes;
+
+  std::scoped_lock lock(m_mutex);
+  for (const auto& block : m_blocks) {
+    for (size_t i = 0; i < out.ops.size(); ++i) {
+      const Block::Op& o = block->ops[i];
+      OpTotals& t        = out.ops[i];
+      t.count += read(o.count);
+      t.total_ns += read(o.total_ns);
+      t.max_ns = std::max(t.max_ns, read(o.max_ns));
+      for (size_t b = 0; b < LatencyBuckets; ++b) {
+        t.buckets[b] += read(o.buckets[b]);
+      }
+    }
+
+    out.bytes_read += read(block->bytes_read);
+    out.bytes_written += read(block->bytes_written);
+    out.copies += read(block->copies);
+    out.copy_bytes += read(block->copy_bytes);
+    out.lock_waits += read(block->lock_waits);
+    out.lock_wait_ns += read(block->lock_wait_ns);
+
+    for (const Block::HotSlot& slot : block->hot) {
+      if (const uint64_t count = read(slot.count); count != 0) {
+        inodes[read(slot.ino)] += count;
+      }
+    }
+  }
+
+  out.hot.assign(inodes.begin(), inodes.end());
+  const size_t n = std::min(hot, out.hot.size());
+  std::partial_sort(out.hot.begin(), out.hot.begin() + static_cast<ptrdiff_t>(n),
+                    out.hot.end(), [](const auto& a, const auto& b) {
+                      return a.second > b.second;
+                    });
+  out.hot.resize(n);
+
+  return out;
+}
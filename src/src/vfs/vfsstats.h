@@ -0,0 +1,108 @@
+#ifndef VFS_VFSSTATS_H
+#define VFS_VFSSTATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+enum class VfsOp : uint8_t
+{
+  Lookup,
+  Getattr,
+  Readdir,
+  Open,
+  Read,
+  Write,
+  Count
+};
+
+const char* vfsOpName(VfsOp op);
+
+// Operation counters and latency histograms of a mounted VFS, to tell
+// whether in-game stutter comes from the filesystem or from the game.
+//
+// Every thread that records gets its own block of counters, which only that
+// thread writes, so recording is a handful of uncontended relaxed stores and
+// no shared cache line bounces between the FUSE workers.  snapshot() sums
+// the blocks; blocks of exited threads are kept so nothing is lost.
+class VfsStats
+{
+public:
+  // latency bucket i counts operations that took less than 2^i microseconds;
+  // the last one takes everything slower
+  static constexpr size_t LatencyBuckets = 24;
+
+  struct OpTotals
+  {
+    uint64_t count    = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns   = 0;
+    std::array<uint64_t, LatencyBuckets> buckets{};
+  };
+
+  struct Snapshot
+  {
+    std::array<OpTotals, size_t(VfsOp::Count)> ops{};
+    uint64_t bytes_read    = 0;
+    uint64_t bytes_written = 0;
+    uint64_t copies        = 0;  // copy-on-write into staging
+    uint64_t copy_bytes    = 0;
+    uint64_t lock_waits    = 0;  // tree lock acquisitions that had to block
+    uint64_t lock_wait_ns  = 0;
+    // most frequently touched inodes, approximate, most frequent first
+    std::vector<std::pair<uint64_t, uint64_t>> hot;
+  };
+
+  VfsStats();
+  ~VfsStats();
+
+  VfsStats(const VfsStats&)            = delete;
+  VfsStats& operator=(const VfsStats&) = delete;
+
+  void record(VfsOp op, std::chrono::nanoseconds elapsed);
+  void addRead(uint64_t bytes);
+  void addWrite(uint64_t bytes);
+  void addCopy(uint64_t bytes);
+  void addLockWait(std::chrono::nanoseconds elapsed);
+
+  // counts an operation on `ino` for the hottest-inode list
+  void touch(uint64_t ino);
+
+  Snapshot snapshot(size_t hot) const;
+
+  // Records the time until destruction as one `op`.
+  class Timer
+  {
+  public:
+    Timer(VfsStats& stats, VfsOp op)
+        : m_stats(stats), m_op(op), m_start(std::chrono::steady_clock::now())
+    {}
+
+    ~Timer() { m_stats.record(m_op, std::chrono::steady_clock::now() - m_start); }
+
+    Timer(const Timer&)            = delete;
+    Timer& operator=(const Timer&) = delete;
+
+  private:
+    VfsStats& m_stats;
+    VfsOp m_op;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+private:
+  struct Block;
+
+  // tells apart instances that reuse an address, for the per-thread cache
+  const uint64_t m_id;
+  mutable std::mutex m_mutex;
+  std::vector<std::unique_ptr<Block>> m_blocks;
+
+  Block& local();
+};
+
+#endif
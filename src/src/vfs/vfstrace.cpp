@@ -0,0 +1,437 @@
+#include "vfstrace.h"
+
+#include "mo2filesystem.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <shared_mutex>
+
+using namespace vfstrace;
+
+namespace
+{
+
+static_assert(sizeof(TraceHeader) == 16);
+static_assert(sizeof(TraceRecord) == 48);
+
+// flushed to the file once this much is buffered
+constexpr size_t BufferBytes = 1 << 20;
+
+VfsTraceWriter* g_writer = nullptr;
+struct fuse_lowlevel_ops g_ops;
+std::chrono::steady_clock::time_point g_start;
+std::atomic<uint16_t> g_nextThread{0};
+
+Mo2FsContext* getContext(fuse_req_t req)
+{
+  return static_cast<Mo2FsContext*>(fuse_req_userdata(req));
+}
+
+TraceRecord begin(Op op)
+{
+  thread_local const uint16_t thread = g_nextThread.fetch_add(1);
+
+  TraceRecord r{};
+  r.time_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now() - g_start)
+                                        .count());
+  r.thread  = thread;
+  r.op      = op;
+  return r;
+}
+
+// id of the inode's path, resolved before the handler runs so removals and
+// renames are recorded under the name they had
+uint32_t nodePath(fuse_req_t req, fuse_ino_t ino)
+{
+  Mo2FsContext* ctx = getContext(req);
+  std::string path;
+  if (ino != InodeTable::RootInode && !ctx->inodes->path(ino, path)) {
+    return NoPath;
+  }
+  return g_writer->pathId(ctx, path);
+}
+
+uint32_t childPath(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  Mo2FsContext* ctx = getContext(req);
+  std::string path;
+  if (parent != InodeTable::RootInode && !ctx->inodes->path(parent, path)) {
+    return NoPath;
+  }
+  if (!path.empty()) {
+    path.push_back('/');
+  }
+  path += name;
+  return g_writer->pathId(ctx, path);
+}
+
+void traceLookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  TraceRecord r = begin(Op::Lookup);
+  r.path        = childPath(req, parent, name);
+  g_ops.lookup(req, parent, name);
+  g_writer->add(r);
+}
+
+void traceGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Getattr);
+  r.path        = nodePath(req, ino);
+  g_ops.getattr(req, ino, fi);
+  g_writer->add(r);
+}
+
+void traceOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Opendir);
+  r.path        = nodePath(req, ino);
+  g_ops.opendir(req, ino, fi);
+  r.fh = fi->fh;
+  g_writer->add(r);
+}
+
+void traceReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Readdir);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  r.offset      = static_cast<uint64_t>(off);
+  r.size        = static_cast<uint32_t>(size);
+  g_ops.readdir(req, ino, size, off, fi);
+  g_writer->add(r);
+}
+
+void traceReaddirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Readdirplus);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  r.offset      = static_cast<uint64_t>(off);
+  r.size        = static_cast<uint32_t>(size);
+  g_ops.readdirplus(req, ino, size, off, fi);
+  g_writer->add(r);
+}
+
+void traceReleasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Releasedir);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  g_ops.releasedir(req, ino, fi);
+  g_writer->add(r);
+}
+
+void traceOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Open);
+  r.path        = nodePath(req, ino);
+  r.flags       = static_cast<uint32_t>(fi->flags);
+  g_ops.open(req, ino, fi);
+  r.fh = fi->fh;
+  g_writer->add(r);
+}
+
+void traceRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Read);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  r.offset      = static_cast<uint64_t>(off);
+  r.size        = static_cast<uint32_t>(size);
+  g_ops.read(req, ino, size, off, fi);
+  g_writer->add(r);
+}
+
+void traceWrite(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size,
+                off_t off, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Write);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  r.offset      = static_cast<uint64_t>(off);
+  r.size        = static_cast<uint32_t>(size);
+  g_ops.write(req, ino, buf, size, off, fi);
+  g_writer->add(r);
+}
+
+void traceFlush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Flush);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  g_ops.flush(req, ino, fi);
+  g_writer->add(r);
+}
+
+void traceRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Release);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  g_ops.release(req, ino, fi);
+  g_writer->add(r);
+}
+
+void traceCreate(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                 struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Create);
+  r.path        = childPath(req, parent, name);
+  r.flags       = static_cast<uint32_t>(fi->flags);
+  g_ops.create(req, parent, name, mode, fi);
+  r.fh = fi->fh;
+  g_writer->add(r);
+}
+
+void traceMkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+  TraceRecord r = begin(Op::Mkdir);
+  r.path        = childPath(req, parent, name);
+  g_ops.mkdir(req, parent, name, mode);
+  g_writer->add(r);
+}
+
+void traceUnlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+  TraceRecord r = begin(Op::Unlink);
+  r.path        = childPath(req, parent, name);
+  g_ops.unlink(req, parent, name);
+  g_writer->add(r);
+}
+
+void traceRename(fuse_req_t req, fuse_ino_t parent, const char* name,
+                 fuse_ino_t newparent, const char* newname, unsigned int flags)
+{
+  TraceRecord r = begin(Op::Rename);
+  r.path        = childPath(req, parent, name);
+  r.path2       = childPath(req, newparent, newname);
+  r.flags       = flags;
+  g_ops.rename(req, parent, name, newparent, newname, flags);
+  g_writer->add(r);
+}
+
+void traceSetattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+                  struct fuse_file_info* fi)
+{
+  TraceRecord r = begin(Op::Setattr);
+  r.path        = nodePath(req, ino);
+  r.fh          = fi != nullptr ? fi->fh : 0;
+  r.offset      = attr != nullptr ? static_cast<uint64_t>(attr->st_size) : 0;
+  r.flags       = static_cast<uint32_t>(to_set);
+  g_ops.setattr(req, ino, attr, to_set, fi);
+  g_writer->add(r);
+}
+
+void traceForget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  TraceRecord r = begin(Op::Forget);
+  r.path        = nodePath(req, ino);
+  r.offset      = nlookup;
+  g_ops.forget(req, ino, nlookup);
+  g_writer->add(r);
+}
+
+void traceForgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+  std::vector<TraceRecord> records;
+  records.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    TraceRecord r = begin(Op::Forget);
+    r.path        = nodePath(req, forgets[i].ino);
+    r.offset      = forgets[i].nlookup;
+    records.push_back(r);
+  }
+
+  g_ops.forget_multi(req, count, forgets);
+
+  for (const TraceRecord& r : records) {
+    g_writer->add(r);
+  }
+}
+
+std::vector<std::string> splitPath(const std::string& path)
+{
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= path.size()) {
+    const size_t slash = path.find('/', start);
+    const size_t end   = slash == std::string::npos ? path.size() : slash;
+    if (end > start) {
+      out.emplace_back(path, start, end - start);
+    }
+    start = end + 1;
+  }
+  return out;
+}
+
+}  // namespace
+
+VfsTraceWriter::~VfsTraceWriter()
+{
+  close();
+}
+
+bool VfsTraceWriter::open(const std::string& path, std::string& error)
+{
+  std::scoped_lock lock(m_mutex);
+
+  m_file = std::fopen(path.c_str(), "wb");
+  if (m_file == nullptr) {
+    error = "cannot create " + path + ": " + std::strerror(errno);
+    return false;
+  }
+
+  TraceHeader header{};
+  std::memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  m_buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  return true;
+}
+
+void VfsTraceWriter::close()
+{
+  std::scoped_lock lock(m_mutex);
+  if (m_file != nullptr) {
+    flushLocked();
+    std::fclose(m_file);
+    m_file = nullptr;
+  }
+}
+
+void VfsTraceWriter::flushLocked()
+{
+  if (m_file != nullptr && !m_buffer.empty()) {
+    std::fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+    std::fflush(m_file);
+  }
+  m_buffer.clear();
+}
+
+uint32_t VfsTraceWriter::pathId(const Mo2FsContext* ctx, const std::string& path)
+{
+  {
+    std::scoped_lock lock(m_mutex);
+    auto it = m_paths.find(path);
+    if (it != m_paths.end()) {
+      return it->second;
+    }
+  }
+
+  TraceRecord r{};
+  r.op   = Op::Path;
+  r.size = static_cast<uint32_t>(path.size());
+  {
+    std::shared_lock lock(ctx->tree_mutex);
+    const VfsNode* node =
+        path.empty() ? &ctx->tree->root() : ctx->tree->resolve(splitPath(path));
+    if (node == nullptr) {
+      r.flags = PathMissing;
+    } else if (node->is_directory) {
+      r.flags = PathDirectory;
+    } else {
+      r.flags  = PathFile;
+      r.offset = node->file_info.size;
+    }
+  }
+
+  std::scoped_lock lock(m_mutex);
+  auto [it, added] = m_paths.emplace(path, static_cast<uint32_t>(m_paths.size()));
+  if (added) {
+    r.path = it->second;
+    m_buffer.append(reinterpret_cast<const char*>(&r), sizeof(r));
+    m_buffer += path;
+  }
+  return it->second;
+}
+
+void VfsTraceWriter::add(const TraceRecord& record)
+{
+  std::scoped_lock lock(m_mutex);
+  m_buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  if (m_buffer.size() >= BufferBytes) {
+    flushLocked();
+  }
+}
+
+void installVfsTrace(struct fuse_lowlevel_ops* ops, VfsTraceWriter* writer)
+{
+  g_writer = writer;
+  g_ops    = *ops;
+  g_start  = std::chrono::steady_clock::now();
+
+  ops->lookup       = traceLookup;
+  ops->getattr      = traceGetattr;
+  ops->opendir      = traceOpendir;
+  ops->readdir      = traceReaddir;
+  ops->readdirplus  = traceReaddirplus;
+  ops->releasedir   = traceReleasedir;
+  ops->open         = traceOpen;
+  ops->read         = traceRead;
+  ops->write        = traceWrite;
+  ops->flush        = traceFlush;
+  ops->release      = traceRelease;
+  ops->create       = traceCreate;
+  ops->mkdir        = traceMkdir;
+  ops->unlink       = traceUnlink;
+  ops->rename       = traceRename;
+  ops->setattr      = traceSetattr;
+  ops->forget       = traceForget;
+  ops->forget_multi = traceForgetMulti;
+}
+
+std::optional<VfsTrace> readVfsTrace(const std::string& path, std::string& error)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    error = "cannot open " + path;
+    return std::nullopt;
+  }
+
+  TraceHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+    error = "not a VFS trace";
+    return std::nullopt;
+  }
+  if (header.version != Version) {
+    error = "unsupported version " + std::to_string(header.version);
+    return std::nullopt;
+  }
+
+  VfsTrace trace;
+  TraceRecord r;
+  while (in.read(reinterpret_cast<char*>(&r), sizeof(r))) {
+    if (r.op >= Op::Count) {
+      error = "corrupt record";
+      return std::nullopt;
+    }
+
+    if (r.op == Op::Path) {
+      std::string name(r.size, '\0');
+      if (!in.read(name.data(), r.size)) {
+        break;
+      }
+      if (r.path >= trace.paths.size()) {
+        trace.paths.resize(r.path + 1);
+        trace.kinds.resize(r.path + 1, PathMissing);
+        trace.sizes.resize(r.path + 1, 0);
+      }
+      trace.paths[r.path] = std::move(name);
+      trace.kinds[r.path] = r.flags;
+      trace.sizes[r.path] = r.offset;
+      continue;
+    }
+
+    trace.threads = std::max<unsigned>(trace.threads, r.thread + 1u);
+    trace.records.push_back(r);
+  }
+
+  // a trace cut short (the helper was killed) is still usable up to there
+  return trace;
+}
@@ -0,0 +1,137 @@
+#ifndef VFS_VFSTRACE_H
+#define VFS_VFSTRACE_H
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Binary log of the FUSE requests a mount served, written by
+// `mo2-vfs-helper --trace` and replayed against the handlers by
+// mo2-vfs-replay, so a game's load can be benchmarked without the game.
+//
+// The file is a header followed by records in arrival order per thread:
+//
+//   TraceHeader
+//   TraceRecord...      a Path record precedes the first use of its id and
+//                       is followed by `size` bytes of UTF-8 path
+//
+// Requests refer to files by path id rather than inode, since inode and
+// handle numbers differ between runs; handles are the helper's own and only
+// serve to pair opens with the reads and releases that use them.  Paths are
+// relative to the mount, "" being the root.  File contents aren't recorded.
+namespace vfstrace
+{
+
+constexpr char Magic[8]     = {'M', 'O', '2', 'V', 'T', 'R', 'C', '\0'};
+constexpr uint32_t Version  = 1;
+constexpr uint32_t NoPath   = UINT32_MAX;  // inode the helper couldn't name
+
+enum class Op : uint8_t
+{
+  Path,
+  Lookup,
+  Getattr,
+  Opendir,
+  Readdir,
+  Readdirplus,
+  Releasedir,
+  Open,
+  Read,
+  Write,
+  Flush,
+  Release,
+  Create,
+  Mkdir,
+  Unlink,
+  Rename,
+  Setattr,
+  Forget,
+  Count
+};
+
+// what a path was when it was first seen
+enum PathKind : uint32_t
+{
+  PathMissing   = 0,
+  PathFile      = 1,
+  PathDirectory = 2,
+};
+
+struct TraceHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct TraceRecord
+{
+  uint64_t time_ns;  // since the trace started, at arrival
+  uint64_t fh;       // handle used, or handed out by open/create/opendir
+  uint64_t offset;   // read/write/readdir offset; setattr size; forget count;
+                     // Path: file size
+  uint32_t path;     // node, or the created/looked up/removed name; Path: id
+  uint32_t path2;    // rename target
+  uint32_t size;     // read/write/readdir size; Path: length of the string
+  uint32_t flags;    // open/create flags; setattr to_set; Path: PathKind
+  uint16_t thread;   // FUSE worker, numbered from 0 in order of appearance
+  Op op;
+  uint8_t reserved[5];
+};
+
+}  // namespace vfstrace
+
+struct Mo2FsContext;
+
+// Appends requests to a trace file.  Records are buffered and written in
+// batches under one lock; tracing is opt-in, so that costs little next to
+// what it measures.
+class VfsTraceWriter
+{
+public:
+  VfsTraceWriter() = default;
+  ~VfsTraceWriter();
+
+  VfsTraceWriter(const VfsTraceWriter&)            = delete;
+  VfsTraceWriter& operator=(const VfsTraceWriter&) = delete;
+
+  bool open(const std::string& path, std::string& error);
+  void close();
+
+  // Id of the path, written as a Path record on first use; `ctx` tells what
+  // the path currently is.
+  uint32_t pathId(const Mo2FsContext* ctx, const std::string& path);
+
+  void add(const vfstrace::TraceRecord& record);
+
+private:
+  std::mutex m_mutex;
+  std::FILE* m_file = nullptr;
+  std::string m_buffer;
+  std::unordered_map<std::string, uint32_t> m_paths;
+
+  void flushLocked();
+};
+
+// Wraps the handlers in `ops` so every request is recorded to `writer`,
+// which must outlive the session.
+void installVfsTrace(struct fuse_lowlevel_ops* ops, VfsTraceWriter* writer);
+
+struct VfsTrace
+{
+  std::vector<vfstrace::TraceRecord> records;  // without the Path records
+  std::vector<std::string> paths;              // by id
+  std::vector<uint32_t> kinds;                 // PathKind by id
+  std::vector<uint64_t> sizes;                 // file size by id
+  unsigned threads = 0;
+};
+
+std::optional<VfsTrace> readVfsTrace(const std::string& path, std::string& error);
+
+#endif
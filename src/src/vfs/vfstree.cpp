@@ -1,6 +1,10 @@
 #include "vfstree.h"
 
+#include "../envdirscan.h"
+
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cctype>
 #include <filesystem>
 
@@ -8,14 +12,6 @@ namespace
 {
 namespace fs = std::filesystem;
 
-std::chrono::system_clock::time_point
-fsTimeToSystemClock(const fs::file_time_type& t)
-{
-  const auto nowFs  = fs::file_time_type::clock::now();
-  const auto nowSys = std::chrono::system_clock::now();
-  return nowSys + std::chrono::duration_cast<std::chrono::system_clock::duration>(t - nowFs);
-}
-
 std::vector<std::string> splitPath(const std::string& path)
 {
   std::vector<std::string> out;
@@ -42,240 +38,763 @@ std::vector<std::string> splitPath(const std::string& path)
   return out;
 }
 
-void addDirectoryToTree(VfsTree& tree, const fs::path& walkDir,
-                        const fs::path& stripPrefix, const std::string& origin,
-                        const std::vector<std::string>& prefix,
-                        bool is_backing = false)
+// Splits an origin-relative path into its directory and file name.
+std::pair<std::string_view, std::string_view> splitDirName(std::string_view path)
 {
-  if (!fs::exists(walkDir)) {
-    return;
+  const size_t slash = path.rfind('/');
+  if (slash == std::string_view::npos) {
+    return {{}, path};
   }
+  return {path.substr(0, slash), path.substr(slash + 1)};
+}
 
-  for (auto it = fs::recursive_directory_iterator(
-           walkDir, fs::directory_options::skip_permission_denied);
-       it != fs::recursive_directory_iterator(); ++it) {
-    const auto& entry = *it;
-    std::error_code ec;
+char foldChar(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
 
-    const fs::path rel = fs::relative(entry.path(), stripPrefix, ec);
-    if (ec || rel.empty()) {
-      continue;
-    }
+std::string foldName(std::string_view name)
+{
+  std::string out;
+  vfsFoldName(name, out);
+  return out;
+}
 
-    const std::string relStr = rel.generic_string();
-    if (relStr == "meta.ini") {
-      continue;
+// Two filter bits per hash, from multiplicative mixes so they don't follow
+// the low bits the slot index is taken from.
+void bloomBits(const std::vector<uint64_t>& bloom, uint32_t hash, size_t& a, size_t& b)
+{
+  const int shift = 64 - std::countr_zero(bloom.size() * 64);
+  a               = static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> shift);
+  b               = static_cast<size_t>((hash * 0xC2B2AE3D27D4EB4Full) >> shift);
+}
+
+void bloomAdd(std::vector<uint64_t>& bloom, uint32_t hash)
+{
+  size_t a = 0;
+  size_t b = 0;
+  bloomBits(bloom, hash, a, b);
+  bloom[a / 64] |= uint64_t(1) << (a % 64);
+  bloom[b / 64] |= uint64_t(1) << (b % 64);
+}
+
+bool bloomMayContain(const std::vector<uint64_t>& bloom, uint32_t hash)
+{
+  size_t a = 0;
+  size_t b = 0;
+  bloomBits(bloom, hash, a, b);
+  return ((bloom[a / 64] >> (a % 64)) & 1) != 0 && ((bloom[b / 64] >> (b % 64)) & 1) != 0;
+}
+
+uint64_t nextTreeEpoch()
+{
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+void addDirectoryToTree(VfsTree& tree, const fs::path& walkDir, VfsOriginId origin,
+                        const std::vector<std::string>& prefix)
+{
+  // the walk is depth first, so the components of the current entry are the
+  // ones of its parent plus its name
+  std::vector<std::string> components = prefix;
+
+  env::scanTree(walkDir.string(), [&](std::string_view rel, const env::ScannedEntry& e) {
+    const size_t depth = static_cast<size_t>(std::count(rel.begin(), rel.end(), '/'));
+    if (depth == 0 && e.name == "meta.ini") {
+      return;
     }
 
-    auto relParts = splitPath(relStr);
-    std::vector<std::string> components;
-    components.reserve(prefix.size() + relParts.size());
-    components.insert(components.end(), prefix.begin(), prefix.end());
-    components.insert(components.end(), relParts.begin(), relParts.end());
+    components.resize(prefix.size() + depth);
+    components.emplace_back(e.name);
 
-    if (entry.is_directory(ec)) {
-      tree.root.insertDirectory(components);
+    if (e.is_dir) {
+      tree.insertDirectory(components);
       ++tree.dir_count;
-      continue;
+      return;
     }
 
-    if (!entry.is_regular_file(ec)) {
-      continue;
+    const auto [dir, name] = splitDirName(rel);
+    tree.insertFile(components, origin, dir, name, e.size, e.mtime);
+    ++tree.file_count;
+  });
+}
+
+}  // namespace
+
+VfsStringPool::VfsStringPool()
+{
+  intern({});
+}
+
+VfsStringId VfsStringPool::intern(std::string_view s)
+{
+  auto it = m_lookup.find(s);
+  if (it != m_lookup.end()) {
+    return it->second;
+  }
+
+  char* storage = nullptr;
+  if (s.size() > ChunkSize / 4) {
+    // oversized strings get a chunk of their own
+    m_chunks.push_back(std::make_unique<char[]>(s.size()));
+    storage     = m_chunks.back().get();
+    m_chunkUsed = ChunkSize;
+  } else if (!s.empty()) {
+    if (m_chunkUsed + s.size() > ChunkSize) {
+      m_chunks.push_back(std::make_unique<char[]>(ChunkSize));
+      m_chunkUsed = 0;
     }
+    storage = m_chunks.back().get() + m_chunkUsed;
+    m_chunkUsed += s.size();
+  }
 
-    const auto size  = entry.file_size(ec);
-    const auto mtime = entry.last_write_time(ec);
-    tree.root.insertFile(components, entry.path().string(), size,
-                         ec ? std::chrono::system_clock::time_point{}
-                            : fsTimeToSystemClock(mtime),
-                         origin, is_backing);
-    ++tree.file_count;
+  std::copy(s.begin(), s.end(), storage);
+  m_bytes += s.size();
+
+  const auto id = static_cast<VfsStringId>(m_strings.size());
+  const std::string_view stored(storage, s.size());
+  m_strings.push_back(stored);
+  m_lookup.emplace(stored, id);
+  return id;
+}
+
+uint32_t vfsNameHash(std::string_view name)
+{
+  // FNV-1a over the case-folded bytes
+  uint32_t h = 2166136261u;
+  for (const char c : name) {
+    h ^= static_cast<unsigned char>(foldChar(c));
+    h *= 16777619u;
   }
+  return h;
 }
 
-bool removeNodeRecursive(VfsNode* node, const std::vector<std::string>& components,
-                         size_t index)
+void vfsFoldName(std::string_view name, std::string& out)
 {
-  if (node == nullptr || !node->is_directory || index >= components.size()) {
-    return false;
+  out.resize(name.size());
+  for (size_t i = 0; i < name.size(); ++i) {
+    out[i] = foldChar(name[i]);
   }
+}
 
-  const std::string key = normalizeForLookup(components[index]);
-  auto it               = node->dir_info.children.find(key);
-  if (it == node->dir_info.children.end()) {
-    return false;
+std::string normalizeForLookup(const std::string& path)
+{
+  std::string result;
+  result.reserve(path.size());
+  for (const char c : path) {
+    result.push_back(c == '\\' ? '/' : foldChar(c));
   }
+  return result;
+}
 
-  if (index + 1 == components.size()) {
-    node->dir_info.children.erase(it);
-    node->dir_info.display_names.erase(key);
-    return true;
+VfsTree::VfsTree()
+{
+  m_origins.push_back({});
+  m_tables.emplace_back();
+
+  VfsNode& root    = m_nodes.emplace_back();
+  root.is_directory = true;
+  root.children     = 0;
+
+  dir_count = 1;
+  m_epoch   = nextTreeEpoch();
+}
+
+VfsOriginId VfsTree::addOrigin(const std::string& name, const std::string& root,
+                               bool is_backing)
+{
+  std::string key = name;
+  key.push_back('\0');
+  key += root;
+  key.push_back(is_backing ? 'b' : '-');
+
+  auto it = m_originLookup.find(key);
+  if (it != m_originLookup.end()) {
+    return it->second;
   }
 
-  VfsNode* child = it->second.get();
-  if (!removeNodeRecursive(child, components, index + 1)) {
-    return false;
+  const auto id = static_cast<VfsOriginId>(m_origins.size());
+  m_origins.push_back({name, root, is_backing});
+  m_originLookup.emplace(std::move(key), id);
+  return id;
+}
+
+std::string VfsTree::realPath(const VfsNode& node) const
+{
+  const VfsOrigin& o          = origin(node);
+  const std::string_view dir  = m_strings.view(node.file_info.dir);
+  const std::string_view name = m_strings.view(node.file_info.name);
+
+  std::string out;
+  out.reserve(o.root.size() + dir.size() + name.size() + 2);
+  out += o.root;
+
+  if (!dir.empty()) {
+    if (!out.empty() && out.back() != '/') {
+      out.push_back('/');
+    }
+    out += dir;
   }
 
-  if (child->is_directory && child->dir_info.children.empty()) {
-    node->dir_info.children.erase(key);
-    node->dir_info.display_names.erase(key);
+  if (!out.empty() && out.back() != '/') {
+    out.push_back('/');
   }
+  out += name;
 
-  return true;
+  return out;
 }
 
-}  // namespace
+VfsNodeId VfsTree::newNode(VfsNodeId parent, std::string_view name, bool is_directory)
+{
+  const std::string key = foldName(name);
+
+  VfsNodeId id = InvalidVfsNode;
+  if (m_freeNodes.empty()) {
+    id = static_cast<VfsNodeId>(m_nodes.size());
+    m_nodes.emplace_back();
+  } else {
+    id = m_freeNodes.back();
+    m_freeNodes.pop_back();
+  }
 
-std::string normalizeForLookup(const std::string& path)
+  VfsNode& node = m_nodes[id];
+  node          = {};
+  node.name     = m_strings.intern(name);
+  node.key      = m_strings.intern(key);
+  node.hash     = vfsNameHash(key);
+  node.parent   = parent;
+  node.is_directory = false;
+
+  if (is_directory) {
+    makeDirectory(node);
+  }
+
+  return id;
+}
+
+void VfsTree::makeDirectory(VfsNode& node)
 {
-  std::string result;
-  result.reserve(path.size());
-  for (unsigned char c : path) {
-    result.push_back(c == '\\' ? '/' : static_cast<char>(std::tolower(c)));
+  node.is_directory = true;
+  node.file_info    = {};
+
+  if (m_freeTables.empty()) {
+    node.children = static_cast<uint32_t>(m_tables.size());
+    m_tables.emplace_back();
+  } else {
+    node.children = m_freeTables.back();
+    m_freeTables.pop_back();
   }
-  return result;
 }
 
-void VfsNode::insertFile(const std::vector<std::string>& components,
-                         const std::string& real_path, uint64_t size,
-                         std::chrono::system_clock::time_point mtime,
-                         const std::string& origin, bool is_backing)
+// Puts a node that is no longer in the tree, and its child table, up for
+// reuse.  The epoch changed when it was unlinked, so cached ids of it aren't
+// trusted any more.
+void VfsTree::freeNode(VfsNodeId id)
 {
-  if (components.empty()) {
+  VfsNode& node = m_nodes[id];
+  if (node.is_directory) {
+    freeTable(node.children);
+  }
+
+  node              = {};
+  node.is_directory = false;
+  m_freeNodes.push_back(id);
+}
+
+void VfsTree::freeTable(uint32_t index)
+{
+  m_tables[index] = {};
+  m_freeTables.push_back(index);
+}
+
+void VfsTree::link(VfsNodeId dir, VfsNodeId child)
+{
+  ChildTable& table = m_tables[m_nodes[dir].children];
+
+  if ((table.count + 1) * 4 > table.slots.size() * 3) {
+    std::vector<Slot> old = std::move(table.slots);
+    table.slots.assign(old.empty() ? 4 : old.size() * 2, Slot{});
+
+    table.bloom.assign(std::max<size_t>(1, table.slots.size() / 8), 0);
+
+    const size_t mask = table.slots.size() - 1;
+    for (const Slot& s : old) {
+      if (s.node == InvalidVfsNode) {
+        continue;
+      }
+      size_t i = s.hash & mask;
+      while (table.slots[i].node != InvalidVfsNode) {
+        i = (i + 1) & mask;
+      }
+      table.slots[i] = s;
+      bloomAdd(table.bloom, s.hash);
+    }
+  }
+
+  const uint32_t hash = m_nodes[child].hash;
+  const size_t mask   = table.slots.size() - 1;
+  size_t i            = hash & mask;
+  while (table.slots[i].node != InvalidVfsNode) {
+    i = (i + 1) & mask;
+  }
+
+  table.slots[i] = {hash, child};
+  ++table.count;
+  bloomAdd(table.bloom, hash);
+}
+
+void VfsTree::unlink(VfsNodeId dir, VfsNodeId child)
+{
+  ChildTable& table = m_tables[m_nodes[dir].children];
+  if (table.slots.empty()) {
     return;
   }
 
-  VfsNode* current = this;
-  for (size_t i = 0; i < components.size(); ++i) {
-    const std::string& part = components[i];
-    if (part.empty()) {
+  const size_t mask = table.slots.size() - 1;
+  size_t i          = m_nodes[child].hash & mask;
+  while (table.slots[i].node != child) {
+    if (table.slots[i].node == InvalidVfsNode) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+
+  // backward-shift deletion keeps probe sequences intact without tombstones
+  size_t hole = i;
+  for (size_t j = (hole + 1) & mask; table.slots[j].node != InvalidVfsNode;
+       j = (j + 1) & mask) {
+    const size_t home = table.slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      table.slots[hole] = table.slots[j];
+      hole              = j;
+    }
+  }
+
+  table.slots[hole] = Slot{};
+  --table.count;
+  m_shadowed.erase(child);
+  m_coveredDirs.erase(child);
+  m_nodes[child].parent = InvalidVfsNode;
+  m_epoch               = nextTreeEpoch();
+
+  if (m_nodes[child].is_directory) {
+    releaseChildren(child);
+  }
+  freeNode(child);
+}
+
+// Detaches everything below `dir`, putting the nodes and their child tables
+// up for reuse.  `dir` is left as an empty directory.
+void VfsTree::releaseChildren(VfsNodeId dir)
+{
+  const ChildTable table = std::exchange(m_tables[m_nodes[dir].children], {});
+  if (table.count == 0) {
+    return;
+  }
+
+  for (const Slot& s : table.slots) {
+    if (s.node == InvalidVfsNode) {
       continue;
     }
 
-    if (!current->is_directory) {
-      current->is_directory = true;
-      current->dir_info     = VfsDirInfo{};
+    m_shadowed.erase(s.node);
+    m_coveredDirs.erase(s.node);
+
+    if (m_nodes[s.node].is_directory) {
+      releaseChildren(s.node);
     }
+    freeNode(s.node);
+  }
 
-    const std::string key = normalizeForLookup(part);
-    current->dir_info.display_names[key] = part;
+  m_epoch = nextTreeEpoch();
+}
 
-    if (i + 1 == components.size()) {
-      auto fileNode              = std::make_unique<VfsNode>();
-      fileNode->is_directory     = false;
-      fileNode->file_info        = {real_path, size, mtime, origin, is_backing};
-      current->dir_info.children[key] = std::move(fileNode);
-      return;
+VfsNodeId VfsTree::findFolded(VfsNodeId dir, std::string_view key, uint32_t hash) const
+{
+  const VfsNode& d = m_nodes[dir];
+  if (!d.is_directory) {
+    return InvalidVfsNode;
+  }
+
+  const ChildTable& table = m_tables[d.children];
+  if (table.slots.empty() || !bloomMayContain(table.bloom, hash)) {
+    return InvalidVfsNode;
+  }
+
+  const size_t mask = table.slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& s = table.slots[i];
+    if (s.node == InvalidVfsNode) {
+      return InvalidVfsNode;
     }
+    if (s.hash == hash && m_strings.view(m_nodes[s.node].key) == key) {
+      return s.node;
+    }
+  }
+}
 
-    auto it = current->dir_info.children.find(key);
-    if (it == current->dir_info.children.end() || !it->second->is_directory) {
-      auto newDir          = std::make_unique<VfsNode>();
-      newDir->is_directory = true;
-      current->dir_info.children[key] = std::move(newDir);
+VfsNodeId VfsTree::find(VfsNodeId dir, std::string_view name) const
+{
+  const std::string key = foldName(name);
+  return findFolded(dir, key, vfsNameHash(key));
+}
+
+VfsNodeId VfsTree::walkOrCreateDir(VfsNodeId dir, std::string_view part,
+                                   bool* created)
+{
+  const VfsNodeId existing = find(dir, part);
+
+  if (existing == InvalidVfsNode) {
+    const VfsNodeId id = newNode(dir, part, true);
+    link(dir, id);
+    if (created != nullptr) {
+      *created = true;
     }
+    return id;
+  }
 
-    current = current->dir_info.children[key].get();
+  VfsNode& node = m_nodes[existing];
+  node.name     = m_strings.intern(part);
+  if (!node.is_directory) {
+    makeDirectory(node);
+    m_shadowed.erase(existing);
+    if (auto covered = m_coveredDirs.extract(existing)) {
+      node.providers = covered.mapped();
+    }
   }
+
+  return existing;
 }
 
-void VfsNode::insertDirectory(const std::vector<std::string>& components)
+bool VfsTree::outranks(const VfsFileInfo& a, const VfsFileInfo& b) const
 {
-  if (components.empty()) {
+  return m_origins[a.origin].priority > m_origins[b.origin].priority;
+}
+
+void VfsTree::addProvider(VfsNodeId id, const VfsFileInfo& info)
+{
+  VfsFileInfo& visible = m_nodes[id].file_info;
+  if (visible.origin == info.origin) {
+    visible = info;
     return;
   }
 
-  VfsNode* current = this;
-  for (const auto& part : components) {
-    if (part.empty()) {
-      continue;
+  auto& shadowed = m_shadowed[id];
+  std::erase_if(shadowed, [&](const VfsFileInfo& f) { return f.origin == info.origin; });
+
+  if (outranks(visible, info)) {
+    shadowed.push_back(info);
+  } else {
+    shadowed.push_back(visible);
+    visible = info;
+  }
+}
+
+bool VfsTree::insertFile(const std::vector<std::string>& components,
+                         VfsOriginId origin, std::string_view dir,
+                         std::string_view real_name, uint64_t size,
+                         std::chrono::system_clock::time_point mtime)
+{
+  if (components.empty()) {
+    return false;
+  }
+
+  VfsNodeId current = Root;
+  for (size_t i = 0; i + 1 < components.size(); ++i) {
+    if (!components[i].empty()) {
+      current = walkOrCreateDir(current, components[i]);
     }
+  }
+
+  const std::string& part = components.back();
+  const VfsFileInfo info{size, mtime, origin, m_strings.intern(dir),
+                         m_strings.intern(real_name)};
+
+  VfsNodeId id = find(current, part);
+  if (id == InvalidVfsNode) {
+    id            = newNode(current, part, false);
+    VfsNode& node = m_nodes[id];
+    node.file_info = info;
+    link(current, id);
+    return true;
+  }
+
+  VfsNode& node = m_nodes[id];
+  if (node.is_directory) {
+    // a file shadows a directory of the same name; the subtree goes, the
+    // directory itself is kept as a provider removeFile() can uncover
+    releaseChildren(id);
+    freeTable(node.children);
+    m_coveredDirs[id] = node.providers;
+    node.is_directory = false;
+    node.children     = 0;
+    node.providers    = 0;
+    node.file_info    = info;
+    node.name         = m_strings.intern(part);
+    m_epoch           = nextTreeEpoch();
+    return false;
+  }
+
+  addProvider(id, info);
+  if (node.file_info.origin == origin) {
+    node.name = m_strings.intern(part);
+  }
+  return false;
+}
+
+bool VfsTree::removeFile(const std::vector<std::string>& components, VfsOriginId origin)
+{
+  const VfsNodeId id = resolveId(components);
+  if (id == InvalidVfsNode || id == Root || m_nodes[id].is_directory) {
+    return false;
+  }
+
+  VfsNode& node = m_nodes[id];
+  auto shadow   = m_shadowed.find(id);
+
+  if (node.file_info.origin != origin) {
+    if (shadow != m_shadowed.end()) {
+      std::erase_if(shadow->second,
+                    [&](const VfsFileInfo& f) { return f.origin == origin; });
+      if (shadow->second.empty()) {
+        m_shadowed.erase(shadow);
+      }
+    }
+    return false;
+  }
+
+  if (shadow == m_shadowed.end()) {
+    auto covered = m_coveredDirs.extract(id);
+    if (covered && covered.mapped() != 0) {
+      // its contents went when the file took its place
+      makeDirectory(node);
+      node.providers = covered.mapped();
+      m_epoch        = nextTreeEpoch();
+
+      std::string& path = m_uncovered.emplace_back();
+      for (const auto& part : components) {
+        if (!part.empty()) {
+          if (!path.empty()) {
+            path.push_back('/');
+          }
+          path += part;
+        }
+      }
+      return false;
+    }
+
+    const VfsNodeId dir = node.parent;
+    unlink(dir, id);
+    prune(dir);
+    return true;
+  }
+
+  // uncover the best remaining provider; among equals the latest insert
+  auto& shadowed = shadow->second;
+  size_t best    = 0;
+  for (size_t i = 1; i < shadowed.size(); ++i) {
+    if (!outranks(shadowed[best], shadowed[i])) {
+      best = i;
+    }
+  }
+
+  node.file_info = shadowed[best];
+  shadowed.erase(shadowed.begin() + static_cast<std::ptrdiff_t>(best));
+  if (shadowed.empty()) {
+    m_shadowed.erase(shadow);
+  }
+
+  return false;
+}
+
+void VfsTree::reresolveConflicts()
+{
+  for (auto& [id, shadowed] : m_shadowed) {
+    VfsFileInfo& visible = m_nodes[id].file_info;
+    for (VfsFileInfo& f : shadowed) {
+      if (outranks(f, visible)) {
+        std::swap(f, visible);
+      }
+    }
+  }
+}
+
+bool VfsTree::releaseDirectory(const std::vector<std::string>& components)
+{
+  const VfsNodeId id = resolveId(components);
+  if (id == InvalidVfsNode || id == Root) {
+    return false;
+  }
 
-    if (!current->is_directory) {
-      current->is_directory = true;
-      current->dir_info     = VfsDirInfo{};
+  if (!m_nodes[id].is_directory) {
+    // covered by a file, which keeps the count until it goes
+    auto covered = m_coveredDirs.find(id);
+    if (covered != m_coveredDirs.end() && covered->second > 0) {
+      --covered->second;
     }
+    return false;
+  }
+
+  VfsNode& node = m_nodes[id];
+  if (node.providers > 0) {
+    --node.providers;
+  }
+
+  if (node.providers != 0 || m_tables[node.children].count != 0) {
+    return false;
+  }
 
-    const std::string key = normalizeForLookup(part);
-    current->dir_info.display_names[key] = part;
+  const VfsNodeId dir = node.parent;
+  unlink(dir, id);
+  prune(dir);
+  return true;
+}
 
-    auto it = current->dir_info.children.find(key);
-    if (it == current->dir_info.children.end() || !it->second->is_directory) {
-      auto newDir          = std::make_unique<VfsNode>();
-      newDir->is_directory = true;
-      current->dir_info.children[key] = std::move(newDir);
+// Removes `dir` and its ancestors while they are empty and were only created
+// implicitly as parents of something that is gone now.
+void VfsTree::prune(VfsNodeId dir)
+{
+  while (dir != Root) {
+    const VfsNode& node = m_nodes[dir];
+    if (node.providers != 0 || m_tables[node.children].count != 0) {
+      return;
     }
 
-    current = current->dir_info.children[key].get();
+    const VfsNodeId parent = node.parent;
+    unlink(parent, dir);
+    dir = parent;
   }
 }
 
-const VfsNode* VfsNode::resolve(const std::vector<std::string>& components) const
+void VfsTree::setPriority(VfsOriginId origin, int32_t priority)
 {
-  const VfsNode* current = this;
+  m_origins[origin].priority = priority;
+}
 
+bool VfsTree::insertFile(const std::vector<std::string>& components,
+                         const std::string& real_path, uint64_t size,
+                         std::chrono::system_clock::time_point mtime,
+                         const std::string& origin, bool is_backing)
+{
+  const auto [dir, name] = splitDirName(real_path);
+  return insertFile(components, addOrigin(origin, {}, is_backing),
+             (dir.empty() && real_path.starts_with('/')) ? std::string_view("/") : dir,
+             name, size, mtime);
+}
+
+bool VfsTree::insertDirectory(const std::vector<std::string>& components)
+{
+  bool created = false;
+
+  VfsNodeId current = Root;
   for (const auto& part : components) {
     if (part.empty()) {
       continue;
     }
+    current = walkOrCreateDir(current, part, &created);
+  }
+
+  if (current != Root) {
+    ++m_nodes[current].providers;
+  }
+
+  return created;
+}
 
-    if (!current->is_directory) {
-      return nullptr;
+VfsNodeId VfsTree::resolveId(const std::vector<std::string>& components) const
+{
+  VfsNodeId current = Root;
+
+  for (const auto& part : components) {
+    if (part.empty()) {
+      continue;
     }
 
-    const std::string key = normalizeForLookup(part);
-    auto it               = current->dir_info.children.find(key);
-    if (it == current->dir_info.children.end()) {
-      return nullptr;
+    if (!m_nodes[current].is_directory) {
+      return InvalidVfsNode;
     }
 
-    current = it->second.get();
+    current = find(current, part);
+    if (current == InvalidVfsNode) {
+      return InvalidVfsNode;
+    }
   }
 
   return current;
 }
 
-std::vector<std::pair<std::string, const VfsNode*>> VfsNode::listChildren() const
+const VfsNode* VfsTree::resolve(const std::vector<std::string>& components) const
 {
-  std::vector<std::pair<std::string, const VfsNode*>> out;
-  if (!is_directory) {
+  const VfsNodeId id = resolveId(components);
+  return id == InvalidVfsNode ? nullptr : &m_nodes[id];
+}
+
+std::vector<VfsNodeId> VfsTree::children(VfsNodeId dir) const
+{
+  std::vector<VfsNodeId> out;
+  if (!m_nodes[dir].is_directory) {
     return out;
   }
 
-  out.reserve(dir_info.children.size());
-  for (const auto& [key, node] : dir_info.children) {
-    auto display = dir_info.display_names.find(key);
-    if (display == dir_info.display_names.end()) {
-      continue;
+  const ChildTable& table = m_tables[m_nodes[dir].children];
+  out.reserve(table.count);
+  for (const Slot& s : table.slots) {
+    if (s.node != InvalidVfsNode) {
+      out.push_back(s.node);
     }
-    out.emplace_back(display->second, node.get());
   }
 
   return out;
 }
 
-bool VfsNode::removeFromTree(const std::vector<std::string>& components)
+bool VfsTree::removeRecursive(VfsNodeId dir, const std::vector<std::string>& components,
+                              size_t index)
+{
+  if (!m_nodes[dir].is_directory || index >= components.size()) {
+    return false;
+  }
+
+  const VfsNodeId child = find(dir, components[index]);
+  if (child == InvalidVfsNode) {
+    return false;
+  }
+
+  if (index + 1 == components.size()) {
+    unlink(dir, child);
+    return true;
+  }
+
+  if (!removeRecursive(child, components, index + 1)) {
+    return false;
+  }
+
+  const VfsNode& c = m_nodes[child];
+  if (c.is_directory && m_tables[c.children].count == 0) {
+    unlink(dir, child);
+  }
+
+  return true;
+}
+
+bool VfsTree::removeFromTree(const std::vector<std::string>& components)
 {
   if (components.empty()) {
     return false;
   }
-  return removeNodeRecursive(this, components, 0);
+  return removeRecursive(Root, components, 0);
 }
 
 VfsTree buildVfsTree(const std::vector<std::pair<std::string, std::string>>& mods,
                      const std::string& overwrite_dir)
 {
   VfsTree tree;
-  tree.root.is_directory = true;
-  tree.file_count        = 0;
-  tree.dir_count         = 1;
 
-  addDirectoryToTree(tree, fs::path(overwrite_dir), fs::path(overwrite_dir),
-                     "Overwrite", {});
+  addDirectoryToTree(tree, fs::path(overwrite_dir),
+                     tree.addOrigin("Overwrite", overwrite_dir), {});
 
   for (const auto& [modName, modPath] : mods) {
-    addDirectoryToTree(tree, fs::path(modPath), fs::path(modPath), modName, {});
+    addDirectoryToTree(tree, fs::path(modPath), tree.addOrigin(modName, modPath), {});
   }
 
   return tree;
@@ -286,18 +805,17 @@ VfsTree buildFullGameVfs(const std::string& game_dir, const std::string& data_di
                          const std::string& overwrite_dir)
 {
   VfsTree tree;
-  tree.root.is_directory = true;
-  tree.file_count        = 0;
-  tree.dir_count         = 1;
 
-  addDirectoryToTree(tree, fs::path(game_dir), fs::path(game_dir), "_base_game", {});
-  addDirectoryToTree(tree, fs::path(overwrite_dir), fs::path(overwrite_dir),
-                     "Overwrite", {});
+  addDirectoryToTree(tree, fs::path(game_dir), tree.addOrigin("_base_game", game_dir),
+                     {});
+  addDirectoryToTree(tree, fs::path(overwrite_dir),
+                     tree.addOrigin("Overwrite", overwrite_dir), {});
 
   const auto dataPrefix = splitPath(data_dir);
   for (const auto& [modName, modPath] : mods) {
     // Step D requirement: no Root/ handling. Every mod file is projected under data_dir.
-    addDirectoryToTree(tree, fs::path(modPath), fs::path(modPath), modName, dataPrefix);
+    addDirectoryToTree(tree, fs::path(modPath), tree.addOrigin(modName, modPath),
+                       dataPrefix);
   }
 
   return tree;
@@ -306,39 +824,15 @@ VfsTree buildFullGameVfs(const std::string& game_dir, const std::string& data_di
 std::vector<CachedBaseFile> scanDataDir(const std::string& data_dir_path)
 {
   std::vector<CachedBaseFile> cache;
-  const fs::path dataDir(data_dir_path);
-
-  if (!fs::exists(dataDir)) {
-    return cache;
-  }
-
-  for (auto it = fs::recursive_directory_iterator(
-           dataDir, fs::directory_options::skip_permission_denied);
-       it != fs::recursive_directory_iterator(); ++it) {
-    const auto& entry = *it;
-    std::error_code ec;
-
-    const fs::path rel = fs::relative(entry.path(), dataDir, ec);
-    if (ec || rel.empty()) {
-      continue;
-    }
 
+  env::scanTree(data_dir_path, [&](std::string_view rel, const env::ScannedEntry& e) {
     CachedBaseFile cf;
-    cf.relative_path = rel.generic_string();
-    cf.is_dir        = entry.is_directory(ec);
-
-    if (!cf.is_dir) {
-      if (!entry.is_regular_file(ec)) {
-        continue;
-      }
-      cf.size  = entry.file_size(ec);
-      const auto mtime = entry.last_write_time(ec);
-      cf.mtime = ec ? std::chrono::system_clock::time_point{}
-                     : fsTimeToSystemClock(mtime);
-    }
-
+    cf.relative_path = rel;
+    cf.is_dir        = e.is_dir;
+    cf.size          = e.size;
+    cf.mtime         = e.mtime;
     cache.push_back(std::move(cf));
-  }
+  });
 
   return cache;
 }
@@ -349,31 +843,30 @@ VfsTree buildDataDirVfs(const std::vector<CachedBaseFile>& cached_files,
                         const std::string& overwrite_dir)
 {
   VfsTree tree;
-  tree.root.is_directory = true;
-  tree.file_count        = 0;
-  tree.dir_count         = 1;
 
   // Layer 1: Base game files from cache (is_backing=true)
-  // real_path stores the relative path; FUSE handler uses openat(backing_fd, rel)
+  // the origin has no root, so realPath() is the relative path and the FUSE
+  // handler uses openat(backing_fd, rel)
+  const VfsOriginId base = tree.addOrigin("_base_game", {}, /*is_backing=*/true);
   for (const auto& cf : cached_files) {
     const auto components = splitPath(cf.relative_path);
     if (cf.is_dir) {
-      tree.root.insertDirectory(components);
+      tree.insertDirectory(components);
       ++tree.dir_count;
     } else {
-      tree.root.insertFile(components, cf.relative_path, cf.size, cf.mtime,
-                           "_base_game", /*is_backing=*/true);
+      const auto [dir, name] = splitDirName(cf.relative_path);
+      tree.insertFile(components, base, dir, name, cf.size, cf.mtime);
       ++tree.file_count;
     }
   }
 
   // Layer 2: Overwrite (higher priority, overwrites base game)
-  addDirectoryToTree(tree, fs::path(overwrite_dir), fs::path(overwrite_dir),
-                     "Overwrite", {});
+  addDirectoryToTree(tree, fs::path(overwrite_dir),
+                     tree.addOrigin("Overwrite", overwrite_dir), {});
 
   // Layer 3: Mods in priority order (highest priority)
   for (const auto& [modName, modPath] : mods) {
-    addDirectoryToTree(tree, fs::path(modPath), fs::path(modPath), modName, {});
+    addDirectoryToTree(tree, fs::path(modPath), tree.addOrigin(modName, modPath), {});
   }
 
   return tree;
@@ -391,9 +884,9 @@ void injectExtraFiles(
 
     std::error_code ec;
     const auto size = fs::file_size(realPath, ec);
-    tree.root.insertFile(components, realPath, ec ? 0ULL : size,
-                         std::chrono::system_clock::now(), "_profile",
-                         /*is_backing=*/false);
+    tree.insertFile(components, realPath, ec ? 0ULL : size,
+                    std::chrono::system_clock::now(), "_profile",
+                    /*is_backing=*/false);
     ++tree.file_count;
   }
 }
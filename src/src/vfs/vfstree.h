@@ -2,22 +2,73 @@
 #define VFS_VFSTREE_H
 
 #include <chrono>
+#include <climits>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
-struct VfsNode;
+using VfsNodeId   = uint32_t;
+using VfsStringId = uint32_t;
+using VfsOriginId = uint32_t;
+
+constexpr VfsNodeId InvalidVfsNode = UINT32_MAX;
+
+// Append-only pool of interned strings.  Mod lists repeat the same names
+// ("textures", "meshes", "actors", common file names) millions of times, so
+// every name in the tree is stored once and referenced by a 32-bit id.
+// Strings are packed into large chunks that never move, so views stay valid
+// for the lifetime of the pool.
+class VfsStringPool
+{
+public:
+  VfsStringPool();
+
+  VfsStringId intern(std::string_view s);
+  std::string_view view(VfsStringId id) const { return m_strings[id]; }
+
+  size_t count() const { return m_strings.size(); }
+  size_t bytes() const { return m_bytes; }
+
+private:
+  static constexpr size_t ChunkSize = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> m_chunks;
+  size_t m_chunkUsed = ChunkSize;
+  size_t m_bytes     = 0;
+  std::vector<std::string_view> m_strings;
+  std::unordered_map<std::string_view, VfsStringId> m_lookup;
+};
+
+// A source of files: a mod, overwrite, the base game, staging.  Files store
+// the origin id plus their origin-relative directory and name, and the real
+// path is rebuilt on demand as root/dir/name.  An empty root means the
+// directory part is already absolute (or, for backing origins, relative to
+// the backing fd).
+//
+// When several origins provide the same file the one with the highest
+// priority is visible and the others are kept as shadowed providers, so an
+// origin can later be removed or re-prioritized without rescanning the rest.
+// Equal priorities resolve to the most recent insert.
+struct VfsOrigin
+{
+  std::string name;
+  std::string root;
+  bool is_backing  = false;
+  int32_t priority = INT32_MAX;
+};
 
 struct VfsFileInfo
 {
-  std::string real_path;
   uint64_t size = 0;
   std::chrono::system_clock::time_point mtime{};
-  std::string origin;
-  bool is_backing = false;
+  VfsOriginId origin = 0;
+  VfsStringId dir    = 0;  // origin-relative directory of the real file
+  VfsStringId name   = 0;  // on-disk name of the real file
 };
 
 struct CachedBaseFile
@@ -28,37 +79,163 @@ struct CachedBaseFile
   bool is_dir = false;
 };
 
-struct VfsDirInfo
+struct VfsNode
 {
-  std::unordered_map<std::string, std::unique_ptr<VfsNode>> children;
-  std::unordered_map<std::string, std::string> display_names;
+  VfsStringId name  = 0;  // display name, as spelled by the winning origin
+  VfsStringId key   = 0;  // case-folded lookup key
+  uint32_t hash     = 0;  // hash of key, see vfsNameHash()
+  VfsNodeId parent   = InvalidVfsNode;
+  bool is_directory  = true;
+  uint32_t children  = 0;  // index of the directory's child table
+  uint32_t providers = 0;  // directories: unreleased insertDirectory() calls
+  VfsFileInfo file_info;  // files: the visible provider
 };
 
-struct VfsNode
+// Case-folded hash of a single path component; equal for names that differ
+// only in ASCII case.
+uint32_t vfsNameHash(std::string_view name);
+
+// Writes the case-folded form of a path component into `out`, reusing its
+// capacity.
+void vfsFoldName(std::string_view name, std::string& out);
+
+class VfsTree
 {
-  bool is_directory = true;
-  VfsFileInfo file_info;
-  VfsDirInfo dir_info;
+public:
+  static constexpr VfsNodeId Root = 0;
+
+  VfsTree();
+
+  VfsTree(VfsTree&&)            = default;
+  VfsTree& operator=(VfsTree&&) = default;
+
+  const VfsNode& root() const { return m_nodes[Root]; }
+  const VfsNode& node(VfsNodeId id) const { return m_nodes[id]; }
 
-  void insertFile(const std::vector<std::string>& components,
+  std::string_view name(const VfsNode& node) const { return m_strings.view(node.name); }
+  std::string_view key(const VfsNode& node) const { return m_strings.view(node.key); }
+  const VfsOrigin& origin(const VfsNode& node) const
+  {
+    return m_origins[node.file_info.origin];
+  }
+  const VfsOrigin& origin(VfsOriginId id) const { return m_origins[id]; }
+
+  bool isBacking(const VfsNode& node) const
+  {
+    return !node.is_directory && origin(node).is_backing;
+  }
+
+  // full path of the file on disk (relative to the backing fd for backing
+  // origins)
+  std::string realPath(const VfsNode& node) const;
+
+  VfsOriginId addOrigin(const std::string& name, const std::string& root,
+                        bool is_backing = false);
+  void setPriority(VfsOriginId origin, int32_t priority);
+
+  // Adds the origin's copy of a file.  Returns true if the path was new.
+  bool insertFile(const std::vector<std::string>& components, VfsOriginId origin,
+                  std::string_view dir, std::string_view real_name, uint64_t size,
+                  std::chrono::system_clock::time_point mtime);
+
+  // convenience overload for files outside any registered root (staging,
+  // profile files); real_path is split into directory and name
+  bool insertFile(const std::vector<std::string>& components,
                   const std::string& real_path, uint64_t size,
                   std::chrono::system_clock::time_point mtime,
                   const std::string& origin, bool is_backing = false);
 
-  void insertDirectory(const std::vector<std::string>& components);
+  // Returns true if the directory was new.
+  bool insertDirectory(const std::vector<std::string>& components);
+
+  // Drops the origin's copy of a file, uncovering the next provider.  Returns
+  // true if the path disappeared altogether.  A directory the file took the
+  // place of comes back empty if something still provides it, see
+  // takeUncovered().
+  bool removeFile(const std::vector<std::string>& components, VfsOriginId origin);
+
+  // Paths of the directories removeFile() brought back since the last call;
+  // their contents went when a file took their place and have to be
+  // inserted again.
+  std::vector<std::string> takeUncovered() { return std::exchange(m_uncovered, {}); }
+
+  // Releases one insertDirectory(); the directory goes away once nothing
+  // provides it any more and it is empty.  Returns true if it was removed.
+  bool releaseDirectory(const std::vector<std::string>& components);
+
+  // Picks the visible provider of every contested file again after origin
+  // priorities changed.  Only touches paths with more than one provider.
+  void reresolveConflicts();
 
   const VfsNode* resolve(const std::vector<std::string>& components) const;
+  VfsNodeId resolveId(const std::vector<std::string>& components) const;
 
-  std::vector<std::pair<std::string, const VfsNode*>> listChildren() const;
+  // child of the given directory by name, or InvalidVfsNode
+  VfsNodeId find(VfsNodeId dir, std::string_view name) const;
+
+  // same, for a name that is already folded and hashed; doesn't allocate
+  VfsNodeId findFolded(VfsNodeId dir, std::string_view key, uint32_t hash) const;
+
+  std::vector<VfsNodeId> children(VfsNodeId dir) const;
+
+  // Changes whenever a node may have been detached from the tree (removal,
+  // a file replacing a directory), and differs between trees, so cached node
+  // ids can be checked cheaply before use.
+  uint64_t epoch() const { return m_epoch; }
 
   bool removeFromTree(const std::vector<std::string>& components);
-};
 
-struct VfsTree
-{
-  VfsNode root;
   size_t file_count = 0;
   size_t dir_count  = 0;
+
+private:
+  struct Slot
+  {
+    uint32_t hash  = 0;
+    VfsNodeId node = InvalidVfsNode;
+  };
+
+  // Open-addressing (linear probing) table of a directory's children.  Slots
+  // carry the child's hash so probing rarely touches the nodes themselves.
+  struct ChildTable
+  {
+    std::vector<Slot> slots;
+    uint32_t count = 0;
+    // Bloom filter of the children's hashes, a byte per slot, so most names
+    // that aren't there (Wine probes plenty) are rejected without probing.
+    // Bits of removed children stay set until the table grows, which only
+    // costs a probe.
+    std::vector<uint64_t> bloom;
+  };
+
+  std::deque<VfsNode> m_nodes;
+  std::vector<ChildTable> m_tables;
+  VfsStringPool m_strings;
+  std::vector<VfsOrigin> m_origins;
+  std::unordered_map<std::string, VfsOriginId> m_originLookup;
+  std::unordered_map<VfsNodeId, std::vector<VfsFileInfo>> m_shadowed;
+  // files that took the place of a directory, with its provider count
+  std::unordered_map<VfsNodeId, uint32_t> m_coveredDirs;
+  std::vector<std::string> m_uncovered;
+  // nodes and child tables of removed paths, reused before the arena grows
+  std::vector<VfsNodeId> m_freeNodes;
+  std::vector<uint32_t> m_freeTables;
+  uint64_t m_epoch = 0;
+
+  VfsNodeId walkOrCreateDir(VfsNodeId dir, std::string_view part,
+                            bool* created = nullptr);
+  VfsNodeId newNode(VfsNodeId parent, std::string_view name, bool is_directory);
+  void makeDirectory(VfsNode& node);
+  void freeNode(VfsNodeId id);
+  void freeTable(uint32_t index);
+  void link(VfsNodeId dir, VfsNodeId child);
+  void unlink(VfsNodeId dir, VfsNodeId child);
+  void releaseChildren(VfsNodeId dir);
+  void addProvider(VfsNodeId id, const VfsFileInfo& info);
+  bool outranks(const VfsFileInfo& a, const VfsFileInfo& b) const;
+  void prune(VfsNodeId dir);
+  bool removeRecursive(VfsNodeId dir, const std::vector<std::string>& components,
+                       size_t index);
 };
 
 std::string normalizeForLookup(const std::string& path);
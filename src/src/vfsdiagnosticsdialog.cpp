@@ -0,0 +1,67 @@
+#include "vfsdiagnosticsdialog.h"
+
+#include <QCheckBox>
+#include <QDialogButtonBox>
+#include <QFontDatabase>
+#include <QHBoxLayout>
+#include <QPlainTextEdit>
+#include <QPushButton>
+#include <QScrollBar>
+#include <QVBoxLayout>
+
+VfsDiagnosticsDialog::VfsDiagnosticsDialog(Source source, QWidget* parent)
+    : QDialog(parent), m_source(std::move(source))
+{
+  setWindowTitle(tr("VFS Diagnostics"));
+  resize(720, 520);
+
+  auto* layout = new QVBoxLayout(this);
+
+  m_report = new QPlainTextEdit(this);
+  m_report->setReadOnly(true);
+  m_report->setLineWrapMode(QPlainTextEdit::NoWrap);
+  m_report->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+  layout->addWidget(m_report);
+
+  auto* controls = new QHBoxLayout();
+  m_autoRefresh  = new QCheckBox(tr("Refresh every second"), this);
+  m_autoRefresh->setChecked(true);
+  controls->addWidget(m_autoRefresh);
+  controls->addStretch();
+
+  auto* refreshButton = new QPushButton(tr("Refresh"), this);
+  controls->addWidget(refreshButton);
+  layout->addLayout(controls);
+
+  auto* buttons = new QDialogButtonBox(QDialogButtonBox::Close, this);
+  layout->addWidget(buttons);
+
+  connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
+  connect(refreshButton, &QPushButton::clicked, this, &VfsDiagnosticsDialog::refresh);
+  connect(m_autoRefresh, &QCheckBox::toggled, this, [this](bool on) {
+    if (on) {
+      m_timer.start();
+    } else {
+      m_timer.stop();
+    }
+  });
+  connect(&m_timer, &QTimer::timeout, this, &VfsDiagnosticsDialog::refresh);
+
+  m_timer.setInterval(1000);
+  m_timer.start();
+  refresh();
+}
+
+void VfsDiagnosticsDialog::refresh()
+{
+  const QStringList lines = m_source();
+
+  // keep the scroll position across refreshes
+  const int scroll = m_report->verticalScrollBar()->value();
+  if (lines.isEmpty()) {
+    m_report->setPlainText(tr("The VFS is not mounted."));
+  } else {
+    m_report->setPlainText(lines.join('\n'));
+  }
+  m_report->verticalScrollBar()->setValue(scroll);
+}
@@ -0,0 +1,34 @@
+#ifndef VFSDIAGNOSTICSDIALOG_H
+#define VFSDIAGNOSTICSDIALOG_H
+
+#include <QDialog>
+#include <QStringList>
+#include <QTimer>
+
+#include <functional>
+
+class QCheckBox;
+class QPlainTextEdit;
+
+// Shows the VFS statistics report (operation latencies, bytes served,
+// copy-on-write, lock waits, hottest paths) and refreshes it while open, so
+// a stutter in game can be matched against what the VFS was doing.
+class VfsDiagnosticsDialog : public QDialog
+{
+  Q_OBJECT
+
+public:
+  using Source = std::function<QStringList()>;
+
+  explicit VfsDiagnosticsDialog(Source source, QWidget* parent = nullptr);
+
+private:
+  void refresh();
+
+  Source m_source;
+  QPlainTextEdit* m_report;
+  QCheckBox* m_autoRefresh;
+  QTimer m_timer;
+};
+
+#endif  // VFSDIAGNOSTICSDIALOG_H